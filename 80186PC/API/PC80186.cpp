@@ -0,0 +1,224 @@
+#include <API/PC80186.h>
+
+#include <Hardware/Machine.h>
+#include <UI/FrameRenderer.h>
+#include <UI/TextScreen.h>
+
+#include <Windows.h>
+#include <comdef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+struct pc80186_machine {
+	explicit pc80186_machine(const Machine::Configuration& configuration) : machine(configuration) {
+
+	}
+
+	Machine machine;
+
+	// Created on first use, as not every embedder renders
+	std::mutex rendererMutex;
+	std::optional<FrameRenderer> renderer;
+};
+
+static_assert(PC80186_CLOCK_FREQUENCY == VirtualClock::Frequency, "the clock frequency of the C interface is out of date");
+static_assert(static_cast<int>(PC80186_SHADE_BRIGHT) == static_cast<int>(FrameRenderer::ShadeBright), "the shades of the C interface are out of date");
+
+static thread_local std::string lastError;
+
+static std::string narrow(const wchar_t* text) {
+	auto size = WideCharToMultiByte(CP_UTF8, 0, text, -1, nullptr, 0, nullptr, nullptr);
+	if (size <= 0)
+		return std::string();
+
+	std::string result(static_cast<size_t>(size), '\0');
+	WideCharToMultiByte(CP_UTF8, 0, text, -1, &result[0], size, nullptr, nullptr);
+	result.resize(static_cast<size_t>(size - 1));
+
+	return result;
+}
+
+// Exceptions must not cross into C, so every call goes through here
+template<typename Function>
+static int translateExceptions(Function&& function) {
+	try {
+		function();
+		return 0;
+	}
+	catch (const std::exception& e) {
+		lastError = e.what();
+	}
+	catch (const _com_error& e) {
+		lastError = narrow(e.ErrorMessage());
+	}
+
+	return -1;
+}
+
+static std::filesystem::path optionalPath(const char* path) {
+	return path ? std::filesystem::u8path(path) : std::filesystem::path();
+}
+
+int pc80186_api_version(void) {
+	return PC80186_API_VERSION;
+}
+
+const char* pc80186_last_error(void) {
+	return lastError.c_str();
+}
+
+void pc80186_config_init(pc80186_config* config) {
+	memset(config, 0, sizeof(*config));
+	config->size = sizeof(*config);
+	config->real_time = 1;
+}
+
+pc80186_machine* pc80186_create(const pc80186_config* config) {
+	pc80186_machine* machine = nullptr;
+
+	translateExceptions([&]() {
+		// Older callers pass a smaller structure, which the fields they don't know about are left out of
+		if (!config || config->size < offsetof(pc80186_config, start_stopped) + sizeof(config->start_stopped))
+			throw std::invalid_argument("configuration of an unknown version");
+
+		if (!config->hard_disk_image)
+			throw std::invalid_argument("no hard disk image");
+
+		Machine::Configuration configuration;
+		configuration.hardDiskImage = std::filesystem::u8path(config->hard_disk_image);
+		configuration.saveState = optionalPath(config->save_state);
+		configuration.biosImage = optionalPath(config->bios_image);
+		configuration.realTimePacing = config->real_time != 0;
+		configuration.startStopped = config->start_stopped != 0;
+
+		machine = new pc80186_machine(configuration);
+	});
+
+	return machine;
+}
+
+void pc80186_destroy(pc80186_machine* machine) {
+	delete machine;
+}
+
+int pc80186_run(pc80186_machine* machine, uint64_t instructions, uint64_t cycles) {
+	return translateExceptions([&]() {
+		machine->machine.runFor(cycles, instructions);
+	});
+}
+
+int pc80186_pause(pc80186_machine* machine) {
+	return translateExceptions([&]() {
+		machine->machine.pause();
+	});
+}
+
+int pc80186_resume(pc80186_machine* machine) {
+	return translateExceptions([&]() {
+		machine->machine.resume();
+	});
+}
+
+int pc80186_machine_time(pc80186_machine* machine, uint64_t* cycles) {
+	return translateExceptions([&]() {
+		*cycles = machine->machine.machineTime();
+	});
+}
+
+int pc80186_push_scancodes(pc80186_machine* machine, const uint8_t* scancodes, size_t count) {
+	return translateExceptions([&]() {
+		machine->machine.keyboard()->pushScancodes(scancodes, count);
+	});
+}
+
+int pc80186_type_text(pc80186_machine* machine, const char* text) {
+	return translateExceptions([&]() {
+		if (!machine->machine.keyboard()->typeText(text))
+			throw std::invalid_argument("text has characters with no key, which were left out");
+	});
+}
+
+int pc80186_mouse_motion(pc80186_machine* machine, int dx, int dy) {
+	return translateExceptions([&]() {
+		machine->machine.mouse()->addDeltas(dx, dy);
+	});
+}
+
+int pc80186_mouse_button(pc80186_machine* machine, int button, int pressed) {
+	return translateExceptions([&]() {
+		// Bus mouse buttons are numbered right to left
+		if (button < PC80186_BUTTON_LEFT || button > PC80186_BUTTON_RIGHT)
+			throw std::invalid_argument("no such mouse button");
+
+		machine->machine.mouse()->updateButtonState(static_cast<unsigned int>(PC80186_BUTTON_RIGHT - button), pressed != 0);
+	});
+}
+
+size_t pc80186_read_text(pc80186_machine* machine, char* buffer, size_t size) {
+	size_t needed = 0;
+
+	translateExceptions([&]() {
+		TextScreen screen;
+		if (!machine->machine.captureTextScreen(screen))
+			throw std::runtime_error("the screen is not in text mode");
+
+		auto text = screen.text();
+
+		if (buffer && size != 0) {
+			auto length = std::min(text.size(), size - 1);
+			memcpy(buffer, text.data(), length);
+			buffer[length] = '\0';
+		}
+
+		needed = text.size() + 1;
+	});
+
+	return needed;
+}
+
+int pc80186_render_screen(pc80186_machine* machine, uint8_t* pixels, size_t size, unsigned int* width, unsigned int* height) {
+	return translateExceptions([&]() {
+		VideoAdapter::AdapterConfiguration config;
+		machine->machine.videoAdapter()->acquireAdapterConfiguration(config, 0);
+
+		FrameRenderer::Frame frame;
+
+		{
+			std::unique_lock<std::mutex> locker(machine->rendererMutex);
+
+			if (!machine->renderer)
+				machine->renderer.emplace();
+
+			machine->renderer->render(config, frame);
+		}
+
+		*width = frame.width;
+		*height = frame.height;
+
+		// Only asked for the size
+		if (!pixels)
+			return;
+
+		if (frame.pixels.size() > size)
+			throw std::length_error("the pixels do not fit");
+
+		memcpy(pixels, frame.pixels.data(), frame.pixels.size());
+	});
+}
+
+int pc80186_save_state(pc80186_machine* machine, const char* path) {
+	return translateExceptions([&]() {
+		machine->machine.saveState(std::filesystem::u8path(path));
+	});
+}
+
+int pc80186_load_state(pc80186_machine* machine, const char* path) {
+	return translateExceptions([&]() {
+		machine->machine.loadState(std::filesystem::u8path(path));
+	});
+}
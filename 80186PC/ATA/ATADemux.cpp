@@ -2,6 +2,11 @@
 
 #include <ATA/ATATypes.h>
 
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
+
+#include <stdexcept>
+
 ATADemux::ATADemux(IATADevice* master, IATADevice* slave) : m_master(master), m_slave(slave), m_selectedDevice(false),
 	m_ien0(false), m_ien1(false), m_host(nullptr) {
 
@@ -94,6 +99,41 @@ bool ATADemux::isInterruptRequested() const {
 	}
 }
 
+void ATADemux::saveState(StateWriter& writer) {
+	writer.beginChunk("ATAX");
+	writer.writeBool(m_selectedDevice);
+	writer.writeBool(m_ien0);
+	writer.writeBool(m_ien1);
+	writer.writeBool(m_master != nullptr);
+	writer.writeBool(m_slave != nullptr);
+	writer.endChunk();
+
+	if (m_master)
+		m_master->saveState(writer);
+
+	if (m_slave)
+		m_slave->saveState(writer);
+}
+
+void ATADemux::loadState(StateReader& reader) {
+	reader.beginChunk("ATAX");
+	m_selectedDevice = reader.readBool();
+	m_ien0 = reader.readBool();
+	m_ien1 = reader.readBool();
+	auto haveMaster = reader.readBool();
+	auto haveSlave = reader.readBool();
+	reader.endChunk();
+
+	if (haveMaster != (m_master != nullptr) || haveSlave != (m_slave != nullptr))
+		throw std::runtime_error("save state has other ATA devices attached");
+
+	if (m_master)
+		m_master->loadState(reader);
+
+	if (m_slave)
+		m_slave->loadState(reader);
+}
+
 void ATADemux::interruptRequestedChanged(IATADevice* device) {
 	auto selectedDevice = m_selectedDevice ? m_slave : m_master;
 
@@ -1,8 +1,14 @@
 #include <ATA/ATADevice.h>
 #include <ATA/ATATypes.h>
 
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
+
+#include <stdexcept>
+
 ATADevice::ATADevice() :
 	m_stopDriveThread(false),
+	m_synchronous(false),
 	m_resetRequest(false),
 	m_commandRequest(false),
 	m_interruptPending(false),
@@ -21,10 +27,11 @@ ATADevice::ATADevice() :
 	m_host(nullptr),
 	m_transferState(TransferState::Idle),
 	m_transferPosition(0),
-	m_transferSize(0),
-	m_driveThread(&ATADevice::driveThread, this) {
+	m_transferSize(0) {
 
-	postReset();
+	// Carried out once the drive thread is started, or the device is made synchronous
+	m_resetRequest = true;
+	m_status |= 0x80;
 }
 
 ATADevice::~ATADevice() {
@@ -45,6 +52,8 @@ void ATADevice::stopDriveThread() {
 void ATADevice::write(CS cs, uint8_t address, uint16_t value) {
 	std::unique_lock<std::mutex> locker(m_driveThreadMutex);
 
+	startDriveThreadLocked();
+
 	switch (cs) {
 	case CS::CS0:
 		if (m_status & 0x80) {
@@ -135,11 +144,16 @@ void ATADevice::write(CS cs, uint8_t address, uint16_t value) {
 		}
 		break;
 	}
+
+	if (m_synchronous)
+		processRequestsLocked(locker);
 }
 
 uint16_t ATADevice::read(CS cs, uint8_t address) {
 	std::unique_lock<std::mutex> locker(m_driveThreadMutex);
 
+	startDriveThreadLocked();
+
 	switch (cs) {
 	case CS::CS0:
 		if ((m_status & 0x80) && address != ATACS0_STATUS_COMMAND) {
@@ -276,59 +290,170 @@ bool ATADevice::isInterruptRequestedLocked() const {
 	return m_interruptPending && m_interruptEnabled;
 }
 
+void ATADevice::startDriveThreadLocked() {
+	if (m_synchronous || m_stopDriveThread || m_driveThread.joinable())
+		return;
+
+	// Waits for the lock the caller holds before it looks at anything
+	m_driveThread = std::thread(&ATADevice::driveThread, this);
+}
+
 void ATADevice::driveThread() {
 	std::unique_lock<std::mutex> locker(m_driveThreadMutex);
 	while (!m_stopDriveThread) {
-		m_driveThreadCondvar.wait(locker, [this]() { return m_stopDriveThread || m_resetRequest || m_commandRequest; });
-
-		if (m_resetRequest) {
-			locker.unlock();
-
-			resetDevice();
-
-			locker.lock();
-
-			m_resetRequest = false;
-			m_status = 0x50; // DRDY, DSC
-			m_feature = 0x00;
-			m_error = 0x01; // Diagnostic code: no error detected
-			m_sectorCount = 0x00;
-			m_sectorNumber = 0x00;
-			m_cylinderLow = 0;
-			m_cylinderHigh = 0x00;
-			m_driveHead = 0x00;
-			m_command = 0x00;
-			m_commandRequest = false;
-		}
+		m_driveThreadCondvar.wait(locker, [this]() {
+			return m_stopDriveThread || (!m_synchronous && (m_resetRequest || m_commandRequest));
+		});
 
-		if (m_commandRequest) {
-			ATACommand command;
-			command.feature = m_feature;
-			command.sectorCount = m_sectorCount;
-			command.sectorNumber = m_sectorNumber;
-			command.cylinderLow = m_cylinderLow;
-			command.cylinderHigh = m_cylinderHigh;
-			command.driveHead = m_driveHead;
-			command.command = m_command;
+		if (!m_synchronous)
+			processRequestsLocked(locker);
 
-			locker.unlock();
+		// For whoever waits for the drive to be idle
+		m_driveThreadCondvar.notify_all();
+	}
+}
 
-			ATACommandResult result;
+void ATADevice::processRequestsLocked(std::unique_lock<std::mutex>& locker) {
+	if (m_resetRequest) {
+		locker.unlock();
+
+		resetDevice();
+
+		locker.lock();
+
+		m_resetRequest = false;
+		m_status = 0x50; // DRDY, DSC
+		m_feature = 0x00;
+		m_error = 0x01; // Diagnostic code: no error detected
+		m_sectorCount = 0x00;
+		m_sectorNumber = 0x00;
+		m_cylinderLow = 0;
+		m_cylinderHigh = 0x00;
+		m_driveHead = 0x00;
+		m_command = 0x00;
+		m_commandRequest = false;
+	}
 
-			executeCommand(command, result);
+	if (m_commandRequest) {
+		ATACommand command;
+		command.feature = m_feature;
+		command.sectorCount = m_sectorCount;
+		command.sectorNumber = m_sectorNumber;
+		command.cylinderLow = m_cylinderLow;
+		command.cylinderHigh = m_cylinderHigh;
+		command.driveHead = m_driveHead;
+		command.command = m_command;
 
-			locker.lock();
+		locker.unlock();
 
-			m_status = (m_status & 0x08) | (result.status & 0x77);
-			m_error = result.error;
-			m_commandRequest = false;
+		ATACommandResult result;
 
-			if (!(m_status & 1))
-				setInterruptLocked();
-		}
+		executeCommand(command, result);
+
+		locker.lock();
+
+		m_status = (m_status & 0x08) | (result.status & 0x77);
+		m_error = result.error;
+		m_commandRequest = false;
+
+		if (!(m_status & 1))
+			setInterruptLocked();
 	}
 }
 
+void ATADevice::setSynchronous(bool synchronous) {
+	std::unique_lock<std::mutex> locker(m_driveThreadMutex);
+
+	// Whatever the drive thread has taken on is finished first
+	if (m_driveThread.joinable())
+		waitForIdleLocked(locker);
+
+	m_synchronous = synchronous;
+
+	// Such as the reset at power up, when there has been no drive thread to carry it out
+	if (m_synchronous)
+		processRequestsLocked(locker);
+}
+
+void ATADevice::waitForIdleLocked(std::unique_lock<std::mutex>& locker) {
+	startDriveThreadLocked();
+
+	m_driveThreadCondvar.wait(locker, [this]() { return m_stopDriveThread || (!m_resetRequest && !m_commandRequest); });
+}
+
+void ATADevice::saveState(StateWriter& writer) {
+	std::unique_lock<std::mutex> locker(m_driveThreadMutex);
+
+	waitForIdleLocked(locker);
+
+	writer.beginChunk("ATA ");
+	writer.writeBool(m_interruptPending);
+	writer.writeBool(m_interruptEnabled);
+	writer.writeBool(m_resetAsserted);
+	writer.writeBool(m_eightBitPIO);
+	writer.write8(m_status);
+	writer.write8(m_feature);
+	writer.write8(m_error);
+	writer.write8(m_sectorCount);
+	writer.write8(m_sectorNumber);
+	writer.write8(m_cylinderLow);
+	writer.write8(m_cylinderHigh);
+	writer.write8(m_driveHead);
+	writer.write8(m_command);
+	writer.write8(static_cast<uint8_t>(m_transferState));
+
+	// The buffer only matters while a transfer is under way
+	if (m_transferState != TransferState::Idle) {
+		writer.write32(static_cast<uint32_t>(m_transferPosition));
+		writer.write32(static_cast<uint32_t>(m_transferSize));
+		writer.writeBytes(m_transferBuffer.data(), m_transferSize);
+	}
+
+	writer.endChunk();
+}
+
+void ATADevice::loadState(StateReader& reader) {
+	std::unique_lock<std::mutex> locker(m_driveThreadMutex);
+
+	waitForIdleLocked(locker);
+
+	reader.beginChunk("ATA ");
+	m_interruptPending = reader.readBool();
+	m_interruptEnabled = reader.readBool();
+	m_resetAsserted = reader.readBool();
+	m_eightBitPIO = reader.readBool();
+	m_status = reader.read8();
+	m_feature = reader.read8();
+	m_error = reader.read8();
+	m_sectorCount = reader.read8();
+	m_sectorNumber = reader.read8();
+	m_cylinderLow = reader.read8();
+	m_cylinderHigh = reader.read8();
+	m_driveHead = reader.read8();
+	m_command = reader.read8();
+
+	auto transferState = reader.read8();
+	if (transferState > static_cast<uint8_t>(TransferState::PIOWrite))
+		throw std::runtime_error("save state has an invalid ATA transfer state");
+
+	m_transferState = static_cast<TransferState>(transferState);
+
+	if (m_transferState != TransferState::Idle) {
+		m_transferPosition = reader.read32();
+		m_transferSize = reader.read32();
+		if (m_transferSize > m_transferBuffer.size() || m_transferPosition > m_transferSize)
+			throw std::runtime_error("save state has an invalid ATA transfer");
+
+		reader.readBytes(m_transferBuffer.data(), m_transferSize);
+	}
+	else {
+		m_transferPosition = 0;
+		m_transferSize = 0;
+	}
+
+	reader.endChunk();
+}
+
 void ATADevice::pioRead(size_t size) {
 	std::unique_lock<std::mutex> locker(m_driveThreadMutex);
 
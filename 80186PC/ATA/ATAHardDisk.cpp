@@ -3,6 +3,12 @@
 
 #include <ATA/ATATypes.h>
 
+#include <Infrastructure/ExecutionLog.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
+
+#include <Utils/Checksums.h>
+
 #include <Windows.h>
 #include <virtdisk.h>
 #define _NTSCSI_USER_MODE_
@@ -10,6 +16,12 @@
 #undef _NTSCSI_USER_MODE_
 
 #include <comdef.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 const char ATAHardDisk::m_serialNumber[20]{
 	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
@@ -25,7 +37,7 @@ const char ATAHardDisk::m_modelNumber[40]{
 	' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '
 };
 
-ATAHardDisk::ATAHardDisk(const std::filesystem::path &diskImage) : m_currentAddress(0), m_currentCommand(0), m_sectorsRemaining(0) {
+ATAHardDisk::ATAHardDisk(const std::filesystem::path &diskImage) : m_executionLog(nullptr), m_currentAddress(0), m_currentCommand(0), m_sectorsRemaining(0) {
 	VIRTUAL_STORAGE_TYPE storage;
 	storage.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
 	storage.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
@@ -110,6 +122,150 @@ ATAHardDisk::~ATAHardDisk() {
 	stopDriveThread();
 }
 
+// Whether the image is a differencing image with the parent as its parent, such as createOverlay() makes
+static bool isOverlayOf(const std::filesystem::path& image, const std::filesystem::path& parent) {
+	VIRTUAL_STORAGE_TYPE storage;
+	storage.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
+	storage.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+
+	// Without opening the parent, which a stray file need not have
+	HANDLE rawHandle;
+	auto result = OpenVirtualDisk(
+		&storage,
+		image.wstring().c_str(),
+		VIRTUAL_DISK_ACCESS_GET_INFO,
+		OPEN_VIRTUAL_DISK_FLAG_NO_PARENTS,
+		nullptr,
+		&rawHandle);
+	if (result != ERROR_SUCCESS)
+		return false;
+
+	WindowsHandle disk;
+	disk.reset(rawHandle);
+
+	std::vector<uint8_t> buffer(sizeof(GET_VIRTUAL_DISK_INFO) + MAX_PATH * sizeof(wchar_t));
+	ULONG sizeUsed = 0;
+
+	do {
+		auto infoSize = static_cast<ULONG>(buffer.size());
+		auto info = reinterpret_cast<GET_VIRTUAL_DISK_INFO*>(buffer.data());
+		info->Version = GET_VIRTUAL_DISK_INFO_PARENT_LOCATION;
+
+		result = GetVirtualDiskInformation(disk.get(), &infoSize, info, &sizeUsed);
+		if (result == ERROR_INSUFFICIENT_BUFFER)
+			buffer.resize(infoSize);
+	} while (result == ERROR_INSUFFICIENT_BUFFER);
+
+	// Images with no parent have no parent location either
+	if (result != ERROR_SUCCESS)
+		return false;
+
+	// Every path the parent is looked for at, one after the other, each NUL terminated
+	auto info = reinterpret_cast<const GET_VIRTUAL_DISK_INFO*>(buffer.data());
+	auto location = static_cast<const wchar_t*>(info->ParentLocation.ParentLocationBuffer);
+	auto end = reinterpret_cast<const wchar_t*>(buffer.data() + std::min<size_t>(sizeUsed, buffer.size()));
+
+	while (location < end && *location != L'\0') {
+		auto length = wcsnlen(location, static_cast<size_t>(end - location));
+
+		// Relative ones are relative to the image
+		std::filesystem::path candidate(std::wstring(location, length));
+		if (candidate.is_relative())
+			candidate = image.parent_path() / candidate;
+
+		std::error_code error;
+		if (std::filesystem::equivalent(candidate, parent, error))
+			return true;
+
+		location += length + 1;
+	}
+
+	return false;
+}
+
+void ATAHardDisk::createOverlay(const std::filesystem::path& parent, const std::filesystem::path& overlay) {
+	if (std::filesystem::exists(overlay)) {
+		std::error_code error;
+		if (std::filesystem::equivalent(overlay, parent, error))
+			throw std::runtime_error(overlay.string() + " is the disk image itself, not a place for an overlay of it");
+
+		if (!isOverlayOf(overlay, parent))
+			throw std::runtime_error(overlay.string() + " already exists, and is not an overlay of " + parent.string());
+
+		std::filesystem::remove(overlay);
+	}
+
+	// The format follows the extension of the overlay, and has to be that of the parent
+	VIRTUAL_STORAGE_TYPE storage;
+	storage.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
+	storage.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+
+	auto parentPath = std::filesystem::absolute(parent).wstring();
+
+	CREATE_VIRTUAL_DISK_PARAMETERS parameters;
+	ZeroMemory(&parameters, sizeof(parameters));
+	parameters.Version = CREATE_VIRTUAL_DISK_VERSION_2;
+	parameters.Version2.ParentPath = parentPath.c_str();
+
+	HANDLE rawHandle;
+	auto result = CreateVirtualDisk(
+		&storage,
+		overlay.wstring().c_str(),
+		VIRTUAL_DISK_ACCESS_NONE,
+		nullptr,
+		CREATE_VIRTUAL_DISK_FLAG_NONE,
+		0,
+		&parameters,
+		nullptr,
+		&rawHandle);
+	if (result != ERROR_SUCCESS) {
+		_com_raise_error(HRESULT_FROM_WIN32(result));
+	}
+
+	CloseHandle(rawHandle);
+}
+
+void ATAHardDisk::saveState(StateWriter& writer) {
+	// Waits for the drive thread, which is what changes the rest
+	ATADevice::saveState(writer);
+
+	writer.beginChunk("HDD ");
+	writer.write64(m_identify.totalSectors);
+	writer.write16(m_identify.currentTranslationValid);
+	writer.write16(m_identify.currentCylinders);
+	writer.write16(m_identify.currentHeads);
+	writer.write16(m_identify.currentSectorsPerTrack);
+	writer.write32(m_identify.currentCapacitySectors);
+	writer.write16(m_identify.multipleSectorConfiguration);
+	writer.write64(m_currentAddress);
+	writer.write8(m_currentCommand);
+	writer.write32(m_sectorsRemaining);
+	writer.write32(m_sectorsInThisChunk);
+	writer.endChunk();
+}
+
+void ATAHardDisk::loadState(StateReader& reader) {
+	ATADevice::loadState(reader);
+
+	reader.beginChunk("HDD ");
+
+	// Not proof that the image is the same, but catches the most likely mixup
+	if (reader.read64() != m_identify.totalSectors)
+		throw std::runtime_error("save state was made with a hard disk image of another size");
+
+	m_identify.currentTranslationValid = reader.read16();
+	m_identify.currentCylinders = reader.read16();
+	m_identify.currentHeads = reader.read16();
+	m_identify.currentSectorsPerTrack = reader.read16();
+	m_identify.currentCapacitySectors = reader.read32();
+	m_identify.multipleSectorConfiguration = reader.read16();
+	m_currentAddress = reader.read64();
+	m_currentCommand = reader.read8();
+	m_sectorsRemaining = reader.read32();
+	m_sectorsInThisChunk = reader.read32();
+	reader.endChunk();
+}
+
 void ATAHardDisk::resetDevice() {
 	printf("ATAHardDisk: reset\n");
 
@@ -288,6 +444,10 @@ void ATAHardDisk::pioNext() {
 		if (bytesRead != bytesToRead)
 			throw std::logic_error("short read");
 
+		// Tells a replay that the image is not the one recorded with before the guest goes astray
+		if (m_executionLog)
+			m_executionLog->diskRead(m_currentAddress, crc32(transferBuffer(), bytesToRead));
+
 		m_currentAddress += m_sectorsInThisChunk;
 		m_sectorsRemaining -= m_sectorsInThisChunk;
 
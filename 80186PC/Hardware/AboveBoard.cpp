@@ -1,12 +1,15 @@
 #include <Hardware/AboveBoard.h>
 #include <Infrastructure/AddressSpaceDispatcher.h>
 #include <Infrastructure/AddressRangeRegistration.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 #include <Utils/AccessSizeUtils.h>
 
 AboveBoard::AboveBoard() :
 	m_expandedMemory(8 * 1024 * 1024, PAGE_READWRITE),
 	m_memoryDispatcher(nullptr),
-	m_reg7Field0(0) {
+	m_reg7Field0(0),
+	m_writeTracking(false) {
 
 }
 
@@ -32,6 +35,32 @@ uint64_t AboveBoard::read(uint64_t address, unsigned int accessSize) {
 	return splitReadAccess(address, accessSize, &AboveBoard::read8, this);
 }
 
+void AboveBoard::saveState(StateWriter& writer) const {
+	writer.beginChunk("EMS ");
+
+	for (const auto& logicalPageState : m_logicalPages) {
+		writer.write8(logicalPageState.bank);
+		writer.write8(logicalPageState.value);
+	}
+
+	writer.write8(m_reg7Field0);
+	writer.endChunk();
+}
+
+void AboveBoard::loadState(StateReader& reader) {
+	reader.beginChunk("EMS ");
+
+	for (unsigned int logicalPage = 0; logicalPage < m_logicalPages.size(); logicalPage++) {
+		auto bank = reader.read8();
+		auto value = reader.read8();
+
+		map(logicalPage, (value & 0x80) != 0, (value & 0x7F) | ((bank & 3) << 7));
+	}
+
+	m_reg7Field0 = reader.read8() & 7;
+	reader.endChunk();
+}
+
 uint8_t AboveBoard::read8(uint64_t address, uint8_t mask) {
 	(void)mask;
 
@@ -92,16 +121,66 @@ void AboveBoard::write8(uint64_t address, uint8_t mask, uint8_t data) {
 	}
 }
 
+void AboveBoard::enableWriteTracking() {
+	if (m_writeTracking)
+		return;
+
+	m_writeTracking = true;
+
+	// The ranges have to be registered again to be mapped without write permission
+	for (unsigned int logicalPage = 0; logicalPage < m_logicalPages.size(); logicalPage++) {
+		auto& logicalPageState = m_logicalPages[logicalPage];
+
+		logicalPageState.registration.reset();
+		logicalPageState.addressRange.enableWriteTracking();
+
+		if (logicalPageState.value & 0x80)
+			map(logicalPage, true, (logicalPageState.value & 0x7F) | ((logicalPageState.bank & 3) << 7));
+	}
+}
+
+void AboveBoard::collectWrites(std::vector<size_t>& pages) {
+	for (auto& logicalPageState : m_logicalPages) {
+		if (logicalPageState.value & 0x80)
+			collectWrites(logicalPageState, pages);
+	}
+
+	pages.insert(pages.end(), m_writtenPages.begin(), m_writtenPages.end());
+	m_writtenPages.clear();
+}
+
+void AboveBoard::collectWrites(LogicalPageState& logicalPageState, std::vector<size_t>& pages) {
+	constexpr size_t pagesPerPhysicalPage = PhysicalPageSize / MappedAddressRange::WriteTrackingPageSize;
+
+	std::vector<size_t> written;
+	logicalPageState.addressRange.collectWrites(logicalPageState.writeGeneration, written);
+
+	auto physicalPage = (logicalPageState.value & 0x7F) | ((logicalPageState.bank & 3) << 7);
+
+	for (auto page : written) {
+		if (page < pagesPerPhysicalPage)
+			pages.push_back(physicalPage * pagesPerPhysicalPage + page);
+	}
+}
+
 void AboveBoard::map(unsigned int logicalPage, bool present, unsigned int physicalPage) {
 	auto& logicalPageState = m_logicalPages[logicalPage];
 
+	logicalPageState.registration.reset();
+
+	// Writes through the old mapping are to the old physical page
+	if (m_writeTracking) {
+		if (logicalPageState.value & 0x80)
+			collectWrites(logicalPageState, m_writtenPages);
+		else
+			logicalPageState.writeGeneration = logicalPageState.addressRange.sampleWrites();
+	}
+
 	logicalPageState.bank = (physicalPage >> 7);
 	logicalPageState.value = (present << 7) | (physicalPage & 0x7F);
 
 	printf("AboveBoard: mapping logical page %u; present: %d, physical page: %u\n", logicalPage, present, physicalPage);
 
-	logicalPageState.registration.reset();
-
 	if (present) {
 		unsigned int offset = 0;
 		if (logicalPage < 24) {
@@ -114,7 +193,7 @@ void AboveBoard::map(unsigned int logicalPage, bool present, unsigned int physic
 		unsigned int logicalPageBase =  offset + (logicalPage << 14);
 		unsigned int logicalPageLimit = offset + ((logicalPage + 1) << 14);
 
-		logicalPageState.addressRange.changeBase(static_cast<uint8_t*>(m_expandedMemory.base()) + physicalPage * 16 * 1024);
+		logicalPageState.addressRange.changeBase(static_cast<uint8_t*>(m_expandedMemory.base()) + physicalPage * PhysicalPageSize);
 
 		logicalPageState.registration = m_memoryDispatcher->registerAddressRange(logicalPageBase, logicalPageLimit, &logicalPageState.addressRange, 0, true);
 	}
@@ -124,7 +203,9 @@ uint8_t AboveBoard::repackAddress(uint64_t address) {
 	return (address & 15) | ((address & 0xF000) >> 8);
 }
 
-AboveBoard::LogicalPageState::LogicalPageState() : addressRange(nullptr, 128 * 1024, IAddressRangeHandler::AccessRead | IAddressRangeHandler::AccessWrite | IAddressRangeHandler::AccessExecute) {
+AboveBoard::LogicalPageState::LogicalPageState() : bank(0), value(0),
+	addressRange(nullptr, 128 * 1024, IAddressRangeHandler::AccessRead | IAddressRangeHandler::AccessWrite | IAddressRangeHandler::AccessExecute),
+	writeGeneration(0) {
 
 }
 
@@ -1,5 +1,7 @@
 #include <Hardware/BusMouse.h>
 #include <Infrastructure/InterruptLine.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 
 #include <stdio.h>
 
@@ -7,17 +9,60 @@
 
 BusMouse::BusMouse() :
 	m_uiButtons(0), m_uiDeltaX(0), m_uiDeltaY(0), m_buttons(0), m_deltaX(0), m_deltaY(0),
-	m_interruptLine(nullptr), m_mousePPI(this), m_runThread(true), m_interruptEnabled(false), m_busMouseThread(&BusMouse::busMouseThread, this) {
+	m_mousePPI(this), m_interruptLine(nullptr), m_clock(nullptr), m_interruptEnabled(false), m_interruptAsserted(false),
+	m_hold(false), m_selector(0), m_timerActive(false), m_lastInterrupt(0), m_probeDeadline(0) {
 
 }
 
 BusMouse::~BusMouse() {
-	{
-		std::unique_lock<std::mutex> locker(m_threadMutex);
-		m_runThread = false;
+	if (m_clock)
+		m_clock->cancelTimer(this);
+}
+
+void BusMouse::saveState(StateWriter& writer) const {
+	m_mousePPI.saveState(writer);
+
+	writer.beginChunk("MOUS");
+	writer.write32(m_uiButtons.load());
+	writer.write32(static_cast<uint32_t>(m_uiDeltaX.load()));
+	writer.write32(static_cast<uint32_t>(m_uiDeltaY.load()));
+	writer.write32(m_buttons.load());
+	writer.write8(static_cast<uint8_t>(m_deltaX.load()));
+	writer.write8(static_cast<uint8_t>(m_deltaY.load()));
+	writer.writeBool(m_interruptEnabled.load());
+	writer.writeBool(m_interruptAsserted.load());
+	writer.writeBool(m_hold.load());
+	writer.write8(static_cast<uint8_t>(m_selector.load()));
+	writer.write64(m_lastInterrupt);
+	writer.write64(m_probeDeadline);
+	writer.endChunk();
+}
+
+void BusMouse::loadState(StateReader& reader) {
+	m_mousePPI.loadState(reader);
+
+	reader.beginChunk("MOUS");
+	m_uiButtons = reader.read32();
+	m_uiDeltaX = static_cast<int32_t>(reader.read32());
+	m_uiDeltaY = static_cast<int32_t>(reader.read32());
+	m_buttons = reader.read32();
+	m_deltaX = static_cast<int8_t>(reader.read8());
+	m_deltaY = static_cast<int8_t>(reader.read8());
+	m_interruptEnabled = reader.readBool();
+	auto asserted = reader.readBool();
+	m_hold = reader.readBool();
+	m_selector = reader.read8() & 3;
+	m_lastInterrupt = reader.read64();
+	m_probeDeadline = reader.read64();
+	reader.endChunk();
+
+	setInterruptAsserted(asserted);
+
+	if (m_clock) {
+		// Whatever was going on carries on from the timer, which stops itself if nothing was
+		m_timerActive = true;
+		m_clock->scheduleTimer(this, asserted ? m_lastInterrupt + InterruptPeriod / 2 : 0);
 	}
-	m_threadCondvar.notify_all();
-	m_busMouseThread.join();
 }
 
 void BusMouse::write(uint64_t address, unsigned int accessSize, uint64_t data) {
@@ -79,62 +124,101 @@ void BusMouse::writePortC(uint8_t value, uint8_t mask) {
 
 	auto oldHold = m_hold.exchange(newHold);
 	m_selector = (value >> 5) & 3;
-	m_interruptEnabled = (value & (1 << 4)) == 0;
+
+	auto interruptEnabled = (value & (1 << 4)) == 0;
+	auto wasEnabled = m_interruptEnabled.exchange(interruptEnabled);
 
 	if (newHold && !oldHold) {
-		std::unique_lock<std::mutex> locker(m_uiMutex);
-		m_buttons = m_uiButtons;
+		m_buttons = m_uiButtons.load();
 		m_deltaX = transferDeltaClamped(m_uiDeltaX);
 		m_deltaY = transferDeltaClamped(m_uiDeltaY);
 	}
-}
-
-int8_t BusMouse::transferDeltaClamped(int& delta) {
-	if (delta < 0) {
-		auto transfer = std::max<int>(delta, -128);
-		delta -= transfer;
 
-		return transfer;
-	}
-	else if (delta > 0) {
-		auto transfer = std::min<int>(delta, 127);
-		delta -= transfer;
+	if (interruptEnabled != wasEnabled) {
+		auto line = m_interruptLine.load();
+		if (line)
+			line->setInterruptAsserted(m_interruptAsserted.load() && interruptEnabled);
 
-		return transfer;
-	}
-	else {
-		return 0;
+		// Input may have piled up while interrupts were off
+		if (interruptEnabled && m_clock) {
+			m_probeDeadline = m_clock->cycles() + ProbeWindow;
+			inputChanged();
+		}
 	}
 }
 
-void BusMouse::busMouseThread() {
-	std::unique_lock<std::mutex> locker(m_threadMutex);
-	while (m_runThread) {
-		if (!m_threadCondvar.wait_for(locker, std::chrono::milliseconds(33), [this] { return !m_runThread; })) {
-			auto asserted = !m_interruptAsserted.load();
-			m_interruptAsserted = asserted;
+int8_t BusMouse::transferDeltaClamped(std::atomic<int>& delta) {
+	// Only this thread takes motion out, so whatever is added meanwhile stays
+	auto transfer = std::clamp(delta.load(), -128, 127);
+	delta -= transfer;
 
-			auto line = m_interruptLine.load();
-			if (line) {
-				line->setInterruptAsserted(asserted && m_interruptEnabled.load());
-			}
-		}
-	}
+	return static_cast<int8_t>(transfer);
 }
 
 void BusMouse::updateButtonState(unsigned int button, bool state) {
-	std::unique_lock<std::mutex> locker(m_uiMutex);
 	if (state) {
 		m_uiButtons |= (1U << button);
 	}
 	else {
 		m_uiButtons &= ~(1U << button);
 	}
+
+	inputChanged();
 }
 
 void BusMouse::addDeltas(int dx, int dy) {
-	std::unique_lock<std::mutex> locker(m_uiMutex);
 	m_uiDeltaX += dx;
 	m_uiDeltaY += dy;
+
+	inputChanged();
+}
+
+bool BusMouse::inputPending() const {
+	return m_uiDeltaX.load() != 0 || m_uiDeltaY.load() != 0 || m_uiButtons.load() != m_buttons.load();
 }
 
+void BusMouse::inputChanged() {
+	if (!m_clock || m_timerActive.exchange(true))
+		return;
+
+	// Runs on the CPU thread as soon as possible, and keeps to the interrupt rate from there on
+	m_clock->scheduleTimer(this, 0);
+}
+
+void BusMouse::timerExpired() {
+	auto now = m_clock->cycles();
+
+	if (m_interruptAsserted.load()) {
+		// End of the pulse; the next one can't come before a whole period has passed
+		setInterruptAsserted(false);
+		m_clock->scheduleTimer(this, m_lastInterrupt + InterruptPeriod);
+		return;
+	}
+
+	auto probing = now < m_probeDeadline;
+	if (!probing && (!inputPending() || !m_interruptEnabled.load())) {
+		m_timerActive = false;
+
+		// Input arriving just now may have seen the timer still active
+		if (!inputPending() || !m_interruptEnabled.load() || m_timerActive.exchange(true))
+			return;
+	}
+
+	if (now < m_lastInterrupt + InterruptPeriod) {
+		m_clock->scheduleTimer(this, m_lastInterrupt + InterruptPeriod);
+		return;
+	}
+
+	m_lastInterrupt = now;
+	setInterruptAsserted(true);
+	m_clock->scheduleTimer(this, now + InterruptPeriod / 2);
+}
+
+void BusMouse::setInterruptAsserted(bool asserted) {
+	m_interruptAsserted = asserted;
+
+	auto line = m_interruptLine.load();
+	if (line) {
+		line->setInterruptAsserted(asserted && m_interruptEnabled.load());
+	}
+}
@@ -1,14 +1,15 @@
 #include <Hardware/HerculesVideo.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 #include <Utils/AccessSizeUtils.h>
 
 #include <stdio.h>
 
-#include <chrono>
+#include <algorithm>
 
-HerculesVideo::HerculesVideo() : m_mode(0), m_graphicsEnable(0), m_crtcAddress(0), m_framebuffer(nullptr) {
-	for (auto& reg : m_crtcRegisters) {
-		reg = 0;
-	}
+HerculesVideo::HerculesVideo() : m_registers{}, m_crtcAddress(0), m_timing{}, m_clock(nullptr), m_publishedSequence(0), m_framebuffer(nullptr) {
+	updateTiming();
+	publishRegisters();
 }
 
 HerculesVideo::~HerculesVideo() = default;
@@ -29,28 +30,14 @@ uint8_t HerculesVideo::read8(uint64_t address, uint8_t mask) {
 	if (address & 8) {
 		switch (address & 7) {
 		case 0:
-		{
-			std::shared_lock<std::shared_mutex> locker(m_configurationMutex);
-			return m_mode;
-		}
+			return m_registers.mode;
 
 		case 1:
 			printf("HGC: color select read\n");
 			break;
 
 		case 2:
-		{
-			uint8_t status = 0xF0;
-
-			// TODO: bit 3 - video
-			// TODO: bit 0 - retrace
-
-			if (hblank()) {
-				status |= 1 << 0;
-			}
-
-			return status;
-		}
+			return readStatus();
 
 		// LPT registers
 		case 4:
@@ -65,13 +52,10 @@ uint8_t HerculesVideo::read8(uint64_t address, uint8_t mask) {
 	}
 	else if (address & 1) {
 		printf("HGC: CRTC read: [%02X]\n", m_crtcAddress);
-		if (m_crtcAddress >= m_crtcRegisters.size())
+		if (m_crtcAddress >= m_registers.crtcRegisters.size())
 			throw std::logic_error("CRTC access is out of range");
 
-		{
-			std::shared_lock<std::shared_mutex> locker(m_configurationMutex);
-			return m_crtcRegisters[m_crtcAddress];
-		}
+		return m_registers.crtcRegisters[m_crtcAddress];
 	}
 	else {
 		return m_crtcAddress;
@@ -88,11 +72,9 @@ void HerculesVideo::write8(uint64_t address, uint8_t mask, uint8_t data) {
 	if (address & 8) {
 		switch (address & 7) {
 		case 0:
-		{
-			std::unique_lock<std::shared_mutex> locker(m_configurationMutex);
-
-			m_mode = data;
-		}
+			m_registers.mode = data;
+			updateTiming();
+			publishRegisters();
 
 			printf("HGC: mode %02X\n", data);
 			break;
@@ -112,10 +94,8 @@ void HerculesVideo::write8(uint64_t address, uint8_t mask, uint8_t data) {
 			break;
 
 		case 7:
-		{
-			std::unique_lock<std::shared_mutex> locker(m_configurationMutex);
-			m_graphicsEnable = data;
-		}
+			m_registers.graphicsEnable = data;
+			publishRegisters();
 			break;
 
 		default:
@@ -126,61 +106,271 @@ void HerculesVideo::write8(uint64_t address, uint8_t mask, uint8_t data) {
 	else if (address & 1) {
 		if(m_crtcAddress != CRTCCursorAddressLSB && m_crtcAddress != CRTCCursorAddressMSB)
 			printf("HGC: CRTC write: [%02X] = %02X\n", m_crtcAddress, data);
-		if (m_crtcAddress >= m_crtcRegisters.size())
+		if (m_crtcAddress >= m_registers.crtcRegisters.size())
 			throw std::logic_error("CRTC access is out of range");
 
-		{
-			std::unique_lock<std::shared_mutex> locker(m_configurationMutex);
-			m_crtcRegisters[m_crtcAddress] = data;
-		}
+		m_registers.crtcRegisters[m_crtcAddress] = data;
+		updateTiming();
+		publishRegisters();
 	}
 	else {
 		m_crtcAddress = data;
 	}
 }
 
-bool HerculesVideo::hblank() const {
-	std::shared_lock<std::shared_mutex> locker(m_configurationMutex);
+void HerculesVideo::saveState(StateWriter& writer) const {
+	writer.beginChunk("HGC ");
+	writer.write8(m_registers.mode);
+	writer.write8(m_registers.graphicsEnable);
+	writer.writeBytes(m_registers.crtcRegisters.data(), m_registers.crtcRegisters.size());
+	writer.write8(m_crtcAddress);
+	writer.endChunk();
+}
+
+void HerculesVideo::loadState(StateReader& reader) {
+	reader.beginChunk("HGC ");
+	m_registers.mode = reader.read8();
+	m_registers.graphicsEnable = reader.read8();
+	reader.readBytes(m_registers.crtcRegisters.data(), m_registers.crtcRegisters.size());
+	m_crtcAddress = reader.read8();
+	reader.endChunk();
+
+	updateTiming();
+	publishRegisters();
+}
+
+void HerculesVideo::publishRegisters() {
+	auto sequence = m_publishedSequence.load(std::memory_order_relaxed);
+
+	m_publishedSequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_publishedMode.store(m_registers.mode, std::memory_order_relaxed);
+	m_publishedGraphicsEnable.store(m_registers.graphicsEnable, std::memory_order_relaxed);
+	for (size_t index = 0; index < CRTCRegisterCount; index++) {
+		m_publishedCRTCRegisters[index].store(m_registers.crtcRegisters[index], std::memory_order_relaxed);
+	}
+
+	m_publishedSequence.store(sequence + 2, std::memory_order_release);
+}
+
+void HerculesVideo::snapshotRegisters(RegisterState& state) const {
+	uint32_t sequence;
+
+	do {
+		sequence = m_publishedSequence.load(std::memory_order_acquire);
+
+		state.mode = m_publishedMode.load(std::memory_order_relaxed);
+		state.graphicsEnable = m_publishedGraphicsEnable.load(std::memory_order_relaxed);
+		for (size_t index = 0; index < CRTCRegisterCount; index++) {
+			state.crtcRegisters[index] = m_publishedCRTCRegisters[index].load(std::memory_order_relaxed);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((sequence & 1) != 0 || m_publishedSequence.load(std::memory_order_relaxed) != sequence);
+}
+
+void HerculesVideo::updateTiming() {
+	const auto& crtcRegisters = m_registers.crtcRegisters;
+
+	// The CRTC is clocked once per character: 9 dots in text mode, 16 in graphics mode
+	uint32_t characterDots = (m_registers.mode & (1 << 1)) ? 16 : 9;
+	uint32_t characterLines = (crtcRegisters[CRTCMaxScanLine] & 0x1F) + 1;
+	uint32_t frameLines = ((crtcRegisters[CRTCVTotal] & 0x7F) + 1) * characterLines + (crtcRegisters[CRTCVTotalAdjust] & 0x1F);
+
+	m_timing.lineDots = (crtcRegisters[CRTCHTotal] + 1) * characterDots;
+	m_timing.frameDots = m_timing.lineDots * frameLines;
+	m_timing.horizontalDisplayDots = crtcRegisters[CRTCHDisplay] * characterDots;
+	m_timing.verticalDisplayLines = (crtcRegisters[CRTCVDisplay] & 0x7F) * characterLines;
+	m_timing.verticalSyncFirstLine = (crtcRegisters[CRTCVSyncPosition] & 0x7F) * characterLines;
+	m_timing.verticalSyncEndLine = m_timing.verticalSyncFirstLine + VerticalSyncLines;
+}
+
+uint8_t HerculesVideo::readStatus() const {
+	uint64_t cycles = 0;
+	if (m_clock) {
+		cycles = m_clock->cycles();
+	}
+
+	// Position of the beam within the frame. Reducing the cycle count modulo
+	// a whole number of frames first keeps the multiplication from overflowing.
+	uint64_t frameCycles = static_cast<uint64_t>(m_timing.frameDots) * DotsPerCycleDenominator;
+	auto dot = static_cast<uint32_t>(((cycles % frameCycles) * DotsPerCycleNumerator / DotsPerCycleDenominator) % m_timing.frameDots);
+	auto line = dot / m_timing.lineDots;
+	auto column = dot % m_timing.lineDots;
+
+	bool horizontalBlank = column >= m_timing.horizontalDisplayDots;
+	bool verticalBlank = line >= m_timing.verticalDisplayLines;
+	bool verticalSync = line >= m_timing.verticalSyncFirstLine && line < m_timing.verticalSyncEndLine;
 
-	unsigned int pixelsPerCharacter = 9;
+	uint8_t status = 0x70;
 
-	auto nanosecondsPerLine = static_cast<uint64_t>(1e9f / (MDACrystal / pixelsPerCharacter / (m_crtcRegisters[CRTCHTotal] + 1)));
-	auto visibleDisplayNanoseconds = static_cast<uint64_t>(1e9f / (MDACrystal / pixelsPerCharacter / (m_crtcRegisters[CRTCHDisplay])));
+	// bit 0 - horizontal retrace
+	if (horizontalBlank) {
+		status |= 1 << 0;
+	}
+
+	// bit 3 - video, approximated as the beam being within the displayed area
+	if (!horizontalBlank && !verticalBlank) {
+		status |= 1 << 3;
+	}
 
-	return (std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() % nanosecondsPerLine) >= visibleDisplayNanoseconds;
+	// bit 7 - clear during vertical retrace on the HGC
+	if (!verticalSync) {
+		status |= 1 << 7;
+	}
+
+	return status;
 }
 
-void HerculesVideo::acquireAdapterConfiguration(AdapterConfiguration& config) {
-	std::shared_lock<std::shared_mutex> locker(m_configurationMutex);
+void HerculesVideo::acquireAdapterConfiguration(AdapterConfiguration& config, uint64_t sinceGeneration) {
+	// Sampling re-protects the framebuffer pages in the CPU, so it has to come
+	// first: writes after it are reported next time.
+	if (m_framebuffer->isWriteTrackingEnabled()) {
+		config.framebufferGeneration = m_framebuffer->sampleWrites();
+	}
+	else {
+		config.framebufferGeneration = 0;
+	}
+
+	RegisterState registers;
+	snapshotRegisters(registers);
+
+	const auto& crtcRegisters = registers.crtcRegisters;
+	auto framebuffer = static_cast<unsigned char*>(m_framebuffer->hostMemoryBase());
 
 	uint16_t startAddress =
-		(static_cast<uint16_t>(m_crtcRegisters[CRTCStartAddressMSB]) << 8) |
-		(static_cast<uint16_t>(m_crtcRegisters[CRTCStartAddressLSB]));
+		(static_cast<uint16_t>(crtcRegisters[CRTCStartAddressMSB]) << 8) |
+		(static_cast<uint16_t>(crtcRegisters[CRTCStartAddressLSB]));
 
 	uint16_t cursorAddress =
-		(static_cast<uint16_t>(m_crtcRegisters[CRTCCursorAddressMSB]) << 8) |
-		(static_cast<uint16_t>(m_crtcRegisters[CRTCCursorAddressLSB]));
+		(static_cast<uint16_t>(crtcRegisters[CRTCCursorAddressMSB]) << 8) |
+		(static_cast<uint16_t>(crtcRegisters[CRTCCursorAddressLSB]));
 
-	config.videoEnabled = (m_mode & (1 << 3)) != 0;
-	config.textMode = (m_mode & (1 << 1)) == 0 || (m_graphicsEnable & (1 << 0)) == 0;
+	config.videoEnabled = (registers.mode & (1 << 3)) != 0;
+	config.textMode = (registers.mode & (1 << 1)) == 0 || (registers.graphicsEnable & (1 << 0)) == 0;
 	if (config.textMode) {
-		config.widthPixels = m_crtcRegisters[CRTCHDisplay] * 9;
+		config.widthPixels = crtcRegisters[CRTCHDisplay] * 9;
 	}
 	else {
-		config.widthPixels = m_crtcRegisters[CRTCHDisplay] * 16;
+		config.widthPixels = crtcRegisters[CRTCHDisplay] * 16;
 	}
 
-	config.heightPixels = m_crtcRegisters[CRTCVDisplay] * (m_crtcRegisters[CRTCMaxScanLine] + 1);
+	config.heightPixels = crtcRegisters[CRTCVDisplay] * (crtcRegisters[CRTCMaxScanLine] + 1);
 
 	config.textModeColumns = 80;
 	config.textModeRows = 25;
-	config.textModeFramebuffer = m_framebuffer + startAddress * 2;
-	config.textModeCharacterHeight = m_crtcRegisters[CRTCMaxScanLine] + 1;
+	config.textModeFramebuffer = framebuffer + startAddress * 2;
+	config.textModeCharacterHeight = crtcRegisters[CRTCMaxScanLine] + 1;
 	config.textModeCursorAddress = (cursorAddress - startAddress) * 2;
-	config.textModeFirstCursorLine = m_crtcRegisters[CRTCCursorStart];
-	config.textModeLastCursorLine = m_crtcRegisters[CRTCCursorEnd];
-	if (m_mode & (1 << 7))
-		config.graphicsModeFramebuffer = m_framebuffer + 0x08000 + startAddress * 2;
+	config.textModeFirstCursorLine = crtcRegisters[CRTCCursorStart];
+	config.textModeLastCursorLine = crtcRegisters[CRTCCursorEnd];
+	if (registers.mode & (1 << 7))
+		config.graphicsModeFramebuffer = framebuffer + 0x08000 + startAddress * 2;
+	else
+		config.graphicsModeFramebuffer = framebuffer + startAddress * 2;
+
+	config.changedScanLineBands = changedScanLineBands(config, sinceGeneration);
+}
+
+bool HerculesVideo::waitForFramebufferWrites(uint64_t sinceGeneration, std::chrono::steady_clock::time_point deadline) {
+	return m_framebuffer->waitForWrites(sinceGeneration, deadline);
+}
+
+uint64_t HerculesVideo::changedScanLineBands(const AdapterConfiguration& config, uint64_t sinceGeneration) const {
+	auto pageCount = m_framebuffer->trackedPageCount();
+
+	if (sinceGeneration == 0 || !m_framebuffer->isWriteTrackingEnabled() || pageCount > 64)
+		return AllScanLineBands;
+
+	uint64_t dirtyPages = 0;
+	for (size_t page = 0; page < pageCount; page++) {
+		if (m_framebuffer->pageGeneration(page) > sinceGeneration)
+			dirtyPages |= static_cast<uint64_t>(1) << page;
+	}
+
+	if (dirtyPages == 0)
+		return 0;
+
+	auto framebuffer = static_cast<const unsigned char*>(m_framebuffer->hostMemoryBase());
+	size_t lineLength;
+	if (config.textMode)
+		lineLength = config.textModeColumns * 2;
 	else
-		config.graphicsModeFramebuffer = m_framebuffer + startAddress * 2;
+		lineLength = config.widthPixels / 8;
+
+	if (lineLength == 0)
+		return 0;
+
+	uint64_t bands = 0;
+
+	for (unsigned int line = 0; line < config.heightPixels; line++) {
+		size_t lineOffset;
+
+		if (config.textMode) {
+			lineOffset = (config.textModeFramebuffer - framebuffer) + (line / config.textModeCharacterHeight) * lineLength;
+		}
+		else {
+			// four interleaved banks of 8 KiB
+			lineOffset = (config.graphicsModeFramebuffer - framebuffer) + ((line & 3) << 13) + (line >> 2) * lineLength;
+		}
+
+		auto firstPage = lineOffset / MappedAddressRange::WriteTrackingPageSize;
+		auto lastPage = (lineOffset + lineLength - 1) / MappedAddressRange::WriteTrackingPageSize;
+
+		for (auto page = firstPage; page <= lastPage; page++) {
+			// the CRTC wraps around the framebuffer
+			if (dirtyPages & (static_cast<uint64_t>(1) << (page % pageCount))) {
+				bands |= static_cast<uint64_t>(1) << std::min(line / ScanLineBandHeight, ScanLineBandCount - 1);
+				break;
+			}
+		}
+	}
+
+	return bands;
+}
+
+bool HerculesVideo::captureTextScreen(TextScreen& screen) {
+	AdapterConfiguration config;
+	acquireAdapterConfiguration(config, 0);
+
+	if (!config.videoEnabled || !config.textMode)
+		return false;
+
+	screen.capture(config);
+	return true;
+}
+
+bool HerculesVideo::waitForTextScreen(const std::function<bool(const TextScreen& screen)>& predicate, std::chrono::milliseconds timeout,
+	TextScreen* lastScreen) {
+
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	TextScreen screen;
+
+	while (true) {
+		// Acquiring samples the framebuffer, so any write after this wakes the wait below
+		AdapterConfiguration config;
+		acquireAdapterConfiguration(config, 0);
+
+		if (config.videoEnabled && config.textMode) {
+			screen.capture(config);
+
+			if (predicate(screen)) {
+				if (lastScreen)
+					*lastScreen = screen;
+
+				return true;
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline) {
+			if (lastScreen)
+				*lastScreen = screen;
+
+			return false;
+		}
+
+		waitForFramebufferWrites(config.framebufferGeneration, std::min(deadline, now + TextScreenRecheckInterval));
+	}
 }
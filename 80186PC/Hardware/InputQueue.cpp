@@ -0,0 +1,220 @@
+#include <Hardware/InputQueue.h>
+#include <Infrastructure/ExecutionLog.h>
+
+#include <memory>
+
+InputQueue::InputQueue() : m_clock(nullptr), m_keyboard(nullptr), m_mouse(nullptr), m_executionLog(nullptr), m_head(&m_stub), m_longestDelay(0), m_tail(&m_stub) {
+	m_stub.next = nullptr;
+}
+
+InputQueue::~InputQueue() {
+	if (m_clock)
+		m_clock->cancelTimer(this);
+
+	// Undelivered events are dropped
+	while (auto event = pop())
+		delete event;
+}
+
+void InputQueue::start() {
+	m_clock->scheduleTimer(this, (m_clock->cycles() / DrainInterval + 1) * DrainInterval);
+}
+
+void InputQueue::pushScancode(uint8_t scancode) {
+	pushScancodes(&scancode, 1);
+}
+
+void InputQueue::pushScancodes(const uint8_t* scancodes, size_t count) {
+	auto event = new Event;
+	event->type = EventType::Scancodes;
+	event->data.assign(reinterpret_cast<const char*>(scancodes), count);
+	push(event);
+}
+
+bool InputQueue::typeText(const std::string& text) {
+	// Checked here, as the keyboard only gets to see the text later on
+	bool complete = true;
+	for (auto character : text) {
+		Keystroke keystroke;
+		if (!translateCharacter(character, keystroke))
+			complete = false;
+	}
+
+	auto event = new Event;
+	event->type = EventType::Text;
+	event->data = text;
+	push(event);
+
+	return complete;
+}
+
+void InputQueue::setTypingFastFill(bool fastFill) {
+	auto event = new Event;
+	event->type = EventType::FastFill;
+	event->values[0] = fastFill;
+	push(event);
+}
+
+void InputQueue::updateButtonState(unsigned int button, bool state) {
+	auto event = new Event;
+	event->type = EventType::MouseButton;
+	event->values[0] = static_cast<int>(button);
+	event->values[1] = state;
+	push(event);
+}
+
+void InputQueue::addDeltas(int dx, int dy) {
+	auto event = new Event;
+	event->type = EventType::MouseMotion;
+	event->values[0] = dx;
+	event->values[1] = dy;
+	push(event);
+}
+
+void InputQueue::push(Event* event) {
+	event->queued = std::chrono::steady_clock::now();
+	event->next.store(nullptr, std::memory_order_relaxed);
+
+	// Until the second store, the consumer sees the queue end at the previous event
+	auto previous = m_head.exchange(event, std::memory_order_acq_rel);
+	previous->next.store(event, std::memory_order_release);
+}
+
+InputQueue::Event* InputQueue::pop() {
+	auto tail = m_tail;
+	auto next = tail->next.load(std::memory_order_acquire);
+
+	if (tail == &m_stub) {
+		if (!next)
+			return nullptr;
+
+		m_tail = next;
+		tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+
+	if (next) {
+		m_tail = next;
+		return tail;
+	}
+
+	// A producer is between its two stores; its event is picked up next time
+	if (tail != m_head.load(std::memory_order_acquire))
+		return nullptr;
+
+	// The last event can only be taken out once there is another behind it
+	push(&m_stub);
+
+	next = tail->next.load(std::memory_order_acquire);
+	if (next) {
+		m_tail = next;
+		return tail;
+	}
+
+	return nullptr;
+}
+
+void InputQueue::timerExpired() {
+	auto now = std::chrono::steady_clock::now();
+	auto replaying = m_executionLog && m_executionLog->replaying();
+	std::vector<uint8_t> data;
+
+	while (auto event = pop()) {
+		std::unique_ptr<Event> owned(event);
+
+		// A replay only gets the input that was recorded
+		if (replaying)
+			continue;
+
+		auto delay = (now - event->queued).count();
+		if (delay > m_longestDelay.load())
+			m_longestDelay = delay;
+
+		if (m_executionLog && m_executionLog->recording()) {
+			data.clear();
+			encodeEvent(*event, data);
+			m_executionLog->recordInput(data);
+		}
+
+		deliver(*event);
+	}
+
+	if (replaying) {
+		Event event;
+
+		while (m_executionLog->takeInput(data)) {
+			if (decodeEvent(data, event))
+				deliver(event);
+		}
+	}
+
+	m_clock->scheduleTimer(this, (m_clock->cycles() / DrainInterval + 1) * DrainInterval);
+}
+
+void InputQueue::deliver(const Event& event) {
+	switch (event.type) {
+	case EventType::Scancodes:
+		if (m_keyboard)
+			m_keyboard->pushScancodes(reinterpret_cast<const uint8_t*>(event.data.data()), event.data.size());
+		break;
+
+	case EventType::Text:
+		if (m_keyboard)
+			m_keyboard->typeText(event.data);
+		break;
+
+	case EventType::MouseButton:
+		if (m_mouse)
+			m_mouse->updateButtonState(static_cast<unsigned int>(event.values[0]), event.values[1] != 0);
+		break;
+
+	case EventType::MouseMotion:
+		if (m_mouse)
+			m_mouse->addDeltas(event.values[0], event.values[1]);
+		break;
+
+	case EventType::FastFill:
+		if (m_keyboard)
+			m_keyboard->setTypingFastFill(event.values[0] != 0);
+		break;
+	}
+}
+
+void InputQueue::encodeEvent(const Event& event, std::vector<uint8_t>& data) {
+	data.push_back(static_cast<uint8_t>(event.type));
+
+	if (event.type == EventType::Scancodes || event.type == EventType::Text) {
+		data.insert(data.end(), event.data.begin(), event.data.end());
+	}
+	else {
+		for (auto value : event.values) {
+			for (unsigned int byte = 0; byte < 4; byte++)
+				data.push_back(static_cast<uint8_t>(static_cast<uint32_t>(value) >> (byte * 8)));
+		}
+	}
+}
+
+bool InputQueue::decodeEvent(const std::vector<uint8_t>& data, Event& event) {
+	if (data.empty() || data[0] > static_cast<uint8_t>(EventType::FastFill))
+		return false;
+
+	event.type = static_cast<EventType>(data[0]);
+
+	if (event.type == EventType::Scancodes || event.type == EventType::Text) {
+		event.data.assign(data.begin() + 1, data.end());
+		return true;
+	}
+
+	if (data.size() != 1 + sizeof(event.values))
+		return false;
+
+	for (unsigned int index = 0; index < 2; index++) {
+		uint32_t value = 0;
+		for (unsigned int byte = 0; byte < 4; byte++)
+			value |= static_cast<uint32_t>(data[1 + index * 4 + byte]) << (byte * 8);
+
+		event.values[index] = static_cast<int>(value);
+	}
+
+	return true;
+}
@@ -1,23 +1,90 @@
 #include <Hardware/Machine.h>
 
 #include <comdef.h>
+#include <string.h>
 
 #include <Hardware/CPUEmulationFactory.h>
 #include <Hardware/CPUEmulation.h>
 
+#include <Infrastructure/CallbackTimer.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
+
 #include <Utils/WindowsResources.h>
 
-Machine::Machine(const std::filesystem::path &hardDiskImage) :
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+static void transferFileAt(HANDLE file, uint64_t offset, void* data, size_t size, bool write) {
+	auto bytes = static_cast<uint8_t*>(data);
+
+	while (size != 0) {
+		OVERLAPPED io;
+		ZeroMemory(&io, sizeof(io));
+		io.OffsetHigh = static_cast<uint32_t>(offset >> 32);
+		io.Offset = static_cast<uint32_t>(offset);
+
+		auto bytesToTransfer = static_cast<DWORD>(std::min<size_t>(size, 0x40000000));
+		DWORD bytesTransferred;
+
+		BOOL result;
+		if (write)
+			result = WriteFile(file, bytes, bytesToTransfer, &bytesTransferred, &io);
+		else
+			result = ReadFile(file, bytes, bytesToTransfer, &bytesTransferred, &io);
+
+		if (!result)
+			_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+		if (bytesTransferred == 0)
+			throw std::runtime_error("save state is truncated");
+
+		bytes += bytesTransferred;
+		offset += bytesTransferred;
+		size -= bytesTransferred;
+	}
+}
+
+static WindowsHandle createStateFile(const std::filesystem::path& path) {
+	auto rawFile = CreateFile(path.wstring().c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (rawFile == INVALID_HANDLE_VALUE)
+		_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+	return WindowsHandle(rawFile);
+}
+
+static Machine::Configuration defaultConfiguration(const std::filesystem::path& hardDiskImage, const std::filesystem::path& saveState) {
+	Machine::Configuration configuration;
+	configuration.hardDiskImage = hardDiskImage;
+	configuration.saveState = saveState;
+	return configuration;
+}
+
+Machine::Machine(const std::filesystem::path &hardDiskImage, const std::filesystem::path& saveState) :
+	Machine(defaultConfiguration(hardDiskImage, saveState)) {
+
+}
+
+Machine::Machine(const Configuration& configuration) :
 	m_mmioDispatcher("MMIO"),
 	m_ioDispatcher("IO"),
 	m_ram(RAMAreaEnd - RAMAreaBase, PAGE_READWRITE),
 	m_vram(VRAMAreaEnd - VRAMAreaBase, PAGE_READWRITE),
 	m_ppi(this),
-	m_hdd(hardDiskImage),
+	m_hdd(configuration.hardDiskImage),
 	m_ataDemux(&m_hdd, nullptr),
 	m_xtide(&m_ataDemux),
 	m_lowSwitches(false),
 	m_switches(0x3C),
+	m_ramWriteGeneration(0),
+	m_vramWriteGeneration(0),
+	m_checkpointInterval(0),
 	m_cpu(CPUEmulationFactory().createCPUEmulation())
 {
 
@@ -27,18 +94,33 @@ Machine::Machine(const std::filesystem::path &hardDiskImage) :
 
 	const void* biosImage;
 	size_t biosImageSize;
-	getRCDATA(1, &biosImage, &biosImageSize);
+
+	if (configuration.biosImage.empty()) {
+		getRCDATA(BIOSResource, &biosImage, &biosImageSize);
+	}
+	else {
+		std::ifstream stream(configuration.biosImage, std::ios::binary);
+		if (!stream)
+			throw std::runtime_error("unable to open " + configuration.biosImage.string());
+
+		m_biosImage.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+		biosImage = m_biosImage.data();
+		biosImageSize = m_biosImage.size();
+	}
 
 	if (biosImageSize != BIOSAreaEnd - BIOSAreaBase)
 		throw std::runtime_error("unexpected BIOS image size");
 
 	m_ramAddressRange.emplace(m_ram.base(), RAMAreaEnd - RAMAreaBase, MappedAddressRange::AccessRead | MappedAddressRange::AccessWrite | MappedAddressRange::AccessExecute);
-		
+	// For rewind checkpoints. Costs a trip through the dispatcher for the first write to each page after a checkpoint.
+	m_ramAddressRange->enableWriteTracking();
+
 	m_mmioDispatcher.registerAddressRange(
 		RAMAreaBase, RAMAreaEnd, &*m_ramAddressRange
 	).release();
 
 	m_vramAddressRange.emplace(m_vram.base(), VRAMAreaEnd - VRAMAreaBase, MappedAddressRange::AccessRead | MappedAddressRange::AccessWrite | MappedAddressRange::AccessExecute);
+	m_vramAddressRange->enableWriteTracking();
 
 	m_mmioDispatcher.registerAddressRange(
 		VRAMAreaBase, VRAMAreaEnd, &*m_vramAddressRange
@@ -49,9 +131,19 @@ Machine::Machine(const std::filesystem::path &hardDiskImage) :
 	);
 	m_mmioDispatcher.registerAddressRange(BIOSAreaBase, BIOSAreaEnd, &*m_biosMainAddressRange).release();
 
-	m_hercules.setFramebuffer(static_cast<unsigned char*>(m_vramAddressRange->hostMemoryBase()));
+	m_hercules.setFramebuffer(&*m_vramAddressRange);
+	m_hercules.setClock(m_cpu.get());
+	m_pit.setClock(m_cpu.get());
+	m_xtKeyboard.setClock(m_cpu.get());
+	m_busMouse.setClock(m_cpu.get());
+	m_xtKeyboard.setBIOSDataArea(static_cast<uint8_t*>(m_ram.base()) + BIOSDataAreaBase);
+	m_inputQueue.setClock(m_cpu.get());
+	m_inputQueue.setKeyboard(&m_xtKeyboard);
+	m_inputQueue.setMouse(&m_busMouse);
+	m_executionLog.setClock(m_cpu.get());
 
 	m_ioDispatcher.registerAddressRange(0x20, 0x22, &m_primaryPIC).release(); // Primary programmable interrupt controller
+	m_ioDispatcher.registerAddressRange(0x24, 0x26, &m_secondaryPIC).release(); // Secondary programmable interrupt controller
 	m_ioDispatcher.registerAddressRange(0x40, 0x60, &m_pit).release(); // Programmable interval timer
 	m_ioDispatcher.registerAddressRange(0x60, 0x70, &m_ppi).release(); 
 	m_ioDispatcher.registerAddressRange(0xA0, 0xB0, &m_nmiControl).release(); // NMI mask register
@@ -61,31 +153,596 @@ Machine::Machine(const std::filesystem::path &hardDiskImage) :
 	m_ioDispatcher.registerAddressRange(0x300, 0x320, &m_xtide).release();
 	m_ioDispatcher.registerAddressRange(0x3B0, 0x3C0, &m_hercules).release();
 	m_ioDispatcher.registerAddressRange(0x4D0, 0x4D1, &m_primaryPIC.elcr).release();
+	m_ioDispatcher.registerAddressRange(0x4D1, 0x4D2, &m_secondaryPIC.elcr).release();
 	
 
+	routeInterrupts();
+
 	/*
-	 * Interrupt routing:
-	 * 0 - PIT
-	 * 1 - Keyboard
-	 * 2 - 
-	 * 3 - 
-	 * 4 -
-	 * 5 -  Bus mouse
-	 * 6 - 
-	 * 7 - IDE
+	 * Without a CPU thread, the drive thread would be one the scheduler knows
+	 * nothing of, so it is never started. This comes before the save state,
+	 * as loading one would start it.
 	 */
-	m_cpu->setInterruptController(&m_primaryPIC);
-	m_primaryPIC.setOutputInterruptLine(m_cpu.get());
-	m_pit.setInterruptLine(m_primaryPIC.line(0));
-	m_xtKeyboard.setInterruptLine(m_primaryPIC.line(1));
-	m_busMouse.setInterruptLine(m_primaryPIC.line(5));
-	m_xtide.setInterruptLine(m_primaryPIC.line(7));
-	
-	m_cpu->start();
+	if (!configuration.cpuThread)
+		m_hdd.setSynchronous(true);
+
+	// Before anything else runs, so that all of memory can be mapped from the file
+	if (!configuration.saveState.empty()) {
+		auto state = openState(configuration.saveState);
+		applyState(state, true);
+	}
+
+	m_cpu->setRealTimePacing(configuration.realTimePacing);
+	if (configuration.startStopped)
+		m_cpu->setStop(0, 0);
+
+	m_inputQueue.start();
+
+	if (configuration.cpuThread)
+		m_cpu->start();
 }
 
 Machine::~Machine() {
 	m_cpu->stop();
+
+	// Whatever was recorded up to here can still be replayed
+	if (m_executionLog.recording())
+		m_executionLog.finish();
+}
+
+const Machine::InterruptRoute Machine::InterruptRoutes[] = {
+	{ 0, "PIT",       [](Machine& machine, InterruptLine* line) { machine.m_pit.setInterruptLine(line); } },
+	{ 1, "keyboard",  [](Machine& machine, InterruptLine* line) { machine.m_xtKeyboard.setInterruptLine(line); } },
+	{ 5, "bus mouse", [](Machine& machine, InterruptLine* line) { machine.m_busMouse.setInterruptLine(line); } },
+	{ 7, "XTIDE",     [](Machine& machine, InterruptLine* line) { machine.m_xtide.setInterruptLine(line); } },
+};
+
+void Machine::routeInterrupts() {
+	m_cpu->setInterruptController(&m_primaryPIC);
+	m_primaryPIC.setOutputInterruptLine(m_cpu.get());
+	m_primaryPIC.setSecondaryPIC(CascadeIRQ, &m_secondaryPIC);
+
+	const char* devices[IRQCount]{};
+	devices[CascadeIRQ] = "secondary PIC";
+
+	for (const auto& route : InterruptRoutes) {
+		if (route.irq >= IRQCount)
+			throw std::logic_error(std::string(route.device) + " is routed to IRQ " + std::to_string(route.irq) + ", which does not exist");
+
+		if (devices[route.irq])
+			throw std::logic_error(std::string(route.device) + " is routed to IRQ " + std::to_string(route.irq) + ", which is already taken by " + devices[route.irq]);
+
+		devices[route.irq] = route.device;
+		route.connect(*this, interruptLine(route.irq));
+	}
+}
+
+InterruptLine* Machine::interruptLine(unsigned int irq) {
+	if (irq < 8)
+		return m_primaryPIC.line(irq);
+	else
+		return m_secondaryPIC.line(irq - 8);
+}
+
+bool Machine::waitInMachineTime(const std::function<uint64_t(uint64_t now)>& poll, std::chrono::milliseconds timeout) {
+	std::mutex mutex;
+	std::condition_variable condvar;
+	bool done = false;
+
+	CallbackTimer timer(m_cpu.get(), [&](uint64_t now) -> uint64_t {
+		auto deadline = poll(now);
+		if (deadline == 0) {
+			// Notified with the lock held, as the waiter may return and take the condvar with it
+			std::unique_lock<std::mutex> locker(mutex);
+			done = true;
+			condvar.notify_all();
+		}
+
+		return deadline;
+	});
+
+	timer.start();
+
+	std::unique_lock<std::mutex> locker(mutex);
+	return condvar.wait_for(locker, timeout, [&done]() { return done; });
+}
+
+void Machine::setTypingFastFill(bool fastFill) {
+	// In order with the text typed
+	m_inputQueue.setTypingFastFill(fastFill);
+}
+
+void Machine::setTimerLagPolicy(VirtualClock::LagPolicy policy) {
+	runOnCPUThread([&]() {
+		if (executionLogged())
+			throw std::logic_error("the timer lag policy is Drop while execution is recorded or replayed");
+
+		m_cpu->setLagPolicy(policy);
+	});
+}
+
+void Machine::runFor(uint64_t cycles, uint64_t instructions) {
+	if (cycles == UINT64_MAX && instructions == UINT64_MAX)
+		throw std::logic_error("running for ever is resume()");
+
+	runOnCPUThread([&]() {
+		auto stopTime = cycles == UINT64_MAX ? UINT64_MAX : m_cpu->cycles() + cycles;
+		auto stopInstructions = instructions == UINT64_MAX ? UINT64_MAX : m_cpu->instructions() + instructions;
+
+		m_cpu->setStop(stopTime, stopInstructions);
+	});
+
+	m_cpu->waitForStop();
+}
+
+void Machine::pause() {
+	runOnCPUThread([this]() {
+		m_cpu->setStop(m_cpu->cycles(), UINT64_MAX);
+	});
+
+	m_cpu->waitForStop();
+}
+
+void Machine::resume() {
+	m_cpu->setStop(UINT64_MAX, UINT64_MAX);
+}
+
+uint64_t Machine::machineTime() {
+	uint64_t time;
+
+	runOnCPUThread([&]() {
+		time = m_cpu->cycles();
+	});
+
+	return time;
+}
+
+bool Machine::waitForText(const std::regex& pattern, std::chrono::milliseconds timeout, TextScreen* screen) {
+	return m_hercules.waitForTextScreen([&pattern](const TextScreen& current) {
+		return std::regex_search(current.text(), pattern);
+	}, timeout, screen);
+}
+
+bool Machine::waitForTextScreenChange(uint64_t hash, std::chrono::milliseconds timeout, TextScreen* screen) {
+	return m_hercules.waitForTextScreen([hash](const TextScreen& current) {
+		return current.hash() != hash;
+	}, timeout, screen);
+}
+
+void Machine::runOnCPUThread(const std::function<void()>& function) {
+	std::mutex mutex;
+	std::condition_variable condvar;
+	bool done = false;
+	std::exception_ptr exception;
+
+	CallbackTimer timer(m_cpu.get(), [&](uint64_t) -> uint64_t {
+		try {
+			function();
+		}
+		catch (...) {
+			exception = std::current_exception();
+		}
+
+		std::unique_lock<std::mutex> locker(mutex);
+		done = true;
+		condvar.notify_all();
+
+		return 0;
+	});
+
+	timer.start();
+
+	{
+		std::unique_lock<std::mutex> locker(mutex);
+		condvar.wait(locker, [&done]() { return done; });
+	}
+
+	if (exception)
+		std::rethrow_exception(exception);
+}
+
+void Machine::memoryImages(MemoryImage (&images)[MemoryImageCount]) {
+	images[RAMImage] = { { 'R', 'A', 'M', ' ' }, &m_ram, 0 };
+	images[VRAMImage] = { { 'V', 'R', 'A', 'M' }, &m_vram, 0 };
+	images[EMSImage] = { { 'E', 'M', 'S', ' ' }, &m_aboveBoard.expandedMemory(), 0 };
+}
+
+void Machine::saveDeviceState(StateWriter& writer) {
+	m_cpu->saveState(writer);
+	m_primaryPIC.saveState(writer);
+	m_secondaryPIC.saveState(writer);
+	m_pit.saveState(writer);
+	m_ppi.saveState(writer);
+
+	writer.beginChunk("MACH");
+	writer.writeBool(m_lowSwitches);
+	writer.endChunk();
+
+	m_nmiControl.saveState(writer);
+	m_hercules.saveState(writer);
+	m_xtide.saveState(writer);
+	m_xtKeyboard.saveState(writer);
+	m_busMouse.saveState(writer);
+	m_aboveBoard.saveState(writer);
+}
+
+void Machine::loadDeviceState(StateReader& reader) {
+	m_cpu->loadState(reader);
+	m_primaryPIC.loadState(reader);
+	m_secondaryPIC.loadState(reader);
+	m_pit.loadState(reader);
+	m_ppi.loadState(reader);
+
+	reader.beginChunk("MACH");
+	m_lowSwitches = reader.readBool();
+	reader.endChunk();
+
+	m_nmiControl.loadState(reader);
+	m_hercules.loadState(reader);
+	m_xtide.loadState(reader);
+	m_xtKeyboard.loadState(reader);
+	m_busMouse.loadState(reader);
+	m_aboveBoard.loadState(reader);
+
+	if (!reader.atEnd())
+		throw std::runtime_error("save state has unexpected device state");
+}
+
+void Machine::replaceDeviceState(const std::vector<uint8_t>& deviceState) {
+	StateWriter previous;
+	saveDeviceState(previous);
+
+	try {
+		StateReader reader(deviceState.data(), deviceState.size());
+		loadDeviceState(reader);
+	}
+	catch (...) {
+		StateReader reader(previous.data().data(), previous.data().size());
+		loadDeviceState(reader);
+		throw;
+	}
+}
+
+/*
+ * Layout: the header, at 0, is the magic, the version, the number of memory
+ * images, the size and offset of the device state, then the tag, size and
+ * offset of every memory image. The images follow at offsets aligned to
+ * SaveStateAlignment, and the device state comes last.
+ */
+void Machine::saveState(const std::filesystem::path& path) {
+	auto file = createStateFile(path);
+
+	runOnCPUThread([&]() {
+		StateWriter devices;
+		saveDeviceState(devices);
+
+		writeState(file.get(), devices.data());
+	});
+}
+
+void Machine::writeState(HANDLE file, const std::vector<uint8_t>& deviceState) {
+	MemoryImage images[MemoryImageCount];
+	memoryImages(images);
+
+	uint64_t offset = SaveStateAlignment;
+	for (auto& image : images) {
+		image.offset = offset;
+		offset += (image.region->length() + SaveStateAlignment - 1) & ~(SaveStateAlignment - 1);
+	}
+
+	StateWriter header;
+	header.writeBytes(SaveStateMagic, sizeof(SaveStateMagic));
+	header.write16(SaveStateVersion);
+	header.write16(MemoryImageCount);
+	header.write32(static_cast<uint32_t>(deviceState.size()));
+	header.write64(offset);
+
+	for (const auto& image : images) {
+		header.writeBytes(image.tag, sizeof(image.tag));
+		header.write32(static_cast<uint32_t>(image.region->length()));
+		header.write64(image.offset);
+	}
+
+	transferFileAt(file, 0, const_cast<uint8_t*>(header.data().data()), header.data().size(), true);
+
+	for (const auto& image : images) {
+		transferFileAt(file, image.offset, image.region->base(), image.region->length(), true);
+	}
+
+	transferFileAt(file, offset, const_cast<uint8_t*>(deviceState.data()), deviceState.size(), true);
+}
+
+void Machine::loadState(const std::filesystem::path& path) {
+	auto state = openState(path);
+
+	runOnCPUThread([&]() {
+		if (executionLogged())
+			throw std::logic_error("states cannot be loaded while execution is recorded or replayed");
+
+		applyState(state, false);
+
+		// Drained at the same machine times as on the machine that saved it
+		m_inputQueue.start();
+	});
+}
+
+Machine::SaveStateFile Machine::openState(const std::filesystem::path& path) {
+	SaveStateFile state;
+
+	auto rawFile = CreateFile(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (rawFile == INVALID_HANDLE_VALUE)
+		_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+	state.file.reset(rawFile);
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(state.file.get(), &fileSize))
+		_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+	auto fileEnd = static_cast<uint64_t>(fileSize.QuadPart);
+
+	// The file is checked before the machine is touched; the device state is checked as it loads, see applyState()
+	uint8_t headerData[sizeof(SaveStateMagic) + 16 + MemoryImageCount * 16];
+	if (fileEnd < sizeof(headerData))
+		throw std::runtime_error("not a save state");
+
+	transferFileAt(state.file.get(), 0, headerData, sizeof(headerData), false);
+
+	StateReader header(headerData, sizeof(headerData));
+
+	char magic[sizeof(SaveStateMagic)];
+	header.readBytes(magic, sizeof(magic));
+	if (memcmp(magic, SaveStateMagic, sizeof(magic)) != 0)
+		throw std::runtime_error("not a save state");
+
+	if (header.read16() != SaveStateVersion)
+		throw std::runtime_error("unsupported save state version");
+
+	if (header.read16() != MemoryImageCount)
+		throw std::runtime_error("save state has an unexpected number of memory images");
+
+	auto deviceStateSize = header.read32();
+	auto deviceStateOffset = header.read64();
+	if (deviceStateOffset > fileEnd || deviceStateSize > fileEnd - deviceStateOffset)
+		throw std::runtime_error("save state is truncated");
+
+	memoryImages(state.images);
+
+	for (auto& image : state.images) {
+		char tag[sizeof(image.tag)];
+		header.readBytes(tag, sizeof(tag));
+		auto length = header.read32();
+		image.offset = header.read64();
+
+		if (memcmp(tag, image.tag, sizeof(tag)) != 0 || length != image.region->length())
+			throw std::runtime_error("save state memory images do not match this machine");
+
+		if (image.offset % SaveStateAlignment != 0 || image.offset > fileEnd || length > fileEnd - image.offset)
+			throw std::runtime_error("save state is truncated");
+	}
+
+	state.deviceState.resize(deviceStateSize);
+	transferFileAt(state.file.get(), deviceStateOffset, state.deviceState.data(), state.deviceState.size(), false);
+
+	StateReader(state.deviceState.data(), state.deviceState.size()).checkChunks();
+
+	state.mapping.reset(CreateFileMapping(state.file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+	if (!state.mapping)
+		_com_raise_error(HRESULT_FROM_WIN32(GetLastError()));
+
+	return state;
+}
+
+void Machine::applyState(SaveStateFile& state, bool constructing) {
+	// The devices go first, while the memory is untouched, so that a state that fails to load leaves the machine as it was
+	replaceDeviceState(state.deviceState);
+
+	for (const auto& image : state.images) {
+		if (image.region == &m_vram && !constructing) {
+			// Copied, as the video adapter reads it from the UI threads
+			transferFileAt(state.file.get(), image.offset, m_vram.base(), m_vram.length(), false);
+		}
+		else {
+			image.region->mapCopyOnWrite(state.mapping.get(), image.offset);
+		}
+	}
+
+	m_vramAddressRange->markWritten();
+
+	// The checkpoints are of another machine now
+	if (m_rewind)
+		m_rewind->clear();
+}
+
+void Machine::enableRewind(size_t capacity, uint64_t interval, bool compress) {
+	runOnCPUThread([&]() {
+		if (m_rewind)
+			throw std::logic_error("rewind is enabled already");
+
+		m_rewind.emplace(capacity, compress);
+
+		MemoryImage images[MemoryImageCount];
+		memoryImages(images);
+
+		for (const auto& image : images)
+			m_rewind->addArea(image.region->base(), image.region->length());
+
+		m_aboveBoard.enableWriteTracking();
+		m_checkpointInterval = interval;
+	});
+
+	// The first checkpoint is taken right away
+	m_checkpointTimer.emplace(m_cpu.get(), [this](uint64_t now) -> uint64_t {
+		takeCheckpoint();
+		return now + m_checkpointInterval;
+	});
+
+	m_checkpointTimer->start();
+}
+
+void Machine::checkpoint() {
+	runOnCPUThread([this]() {
+		if (!m_rewind)
+			throw std::logic_error("rewind is not enabled");
+
+		takeCheckpoint();
+	});
+}
+
+bool Machine::rewind(size_t steps) {
+	bool rewound = false;
+
+	runOnCPUThread([&]() {
+		if (executionLogged())
+			throw std::logic_error("rewinding is not possible while execution is recorded or replayed");
+
+		if (!m_rewind || steps >= m_rewind->checkpointCount())
+			return;
+
+		// As with save states, the devices go first, so that the checkpoints are only changed once they have loaded
+		replaceDeviceState(m_rewind->checkpointDeviceState(m_rewind->checkpointCount() - 1 - steps));
+
+		collectWrites();
+		m_rewind->rewind(steps);
+
+		m_vramAddressRange->markWritten();
+
+		m_inputQueue.start();
+
+		rewound = true;
+	});
+
+	return rewound;
+}
+
+Machine::RewindStatistics Machine::rewindStatistics() {
+	RewindStatistics statistics{};
+
+	runOnCPUThread([&]() {
+		if (m_rewind) {
+			statistics.checkpoints = m_rewind->checkpointCount();
+			statistics.memoryUsed = m_rewind->memoryUsed();
+		}
+	});
+
+	return statistics;
+}
+
+/*
+ * The recording machine loads the device state it has just saved, as the
+ * replaying one will, so that devices that reschedule their timers on
+ * loading do so the same way on both.
+ */
+void Machine::startRecording(const std::filesystem::path& path) {
+	auto statePath = path;
+	statePath += ".state";
+
+	auto file = createStateFile(statePath);
+
+	runOnCPUThread([&]() {
+		if (executionLogged())
+			throw std::logic_error("execution is recorded or replayed already");
+
+		m_cpu->setLagPolicy(VirtualClock::LagPolicy::Drop);
+		m_hdd.setSynchronous(true);
+
+		StateWriter devices;
+		saveDeviceState(devices);
+
+		writeState(file.get(), devices.data());
+
+		StateReader reader(devices.data().data(), devices.data().size());
+		loadDeviceState(reader);
+
+		m_inputQueue.start();
+
+		m_executionLog.startRecording(path);
+		attachExecutionLog(&m_executionLog);
+	});
+}
+
+void Machine::stopRecording() {
+	runOnCPUThread([this]() {
+		if (m_executionLog.recording()) {
+			m_executionLog.finish();
+			attachExecutionLog(nullptr);
+		}
+	});
+}
+
+void Machine::startReplay(const std::filesystem::path& path, std::function<void(const std::string& divergence)> endHandler) {
+	auto statePath = path;
+	statePath += ".state";
+
+	auto state = openState(statePath);
+
+	runOnCPUThread([&]() {
+		if (executionLogged())
+			throw std::logic_error("execution is recorded or replayed already");
+
+		m_cpu->setLagPolicy(VirtualClock::LagPolicy::Drop);
+		m_hdd.setSynchronous(true);
+
+		applyState(state, false);
+
+		m_inputQueue.start();
+
+		m_executionLog.setEndHandler([this, endHandler](const std::string& divergence) {
+			attachExecutionLog(nullptr);
+			m_cpu->setRealTimePacing(true);
+
+			if (endHandler)
+				endHandler(divergence);
+		});
+
+		m_executionLog.startReplay(path);
+		attachExecutionLog(&m_executionLog);
+		m_cpu->setRealTimePacing(false);
+	});
+}
+
+bool Machine::executionLogged() const {
+	return m_executionLog.recording() || m_executionLog.replaying();
+}
+
+void Machine::attachExecutionLog(ExecutionLog* executionLog) {
+	m_cpu->setExecutionLog(executionLog);
+	m_hdd.setExecutionLog(executionLog);
+	m_inputQueue.setExecutionLog(executionLog);
+}
+
+void Machine::collectWrites() {
+	static_assert(MappedAddressRange::WriteTrackingPageSize == RewindBuffer::PageSize, "write tracking and rewind pages differ");
+
+	std::vector<size_t> pages;
+
+	m_ramAddressRange->collectWrites(m_ramWriteGeneration, pages);
+	// Fast fill writes the BIOS keyboard buffer behind the CPU's back
+	pages.push_back(BIOSDataAreaBase / RewindBuffer::PageSize);
+
+	for (auto page : pages)
+		m_rewind->markWritten(RAMImage, page);
+
+	pages.clear();
+	m_vramAddressRange->collectWrites(m_vramWriteGeneration, pages);
+
+	for (auto page : pages)
+		m_rewind->markWritten(VRAMImage, page);
+
+	pages.clear();
+	m_aboveBoard.collectWrites(pages);
+
+	for (auto page : pages)
+		m_rewind->markWritten(EMSImage, page);
+}
+
+void Machine::takeCheckpoint() {
+	collectWrites();
+
+	StateWriter devices;
+	saveDeviceState(devices);
+
+	m_rewind->checkpoint(m_cpu->cycles(), devices.data());
 }
 
 uint8_t Machine::readPortA(uint8_t mask) const {
@@ -107,7 +764,7 @@ uint8_t Machine::readPortB(uint8_t mask) const {
 void Machine::writePortB(uint8_t value, uint8_t mask) {
 	value |= ~mask;
 
-	// TODO: 0: speaker gate
+	m_pit.setGate(2, (value & (1 << 0)) != 0);
 	// TODO: 1: speaker data
 	// 2 - turbo
 	m_lowSwitches = (value & (1 << 3)) == 0;
@@ -132,7 +789,10 @@ uint8_t Machine::readPortC(uint8_t mask) const {
 		result |= (m_switches & 0xF0) >> 4;
 	}
 
-	// TODO: bit 5: timer channel 2 out
+	if (m_pit.output(2)) {
+		result |= 1 << 5;
+	}
+
 	// TODO: bit 6: I/O channel check
 	// TODO: bit 7: RAM parity check
 
@@ -0,0 +1,295 @@
+#include <Hardware/MachineFleet.h>
+#include <Hardware/CPUEmulation.h>
+
+#include <algorithm>
+
+MachineFleet::MachineFleet(unsigned int threads) : m_quantum(DefaultQuantum), m_nextWakeTime(INT64_MAX), m_queued(0),
+	m_idleWorkers(0), m_nextWorker(0), m_run(false) {
+
+	threads = std::max(threads, 1U);
+
+	for (unsigned int index = 0; index < threads; index++)
+		m_workers.emplace_back(std::make_unique<Worker>());
+}
+
+MachineFleet::~MachineFleet() {
+	stop();
+
+	// The machines go first, as stopping their CPUs may still wake them
+	for (auto& entry : m_entries)
+		entry->cpu->setWakeHandler(nullptr);
+
+	m_entries.clear();
+}
+
+Machine& MachineFleet::addMachine(Machine::Configuration configuration) {
+	configuration.cpuThread = false;
+
+	auto entry = std::make_unique<Entry>();
+	entry->machine = std::make_unique<Machine>(configuration);
+	entry->cpu = entry->machine->cpu();
+	entry->state = State::Queued;
+	entry->wakePending = false;
+	entry->sleeping = false;
+	// Nothing runs the machine yet, so these are consistent
+	entry->instructions = entry->cpu->instructions();
+	entry->cycles = entry->cpu->cycles();
+	entry->slices = 0;
+	entry->busyNanoseconds = 0;
+
+	auto rawEntry = entry.get();
+	entry->cpu->setWakeHandler([this, rawEntry]() { wake(rawEntry); });
+
+	auto& machine = *entry->machine;
+
+	{
+		std::unique_lock<std::mutex> locker(m_entriesMutex);
+		m_entries.emplace_back(std::move(entry));
+	}
+
+	enqueue(m_nextWorker++ % m_workers.size(), rawEntry);
+	notifyIdleWorker();
+
+	return machine;
+}
+
+void MachineFleet::start() {
+	m_run = true;
+
+	for (unsigned int index = 0; index < m_workers.size(); index++)
+		m_workers[index]->thread = std::thread(&MachineFleet::workerThread, this, index);
+}
+
+void MachineFleet::stop() {
+	{
+		std::unique_lock<std::mutex> locker(m_parkMutex);
+		m_run = false;
+		m_workCondvar.notify_all();
+	}
+
+	for (auto& worker : m_workers) {
+		if (worker->thread.joinable())
+			worker->thread.join();
+	}
+}
+
+std::vector<MachineFleet::MachineStatistics> MachineFleet::statistics() const {
+	std::unique_lock<std::mutex> locker(m_entriesMutex);
+
+	std::vector<MachineStatistics> statistics;
+	statistics.reserve(m_entries.size());
+
+	for (const auto& entry : m_entries) {
+		statistics.emplace_back(MachineStatistics{
+			entry->instructions.load(),
+			entry->cycles.load(),
+			entry->slices.load(),
+			std::chrono::nanoseconds(entry->busyNanoseconds.load()),
+			entry->state.load() == State::Finished
+		});
+	}
+
+	return statistics;
+}
+
+void MachineFleet::workerThread(unsigned int index) {
+	while (m_run.load()) {
+		auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		if (now >= m_nextWakeTime.load()) {
+			std::unique_lock<std::mutex> locker(m_parkMutex);
+			wakeSleepersLocked(index);
+		}
+
+		auto entry = takeEntry(index);
+		if (entry)
+			runEntry(index, entry);
+		else
+			waitForWork(index);
+	}
+}
+
+void MachineFleet::runEntry(unsigned int index, Entry* entry) {
+	entry->state = State::Running;
+
+	auto begin = std::chrono::steady_clock::now();
+
+	std::chrono::steady_clock::time_point wakeTime;
+	auto result = entry->cpu->runSlice(m_quantum, wakeTime);
+
+	auto end = std::chrono::steady_clock::now();
+
+	entry->instructions = entry->cpu->instructions();
+	entry->cycles = entry->cpu->cycles();
+	entry->slices++;
+	entry->busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+
+	switch (result) {
+	case CPUEmulation::SliceResult::Runnable:
+		// More than this one machine queued is work for an idle worker to steal
+		if (enqueue(index, entry) > 1)
+			notifyIdleWorker();
+
+		break;
+
+	case CPUEmulation::SliceResult::Parked:
+		park(index, entry, wakeTime);
+		break;
+
+	case CPUEmulation::SliceResult::Finished:
+		entry->state = State::Finished;
+		break;
+	}
+}
+
+size_t MachineFleet::enqueue(unsigned int index, Entry* entry) {
+	auto& worker = *m_workers[index];
+	size_t queued;
+
+	entry->state = State::Queued;
+
+	{
+		std::unique_lock<std::mutex> locker(worker.mutex);
+		worker.queue.push_back(entry);
+		queued = worker.queue.size();
+	}
+
+	m_queued++;
+
+	return queued;
+}
+
+MachineFleet::Entry* MachineFleet::takeEntry(unsigned int index) {
+	if (m_queued.load() == 0)
+		return nullptr;
+
+	// Round robin through a worker's own queue, and stealing from the other end of the others
+	for (size_t offset = 0; offset < m_workers.size(); offset++) {
+		auto& worker = *m_workers[(index + offset) % m_workers.size()];
+
+		std::unique_lock<std::mutex> locker(worker.mutex);
+		if (worker.queue.empty())
+			continue;
+
+		Entry* entry;
+		if (offset == 0) {
+			entry = worker.queue.front();
+			worker.queue.pop_front();
+		}
+		else {
+			entry = worker.queue.back();
+			worker.queue.pop_back();
+		}
+
+		m_queued--;
+		return entry;
+	}
+
+	return nullptr;
+}
+
+void MachineFleet::waitForWork(unsigned int index) {
+	std::unique_lock<std::mutex> locker(m_parkMutex);
+
+	/*
+	 * Counted as idle before looking at m_queued, and machines are counted
+	 * as queued before looking at m_idleWorkers, so either this sees the
+	 * machine queued, or whoever queued it sees this worker idle and
+	 * notifies it.
+	 */
+	m_idleWorkers++;
+
+	while (m_run.load()) {
+		wakeSleepersLocked(index);
+
+		if (m_queued.load() != 0)
+			break;
+
+		if (m_sleeping.empty())
+			m_workCondvar.wait(locker);
+		else
+			m_workCondvar.wait_until(locker, m_sleeping.begin()->first);
+	}
+
+	m_idleWorkers--;
+}
+
+void MachineFleet::notifyIdleWorker() {
+	if (m_idleWorkers.load() == 0)
+		return;
+
+	std::unique_lock<std::mutex> locker(m_parkMutex);
+	m_workCondvar.notify_one();
+}
+
+void MachineFleet::wake(Entry* entry) {
+	std::unique_lock<std::mutex> locker(m_parkMutex);
+
+	switch (entry->state.load()) {
+	case State::Parked:
+		if (entry->sleeping) {
+			m_sleeping.erase(entry->sleepingPosition);
+			entry->sleeping = false;
+			updateNextWakeTimeLocked();
+		}
+
+		enqueue(m_nextWorker++ % m_workers.size(), entry);
+		m_workCondvar.notify_one();
+		break;
+
+	case State::Running:
+		// Parked by the slice that has just ended, and not yet off the worker; see park()
+		entry->wakePending = true;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void MachineFleet::park(unsigned int index, Entry* entry, std::chrono::steady_clock::time_point wakeTime) {
+	std::unique_lock<std::mutex> locker(m_parkMutex);
+
+	if (entry->wakePending) {
+		entry->wakePending = false;
+		enqueue(index, entry);
+		return;
+	}
+
+	entry->state = State::Parked;
+
+	if (wakeTime != std::chrono::steady_clock::time_point::max()) {
+		entry->sleeping = true;
+		entry->sleepingPosition = m_sleeping.emplace(wakeTime, entry);
+		updateNextWakeTimeLocked();
+	}
+}
+
+void MachineFleet::wakeSleepersLocked(unsigned int index) {
+	auto now = std::chrono::steady_clock::now();
+	bool woken = false;
+
+	while (!m_sleeping.empty() && m_sleeping.begin()->first <= now) {
+		auto entry = m_sleeping.begin()->second;
+		m_sleeping.erase(m_sleeping.begin());
+		entry->sleeping = false;
+
+		enqueue(index, entry);
+		woken = true;
+	}
+
+	if (woken) {
+		updateNextWakeTimeLocked();
+
+		// Machines tend to wake together, as they are paced to the same real time
+		m_workCondvar.notify_all();
+	}
+}
+
+void MachineFleet::updateNextWakeTimeLocked() {
+	if (m_sleeping.empty()) {
+		m_nextWakeTime = INT64_MAX;
+	}
+	else {
+		m_nextWakeTime = std::chrono::duration_cast<std::chrono::nanoseconds>(m_sleeping.begin()->first.time_since_epoch()).count();
+	}
+}
@@ -1,4 +1,6 @@
 #include <Hardware/NMIControl.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 #include <Utils/AccessSizeUtils.h>
 
 NMIControl::NMIControl() : m_allowNMI(false) {
@@ -15,6 +17,18 @@ uint64_t NMIControl::read(uint64_t address, unsigned int accessSize) {
 	return splitReadAccess(address, accessSize, &NMIControl::read8, this);
 }
 
+void NMIControl::saveState(StateWriter& writer) const {
+	writer.beginChunk("NMI ");
+	writer.writeBool(m_allowNMI);
+	writer.endChunk();
+}
+
+void NMIControl::loadState(StateReader& reader) {
+	reader.beginChunk("NMI ");
+	m_allowNMI = reader.readBool();
+	reader.endChunk();
+}
+
 uint8_t NMIControl::read8(uint64_t address, uint8_t mask) {
 	(void)address;
 	(void)mask;
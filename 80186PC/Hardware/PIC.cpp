@@ -1,13 +1,17 @@
 #include <Hardware/PIC.h>
 
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 #include <Utils/AccessSizeUtils.h>
 
 #include <stdio.h>
 #include <assert.h>
 
+#include <stdexcept>
+
 #undef TRACE_INTERRUPTS
 
-PIC::ELCR::ELCR(PIC* owner) : m_owner(owner), m_value(0) {
+PIC::ELCR::ELCR(PIC* owner) : m_owner(owner) {
 
 }
 
@@ -24,13 +28,22 @@ uint64_t PIC::ELCR::read(uint64_t address, unsigned int accessSize) {
 void PIC::ELCR::write8(uint64_t address, uint8_t mask, uint8_t data) {
 	(void)address;
 	(void)mask;
-	m_value = data;
+	m_owner->m_elcr = data;
+
+	auto levelTriggered = m_owner->levelTriggeredLines();
+	m_owner->updateRegisters([levelTriggered](Registers& registers) {
+		registers.levelTriggered = levelTriggered;
+	});
 }
 
 uint8_t PIC::ELCR::read8(uint64_t address, uint8_t mask) {
 	(void)address;
 	(void)mask;
-	return m_value;
+	return value();
+}
+
+uint8_t PIC::ELCR::value() const {
+	return m_owner->m_elcr;
 }
 
 PIC::PIC() :
@@ -50,12 +63,30 @@ PIC::PIC() :
 		nullptr, nullptr, nullptr, nullptr,
 	},
 	m_outputInterruptLine(nullptr),
-	m_state(State::Idle), m_edgeSense(0), m_mask(0), m_icw1(0), m_icw2(0), m_icw3(0), m_icw4(0), m_ocw3(0), m_isr(0), m_irr(0) {
+	m_registers(Registers{ 0, 0, 0, 0, 0, 0, NoRequest, 0 }),
+	m_state(State::Idle), m_elcr(0), m_cascadeLines(0), m_icw1(0), m_icw3(0), m_icw4(0), m_ocw3(0) {
 
 }
 
 PIC::~PIC() = default;
 
+void PIC::setSecondaryPIC(unsigned int line, PIC* pic) {
+	m_secondaryPICs[line] = pic;
+
+	if (pic) {
+		m_cascadeLines |= 1 << line;
+		pic->setOutputInterruptLine(&m_interruptLines[line]);
+	}
+	else {
+		m_cascadeLines &= ~(1 << line);
+	}
+
+	auto levelTriggered = levelTriggeredLines();
+	updateRegisters([levelTriggered](Registers& registers) {
+		registers.levelTriggered = levelTriggered;
+	});
+}
+
 void PIC::write(uint64_t address, unsigned int accessSize, uint64_t data) {
 	splitWriteAccess(address, accessSize, data, &PIC::write8, this);
 }
@@ -67,8 +98,6 @@ uint64_t PIC::read(uint64_t address, unsigned int accessSize) {
 void PIC::write8(uint64_t address, uint8_t mask, uint8_t data) {
 	(void)mask;
 
-	std::unique_lock locker(m_picMutex);
-
 #if defined(TRACE_INTERRUPTS)
 	printf("PIC: write: %u <- %02X\n", static_cast<uint32_t>(address), data);
 #endif
@@ -76,8 +105,6 @@ void PIC::write8(uint64_t address, uint8_t mask, uint8_t data) {
 	switch (address & 1) {
 	case RegisterCommand:
 		if (data & CommandICW1) {
-			m_edgeSense = 0;
-			m_mask = 0;
 			// IR7 input is assigned priority 7
 			// The slave mode address is set to 7
 			m_ocw3 = 0;
@@ -86,6 +113,13 @@ void PIC::write8(uint64_t address, uint8_t mask, uint8_t data) {
 				m_icw4 = 0;
 			}
 			m_state = State::WaitingForICW2;
+
+			auto levelTriggered = levelTriggeredLines();
+			updateRegisters([levelTriggered](Registers& registers) {
+				registers.inputs = 0;
+				registers.imr = 0;
+				registers.levelTriggered = levelTriggered;
+			});
 		}
 		else if (data & CommandOCW3) {
 			if (data & OCW3_RR) {
@@ -111,19 +145,20 @@ void PIC::write8(uint64_t address, uint8_t mask, uint8_t data) {
 			if (data & OCW2_EOI) {
 				unsigned int level;
 
-				if (data & OCW2_SL) {
-					level = (data & OCW2_LMask) >> OCW2_LPos;
-				}
-				else {
-					level = findHighestPriorityRequest(m_isr);
-				}
+				updateRegisters([data, &level](Registers& registers) {
+					if (data & OCW2_SL) {
+						level = (data & OCW2_LMask) >> OCW2_LPos;
+					}
+					else {
+						level = findHighestPriorityRequest(registers.isr);
+					}
+
+					registers.isr &= ~(1 << level);
+				});
 
 #if defined(TRACE_INTERRUPTS)
 				printf("PIC: EOI %sspecific, level %u\n", (data & OCW2_SL) ? "" : "non-", level);
 #endif
-
-				m_isr &= ~(1 << level);
-				irrUpdated();
 			}
 		}
 
@@ -133,12 +168,15 @@ void PIC::write8(uint64_t address, uint8_t mask, uint8_t data) {
 		switch (m_state) {
 		case State::Idle:
 			// OCW1
-			m_mask = data;
-			irrUpdated();
+			updateRegisters([data](Registers& registers) {
+				registers.imr = data;
+			});
 			break;
 
 		case State::WaitingForICW2:
-			m_icw2 = data;
+			updateRegisters([data](Registers& registers) {
+				registers.vectorBase = data;
+			});
 
 			if (!(m_icw1 & ICW1_SNGL)) {
 				m_state = State::WaitingForICW3;
@@ -179,8 +217,6 @@ void PIC::write8(uint64_t address, uint8_t mask, uint8_t data) {
 
 uint8_t PIC::read8(uint64_t address, uint8_t mask) {
 	(void)mask;
-	
-	std::unique_lock locker(m_picMutex);
 
 #if defined(TRACE_INTERRUPTS)
 	printf("PIC: read: %u\n", static_cast<uint32_t>(address));
@@ -195,17 +231,19 @@ uint8_t PIC::read8(uint64_t address, uint8_t mask) {
 		return (request << 7) | lineNumber;
 	}
 
+	auto registers = m_registers.load();
+
 	switch (address & 1) {
 	case RegisterCommand:
 		if (m_ocw3 & OCW3_RIS) {
-			return m_isr;
+			return registers.isr;
 		}
 		else {
-			return m_irr;
+			return registers.irr;
 		}
 
 	case RegisterData:
-		return m_mask;
+		return registers.imr;
 
 	default:
 		__assume(0);
@@ -213,101 +251,157 @@ uint8_t PIC::read8(uint64_t address, uint8_t mask) {
 }
 
 void PIC::setInterruptLineAsserted(unsigned int line, bool asserted) {
-	std::unique_lock locker(m_picMutex);
-
 #if defined(TRACE_INTERRUPTS)
 	printf("PIC: line asserted: %u, %u\n", line, static_cast<unsigned int>(asserted));
 #endif
 
-	auto lineMask = 1 << line;
+	auto lineMask = static_cast<uint8_t>(1 << line);
 
-	if ((m_icw1 & ICW1_LTIM) || (elcr.value() & (1 << line))) {
-		// Level triggered
+	updateRegisters([lineMask, asserted](Registers& registers) {
+		if (registers.levelTriggered & lineMask) {
+			if (asserted) {
+				registers.irr |= lineMask;
+			}
+			else {
+				registers.irr &= ~lineMask;
+			}
+		}
+		else if (asserted && !(registers.inputs & lineMask)) {
+			// Rising edge
+			registers.irr |= lineMask;
+		}
 
-		if ((m_irr ^ (asserted << line)) & lineMask) {
-			m_irr = (m_irr & ~lineMask) | (asserted << line);
-			irrUpdated();
+		if (asserted) {
+			registers.inputs |= lineMask;
+		}
+		else {
+			registers.inputs &= ~lineMask;
 		}
+	});
+}
 
-	}
-	else {
-		// Edge triggered
+template<typename Modify>
+void PIC::updateRegisters(Modify&& modify) {
+	auto before = m_registers.load();
+	Registers after;
 
-		if (asserted && !(m_edgeSense & lineMask)) {
-			m_irr |= lineMask;
-			irrUpdated();
-		}
+	do {
+		after = before;
+		modify(after);
+		updatePendingRequest(after);
+	} while (!m_registers.compare_exchange_weak(before, after));
 
-		m_edgeSense = (m_edgeSense & ~lineMask) | (asserted << line);
+#if defined(TRACE_INTERRUPTS)
+	printf("PIC: IRR %02X, ISR %02X, IMR %02X, pending line %02X\n", after.irr, after.isr, after.imr, after.pendingLine);
+#endif
+
+	auto wasAsserted = before.pendingLine != NoRequest;
+	auto asserted = after.pendingLine != NoRequest;
+	if (asserted != wasAsserted)
+		publishOutput(asserted);
+}
+
+void PIC::publishOutput(bool asserted) {
+	auto line = m_outputInterruptLine;
+	if (!line)
+		return;
+
+	/*
+	 * Another thread may have changed the output again and published it
+	 * before this one gets to, so publishing is repeated until what was
+	 * published is known to have been current afterwards. Any later change
+	 * is then published by whoever makes it.
+	 */
+	while (true) {
+		line->setInterruptAsserted(asserted);
+
+		auto current = m_registers.load().pendingLine != NoRequest;
+		if (current == asserted)
+			break;
+
+		asserted = current;
 	}
 }
 
-void PIC::irrUpdated() {
-	auto unserviced = m_irr & ~m_mask & ~m_isr;
+uint8_t PIC::levelTriggeredLines() const {
+	return ((m_icw1 & ICW1_LTIM) ? 0xFF : m_elcr) | m_cascadeLines;
+}
 
-#if defined(TRACE_INTERRUPTS)
-	printf("PIC: IRR updated, now %02X. Interrupts demanding service: %02X\n", m_irr, unserviced);
-#endif
+void PIC::updatePendingRequest(Registers& registers) {
+	uint8_t unserviced = registers.irr & ~registers.imr & ~registers.isr;
 
-	m_outputInterruptLine->setInterruptAsserted(unserviced != 0);
+	if (unserviced == 0) {
+		registers.pendingLine = NoRequest;
+		registers.pendingVector = 0;
+	}
+	else {
+		auto line = findHighestPriorityRequest(unserviced);
+		registers.pendingLine = static_cast<uint8_t>(line);
+		registers.pendingVector = static_cast<uint8_t>((registers.vectorBase & 0xF8) | line);
+	}
 }
 
 unsigned int PIC::internalInterruptAcknowledge(bool& request) {
 	assert(m_icw4 & ICW4_UPM);
 
-	auto unserviced = m_irr & ~m_mask & ~m_isr;
+	auto autoEOI = (m_icw4 & ICW4_AEOI) != 0;
 	uint8_t lineNumber;
 
-	if (unserviced == 0) {
-#if defined(TRACE_INTERRUPTS)
-		printf("PIC: spurious interrupt\n");
-#endif
-		lineNumber = 7;
-		request = false;
-	}
-	else {
-		lineNumber = findHighestPriorityRequest(unserviced);
+	updateRegisters([autoEOI, &lineNumber](Registers& registers) {
+		lineNumber = registers.pendingLine;
+		if (lineNumber == NoRequest)
+			return;
 
-		if (!((m_icw1 & ICW1_LTIM) || (elcr.value() & (1 << lineNumber)))) {
-			m_irr &= ~(1 << lineNumber);
-		}
+		auto lineMask = static_cast<uint8_t>(1 << lineNumber);
 
-		if (!(m_icw4 & ICW4_AEOI)) {
-			m_isr |= 1 << lineNumber;
+		if (!(registers.levelTriggered & lineMask)) {
+			registers.irr &= ~lineMask;
 		}
 
-		irrUpdated();
+		if (!autoEOI) {
+			registers.isr |= lineMask;
+		}
+	});
 
-		request = true;
+	if (lineNumber == NoRequest) {
+#if defined(TRACE_INTERRUPTS)
+		printf("PIC: spurious interrupt\n");
+#endif
+		request = false;
+		return 7;
 	}
 
+	request = true;
 	return lineNumber;
 }
 
 uint8_t PIC::processInterruptAcknowledge() {
-	std::unique_lock locker(m_picMutex);
+	// The common case: the vector is the one cached with the request
+	auto registers = m_registers.load();
+	auto vector = registers.pendingVector;
 
 	bool request;
 	unsigned int lineNumber = internalInterruptAcknowledge(request);
 
-	uint8_t vector;
-	
-	if (m_secondaryPICs[lineNumber]) {
+	if (request && m_secondaryPICs[lineNumber]) {
+		// The secondary drives the vector onto the bus
 		vector = m_secondaryPICs[lineNumber]->processInterruptAcknowledge();
 	}
-	else {
-		vector = (m_icw2 & 0xF8) | lineNumber;
+	else if (!request || lineNumber != registers.pendingLine) {
+		// Changed meanwhile, or spurious
+		vector = static_cast<uint8_t>((registers.vectorBase & 0xF8) | lineNumber);
 	}
 
 #if defined(TRACE_INTERRUPTS)
-	printf("PIC: INTA, vector %02X. IRR is now %02X, ISR is now %02X\n", vector, m_irr, m_isr);
+	registers = m_registers.load();
+	printf("PIC: INTA, vector %02X. IRR is now %02X, ISR is now %02X\n", vector, registers.irr, registers.isr);
 #endif
 	
 	return vector;
 }
 
-unsigned int PIC::findHighestPriorityRequest(uint8_t mask) const {
-	for (unsigned int index = 0; index < 6; index++) {
+unsigned int PIC::findHighestPriorityRequest(uint8_t mask) {
+	for (unsigned int index = 0; index < 7; index++) {
 		if (mask & (1 << index))
 			return index;
 	}
@@ -315,6 +409,53 @@ unsigned int PIC::findHighestPriorityRequest(uint8_t mask) const {
 	return 7;
 }
 
+void PIC::saveState(StateWriter& writer) const {
+	auto registers = m_registers.load();
+
+	writer.beginChunk("PIC ");
+	writer.write8(registers.irr);
+	writer.write8(registers.isr);
+	writer.write8(registers.imr);
+	writer.write8(registers.inputs);
+	writer.write8(registers.vectorBase);
+	writer.write8(static_cast<uint8_t>(m_state));
+	writer.write8(m_elcr);
+	writer.write8(m_icw1);
+	writer.write8(m_icw3);
+	writer.write8(m_icw4);
+	writer.write8(m_ocw3);
+	writer.endChunk();
+}
+
+void PIC::loadState(StateReader& reader) {
+	Registers registers;
+
+	reader.beginChunk("PIC ");
+	registers.irr = reader.read8();
+	registers.isr = reader.read8();
+	registers.imr = reader.read8();
+	registers.inputs = reader.read8();
+	registers.vectorBase = reader.read8();
+
+	auto state = reader.read8();
+	if (state > static_cast<uint8_t>(State::Poll))
+		throw std::runtime_error("save state has an invalid PIC state");
+
+	m_state = static_cast<State>(state);
+	m_elcr = reader.read8();
+	m_icw1 = reader.read8();
+	m_icw3 = reader.read8();
+	m_icw4 = reader.read8();
+	m_ocw3 = reader.read8();
+	reader.endChunk();
+
+	registers.levelTriggered = levelTriggeredLines();
+	updatePendingRequest(registers);
+	m_registers.store(registers);
+
+	publishOutput(registers.pendingLine != NoRequest);
+}
+
 PIC::PICInterruptLine::PICInterruptLine(PIC* owner, unsigned int line) : m_owner(owner), m_line(line) {
 
 }
@@ -1,20 +1,49 @@
 #include <Hardware/PIT.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 #include <Utils/AccessSizeUtils.h>
 
-#include <stdio.h>
-#include <Windows.h>
+#include <algorithm>
+#include <stdexcept>
 
-PIT::PIT() : m_interruptLine(nullptr), m_byte(false), m_writeLatch(0), m_compareValue(0), m_runPITThread(true), m_pitThreadAlert(false), m_pitThread(&PIT::pitThread, this) {
+static uint32_t bcdToBinary(uint16_t value) {
+	return
+		(value & 0xF) +
+		((value >> 4) & 0xF) * 10 +
+		((value >> 8) & 0xF) * 100 +
+		((value >> 12) & 0xF) * 1000;
+}
 
+static uint16_t binaryToBCD(uint32_t value) {
+	return static_cast<uint16_t>(
+		(value % 10) |
+		((value / 10 % 10) << 4) |
+		((value / 100 % 10) << 8) |
+		((value / 1000 % 10) << 12));
 }
 
-PIT::~PIT() {
-	{
-		std::unique_lock locker(m_pitThreadMutex);
-		m_runPITThread = false;
+PIT::PIT() : m_interruptLine(nullptr), m_clock(nullptr), m_channels{}, m_output0(false), m_output0Tick(0),
+	m_ticks(0), m_lateTicks(0), m_lostTicks(0), m_droppedCyclesSeen(0), m_droppedCyclesUncounted(0) {
+	for (auto& channel : m_channels) {
+		channel.access = AccessLowHigh;
+		channel.gate = true;
+		channel.nullCount = true;
 	}
-	m_pitThreadCondvar.notify_all();
-	m_pitThread.join();
+}
+
+PIT::~PIT() {
+	if (m_clock)
+		m_clock->cancelTimer(this);
+}
+
+void PIT::setClock(VirtualClock* clock) {
+	if (m_clock)
+		m_clock->cancelTimer(this);
+
+	m_clock = clock;
+	m_output0Tick = now();
+	m_droppedCyclesSeen = m_clock ? m_clock->droppedCycles() : 0;
+	scheduleOutput0();
 }
 
 void PIT::write(uint64_t address, unsigned int accessSize, uint64_t data) {
@@ -25,82 +54,651 @@ uint64_t PIT::read(uint64_t address, unsigned int accessSize) {
 	return splitReadAccess(address, accessSize, &PIT::read8, this);
 }
 
+uint64_t PIT::now() const {
+	return m_clock ? m_clock->cycles() / CyclesPerTick : 0;
+}
+
 void PIT::write8(uint64_t address, uint8_t mask, uint8_t data) {
 	(void)mask;
 
-	printf("PIT: write: %02llX, %02X\n", address, data);
+	auto tick = now();
+	advanceOutput0(tick);
+
+	auto index = address & 3;
+	if (index == 3) {
+		writeControlWord(tick, data);
+	}
+	else {
+		writeCount(m_channels[index], tick, data);
+	}
+
+	updateOutput0(tick);
+}
+
+uint8_t PIT::read8(uint64_t address, uint8_t mask) {
+	(void)mask;
+
+	auto tick = now();
+	advanceOutput0(tick);
+
+	auto index = address & 3;
+	if (index == 3) {
+		// The control word register can't be read
+		return 0xFF;
+	}
+
+	return readCount(m_channels[index], tick);
+}
+
+void PIT::setGate(unsigned int channelIndex, bool gate) {
+	auto tick = now();
+	advanceOutput0(tick);
+
+	auto& channel = m_channels[channelIndex];
+	settle(channel, tick);
+
+	if (channel.gate == gate)
+		return;
 
-	switch (address & 3) {
+	channel.gate = gate;
+
+	switch (channel.mode) {
 	case 0:
-		if (m_byte) {
-			{
-				std::unique_lock locker(m_pitThreadMutex);
-				m_compareValue = m_writeLatch | (data << 8);
-				m_pitThreadAlert = true;
+	case 4:
+		// The gate only enables counting
+		if (!gate) {
+			freeze(channel, tick);
+		}
+		else if (channel.countWritten && !channel.writeHighByteNext) {
+			channel.counting = true;
+			channel.base = tick + 1;
+			channel.start = channel.idleValue == 0 ? modulus(channel) : channel.idleValue;
+		}
+		break;
+
+	case 1:
+	case 5:
+		// The rising edge (re)triggers the count
+		if (gate && channel.countWritten) {
+			freeze(channel, tick);
+			channel.counting = true;
+			channel.base = tick + 1;
+			channel.start = countValue(channel);
+			channel.terminalPassed = false;
+			channel.nullCount = false;
+		}
+		break;
+
+	case 2:
+	case 3:
+		// Low stops the count and forces the output high, the rising edge reloads the count
+		if (!gate) {
+			freeze(channel, tick);
+			channel.idleOutput = true;
+			channel.reloadPending = false;
+		}
+		else if (channel.countWritten) {
+			channel.counting = true;
+			channel.base = tick + 1;
+			channel.start = std::max<uint32_t>(countValue(channel), 2);
+			channel.nullCount = false;
+		}
+		break;
+	}
+
+	if (channelIndex == 0)
+		updateOutput0(tick);
+}
+
+bool PIT::output(unsigned int channelIndex) const {
+	auto tick = now();
+
+	auto channel = m_channels[channelIndex];
+	settle(channel, tick);
+
+	return outputAt(channel, tick);
+}
+
+void PIT::timerExpired() {
+	advanceOutput0(now());
+	scheduleOutput0();
+}
+
+void PIT::writeControlWord(uint64_t now, uint8_t data) {
+	auto select = data >> 6;
+	auto access = static_cast<uint8_t>((data >> 4) & 3);
+
+	if (select == 3) {
+		// Read-back command, with the latch bits active low
+		for (unsigned int index = 0; index < ChannelCount; index++) {
+			if (!(data & (2 << index)))
+				continue;
+
+			auto& channel = m_channels[index];
+			settle(channel, now);
+
+			if (!(data & 0x20))
+				latchCount(channel, now);
+
+			if (!(data & 0x10))
+				latchStatus(channel, now);
+		}
+
+		return;
+	}
+
+	auto& channel = m_channels[select];
+	settle(channel, now);
+
+	if (access == AccessLatch) {
+		latchCount(channel, now);
+		return;
+	}
+
+	// Programming a mode stops the channel until a count is written
+	freeze(channel, now);
+
+	channel.mode = (data >> 1) & 7;
+	if (channel.mode >= 6)
+		channel.mode -= 4;
+
+	channel.access = access;
+	channel.bcd = (data & 1) != 0;
+	channel.countWritten = false;
+	channel.nullCount = true;
+	channel.terminalPassed = false;
+	channel.reloadPending = false;
+	channel.idleOutput = channel.mode != 0;
+	channel.writeHighByteNext = false;
+	channel.readHighByteNext = false;
+	channel.countLatched = false;
+	channel.statusLatched = false;
+}
+
+void PIT::writeCount(Channel& channel, uint64_t now, uint8_t data) {
+	settle(channel, now);
+
+	switch (channel.access) {
+	case AccessLow:
+		channel.countRegister = data;
+		break;
+
+	case AccessHigh:
+		channel.countRegister = static_cast<uint16_t>(data << 8);
+		break;
+
+	default:
+		if (!channel.writeHighByteNext) {
+			channel.writtenLowByte = data;
+			channel.writeHighByteNext = true;
+
+			// In mode 0, the first byte already stops the count
+			if (channel.mode == 0) {
+				freeze(channel, now);
+				channel.idleOutput = false;
 			}
 
-			m_pitThreadCondvar.notify_all();
+			return;
 		}
-		else {
-			m_writeLatch = data;
+
+		channel.countRegister = static_cast<uint16_t>(channel.writtenLowByte | (data << 8));
+		channel.writeHighByteNext = false;
+		break;
+	}
+
+	loadCount(channel, now);
+}
+
+void PIT::loadCount(Channel& channel, uint64_t now) {
+	auto value = countValue(channel);
+
+	channel.countWritten = true;
+	channel.nullCount = true;
+
+	switch (channel.mode) {
+	case 0:
+	case 4:
+		// Loaded on the next clock, and counted down while the gate is high
+		freeze(channel, now);
+		channel.terminalPassed = false;
+		channel.idleOutput = channel.mode == 4;
+		channel.idleValue = value % modulus(channel);
+		channel.nullCount = false;
+
+		if (channel.gate) {
+			channel.counting = true;
+			channel.base = now + 1;
+			channel.start = value;
 		}
-		m_byte = !m_byte;
 		break;
 
+	case 1:
+	case 5:
+		// Loaded by the next trigger; a count in progress carries on
+		break;
+
+	case 2:
 	case 3:
-		if (data == 0x34) {
-			m_byte = false;
+		value = std::max<uint32_t>(value, 2);
+
+		if (!channel.counting) {
+			channel.idleValue = value;
+			channel.nullCount = false;
+
+			if (channel.gate) {
+				channel.counting = true;
+				channel.base = now + 1;
+				channel.start = value;
+			}
 		}
 		else {
-			fprintf(stderr, "PIT emulation is very limited at the moment and only supports control byte 0x34\n");
-			//if (IsDebuggerPresent())
-			//	__debugbreak();
+			// The current period is completed first
+			auto elapsed = now >= channel.base ? now - channel.base : 0;
+			channel.reloadPending = true;
+			channel.pendingBase = channel.base + (elapsed / channel.start + 1) * channel.start;
+			channel.pendingStart = value;
 		}
 		break;
+	}
+}
+
+uint8_t PIT::readCount(Channel& channel, uint64_t now) {
+	settle(channel, now);
+
+	if (channel.statusLatched) {
+		channel.statusLatched = false;
+		return channel.latchedStatus;
+	}
+
+	auto value = channel.countLatched ? channel.latchedCount : displayValue(channel, counterAt(channel, now));
+
+	switch (channel.access) {
+	case AccessLow:
+		channel.countLatched = false;
+		return static_cast<uint8_t>(value);
+
+	case AccessHigh:
+		channel.countLatched = false;
+		return static_cast<uint8_t>(value >> 8);
 
 	default:
-		fprintf(stderr, "PIT emulation is very limited at the moment and only supports channel 0\n");
-		//if (IsDebuggerPresent())
-		//	__debugbreak();
+		if (!channel.readHighByteNext) {
+			channel.readHighByteNext = true;
+			return static_cast<uint8_t>(value);
+		}
+
+		channel.readHighByteNext = false;
+		channel.countLatched = false;
+		return static_cast<uint8_t>(value >> 8);
 	}
 }
 
-uint8_t PIT::read8(uint64_t address, uint8_t mask) {
-	(void)mask;
+void PIT::latchCount(Channel& channel, uint64_t now) {
+	// Latching again before the latched count was read has no effect
+	if (channel.countLatched)
+		return;
 
-	printf("PIT: read: %02llX\n", address);
+	channel.latchedCount = displayValue(channel, counterAt(channel, now));
+	channel.countLatched = true;
+}
+
+void PIT::latchStatus(Channel& channel, uint64_t now) {
+	if (channel.statusLatched)
+		return;
 
-	fprintf(stderr, "PIT emulation is very limited at the moment and does not support reads at all\n");
+	channel.latchedStatus = static_cast<uint8_t>(
+		(outputAt(channel, now) ? 0x80 : 0) |
+		(channel.nullCount ? 0x40 : 0) |
+		(channel.access << 4) |
+		(channel.mode << 1) |
+		(channel.bcd ? 1 : 0));
+	channel.statusLatched = true;
+}
 
-	if (IsDebuggerPresent())
-		__debugbreak();
+void PIT::freeze(Channel& channel, uint64_t now) {
+	if (!channel.counting)
+		return;
 
-	return 0;
+	channel.idleValue = counterAt(channel, now);
+	channel.idleOutput = outputAt(channel, now);
+
+	bool oneShot = channel.mode != 2 && channel.mode != 3;
+	if (oneShot && now >= channel.base && now - channel.base >= channel.start)
+		channel.terminalPassed = true;
+
+	channel.counting = false;
+}
+
+uint32_t PIT::modulus(const Channel& channel) {
+	return channel.bcd ? 10000 : 0x10000;
 }
 
-void PIT::pitThread() {
-	std::unique_lock locker(m_pitThreadMutex);
-	while (m_runPITThread) {
-		uint64_t freq = m_compareValue;
+uint32_t PIT::countValue(const Channel& channel) {
+	uint32_t value = channel.bcd ? bcdToBinary(channel.countRegister) : channel.countRegister;
 
-		if (freq == 0) {
-			freq = 65536;
-		}
+	// A count of zero stands for the largest one
+	return value == 0 ? modulus(channel) : value;
+}
 
-		std::chrono::microseconds delay(freq * 1000000 / 1193182);
-		if (m_pitThreadCondvar.wait_for(locker, delay, [this]() { return m_pitThreadAlert || !m_runPITThread; })) {
-			m_pitThreadAlert = false;
+uint16_t PIT::displayValue(const Channel& channel, uint32_t value) {
+	value %= modulus(channel);
+
+	return channel.bcd ? binaryToBCD(value) : static_cast<uint16_t>(value);
+}
+
+void PIT::settle(Channel& channel, uint64_t now) {
+	if (channel.reloadPending && now >= channel.pendingBase) {
+		channel.base = channel.pendingBase;
+		channel.start = channel.pendingStart;
+		channel.reloadPending = false;
+		channel.nullCount = false;
+	}
+}
+
+uint32_t PIT::counterAt(const Channel& channel, uint64_t now) {
+	if (!channel.counting || now < channel.base)
+		return channel.idleValue;
+
+	auto elapsed = now - channel.base;
+
+	switch (channel.mode) {
+	case 2:
+		return static_cast<uint32_t>(channel.start - elapsed % channel.start);
+
+	case 3:
+	{
+		// Counts down by two, through both halves of the period
+		auto phase = static_cast<uint32_t>(elapsed % channel.start);
+		auto highTicks = (channel.start + 1) / 2;
+		auto halfPhase = phase < highTicks ? phase : phase - highTicks;
+
+		return (channel.start & ~1u) - 2 * halfPhase;
+	}
+
+	default:
+	{
+		// Carries on counting, wrapping around, after the terminal count
+		auto counterModulus = modulus(channel);
+		return static_cast<uint32_t>((channel.start + counterModulus - elapsed % counterModulus) % counterModulus);
+	}
+	}
+}
+
+bool PIT::outputAt(const Channel& channel, uint64_t now) {
+	if (!channel.counting || now < channel.base)
+		return channel.idleOutput;
+
+	auto elapsed = now - channel.base;
+
+	switch (channel.mode) {
+	case 0:
+	case 1:
+		// Low until the terminal count
+		return channel.terminalPassed || elapsed >= channel.start;
+
+	case 2:
+		// Low for the last clock of every period
+		return elapsed % channel.start != channel.start - 1;
+
+	case 3:
+		// High for the first, longer half of every period
+		return elapsed % channel.start < (channel.start + 1) / 2;
+
+	default:
+		// Low for the clock of the terminal count
+		return channel.terminalPassed || elapsed != channel.start;
+	}
+}
+
+uint64_t PIT::nextOutputChange(const Channel& channel, uint64_t now) {
+	uint64_t next = UINT64_MAX;
+
+	if (channel.reloadPending && channel.pendingBase > now)
+		next = channel.pendingBase;
+
+	if (!channel.counting)
+		return next;
+
+	if (now < channel.base)
+		return std::min(next, channel.base);
+
+	auto elapsed = now - channel.base;
+
+	switch (channel.mode) {
+	case 0:
+	case 1:
+		if (!channel.terminalPassed && elapsed < channel.start)
+			next = std::min(next, channel.base + channel.start);
+		break;
+
+	case 2:
+	{
+		auto phase = elapsed % channel.start;
+		next = std::min(next, phase < channel.start - 1 ? now + (channel.start - 1 - phase) : now + 1);
+		break;
+	}
+
+	case 3:
+	{
+		auto phase = elapsed % channel.start;
+		auto highTicks = (channel.start + 1) / 2;
+		next = std::min(next, phase < highTicks ? now + (highTicks - phase) : now + (channel.start - phase));
+		break;
+	}
+
+	default:
+		if (!channel.terminalPassed) {
+			if (elapsed < channel.start)
+				next = std::min(next, channel.base + channel.start);
+			else if (elapsed == channel.start)
+				next = std::min(next, channel.base + channel.start + 1);
 		}
-		else {
-			locker.unlock();
+		break;
+	}
 
-			auto line = m_interruptLine.load();
-			if (line) {
-				line->setInterruptAsserted(true);
-				line->setInterruptAsserted(false);
-			}
+	return next;
+}
 
-			locker.lock();
-		}		
+void PIT::advanceOutput0(uint64_t now) {
+	auto& channel = m_channels[0];
+
+	// Whole periods run past at once are skipped rather than stepped through
+	if (channel.counting && (channel.mode == 2 || channel.mode == 3) && !channel.reloadPending &&
+		m_output0Tick >= channel.base && now > m_output0Tick && now - m_output0Tick > 2 * static_cast<uint64_t>(channel.start)) {
+
+		auto periods = (now - m_output0Tick) / channel.start - 1;
+		m_output0Tick += periods * channel.start;
+		m_lostTicks += periods;
+	}
+
+	// Step through every transition, so that short pulses aren't missed when the CPU runs late
+	auto output = m_output0;
+	uint64_t risingEdges = 0;
+
+	while (true) {
+		auto next = nextOutputChange(channel, m_output0Tick);
+		if (next > now)
+			break;
+
+		settle(channel, next);
+
+		auto level = outputAt(channel, next);
+		if (level && !output)
+			risingEdges++;
+
+		output = level;
+		m_output0Tick = next;
+
+		/*
+		 * Levels go out up to the first rising edge only. Whatever follows
+		 * is merged into it, rather than pulsing the interrupt line back to
+		 * back, which the PIC would only latch once anyway.
+		 */
+		if (risingEdges == 0 || (risingEdges == 1 && level && !m_output0))
+			setOutput0(output);
+	}
+
+	if (risingEdges != 0) {
+		// The line is high from the first edge, and only lowered here if it ends low
+		setOutput0(output);
+		m_lostTicks += risingEdges - 1;
 	}
+
+	m_output0Tick = std::max(m_output0Tick, now);
+}
+
+void PIT::updateOutput0(uint64_t now) {
+	auto& channel = m_channels[0];
+	settle(channel, now);
+
+	setOutput0(outputAt(channel, now));
+	m_output0Tick = now;
+
+	scheduleOutput0();
+}
+
+void PIT::setOutput0(bool output) {
+	if (output == m_output0)
+		return;
+
+	m_output0 = output;
+
+	if (output)
+		countTick();
+
+	auto line = m_interruptLine.load();
+	if (line)
+		line->setInterruptAsserted(output);
+}
+
+void PIT::scheduleOutput0() {
+	if (!m_clock)
+		return;
+
+	auto next = nextOutputChange(m_channels[0], m_output0Tick);
+	if (next == UINT64_MAX) {
+		m_clock->cancelTimer(this);
+	}
+	else {
+		m_clock->scheduleTimer(this, next * CyclesPerTick);
+	}
+}
+
+void PIT::countTick() {
+	m_ticks++;
+
+	// Lateness and loss only mean anything for a periodic tick
+	auto& channel = m_channels[0];
+	if (!m_clock || !channel.counting || (channel.mode != 2 && channel.mode != 3))
+		return;
+
+	auto period = channel.start * CyclesPerTick;
+
+	if (m_clock->lagCycles() > period)
+		m_lateTicks++;
+
+	auto dropped = m_clock->droppedCycles();
+	m_droppedCyclesUncounted += dropped - m_droppedCyclesSeen;
+	m_droppedCyclesSeen = dropped;
+
+	m_lostTicks += m_droppedCyclesUncounted / period;
+	m_droppedCyclesUncounted %= period;
+}
+
+void PIT::saveState(StateWriter& writer) const {
+	writer.beginChunk("PIT ");
+
+	for (const auto& channel : m_channels)
+		saveChannel(writer, channel);
+
+	writer.writeBool(m_output0);
+	writer.write64(m_output0Tick);
+
+	writer.endChunk();
+}
+
+void PIT::loadState(StateReader& reader) {
+	reader.beginChunk("PIT ");
+
+	for (auto& channel : m_channels)
+		loadChannel(reader, channel);
+
+	m_output0 = reader.readBool();
+	m_output0Tick = reader.read64();
+
+	reader.endChunk();
+
+	// Not a tick: the line is only brought back to where it was
+	auto line = m_interruptLine.load();
+	if (line)
+		line->setInterruptAsserted(m_output0);
+
+	// Machine time given up on before the state was loaded is none of its business
+	m_droppedCyclesSeen = m_clock ? m_clock->droppedCycles() : 0;
+	m_droppedCyclesUncounted = 0;
+
+	scheduleOutput0();
+}
+
+void PIT::saveChannel(StateWriter& writer, const Channel& channel) {
+	writer.write8(channel.mode);
+	writer.write8(channel.access);
+	writer.writeBool(channel.bcd);
+	writer.writeBool(channel.gate);
+	writer.write16(channel.countRegister);
+	writer.writeBool(channel.countWritten);
+	writer.writeBool(channel.nullCount);
+	writer.writeBool(channel.counting);
+	writer.write64(channel.base);
+	writer.write32(channel.start);
+	writer.write32(channel.idleValue);
+	writer.writeBool(channel.idleOutput);
+	writer.writeBool(channel.terminalPassed);
+	writer.writeBool(channel.reloadPending);
+	writer.write64(channel.pendingBase);
+	writer.write32(channel.pendingStart);
+	writer.writeBool(channel.writeHighByteNext);
+	writer.write8(channel.writtenLowByte);
+	writer.writeBool(channel.readHighByteNext);
+	writer.writeBool(channel.countLatched);
+	writer.write16(channel.latchedCount);
+	writer.writeBool(channel.statusLatched);
+	writer.write8(channel.latchedStatus);
+}
+
+void PIT::loadChannel(StateReader& reader, Channel& channel) {
+	channel.mode = reader.read8();
+	channel.access = reader.read8();
+	if (channel.mode > 5 || channel.access > AccessLowHigh)
+		throw std::runtime_error("save state has an invalid PIT channel mode");
+
+	channel.bcd = reader.readBool();
+	channel.gate = reader.readBool();
+	channel.countRegister = reader.read16();
+	channel.countWritten = reader.readBool();
+	channel.nullCount = reader.readBool();
+	channel.counting = reader.readBool();
+	channel.base = reader.read64();
+	channel.start = reader.read32();
+	channel.idleValue = reader.read32();
+	channel.idleOutput = reader.readBool();
+	channel.terminalPassed = reader.readBool();
+	channel.reloadPending = reader.readBool();
+	channel.pendingBase = reader.read64();
+	channel.pendingStart = reader.read32();
+	channel.writeHighByteNext = reader.readBool();
+	channel.writtenLowByte = reader.read8();
+	channel.readHighByteNext = reader.readBool();
+	channel.countLatched = reader.readBool();
+	channel.latchedCount = reader.read16();
+	channel.statusLatched = reader.readBool();
+	channel.latchedStatus = reader.read8();
+}
+
+PIT::TickStatistics PIT::tickStatistics() const {
+	TickStatistics statistics;
+	statistics.ticks = m_ticks.load();
+	statistics.lateTicks = m_lateTicks.load();
+	statistics.lostTicks = m_lostTicks.load();
+	return statistics;
 }
@@ -1,5 +1,7 @@
 #include <Hardware/PPI.h>
 #include <Hardware/PPIConsumer.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 
 #include <Utils/AccessSizeUtils.h>
 
@@ -19,6 +21,24 @@ uint64_t PPI::read(uint64_t address, unsigned int accessSize) {
 	return splitReadAccess(address, accessSize, &PPI::read8, this);
 }
 
+void PPI::saveState(StateWriter& writer) const {
+	writer.beginChunk("PPI ");
+	writer.write8(m_porta);
+	writer.write8(m_portb);
+	writer.write8(m_portc);
+	writer.write8(m_mode);
+	writer.endChunk();
+}
+
+void PPI::loadState(StateReader& reader) {
+	reader.beginChunk("PPI ");
+	m_porta = reader.read8();
+	m_portb = reader.read8();
+	m_portc = reader.read8();
+	m_mode = reader.read8();
+	reader.endChunk();
+}
+
 uint8_t PPI::read8(uint64_t address, uint8_t mask) {
 	(void)mask;
 
@@ -3,6 +3,8 @@
 #include <Utils/AccessSizeUtils.h>
 
 #include <Infrastructure/InterruptLine.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 
 #include <ATA/IATADevice.h>
 
@@ -83,6 +85,24 @@ uint8_t XTIDE::read8(uint64_t address, uint8_t mask) {
 	return static_cast<uint8_t>(m_device->read(cs, reg));
 }
 
+void XTIDE::saveState(StateWriter& writer) {
+	writer.beginChunk("XTID");
+	writer.write16(m_transferBuffer);
+	writer.endChunk();
+
+	m_device->saveState(writer);
+}
+
+void XTIDE::loadState(StateReader& reader) {
+	reader.beginChunk("XTID");
+	m_transferBuffer = reader.read16();
+	reader.endChunk();
+
+	m_device->loadState(reader);
+
+	interruptRequestedChanged(m_device);
+}
+
 void XTIDE::interruptRequestedChanged(IATADevice* device) {
 	m_interruptLine.load()->setInterruptAsserted(device->isInterruptRequested());
 }
\ No newline at end of file
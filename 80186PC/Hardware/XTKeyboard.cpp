@@ -1,75 +1,247 @@
 #include <Hardware/XTKeyboard.h>
 #include <Infrastructure/InterruptLine.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
 
-XTKeyboard::XTKeyboard() : m_runThread(true), m_thread(&XTKeyboard::xtKeyboardThread, this) {
+#include <string.h>
+
+#include <algorithm>
+
+XTKeyboard::XTKeyboard() : m_interruptLine(nullptr), m_clock(nullptr), m_biosDataArea(nullptr), m_reset(false),
+	m_waitingForAck(false), m_hold(false), m_fastFill(false), m_scancode(0), m_lastAcknowledge(0) {
 
 }
 
 XTKeyboard::~XTKeyboard() {
-	{
-		std::unique_lock<std::mutex> locker(m_threadMutex);
-		m_runThread = false;
-	}
-	m_threadCondvar.notify_all();
-	m_thread.join();
+	if (m_clock)
+		m_clock->cancelTimer(this);
 }
 
 void XTKeyboard::pushScancode(uint8_t scancode) {
-	{
-		std::unique_lock<std::mutex> locker(m_threadMutex);
+	pushScancodes(&scancode, 1);
+}
+
+void XTKeyboard::pushScancodes(const uint8_t* scancodes, size_t count) {
+	m_queue.insert(m_queue.end(), scancodes, scancodes + count);
+
+	scheduleUpdate();
+}
+
+bool XTKeyboard::typeText(const std::string& text) {
+	bool complete = true;
 
-		m_queue.push_back(scancode);
+	for (auto character : text) {
+		Keystroke keystroke;
+		if (translateCharacter(character, keystroke)) {
+			m_textQueue.push_back(keystroke);
+		}
+		else {
+			complete = false;
+		}
 	}
-	m_threadCondvar.notify_one();
+
+	scheduleUpdate();
+
+	return complete;
+}
+
+void XTKeyboard::setTypingFastFill(bool fastFill) {
+	// Whatever text is left is typed instead when turned off
+	m_fastFill = fastFill;
+
+	scheduleUpdate();
 }
 
 void XTKeyboard::setReset(bool reset) {
 	m_reset = reset;
 	if (reset) {
-		bool wasWaiting = m_waitingForAck.exchange(false);
-		if (wasWaiting) {
-			m_threadCondvar.notify_all();
+		if (m_clock)
+			m_lastAcknowledge = m_clock->cycles();
+
+		if (m_waitingForAck) {
+			if (m_interruptLine) {
+				m_interruptLine->setInterruptAsserted(false);
+			}
+
+			m_waitingForAck = false;
+			scheduleUpdate();
 		}
 	}
 }
 
-void XTKeyboard::xtKeyboardThread() {
-	std::unique_lock<std::mutex> locker(m_threadMutex);
-	while (m_runThread) {
-		m_threadCondvar.wait(locker, [this]() { return !m_runThread || (!m_queue.empty() && !m_hold); });
+void XTKeyboard::setHold(bool hold) {
+	m_hold = hold;
+	if (!hold) {
+		scheduleUpdate();
+	}
+}
+
+void XTKeyboard::saveState(StateWriter& writer) const {
+	writer.beginChunk("KBD ");
+	writer.write8(m_scancode);
+	writer.writeBool(m_waitingForAck);
+	writer.writeBool(m_reset);
+	writer.writeBool(m_hold);
+	writer.write64(m_lastAcknowledge);
+
+	writer.write32(static_cast<uint32_t>(m_queue.size()));
+	for (auto scancode : m_queue)
+		writer.write8(scancode);
+
+	writer.write32(static_cast<uint32_t>(m_textQueue.size()));
+	for (const auto& keystroke : m_textQueue) {
+		writer.write8(keystroke.scancode);
+		writer.write8(keystroke.character);
+		writer.writeBool(keystroke.shift);
+	}
+
+	writer.endChunk();
+}
+
+void XTKeyboard::loadState(StateReader& reader) {
+	reader.beginChunk("KBD ");
+	m_scancode = reader.read8();
+	m_waitingForAck = reader.readBool();
+	m_reset = reader.readBool();
+	m_hold = reader.readBool();
+	m_lastAcknowledge = reader.read64();
+
+	m_queue.clear();
+	for (auto count = reader.read32(); count != 0; count--)
+		m_queue.push_back(reader.read8());
+
+	m_textQueue.clear();
+	for (auto count = reader.read32(); count != 0; count--) {
+		Keystroke keystroke;
+		keystroke.scancode = reader.read8();
+		keystroke.character = reader.read8();
+		keystroke.shift = reader.readBool();
+		m_textQueue.push_back(keystroke);
+	}
 
-		if (!m_runThread)
-			break;
+	reader.endChunk();
 
-		locker.unlock();
+	if (m_interruptLine) {
+		m_interruptLine->setInterruptAsserted(m_waitingForAck);
+	}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	scheduleUpdate();
+}
 
-		locker.lock();
+void XTKeyboard::queueKeystroke(const Keystroke& keystroke) {
+	if (keystroke.shift)
+		m_queue.push_back(LeftShiftScancode);
 
-		m_scancode = m_queue.front();
-		m_waitingForAck = true;
+	m_queue.push_back(keystroke.scancode);
+	m_queue.push_back(keystroke.scancode | BreakCode);
 
-		m_queue.pop_front();
+	if (keystroke.shift)
+		m_queue.push_back(LeftShiftScancode | BreakCode);
+}
 
-		auto line = m_interruptLine.load();
-		if (line) {
-			line->setInterruptAsserted(true);
-		}
+void XTKeyboard::scheduleUpdate() {
+	if (!m_clock)
+		return;
 
-		m_threadCondvar.wait(locker, [this]() { return !m_runThread || !m_waitingForAck; });
+	auto now = m_clock->cycles();
+	auto deadline = UINT64_MAX;
 
-		if (m_runThread && line) {
-			line->setInterruptAsserted(false);
+	if (!m_waitingForAck && !m_hold) {
+		if (!m_queue.empty() || (!m_textQueue.empty() && !m_fastFill && biosBufferHasRoom())) {
+			deadline = std::max(now, m_lastAcknowledge + ScancodeInterval);
 		}
+		else if (!m_textQueue.empty() && !m_fastFill) {
+			// Typed text goes no faster than the guest takes it out of the BIOS buffer
+			deadline = now + BufferPollInterval;
+		}
+	}
+
+	if (m_fastFill && !m_textQueue.empty()) {
+		deadline = std::min(deadline, now + FillInterval);
 	}
+
+	if (deadline == UINT64_MAX)
+		m_clock->cancelTimer(this);
+	else
+		m_clock->scheduleTimer(this, deadline);
+}
+
+void XTKeyboard::timerExpired() {
+	if (m_fastFill)
+		fill();
+
+	if (!m_waitingForAck && !m_hold)
+		sendScancode();
+
+	scheduleUpdate();
 }
 
-/*
+void XTKeyboard::sendScancode() {
+	if (m_clock->cycles() < m_lastAcknowledge + ScancodeInterval)
+		return;
 
-	auto line = m_interruptLine.load();
-	if (line) {
-		line->setInterruptAsserted(true);
-		line->setInterruptAsserted(false);
+	if (m_queue.empty()) {
+		if (m_textQueue.empty() || m_fastFill || !biosBufferHasRoom())
+			return;
+
+		queueKeystroke(m_textQueue.front());
+		m_textQueue.pop_front();
 	}
-}*/
\ No newline at end of file
+
+	m_scancode = m_queue.front();
+	m_waitingForAck = true;
+
+	m_queue.pop_front();
+
+	// Lowered again by the acknowledge
+	if (m_interruptLine) {
+		m_interruptLine->setInterruptAsserted(true);
+	}
+}
+
+void XTKeyboard::fill() {
+	// The BIOS interrupt handler updates the buffer too, so only while it can't be running
+	if (!m_queue.empty() || m_waitingForAck || m_clock->cycles() - m_lastAcknowledge < FillQuietTime)
+		return;
+
+	while (!m_textQueue.empty() && fillBIOSBuffer(m_textQueue.front()))
+		m_textQueue.pop_front();
+}
+
+bool XTKeyboard::biosBufferPointers(uint16_t& head, uint16_t& tail) const {
+	if (!m_biosDataArea)
+		return false;
+
+	memcpy(&head, m_biosDataArea + BufferHead, sizeof(head));
+	memcpy(&tail, m_biosDataArea + BufferTail, sizeof(tail));
+
+	// Not set up by the BIOS yet, otherwise
+	return
+		head >= BufferStart && head < BufferEnd && (head & 1) == 0 &&
+		tail >= BufferStart && tail < BufferEnd && (tail & 1) == 0;
+}
+
+bool XTKeyboard::biosBufferHasRoom() const {
+	uint16_t head, tail;
+	if (!biosBufferPointers(head, tail))
+		return true;
+
+	auto next = tail + 2 == BufferEnd ? BufferStart : tail + 2;
+	return next != head;
+}
+
+bool XTKeyboard::fillBIOSBuffer(const Keystroke& keystroke) {
+	uint16_t head, tail;
+	if (!biosBufferPointers(head, tail))
+		return false;
+
+	auto next = static_cast<uint16_t>(tail + 2 == BufferEnd ? BufferStart : tail + 2);
+	if (next == head)
+		return false;
+
+	uint16_t entry = static_cast<uint16_t>((keystroke.scancode << 8) | keystroke.character);
+	memcpy(m_biosDataArea + tail, &entry, sizeof(entry));
+	memcpy(m_biosDataArea + BufferTail, &next, sizeof(next));
+
+	return true;
+}
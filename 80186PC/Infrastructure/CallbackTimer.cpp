@@ -0,0 +1,21 @@
+#include <Infrastructure/CallbackTimer.h>
+
+CallbackTimer::CallbackTimer(VirtualClock* clock, std::function<uint64_t(uint64_t now)> callback) :
+	m_clock(clock), m_callback(std::move(callback)) {
+
+}
+
+CallbackTimer::~CallbackTimer() {
+	// Also waits for the function to return, if it is running
+	m_clock->cancelTimer(this);
+}
+
+void CallbackTimer::start() {
+	m_clock->scheduleTimer(this, 0);
+}
+
+void CallbackTimer::timerExpired() {
+	auto deadline = m_callback(m_clock->cycles());
+	if (deadline != 0)
+		m_clock->scheduleTimer(this, deadline);
+}
@@ -0,0 +1,292 @@
+#include <Infrastructure/ExecutionLog.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdexcept>
+
+const char ExecutionLog::Magic[8]{ '8', '6', 'P', 'C', 'E', 'X', 'E', '\x1A' };
+
+ExecutionLog::ExecutionLog() : m_clock(nullptr), m_mode(Mode::Off), m_lastTime(0), m_next{} {
+
+}
+
+ExecutionLog::~ExecutionLog() {
+	if (m_clock)
+		m_clock->cancelTimer(this);
+}
+
+void ExecutionLog::startRecording(const std::filesystem::path& path) {
+	if (m_mode != Mode::Off)
+		throw std::logic_error("the execution log is in use already");
+
+	m_output.open(path, std::ios::binary | std::ios::trunc);
+	if (!m_output)
+		throw std::runtime_error("unable to create " + path.string());
+
+	m_lastTime = m_clock->cycles();
+
+	m_output.write(Magic, sizeof(Magic));
+	writeLE(Version, 2);
+	writeLE(m_lastTime, 8);
+
+	m_mode = Mode::Recording;
+	m_clock->scheduleTimer(this, m_lastTime + FlushInterval);
+}
+
+void ExecutionLog::startReplay(const std::filesystem::path& path) {
+	if (m_mode != Mode::Off)
+		throw std::logic_error("the execution log is in use already");
+
+	m_input.open(path, std::ios::binary);
+	if (!m_input)
+		throw std::runtime_error("unable to open " + path.string());
+
+	char magic[sizeof(Magic)];
+	uint64_t version;
+	uint64_t start;
+
+	if (!m_input.read(magic, sizeof(magic)) || memcmp(magic, Magic, sizeof(magic)) != 0 || !readLE(version, 2) || !readLE(start, 8)) {
+		m_input.close();
+		throw std::runtime_error(path.string() + " is not an execution log");
+	}
+
+	if (version != Version || start != m_clock->cycles()) {
+		m_input.close();
+		throw std::runtime_error(path.string() + " does not match the state it is replayed from");
+	}
+
+	m_lastTime = start;
+	m_mode = Mode::Replaying;
+	readNextEvent();
+}
+
+void ExecutionLog::finish() {
+	if (m_mode == Mode::Recording) {
+		writeEventHeader(EventType::End);
+		m_output.close();
+	}
+	else if (m_mode == Mode::Replaying) {
+		m_input.close();
+	}
+
+	m_mode = Mode::Off;
+	m_clock->cancelTimer(this);
+}
+
+void ExecutionLog::recordInput(const std::vector<uint8_t>& input) {
+	if (m_mode != Mode::Recording)
+		return;
+
+	writeEventHeader(EventType::Input);
+	writeNumber(input.size());
+	m_output.write(reinterpret_cast<const char*>(input.data()), input.size());
+}
+
+bool ExecutionLog::takeInput(std::vector<uint8_t>& input) {
+	if (m_mode != Mode::Replaying || m_next.type != EventType::Input || m_next.time != m_clock->cycles())
+		return false;
+
+	input = std::move(m_next.input);
+	readNextEvent();
+
+	return true;
+}
+
+void ExecutionLog::interruptDelivered(uint8_t vector) {
+	if (m_mode == Mode::Recording) {
+		writeEventHeader(EventType::Interrupt);
+		writeLE(vector, 1);
+	}
+	else if (m_mode == Mode::Replaying) {
+		expectEvent(EventType::Interrupt, vector, 0);
+	}
+}
+
+void ExecutionLog::diskRead(uint64_t sector, uint32_t checksum) {
+	if (m_mode == Mode::Recording) {
+		writeEventHeader(EventType::DiskRead);
+		writeNumber(sector);
+		writeLE(checksum, 4);
+	}
+	else if (m_mode == Mode::Replaying) {
+		expectEvent(EventType::DiskRead, sector, checksum);
+	}
+}
+
+void ExecutionLog::timerExpired() {
+	if (m_mode == Mode::Recording) {
+		if (!m_output.flush()) {
+			fprintf(stderr, "ExecutionLog: write failed, recording stopped\n");
+			m_output.close();
+			m_mode = Mode::Off;
+			return;
+		}
+
+		m_clock->scheduleTimer(this, m_clock->cycles() + FlushInterval);
+	}
+	else if (m_mode == Mode::Replaying) {
+		// Either the end, or an event that should have happened by now
+		if (m_next.type == EventType::End)
+			end(std::string());
+		else
+			end(describeEvent(m_next) + " did not happen");
+	}
+}
+
+void ExecutionLog::writeEventHeader(EventType type) {
+	auto now = m_clock->cycles();
+
+	writeLE(static_cast<uint8_t>(type), 1);
+	writeNumber(now - m_lastTime);
+
+	m_lastTime = now;
+}
+
+void ExecutionLog::writeNumber(uint64_t value) {
+	while (value >= 0x80) {
+		m_output.put(static_cast<char>(value | 0x80));
+		value >>= 7;
+	}
+
+	m_output.put(static_cast<char>(value));
+}
+
+void ExecutionLog::writeLE(uint64_t value, unsigned int size) {
+	for (unsigned int byte = 0; byte < size; byte++)
+		m_output.put(static_cast<char>(value >> (byte * 8)));
+}
+
+void ExecutionLog::readNextEvent() {
+	if (!readEvent(m_next)) {
+		m_next = Event{};
+		m_next.type = EventType::End;
+		m_next.time = m_lastTime;
+	}
+
+	m_lastTime = m_next.time;
+
+	// Events are due at their time; the check comes after whatever else happens then
+	m_clock->scheduleTimer(this, m_next.type == EventType::End ? m_next.time : m_next.time + 1);
+}
+
+bool ExecutionLog::readEvent(Event& event) {
+	uint64_t type;
+	uint64_t delta;
+
+	if (!readLE(type, 1) || !readNumber(delta))
+		return false;
+
+	event.type = static_cast<EventType>(type);
+	event.time = m_lastTime + delta;
+	event.input.clear();
+	event.values[0] = 0;
+	event.values[1] = 0;
+
+	switch (event.type) {
+	case EventType::Input:
+	{
+		uint64_t size;
+		if (!readNumber(size) || size > 65536)
+			return false;
+
+		event.input.resize(static_cast<size_t>(size));
+		return static_cast<bool>(m_input.read(reinterpret_cast<char*>(event.input.data()), event.input.size()));
+	}
+
+	case EventType::Interrupt:
+		return readLE(event.values[0], 1);
+
+	case EventType::DiskRead:
+		return readNumber(event.values[0]) && readLE(event.values[1], 4);
+
+	case EventType::End:
+		return true;
+
+	default:
+		fprintf(stderr, "ExecutionLog: unknown event type %02X, replay ends here\n", static_cast<unsigned int>(type));
+		return false;
+	}
+}
+
+bool ExecutionLog::readNumber(uint64_t& value) {
+	value = 0;
+
+	for (unsigned int shift = 0; shift < 64; shift += 7) {
+		auto byte = m_input.get();
+		if (byte == std::char_traits<char>::eof())
+			return false;
+
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+bool ExecutionLog::readLE(uint64_t& value, unsigned int size) {
+	value = 0;
+
+	for (unsigned int byte = 0; byte < size; byte++) {
+		auto data = m_input.get();
+		if (data == std::char_traits<char>::eof())
+			return false;
+
+		value |= static_cast<uint64_t>(data & 0xFF) << (byte * 8);
+	}
+
+	return true;
+}
+
+void ExecutionLog::expectEvent(EventType type, uint64_t value0, uint64_t value1) {
+	Event seen;
+	seen.type = type;
+	seen.time = m_clock->cycles();
+	seen.values[0] = value0;
+	seen.values[1] = value1;
+
+	if (m_next.type != type || m_next.time != seen.time || m_next.values[0] != value0 || m_next.values[1] != value1) {
+		end(describeEvent(seen) + " instead of " + describeEvent(m_next));
+		return;
+	}
+
+	readNextEvent();
+}
+
+std::string ExecutionLog::describeEvent(const Event& event) {
+	char description[96];
+
+	switch (event.type) {
+	case EventType::Input:
+		snprintf(description, sizeof(description), "input at %llu", static_cast<unsigned long long>(event.time));
+		break;
+
+	case EventType::Interrupt:
+		snprintf(description, sizeof(description), "interrupt %02Xh at %llu",
+			static_cast<unsigned int>(event.values[0]), static_cast<unsigned long long>(event.time));
+		break;
+
+	case EventType::DiskRead:
+		snprintf(description, sizeof(description), "read of sector %llu with checksum %08X at %llu",
+			static_cast<unsigned long long>(event.values[0]), static_cast<unsigned int>(event.values[1]),
+			static_cast<unsigned long long>(event.time));
+		break;
+
+	default:
+		snprintf(description, sizeof(description), "end of the log at %llu", static_cast<unsigned long long>(event.time));
+		break;
+	}
+
+	return description;
+}
+
+void ExecutionLog::end(const std::string& divergence) {
+	m_input.close();
+	m_mode = Mode::Off;
+	m_clock->cancelTimer(this);
+
+	if (m_endHandler)
+		m_endHandler(divergence);
+}
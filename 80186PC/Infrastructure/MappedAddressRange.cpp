@@ -1,8 +1,13 @@
 #include <Infrastructure/MappedAddressRange.h>
 
+#include <Hardware/CPUEmulation.h>
+
 #include <stdio.h>
 
-MappedAddressRange::MappedAddressRange(void* base, size_t size, unsigned int permissions) : m_base(base), m_size(size), m_permissions(permissions) {
+#include <algorithm>
+
+MappedAddressRange::MappedAddressRange(void* base, size_t size, unsigned int permissions) : m_base(base), m_size(size), m_permissions(permissions),
+	m_emulation(nullptr), m_mappingBase(0), m_mappingLimit(0), m_writeGeneration(1), m_writeWaiters(0) {
 
 }
 
@@ -31,6 +36,10 @@ void MappedAddressRange::write(uint64_t address, unsigned int accessSize, uint64
 		*reinterpret_cast<uint64_t*>(static_cast<uint8_t*>(m_base) + address % m_size) = static_cast<uint64_t>(data);
 		break;
 	}
+
+	if (isWriteTrackingEnabled()) {
+		recordWrite(address % m_size, accessSize);
+	}
 }
 
 uint64_t MappedAddressRange::read(uint64_t address, unsigned int accessSize) {
@@ -61,5 +70,141 @@ size_t MappedAddressRange::hostMemorySize() const {
 }
 
 unsigned int MappedAddressRange::hostMemoryPermissions() const {
-	return m_permissions;
+	if (isWriteTrackingEnabled()) {
+		return m_permissions & ~AccessWrite;
+	}
+	else {
+		return m_permissions;
+	}
+}
+
+void MappedAddressRange::establishMappings(CPUEmulation* emulation, uint64_t base, uint64_t limit) {
+	m_emulation = emulation;
+	m_mappingBase = base;
+	m_mappingLimit = limit;
+}
+
+void MappedAddressRange::removeMappings(CPUEmulation* emulation, uint64_t base, uint64_t limit) {
+	(void)emulation;
+	(void)base;
+	(void)limit;
+
+	m_emulation = nullptr;
+	m_mappingBase = 0;
+	m_mappingLimit = 0;
+}
+
+void MappedAddressRange::enableWriteTracking() {
+	auto pages = (m_size + WriteTrackingPageSize - 1) / WriteTrackingPageSize;
+
+	m_pageGenerations = std::vector<std::atomic<uint64_t>>(pages);
+	m_pageWritable = std::vector<std::atomic<bool>>(pages);
+
+	// Everything is considered to be written before the first sample
+	for (auto& generation : m_pageGenerations) {
+		generation.store(m_writeGeneration.load());
+	}
+}
+
+uint64_t MappedAddressRange::sampleWrites() {
+	auto generation = ++m_writeGeneration;
+
+	for (size_t page = 0; page < m_pageWritable.size(); page++) {
+		if (m_pageWritable[page].exchange(false)) {
+			setPageWritable(page, false);
+		}
+	}
+
+	return generation;
+}
+
+void MappedAddressRange::markWritten() {
+	if (isWriteTrackingEnabled() && m_size != 0) {
+		recordWrite(0, static_cast<unsigned int>(m_size));
+	}
+}
+
+void MappedAddressRange::recordWrite(uint64_t offset, unsigned int accessSize) {
+	auto firstPage = offset / WriteTrackingPageSize;
+	auto lastPage = std::min<uint64_t>((offset + accessSize - 1) / WriteTrackingPageSize, m_pageGenerations.size() - 1);
+
+	for (auto page = firstPage; page <= lastPage; page++) {
+		if (!m_pageWritable[page].exchange(true)) {
+			setPageWritable(page, true);
+		}
+
+		/*
+		 * The generation goes last: a sample taken before it either finds the
+		 * page writable and protects it again, or is older than it, so a page
+		 * is never left writable with a generation from before a sample.
+		 */
+		m_pageGenerations[page].store(++m_writeGeneration);
+	}
+
+	// Pairs with the waiter count increment in waitForWrites
+	if (m_writeWaiters.load() != 0) {
+		{
+			std::unique_lock<std::mutex> locker(m_writeWaitMutex);
+		}
+
+		m_writeWaitCondvar.notify_all();
+	}
+}
+
+bool MappedAddressRange::writtenSince(uint64_t generation) const {
+	for (const auto& pageGeneration : m_pageGenerations) {
+		if (pageGeneration.load() > generation)
+			return true;
+	}
+
+	return false;
+}
+
+void MappedAddressRange::collectWrites(uint64_t& generation, std::vector<size_t>& pages) {
+	// Sampled first: a page written in between shows up now and next time, rather than not at all
+	auto next = sampleWrites();
+
+	for (size_t page = 0; page < m_pageGenerations.size(); page++) {
+		if (pageGeneration(page) > generation)
+			pages.push_back(page);
+	}
+
+	generation = next;
+}
+
+bool MappedAddressRange::waitForWrites(uint64_t sinceGeneration, std::chrono::steady_clock::time_point deadline) {
+	std::unique_lock<std::mutex> locker(m_writeWaitMutex);
+
+	if (!isWriteTrackingEnabled()) {
+		m_writeWaitCondvar.wait_until(locker, deadline);
+		return false;
+	}
+
+	++m_writeWaiters;
+	auto written = m_writeWaitCondvar.wait_until(locker, deadline, [this, sinceGeneration]() { return writtenSince(sinceGeneration); });
+	--m_writeWaiters;
+
+	return written;
+}
+
+void MappedAddressRange::setPageWritable(size_t page, bool writable) {
+	if (!m_emulation)
+		return;
+
+	auto permissions = writable ? m_permissions : (m_permissions & ~AccessWrite);
+	auto pageOffset = page * WriteTrackingPageSize;
+	auto pageLength = std::min(WriteTrackingPageSize, m_size - pageOffset);
+
+	// The range may be mirrored over a mapping larger than itself
+	for (auto mirror = m_mappingBase; mirror < m_mappingLimit; mirror += m_size) {
+		auto pageBase = mirror + pageOffset;
+		if (pageBase >= m_mappingLimit)
+			break;
+
+		m_emulation->mapMemory(
+			pageBase,
+			std::min(pageBase + pageLength, m_mappingLimit),
+			static_cast<uint8_t*>(m_base) + pageOffset,
+			permissions);
+	}
 }
@@ -0,0 +1,169 @@
+#include <Infrastructure/RewindBuffer.h>
+
+#include <Utils/FrameDelta.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+RewindBuffer::RewindBuffer(size_t capacity, bool compress) : m_capacity(capacity), m_compress(compress), m_haveCopy(false), m_memoryUsed(0) {
+	if (m_capacity == 0)
+		throw std::logic_error("a rewind buffer needs room for a checkpoint at least");
+}
+
+RewindBuffer::~RewindBuffer() = default;
+
+unsigned int RewindBuffer::addArea(void* base, size_t size) {
+	if (m_haveCopy)
+		throw std::logic_error("areas have to be added before the first checkpoint");
+
+	Area area;
+	area.base = static_cast<uint8_t*>(base);
+	area.size = size;
+	area.written.resize((size + PageSize - 1) / PageSize);
+
+	m_areas.emplace_back(std::move(area));
+
+	return static_cast<unsigned int>(m_areas.size() - 1);
+}
+
+void RewindBuffer::markWritten(unsigned int area, size_t page) {
+	auto& target = m_areas[area];
+
+	if (page < target.written.size() && !target.written[page]) {
+		target.written[page] = true;
+		target.writtenPages.push_back(page);
+	}
+}
+
+void RewindBuffer::checkpoint(uint64_t time, std::vector<uint8_t> deviceState) {
+	Checkpoint checkpoint;
+	checkpoint.time = time;
+	checkpoint.deviceState = std::move(deviceState);
+	checkpoint.size = checkpoint.deviceState.size();
+
+	if (!m_haveCopy) {
+		for (auto& area : m_areas) {
+			area.copy.assign(area.base, area.base + area.size);
+			m_memoryUsed += area.size;
+		}
+
+		m_haveCopy = true;
+	}
+	else {
+		for (unsigned int index = 0; index < m_areas.size(); index++) {
+			auto& area = m_areas[index];
+
+			for (auto page : area.writtenPages) {
+				auto offset = page * PageSize;
+				auto length = pageLength(area, page);
+				auto current = area.base + offset;
+				auto previous = area.copy.data() + offset;
+
+				// Written over with the same contents, such as by a loop clearing memory that was clear already
+				if (memcmp(previous, current, length) == 0)
+					continue;
+
+				PageDelta pageDelta;
+				pageDelta.area = index;
+				pageDelta.page = page;
+
+				if (m_compress) {
+					encodeFrameDelta(previous, current, length, pageDelta.delta);
+				}
+				else {
+					pageDelta.delta.resize(length);
+					for (size_t byte = 0; byte < length; byte++)
+						pageDelta.delta[byte] = previous[byte] ^ current[byte];
+				}
+
+				memcpy(previous, current, length);
+
+				checkpoint.size += pageDelta.delta.size();
+				checkpoint.pages.emplace_back(std::move(pageDelta));
+			}
+		}
+	}
+
+	clearWritten();
+
+	m_memoryUsed += checkpoint.size;
+	m_checkpoints.emplace_back(std::move(checkpoint));
+
+	while (m_checkpoints.size() > m_capacity)
+		dropOldest();
+}
+
+const std::vector<uint8_t>& RewindBuffer::rewind(size_t steps) {
+	if (steps >= m_checkpoints.size())
+		throw std::logic_error("rewinding past the oldest checkpoint");
+
+	// The pages written since the newest checkpoint are marked already, and the copy has them as they were then
+	for (; steps != 0; steps--) {
+		auto& newest = m_checkpoints.back();
+
+		for (const auto& pageDelta : newest.pages) {
+			auto& area = m_areas[pageDelta.area];
+			auto previous = area.copy.data() + pageDelta.page * PageSize;
+			auto length = pageLength(area, pageDelta.page);
+
+			if (m_compress) {
+				applyFrameDelta(pageDelta.delta.data(), pageDelta.delta.size(), previous, length);
+			}
+			else {
+				for (size_t byte = 0; byte < length; byte++)
+					previous[byte] ^= pageDelta.delta[byte];
+			}
+
+			markWritten(pageDelta.area, pageDelta.page);
+		}
+
+		m_memoryUsed -= newest.size;
+		m_checkpoints.pop_back();
+	}
+
+	for (auto& area : m_areas) {
+		for (auto page : area.writtenPages) {
+			auto offset = page * PageSize;
+			memcpy(area.base + offset, area.copy.data() + offset, pageLength(area, page));
+		}
+	}
+
+	clearWritten();
+
+	return m_checkpoints.back().deviceState;
+}
+
+void RewindBuffer::clear() {
+	m_checkpoints.clear();
+
+	for (auto& area : m_areas) {
+		area.copy.clear();
+		area.copy.shrink_to_fit();
+	}
+
+	clearWritten();
+
+	m_haveCopy = false;
+	m_memoryUsed = 0;
+}
+
+size_t RewindBuffer::pageLength(const Area& area, size_t page) {
+	return std::min(PageSize, area.size - page * PageSize);
+}
+
+void RewindBuffer::clearWritten() {
+	for (auto& area : m_areas) {
+		for (auto page : area.writtenPages)
+			area.written[page] = false;
+
+		area.writtenPages.clear();
+	}
+}
+
+void RewindBuffer::dropOldest() {
+	// Its pages only lead back to the checkpoint before it, which is gone already
+	m_memoryUsed -= m_checkpoints.front().size;
+	m_checkpoints.pop_front();
+}
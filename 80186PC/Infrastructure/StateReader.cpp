@@ -0,0 +1,100 @@
+#include <Infrastructure/StateReader.h>
+
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+
+StateReader::StateReader(const void* data, size_t size) : m_data(static_cast<const uint8_t*>(data)), m_size(size), m_position(0), m_chunkEnd(SIZE_MAX) {
+
+}
+
+StateReader::~StateReader() = default;
+
+void StateReader::checkChunks() const {
+	size_t position = m_position;
+
+	while (position != m_size) {
+		if (m_size - position < ChunkHeaderSize)
+			throw std::runtime_error("save state is truncated");
+
+		auto sizeBytes = m_data + position + 4;
+		size_t size = sizeBytes[0] | (sizeBytes[1] << 8) | (sizeBytes[2] << 16) | (static_cast<size_t>(sizeBytes[3]) << 24);
+
+		position += ChunkHeaderSize;
+		if (m_size - position < size)
+			throw std::runtime_error("save state is truncated");
+
+		position += size;
+	}
+}
+
+void StateReader::beginChunk(const char* tag) {
+	if (m_chunkEnd != SIZE_MAX)
+		throw std::logic_error("state chunks don't nest");
+
+	if (m_size - m_position < ChunkHeaderSize)
+		throw std::runtime_error(std::string("save state ends where ") + tag + " was expected");
+
+	// The tag, then the size of what follows
+	auto header = take(4);
+	if (memcmp(header, tag, 4) != 0)
+		throw std::runtime_error("save state has " + std::string(reinterpret_cast<const char*>(header), 4) + " where " + tag + " was expected");
+
+	auto size = readLE(4);
+	if (m_size - m_position < size)
+		throw std::runtime_error(std::string("save state chunk ") + tag + " is truncated");
+
+	m_chunkEnd = m_position + static_cast<size_t>(size);
+}
+
+void StateReader::endChunk() {
+	if (m_position != m_chunkEnd)
+		throw std::runtime_error("save state chunk does not match what reads it");
+
+	m_chunkEnd = SIZE_MAX;
+}
+
+uint8_t StateReader::read8() {
+	return *take(1);
+}
+
+uint16_t StateReader::read16() {
+	return static_cast<uint16_t>(readLE(2));
+}
+
+uint32_t StateReader::read32() {
+	return static_cast<uint32_t>(readLE(4));
+}
+
+uint64_t StateReader::read64() {
+	return readLE(8);
+}
+
+bool StateReader::readBool() {
+	return read8() != 0;
+}
+
+void StateReader::readBytes(void* data, size_t size) {
+	memcpy(data, take(size), size);
+}
+
+uint64_t StateReader::readLE(unsigned int size) {
+	auto bytes = take(size);
+
+	uint64_t value = 0;
+	for (unsigned int index = size; index-- > 0;)
+		value = (value << 8) | bytes[index];
+
+	return value;
+}
+
+const uint8_t* StateReader::take(size_t size) {
+	auto end = m_chunkEnd == SIZE_MAX ? m_size : m_chunkEnd;
+	if (end - m_position < size)
+		throw std::runtime_error("save state chunk does not match what reads it");
+
+	auto data = m_data + m_position;
+	m_position += size;
+	return data;
+}
@@ -0,0 +1,67 @@
+#include <Infrastructure/StateWriter.h>
+
+#include <string.h>
+
+#include <stdexcept>
+
+StateWriter::StateWriter() : m_chunkStart(SIZE_MAX) {
+
+}
+
+StateWriter::~StateWriter() = default;
+
+void StateWriter::beginChunk(const char* tag) {
+	if (m_chunkStart != SIZE_MAX)
+		throw std::logic_error("state chunks don't nest");
+
+	if (strlen(tag) != 4)
+		throw std::logic_error("state chunk tags are four characters");
+
+	writeBytes(tag, 4);
+	write32(0);
+	m_chunkStart = m_data.size();
+}
+
+void StateWriter::endChunk() {
+	if (m_chunkStart == SIZE_MAX)
+		throw std::logic_error("no state chunk to end");
+
+	auto size = m_data.size() - m_chunkStart;
+	if (size > UINT32_MAX)
+		throw std::logic_error("state chunk is too large");
+
+	for (unsigned int index = 0; index < 4; index++)
+		m_data[m_chunkStart - 4 + index] = static_cast<uint8_t>(size >> (index * 8));
+
+	m_chunkStart = SIZE_MAX;
+}
+
+void StateWriter::write8(uint8_t value) {
+	m_data.push_back(value);
+}
+
+void StateWriter::write16(uint16_t value) {
+	writeLE(value, 2);
+}
+
+void StateWriter::write32(uint32_t value) {
+	writeLE(value, 4);
+}
+
+void StateWriter::write64(uint64_t value) {
+	writeLE(value, 8);
+}
+
+void StateWriter::writeBool(bool value) {
+	write8(value ? 1 : 0);
+}
+
+void StateWriter::writeBytes(const void* data, size_t size) {
+	auto bytes = static_cast<const uint8_t*>(data);
+	m_data.insert(m_data.end(), bytes, bytes + size);
+}
+
+void StateWriter::writeLE(uint64_t value, unsigned int size) {
+	for (unsigned int index = 0; index < size; index++)
+		m_data.push_back(static_cast<uint8_t>(value >> (index * 8)));
+}
@@ -0,0 +1,5 @@
+#include <Infrastructure/VirtualClock.h>
+
+VirtualClock::VirtualClock() = default;
+
+VirtualClock::~VirtualClock() = default;
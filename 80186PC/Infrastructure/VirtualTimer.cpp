@@ -0,0 +1,5 @@
+#include <Infrastructure/VirtualTimer.h>
+
+VirtualTimer::VirtualTimer() = default;
+
+VirtualTimer::~VirtualTimer() = default;
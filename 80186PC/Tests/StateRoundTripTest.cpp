@@ -0,0 +1,143 @@
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Device state written with StateWriter has to read back with StateReader
+ * exactly, chunk by chunk, the way Machine saves and loads its devices.
+ */
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+	if (!condition) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+static bool throwsRuntimeError(StateReader& reader, void (*read)(StateReader& reader)) {
+	try {
+		read(reader);
+	}
+	catch (const std::runtime_error&) {
+		return true;
+	}
+
+	return false;
+}
+
+static std::vector<uint8_t> writeDeviceState() {
+	StateWriter writer;
+
+	writer.beginChunk("CPU ");
+	writer.write32(0x12345678);
+	writer.write16(0xF000);
+	writer.write64(0x0123456789ABCDEFULL);
+	writer.endChunk();
+
+	writer.beginChunk("PIT ");
+	writer.write8(0x36);
+	writer.writeBool(true);
+	writer.writeBool(false);
+	writer.endChunk();
+
+	// Empty chunks happen too, for devices with nothing to save at the moment
+	writer.beginChunk("EMS ");
+	writer.endChunk();
+
+	writer.beginChunk("ATA ");
+	const char sector[] = "sector data";
+	writer.write32(sizeof(sector));
+	writer.writeBytes(sector, sizeof(sector));
+	writer.endChunk();
+
+	return writer.data();
+}
+
+static void testRoundTrip() {
+	auto data = writeDeviceState();
+
+	StateReader reader(data.data(), data.size());
+	reader.checkChunks();
+
+	reader.beginChunk("CPU ");
+	check(reader.read32() == 0x12345678, "32 bit value reads back");
+	check(reader.read16() == 0xF000, "16 bit value reads back");
+	check(reader.read64() == 0x0123456789ABCDEFULL, "64 bit value reads back");
+	reader.endChunk();
+
+	reader.beginChunk("PIT ");
+	check(reader.read8() == 0x36, "8 bit value reads back");
+	check(reader.readBool(), "true reads back");
+	check(!reader.readBool(), "false reads back");
+	reader.endChunk();
+
+	reader.beginChunk("EMS ");
+	reader.endChunk();
+
+	reader.beginChunk("ATA ");
+	char sector[32]{};
+	auto size = reader.read32();
+	check(size == sizeof("sector data"), "byte count reads back");
+	reader.readBytes(sector, size);
+	check(strcmp(sector, "sector data") == 0, "bytes read back");
+	reader.endChunk();
+
+	check(reader.atEnd(), "all of the state is read");
+}
+
+static void testMismatches() {
+	auto data = writeDeviceState();
+
+	{
+		StateReader reader(data.data(), data.size());
+		check(throwsRuntimeError(reader, [](StateReader& reader) { reader.beginChunk("PIT "); }), "another tag is reported");
+	}
+
+	{
+		StateReader reader(data.data(), data.size());
+		check(throwsRuntimeError(reader, [](StateReader& reader) {
+			reader.beginChunk("CPU ");
+			reader.read32();
+			reader.endChunk();
+		}), "a chunk not read to its end is reported");
+	}
+
+	{
+		StateReader reader(data.data(), data.size());
+		check(throwsRuntimeError(reader, [](StateReader& reader) {
+			reader.beginChunk("CPU ");
+			reader.read64();
+			reader.read64();
+		}), "reading past the end of a chunk is reported");
+	}
+
+	{
+		StateReader reader(data.data(), data.size() - 1);
+		check(throwsRuntimeError(reader, [](StateReader& reader) { reader.checkChunks(); }), "a truncated state is reported");
+	}
+}
+
+int main() {
+	try {
+		testRoundTrip();
+		testMismatches();
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "FAILED: %s\n", e.what());
+		failures++;
+	}
+
+	if (failures != 0)
+		return 1;
+
+	printf("StateRoundTripTest: passed\n");
+	return 0;
+}
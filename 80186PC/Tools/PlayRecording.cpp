@@ -0,0 +1,206 @@
+#include <UI/ScreenRecording.h>
+
+#include <Utils/ImageWriter.h>
+
+#include <SDL.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Plays back or extracts screen recordings made with --record.
+ */
+
+struct SDLWindowDeleter {
+	void operator()(SDL_Window* window) const {
+		SDL_DestroyWindow(window);
+	}
+};
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s <RECORDING>\n"
+		"       %s --png PREFIX <RECORDING>\n"
+		"Space pauses and resumes the playback, Escape quits.\n",
+		name, name);
+}
+
+static void exportFrames(ScreenRecording& recording, const std::string& prefix) {
+	FrameRenderer::Frame frame;
+	uint64_t timestamp;
+	unsigned long number = 0;
+
+	while (recording.readFrame(frame, timestamp)) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "-%06lu.png", number++);
+
+		writeIndexedPNG(prefix + suffix, frame.width, frame.height, frame.pixels.data(), recording.palette(), recording.paletteSize());
+	}
+
+	printf("%lu frames written\n", number);
+}
+
+static void showFrame(SDL_Window* window, const FrameRenderer::Frame& frame, const uint8_t (*palette)[3]) {
+	int windowWidth, windowHeight;
+	SDL_GetWindowSize(window, &windowWidth, &windowHeight);
+
+	if (windowWidth != static_cast<int>(frame.width) || windowHeight != static_cast<int>(frame.height))
+		SDL_SetWindowSize(window, frame.width, frame.height);
+
+	auto surface = SDL_GetWindowSurface(window);
+	if (!surface)
+		throw std::runtime_error("SDL_GetWindowSurface failed: " + std::string(SDL_GetError()));
+
+	if (surface->format->BytesPerPixel != 4)
+		throw std::runtime_error("unsupported window surface format");
+
+	Uint32 colors[FrameRenderer::ShadeCount];
+	for (unsigned int shade = 0; shade < FrameRenderer::ShadeCount; shade++)
+		colors[shade] = SDL_MapRGB(surface->format, palette[shade][0], palette[shade][1], palette[shade][2]);
+
+	if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0)
+		throw std::runtime_error("SDL_LockSurface failed: " + std::string(SDL_GetError()));
+
+	auto width = std::min(frame.width, static_cast<unsigned int>(surface->w));
+	auto height = std::min(frame.height, static_cast<unsigned int>(surface->h));
+
+	for (unsigned int y = 0; y < height; y++) {
+		auto source = frame.pixels.data() + static_cast<size_t>(y) * frame.width;
+		auto destination = reinterpret_cast<Uint32*>(static_cast<uint8_t*>(surface->pixels) + y * surface->pitch);
+
+		for (unsigned int x = 0; x < width; x++)
+			destination[x] = colors[source[x]];
+	}
+
+	if (SDL_MUSTLOCK(surface))
+		SDL_UnlockSurface(surface);
+
+	SDL_UpdateWindowSurface(window);
+}
+
+static void play(ScreenRecording& recording) {
+	FrameRenderer::Frame shown, next;
+	uint64_t timestamp;
+
+	bool haveNext = recording.readFrame(next, timestamp);
+	if (!haveNext) {
+		printf("The recording is empty\n");
+		return;
+	}
+
+	if (SDL_InitSubSystem(SDL_INIT_VIDEO | SDL_INIT_EVENTS) < 0)
+		throw std::runtime_error("SDL_InitSubSystem failed: " + std::string(SDL_GetError()));
+
+	std::unique_ptr<SDL_Window, SDLWindowDeleter> window(SDL_CreateWindow("80186PC recording", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+		next.width, next.height, 0));
+	if (!window)
+		throw std::runtime_error("SDL_CreateWindow failed: " + std::string(SDL_GetError()));
+
+	// Playback starts with the first frame rather than with the recording
+	auto firstTimestamp = timestamp;
+	auto start = std::chrono::steady_clock::now();
+	auto pausedPosition = std::chrono::microseconds(0);
+	bool paused = false;
+
+	while (true) {
+		auto position = paused ? pausedPosition :
+			std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+		if (haveNext && !paused && timestamp - firstTimestamp <= static_cast<uint64_t>(position.count())) {
+			std::swap(shown, next);
+			showFrame(window.get(), shown, recording.palette());
+
+			haveNext = recording.readFrame(next, timestamp);
+			if (!haveNext)
+				printf("End of recording\n");
+
+			continue;
+		}
+
+		SDL_Event ev;
+		int result;
+
+		if (haveNext && !paused) {
+			auto wait = (timestamp - firstTimestamp - position.count() + 999) / 1000;
+			result = SDL_WaitEventTimeout(&ev, static_cast<int>(std::min<uint64_t>(wait, 1000)));
+		}
+		else {
+			result = SDL_WaitEvent(&ev);
+			if (!result)
+				throw std::runtime_error("SDL_WaitEvent failed: " + std::string(SDL_GetError()));
+		}
+
+		if (!result)
+			continue;
+
+		switch (ev.type) {
+		case SDL_QUIT:
+			return;
+
+		case SDL_KEYDOWN:
+			if (ev.key.keysym.sym == SDLK_ESCAPE)
+				return;
+
+			if (ev.key.keysym.sym == SDLK_SPACE) {
+				if (paused)
+					start = std::chrono::steady_clock::now() - pausedPosition;
+				else
+					pausedPosition = position;
+
+				paused = !paused;
+			}
+			break;
+
+		case SDL_WINDOWEVENT:
+			if (ev.window.event == SDL_WINDOWEVENT_EXPOSED && shown.width != 0)
+				showFrame(window.get(), shown, recording.palette());
+
+			break;
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	const char* recordingPath = nullptr;
+	const char* pngPrefix = nullptr;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--png") == 0 && arg + 1 < argc) {
+			pngPrefix = argv[++arg];
+		}
+		else if (!recordingPath) {
+			recordingPath = argv[arg];
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!recordingPath) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		ScreenRecording recording;
+		recording.open(recordingPath);
+
+		if (pngPrefix)
+			exportFrames(recording, pngPrefix);
+		else
+			play(recording);
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+#include <Hardware/MachineFleet.h>
+
+#include <comdef.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+/*
+ * Runs many machines at once on a few worker threads, see MachineFleet, and
+ * reports how fast each of them ran.
+ */
+
+static std::atomic<bool> interrupted(false);
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s [--threads N] [--quantum INSTRUCTIONS] [--seconds S] [--fast] [--load-state PATH]\n"
+		"          <COUNT> <HARD DISK IMAGE IN VHD FORMAT> <OVERLAY PREFIX>\n"
+		"Every machine writes to a differencing image of its own, named OVERLAY PREFIX, its number and .vhd.\n"
+		"--fast runs machine time as fast as the host can go rather than in step with real time.\n",
+		name);
+}
+
+static void interrupt(int signal) {
+	(void)signal;
+
+	interrupted = true;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned int threads = std::thread::hardware_concurrency();
+	uint64_t quantum = MachineFleet::DefaultQuantum;
+	unsigned long seconds = 10;
+	bool fast = false;
+	const char* statePath = nullptr;
+	const char* positional[3]{};
+	unsigned int positionalCount = 0;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+			threads = static_cast<unsigned int>(strtoul(argv[++arg], nullptr, 10));
+		}
+		else if (strcmp(argv[arg], "--quantum") == 0 && arg + 1 < argc) {
+			quantum = strtoull(argv[++arg], nullptr, 10);
+		}
+		else if (strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc) {
+			seconds = strtoul(argv[++arg], nullptr, 10);
+		}
+		else if (strcmp(argv[arg], "--fast") == 0) {
+			fast = true;
+		}
+		else if (strcmp(argv[arg], "--load-state") == 0 && arg + 1 < argc) {
+			statePath = argv[++arg];
+		}
+		else if (positionalCount < 3) {
+			positional[positionalCount++] = argv[arg];
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	auto count = positionalCount == 3 ? strtoul(positional[0], nullptr, 10) : 0;
+
+	if (count == 0 || quantum == 0 || seconds == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	MachineFleet fleet(threads);
+	fleet.setQuantum(quantum);
+
+	try {
+		for (unsigned long index = 0; index < count; index++) {
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), "%04lu.vhd", index);
+
+			// Replaces the overlay of an earlier run, but nothing else that may be there
+			auto overlayPath = std::string(positional[2]) + suffix;
+			ATAHardDisk::createOverlay(positional[1], overlayPath);
+
+			Machine::Configuration configuration;
+			configuration.hardDiskImage = overlayPath;
+			if (statePath)
+				configuration.saveState = statePath;
+			configuration.realTimePacing = !fast;
+
+			fleet.addMachine(configuration);
+		}
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	catch (const _com_error& e) {
+		fprintf(stderr, "%ls\n", e.ErrorMessage());
+		return 1;
+	}
+
+	printf("Running %lu machines on %u threads for %lu seconds\n", count, std::max(threads, 1U), seconds);
+
+	signal(SIGINT, interrupt);
+	signal(SIGTERM, interrupt);
+
+	auto before = fleet.statistics();
+	auto start = std::chrono::steady_clock::now();
+
+	fleet.start();
+
+	auto deadline = start + std::chrono::seconds(seconds);
+	while (!interrupted.load() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	fleet.stop();
+
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	auto after = fleet.statistics();
+
+	double totalInstructions = 0;
+
+	for (size_t index = 0; index < after.size(); index++) {
+		auto instructions = static_cast<double>(after[index].instructions - before[index].instructions);
+		auto cycles = static_cast<double>(after[index].cycles - before[index].cycles);
+		auto busy = std::chrono::duration<double>(after[index].busyTime - before[index].busyTime).count();
+
+		totalInstructions += instructions;
+
+		printf("%4zu: %8.3f MIPS, %6.2fx real time, %5.1f%% of a thread, %llu slices%s\n",
+			index,
+			instructions / elapsed / 1e6,
+			cycles / elapsed / VirtualClock::Frequency,
+			busy / elapsed * 100.0,
+			static_cast<unsigned long long>(after[index].slices - before[index].slices),
+			after[index].finished ? ", finished" : "");
+	}
+
+	printf("Total: %.3f MIPS\n", totalInstructions / elapsed / 1e6);
+
+	return 0;
+}
@@ -0,0 +1,478 @@
+#include <UI/AutomationScript.h>
+#include <UI/Keyboard.h>
+#include <UI/Mouse.h>
+#include <UI/TextScreen.h>
+
+#include <Hardware/Machine.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+AutomationScript::AutomationScript() : m_machine(nullptr), m_timeout(DefaultTimeout), m_run(false), m_exitCode(0) {
+
+}
+
+AutomationScript::~AutomationScript() {
+	stop();
+}
+
+void AutomationScript::load(const std::filesystem::path& path) {
+	std::ifstream stream(path);
+	if (!stream)
+		throw std::runtime_error("cannot open script " + path.string());
+
+	std::vector<Step> steps;
+	std::string line;
+	unsigned int lineNumber = 0;
+
+	while (std::getline(stream, line)) {
+		lineNumber++;
+
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		auto start = line.find_first_not_of(" \t");
+		if (start == std::string::npos || line[start] == '#')
+			continue;
+
+		auto end = line.find_first_of(" \t", start);
+		auto command = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+		std::string arguments;
+		if (end != std::string::npos) {
+			auto argumentsStart = line.find_first_not_of(" \t", end);
+			if (argumentsStart != std::string::npos)
+				arguments = line.substr(argumentsStart);
+		}
+
+		try {
+			steps.emplace_back(parseStep(command, arguments));
+			steps.back().line = lineNumber;
+		}
+		catch (const std::exception& e) {
+			throw std::runtime_error(path.string() + ":" + std::to_string(lineNumber) + ": " + e.what());
+		}
+	}
+
+	m_steps = std::move(steps);
+	m_path = path;
+}
+
+AutomationScript::Step AutomationScript::parseStep(const std::string& command, const std::string& arguments) {
+	Step step{};
+
+	auto requireArguments = [&arguments, &command]() {
+		if (arguments.empty())
+			throw std::runtime_error(command + " needs an argument");
+	};
+
+	if (command == "type") {
+		requireArguments();
+		step.type = StepType::Type;
+		step.text = unescape(arguments);
+	}
+	else if (command == "key") {
+		requireArguments();
+		step.type = StepType::Key;
+		step.scancodes = parseKeys(arguments);
+	}
+	else if (command == "fast-fill") {
+		step.type = StepType::FastFill;
+		if (arguments == "on") {
+			step.values[0] = 1;
+		}
+		else if (arguments != "off") {
+			throw std::runtime_error("fast-fill is either on or off");
+		}
+	}
+	else if (command == "mouse-move") {
+		step.type = StepType::MouseMove;
+
+		auto separator = arguments.find_first_of(" \t");
+		if (separator == std::string::npos)
+			throw std::runtime_error("mouse-move needs two deltas");
+
+		step.values[0] = parseNumber(arguments.substr(0, separator));
+		step.values[1] = parseNumber(arguments.substr(arguments.find_first_not_of(" \t", separator)));
+	}
+	else if (command == "mouse-button") {
+		step.type = StepType::MouseButton;
+
+		// Bus mouse button numbers
+		static const std::unordered_map<std::string, int64_t> buttons{
+			{ "left", 2 },
+			{ "middle", 1 },
+			{ "right", 0 }
+		};
+
+		auto separator = arguments.find_first_of(" \t");
+		auto button = buttons.find(arguments.substr(0, separator));
+		auto state = separator == std::string::npos ? std::string() : arguments.substr(arguments.find_first_not_of(" \t", separator));
+
+		if (button == buttons.end() || (state != "down" && state != "up"))
+			throw std::runtime_error("mouse-button needs left, middle or right, then down or up");
+
+		step.values[0] = button->second;
+		step.values[1] = state == "down";
+	}
+	else if (command == "wait-text") {
+		requireArguments();
+		step.type = StepType::WaitText;
+		step.text = arguments;
+		step.pattern = std::regex(arguments);
+	}
+	else if (command == "wait-ticks" || command == "wait-idle") {
+		requireArguments();
+		step.type = command == "wait-ticks" ? StepType::WaitTicks : StepType::WaitIdle;
+		step.values[0] = parseNumber(arguments);
+		if (step.values[0] < 0)
+			throw std::runtime_error("negative tick count");
+	}
+	else if (command == "timeout") {
+		requireArguments();
+		step.type = StepType::Timeout;
+		step.values[0] = parseNumber(arguments);
+		if (step.values[0] <= 0)
+			throw std::runtime_error("timeout must be positive");
+	}
+	else if (command == "snapshot") {
+		requireArguments();
+		step.type = StepType::Snapshot;
+		step.text = arguments;
+
+		auto extension = std::filesystem::path(arguments).extension();
+		if (extension == ".png") {
+			step.values[0] = static_cast<int64_t>(HeadlessUI::SnapshotFormat::PNG);
+		}
+		else if (extension == ".ppm") {
+			step.values[0] = static_cast<int64_t>(HeadlessUI::SnapshotFormat::Raw);
+		}
+		else if (extension == ".txt") {
+			step.values[0] = static_cast<int64_t>(HeadlessUI::SnapshotFormat::Text);
+		}
+		else {
+			throw std::runtime_error("snapshots are .png, .ppm or .txt");
+		}
+	}
+	else if (command == "save-state" || command == "load-state") {
+		requireArguments();
+		step.type = command == "save-state" ? StepType::SaveState : StepType::LoadState;
+		step.text = arguments;
+	}
+	else if (command == "checkpoint") {
+		step.type = StepType::Checkpoint;
+	}
+	else if (command == "rewind") {
+		step.type = StepType::Rewind;
+		if (!arguments.empty())
+			step.values[0] = parseNumber(arguments);
+
+		if (step.values[0] < 0)
+			throw std::runtime_error("negative checkpoint count");
+	}
+	else if (command == "quit") {
+		step.type = StepType::Quit;
+		if (!arguments.empty())
+			step.values[0] = parseNumber(arguments);
+	}
+	else {
+		throw std::runtime_error("unknown step " + command);
+	}
+
+	return step;
+}
+
+std::string AutomationScript::unescape(const std::string& text) {
+	std::string result;
+	result.reserve(text.size());
+
+	for (size_t index = 0; index < text.size(); index++) {
+		if (text[index] != '\\' || index + 1 == text.size()) {
+			result.push_back(text[index]);
+			continue;
+		}
+
+		switch (text[++index]) {
+		case 'n':
+			result.push_back('\n');
+			break;
+
+		case 't':
+			result.push_back('\t');
+			break;
+
+		case 'e':
+			result.push_back('\x1B');
+			break;
+
+		case '\\':
+			result.push_back('\\');
+			break;
+
+		default:
+			throw std::runtime_error(std::string("unknown escape \\") + text[index]);
+		}
+	}
+
+	return result;
+}
+
+std::vector<uint8_t> AutomationScript::parseKeys(const std::string& keys) {
+	static const std::unordered_map<std::string, uint8_t> namedKeys{
+		{ "esc", 0x01 }, { "escape", 0x01 }, { "backspace", 0x0E }, { "tab", 0x0F }, { "enter", 0x1C },
+		{ "ctrl", 0x1D }, { "shift", 0x2A }, { "rshift", 0x36 }, { "alt", 0x38 }, { "space", 0x39 },
+		{ "capslock", 0x3A },
+		{ "f1", 0x3B }, { "f2", 0x3C }, { "f3", 0x3D }, { "f4", 0x3E }, { "f5", 0x3F },
+		{ "f6", 0x40 }, { "f7", 0x41 }, { "f8", 0x42 }, { "f9", 0x43 }, { "f10", 0x44 },
+		{ "numlock", 0x45 }, { "scrolllock", 0x46 },
+		{ "home", 0x47 }, { "up", 0x48 }, { "pgup", 0x49 }, { "left", 0x4B }, { "right", 0x4D },
+		{ "end", 0x4F }, { "down", 0x50 }, { "pgdn", 0x51 }, { "ins", 0x52 }, { "del", 0x53 },
+		{ "f11", 0x57 }, { "f12", 0x58 }
+	};
+
+	std::vector<uint8_t> makeCodes;
+	size_t start = 0;
+
+	while (start <= keys.size()) {
+		auto end = keys.find('+', start + 1);
+		if (end == std::string::npos)
+			end = keys.size();
+
+		auto name = keys.substr(start, end - start);
+		std::string lowerName(name);
+		std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+		auto namedKey = namedKeys.find(lowerName);
+		Keyboard::Keystroke keystroke;
+
+		if (namedKey != namedKeys.end()) {
+			makeCodes.push_back(namedKey->second);
+		}
+		else if (name.size() == 1 && Keyboard::translateCharacter(name[0], keystroke)) {
+			if (keystroke.shift)
+				makeCodes.push_back(Keyboard::LeftShiftScancode);
+
+			makeCodes.push_back(keystroke.scancode);
+		}
+		else {
+			throw std::runtime_error("unknown key " + name);
+		}
+
+		start = end + 1;
+	}
+
+	// Pressed in order, released in reverse
+	auto scancodes = makeCodes;
+	for (auto it = makeCodes.rbegin(); it != makeCodes.rend(); it++)
+		scancodes.push_back(*it | Keyboard::BreakCode);
+
+	return scancodes;
+}
+
+int64_t AutomationScript::parseNumber(const std::string& text) {
+	size_t length;
+	auto value = std::stoll(text, &length);
+
+	if (length != text.size())
+		throw std::runtime_error("not a number: " + text);
+
+	return value;
+}
+
+void AutomationScript::start() {
+	if (!m_machine)
+		throw std::logic_error("no machine to run the script against");
+
+	m_run = true;
+	m_thread = std::thread(&AutomationScript::scriptThread, this);
+}
+
+void AutomationScript::stop() {
+	m_run = false;
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void AutomationScript::scriptThread() {
+	m_snapshots.setVideoAdapter(m_machine->videoAdapter());
+
+	for (const auto& step : m_steps) {
+		if (!m_run)
+			return;
+
+		bool succeeded;
+
+		try {
+			succeeded = runStep(step);
+		}
+		catch (const std::exception& e) {
+			printf("Script: %s:%u: %s\n", m_path.string().c_str(), step.line, e.what());
+			m_exitCode = ExitFailed;
+			succeeded = false;
+		}
+
+		if (!m_run)
+			return;
+
+		if (step.type == StepType::Quit || !succeeded) {
+			if (m_quitHandler)
+				m_quitHandler(m_exitCode);
+
+			return;
+		}
+	}
+
+	printf("Script: %s: done\n", m_path.string().c_str());
+}
+
+bool AutomationScript::runStep(const Step& step) {
+	switch (step.type) {
+	case StepType::Type:
+		if (!m_machine->keyboard()->typeText(step.text))
+			printf("Script: %s:%u: some characters have no key, skipped\n", m_path.string().c_str(), step.line);
+
+		return true;
+
+	case StepType::Key:
+		m_machine->keyboard()->pushScancodes(step.scancodes.data(), step.scancodes.size());
+		return true;
+
+	case StepType::FastFill:
+		m_machine->setTypingFastFill(step.values[0] != 0);
+		return true;
+
+	case StepType::MouseMove:
+		m_machine->mouse()->addDeltas(static_cast<int>(step.values[0]), static_cast<int>(step.values[1]));
+		return true;
+
+	case StepType::MouseButton:
+		m_machine->mouse()->updateButtonState(static_cast<unsigned int>(step.values[0]), step.values[1] != 0);
+		return true;
+
+	case StepType::WaitText:
+	{
+		TextScreen screen;
+
+		if (waitSliced([this, &step, &screen](std::chrono::milliseconds slice) { return m_machine->waitForText(step.pattern, slice, &screen); }))
+			return true;
+
+		if (m_run) {
+			printf("Script: %s:%u: timed out waiting for %s. The screen was:\n%s\n", m_path.string().c_str(), step.line,
+				step.text.c_str(), screen.text().c_str());
+			m_exitCode = ExitTimedOut;
+		}
+
+		return false;
+	}
+
+	case StepType::WaitTicks:
+	{
+		auto cycles = static_cast<uint64_t>(step.values[0]) * CyclesPerTimerTick;
+		uint64_t target = 0;
+		bool started = false;
+
+		return waitInMachineTime(step, [&](uint64_t now) -> uint64_t {
+			if (!started) {
+				target = now + cycles;
+				started = true;
+			}
+
+			return now >= target ? 0 : target;
+		});
+	}
+
+	case StepType::WaitIdle:
+	{
+		auto cycles = static_cast<uint64_t>(step.values[0]) * CyclesPerTimerTick;
+		uint64_t sample = 0;
+		uint64_t sampleTime = 0;
+		bool sampled = false;
+
+		// Idle once a whole window passes without writes; a write starts a new window
+		return waitInMachineTime(step, [&](uint64_t now) -> uint64_t {
+			if (sampled && now >= sampleTime + cycles) {
+				if (!m_machine->framebufferWrittenSince(sample))
+					return 0;
+
+				sampled = false;
+			}
+
+			if (!sampled) {
+				sample = m_machine->sampleFramebufferWrites();
+				sampleTime = now;
+				sampled = true;
+			}
+
+			return std::max<uint64_t>(sampleTime + cycles, 1);
+		});
+	}
+
+	case StepType::Timeout:
+		m_timeout = std::chrono::seconds(step.values[0]);
+		return true;
+
+	case StepType::Snapshot:
+		if (!m_snapshots.snapshot(step.text, static_cast<HeadlessUI::SnapshotFormat>(step.values[0])))
+			printf("Script: %s:%u: nothing to capture for %s\n", m_path.string().c_str(), step.line, step.text.c_str());
+
+		return true;
+
+	case StepType::SaveState:
+		m_machine->saveState(step.text);
+		return true;
+
+	case StepType::LoadState:
+		m_machine->loadState(step.text);
+		return true;
+
+	case StepType::Checkpoint:
+		m_machine->checkpoint();
+		return true;
+
+	case StepType::Rewind:
+		if (!m_machine->rewind(static_cast<size_t>(step.values[0])))
+			throw std::runtime_error("no checkpoint to rewind to");
+
+		return true;
+
+	case StepType::Quit:
+		m_exitCode = static_cast<int>(step.values[0]);
+		return true;
+
+	default:
+		throw std::logic_error("unknown step type");
+	}
+}
+
+bool AutomationScript::waitSliced(const std::function<bool(std::chrono::milliseconds slice)>& wait) {
+	auto deadline = std::chrono::steady_clock::now() + m_timeout;
+
+	while (m_run) {
+		auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (remaining.count() < 0)
+			return false;
+
+		if (wait(std::min(remaining, StopCheckInterval)))
+			return true;
+	}
+
+	return false;
+}
+
+bool AutomationScript::waitInMachineTime(const Step& step, const std::function<uint64_t(uint64_t now)>& poll) {
+	if (waitSliced([this, &poll](std::chrono::milliseconds slice) { return m_machine->waitInMachineTime(poll, slice); }))
+		return true;
+
+	if (m_run) {
+		printf("Script: %s:%u: timed out waiting in machine time\n", m_path.string().c_str(), step.line);
+		m_exitCode = ExitTimedOut;
+	}
+
+	return false;
+}
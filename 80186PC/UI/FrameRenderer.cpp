@@ -0,0 +1,119 @@
+#include <UI/FrameRenderer.h>
+
+#include <algorithm>
+
+const uint8_t FrameRenderer::ShadeColors[ShadeCount][3]{
+	// ShadeBlack
+	{ 0x00, 0x00, 0x00 },
+	// ShadeNormal
+	{ 0xBF, 0x89, 0x00 },
+	// ShadeBright
+	{ 0xFF, 0xB7, 0x00 }
+};
+
+FrameRenderer::FrameRenderer() = default;
+
+FrameRenderer::~FrameRenderer() = default;
+
+void FrameRenderer::render(const VideoAdapter::AdapterConfiguration& config, Frame& frame) const {
+	frame.width = config.widthPixels;
+	frame.height = config.heightPixels;
+	frame.pixels.resize(static_cast<size_t>(frame.width) * frame.height);
+
+	if (!config.videoEnabled) {
+		std::fill(frame.pixels.begin(), frame.pixels.end(), ShadeBlack);
+	}
+	else if (config.textMode) {
+		renderTextMode(config, frame);
+	}
+	else {
+		renderGraphicsMode(config, frame);
+	}
+}
+
+void FrameRenderer::renderTextMode(const VideoAdapter::AdapterConfiguration& config, Frame& frame) const {
+	std::fill(frame.pixels.begin(), frame.pixels.end(), ShadeBlack);
+
+	auto characterHeight = config.textModeCharacterHeight;
+	if (characterHeight == 0)
+		return;
+
+	// Only draw the cells that fit into the frame completely
+	auto columns = std::min(config.textModeColumns, frame.width / GlyphWidth);
+	auto rows = std::min(config.textModeRows, frame.height / characterHeight);
+	auto glyphLines = std::min(characterHeight, m_font.glyphHeight());
+
+	for (unsigned int row = 0; row < rows; row++) {
+		for (unsigned int column = 0; column < columns; column++) {
+			auto cellOffset = (row * config.textModeColumns + column) * 2;
+			auto ch = config.textModeFramebuffer[cellOffset];
+			auto attribute = config.textModeFramebuffer[cellOffset + 1];
+
+			uint8_t background = ShadeBlack;
+			uint8_t foreground;
+
+			if ((attribute & 0x77) == 0x00) {
+				// all black/blank
+				foreground = ShadeBlack;
+			}
+			else if ((attribute & 0x77) == 0x70) {
+				// inverse video
+				background = (attribute & 0x80) ? ShadeBright : ShadeNormal;
+				foreground = ShadeBlack;
+			}
+			else if (attribute & 0x08) {
+				foreground = ShadeBright;
+			}
+			else {
+				foreground = ShadeNormal;
+			}
+
+			bool underline = (attribute & 0x07) == 0x01 && characterHeight >= 2;
+			bool cursor =
+				config.textModeCursorAddress == cellOffset &&
+				config.textModeFirstCursorLine <= config.textModeLastCursorLine &&
+				config.textModeFirstCursorLine < characterHeight;
+
+			auto cell = frame.pixels.data() + (row * characterHeight) * frame.width + column * GlyphWidth;
+
+			for (unsigned int line = 0; line < characterHeight; line++, cell += frame.width) {
+				unsigned int bits = 0;
+
+				if ((underline && line == characterHeight - 2) ||
+					(cursor && line >= config.textModeFirstCursorLine && line <= config.textModeLastCursorLine)) {
+					bits = 0x1FF;
+				}
+				else if (line < glyphLines) {
+					bits = static_cast<unsigned int>(m_font.glyphLine(ch, line)) << 1;
+
+					// Line drawing characters extend their eighth column into the ninth one
+					if (ch >= 0xC0 && ch <= 0xDF) {
+						bits |= (bits >> 1) & 1;
+					}
+				}
+
+				for (unsigned int pixel = 0; pixel < GlyphWidth; pixel++) {
+					cell[pixel] = (bits & (0x100 >> pixel)) ? foreground : background;
+				}
+			}
+		}
+	}
+}
+
+void FrameRenderer::renderGraphicsMode(const VideoAdapter::AdapterConfiguration& config, Frame& frame) const {
+	size_t bankPitch = config.widthPixels / 8;
+	auto dest = frame.pixels.data();
+
+	for (unsigned int line = 0; line < frame.height; line++) {
+		// four interleaved banks of 8 KiB
+		auto source = config.graphicsModeFramebuffer + ((line & 3) << 13) + (line >> 2) * bankPitch;
+
+		for (size_t byte = 0; byte < bankPitch; byte++) {
+			auto value = source[byte];
+
+			for (unsigned int bit = 0; bit < 8; bit++) {
+				*dest++ = (value & (0x80 >> bit)) ? ShadeNormal : ShadeBlack;
+			}
+		}
+	}
+}
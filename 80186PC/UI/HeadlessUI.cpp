@@ -0,0 +1,141 @@
+#include <UI/HeadlessUI.h>
+
+#include <Utils/ImageWriter.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+HeadlessUI::HeadlessUI() : m_videoAdapter(nullptr), m_run(true), m_snapshotInterval(0), m_snapshotPrefix("snapshot"),
+	m_snapshotFormat(SnapshotFormat::PNG), m_frame{}, m_framebufferGeneration(0), m_lastSnapshotValid(false),
+	m_lastSnapshotConfiguration{}, m_snapshotNumber(0) {
+
+}
+
+HeadlessUI::~HeadlessUI() = default;
+
+const char* HeadlessUI::snapshotExtension(SnapshotFormat format) {
+	switch (format) {
+	case SnapshotFormat::PNG:
+		return "png";
+
+	case SnapshotFormat::Raw:
+		return "ppm";
+
+	case SnapshotFormat::Text:
+		return "txt";
+
+	default:
+		throw std::logic_error("unknown snapshot format");
+	}
+}
+
+void HeadlessUI::run() {
+	// Short enough to react to stop() promptly
+	auto pollInterval = std::chrono::milliseconds(100);
+	auto nextSnapshot = std::chrono::steady_clock::now() + m_snapshotInterval;
+
+	while (m_run) {
+		if (m_snapshotInterval.count() == 0) {
+			std::this_thread::sleep_for(pollInterval);
+			continue;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now < nextSnapshot) {
+			std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(nextSnapshot - now, pollInterval));
+			continue;
+		}
+
+		takePeriodicSnapshot();
+
+		// Don't try to catch up on missed snapshots
+		nextSnapshot = std::max(nextSnapshot + m_snapshotInterval, now);
+	}
+}
+
+bool HeadlessUI::snapshot(const std::filesystem::path& path, SnapshotFormat format) {
+	auto video = m_videoAdapter.load();
+	if (!video)
+		return false;
+
+	std::unique_lock<std::mutex> locker(m_renderMutex);
+
+	// Passing 0 leaves the periodic snapshot change tracking alone
+	VideoAdapter::AdapterConfiguration config;
+	video->acquireAdapterConfiguration(config, 0);
+
+	return writeSnapshot(config, path, format);
+}
+
+void HeadlessUI::takePeriodicSnapshot() {
+	auto video = m_videoAdapter.load();
+	if (!video)
+		return;
+
+	std::unique_lock<std::mutex> locker(m_renderMutex);
+
+	VideoAdapter::AdapterConfiguration config;
+	video->acquireAdapterConfiguration(config, m_framebufferGeneration);
+	m_framebufferGeneration = config.framebufferGeneration;
+
+	bool unchanged =
+		m_lastSnapshotValid &&
+		config.changedScanLineBands == 0 &&
+		VideoAdapter::sameDisplayState(m_lastSnapshotConfiguration, config);
+
+	if (unchanged)
+		return;
+
+	auto path = m_snapshotPrefix;
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-%06lu.%s", m_snapshotNumber, snapshotExtension(m_snapshotFormat));
+	path += suffix;
+
+	if (writeSnapshot(config, path, m_snapshotFormat)) {
+		m_snapshotNumber++;
+	}
+
+	m_lastSnapshotConfiguration = config;
+	m_lastSnapshotValid = true;
+}
+
+bool HeadlessUI::writeSnapshot(const VideoAdapter::AdapterConfiguration& config, const std::filesystem::path& path, SnapshotFormat format) {
+	if (!config.videoEnabled || config.widthPixels == 0 || config.heightPixels == 0)
+		return false;
+
+	switch (format) {
+	case SnapshotFormat::PNG:
+		m_renderer.render(config, m_frame);
+		writeIndexedPNG(path, m_frame.width, m_frame.height, m_frame.pixels.data(), FrameRenderer::ShadeColors, FrameRenderer::ShadeCount);
+		break;
+
+	case SnapshotFormat::Raw:
+		m_renderer.render(config, m_frame);
+		writeIndexedPPM(path, m_frame.width, m_frame.height, m_frame.pixels.data(), FrameRenderer::ShadeColors);
+		break;
+
+	case SnapshotFormat::Text:
+	{
+		if (!config.textMode)
+			return false;
+
+		m_textScreen.capture(config);
+		auto text = m_textScreen.text();
+
+		std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+		stream.write(text.data(), text.size());
+		stream.close();
+
+		if (!stream)
+			throw std::runtime_error("unable to write " + path.string());
+
+		break;
+	}
+	}
+
+	return true;
+}
@@ -0,0 +1,202 @@
+#include <UI/HerculesScanout.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HERCULES_SCANOUT_X86
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HERCULES_SCANOUT_TARGET_AVX2
+#else
+#define HERCULES_SCANOUT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+HerculesScanout::HerculesScanout() : m_avx2(isAVX2Supported()), m_scale(0), m_expandLine(nullptr), m_background(0), m_foreground(0) {
+	setScale(1);
+}
+
+HerculesScanout::~HerculesScanout() = default;
+
+void HerculesScanout::setScale(unsigned int scale) {
+	switch (scale) {
+	case 1:
+#if defined(HERCULES_SCANOUT_X86)
+		m_expandLine = m_avx2 ? &HerculesScanout::expandLineAVX2_1x : &HerculesScanout::expandLineSSE2_1x;
+#else
+		m_expandLine = &HerculesScanout::expandLineScalar1x;
+#endif
+		break;
+
+	case 2:
+#if defined(HERCULES_SCANOUT_X86)
+		m_expandLine = m_avx2 ? &HerculesScanout::expandLineAVX2_2x : &HerculesScanout::expandLineSSE2_2x;
+#else
+		m_expandLine = &HerculesScanout::expandLineScalar2x;
+#endif
+		break;
+
+	default:
+		throw std::logic_error("unsupported scan-out scale");
+	}
+
+	m_scale = scale;
+}
+
+void HerculesScanout::scanout(const VideoAdapter::AdapterConfiguration& config, void* pixels, size_t pitch, unsigned int width, unsigned int height,
+	unsigned int firstLine, unsigned int lineCount) const {
+	size_t bankPitch = config.widthPixels / 8;
+
+	// Clip to the destination, it might not be resized yet.
+	auto bytes = std::min<size_t>(bankPitch, width / (8 * m_scale));
+	auto lines = std::min(config.heightPixels, height / m_scale);
+	auto endLine = std::min(lines, firstLine + lineCount);
+	auto dest = static_cast<uint8_t*>(pixels);
+
+	for (unsigned int line = firstLine; line < endLine; line++) {
+		auto source = config.graphicsModeFramebuffer + ((line % BankCount) << BankShift) + (line / BankCount) * bankPitch;
+		auto destLine = dest + line * m_scale * pitch;
+
+		m_expandLine(source, bytes, reinterpret_cast<uint32_t*>(destLine), m_background, m_foreground);
+
+		for (unsigned int copy = 1; copy < m_scale; copy++) {
+			memcpy(destLine + copy * pitch, destLine, bytes * 8 * m_scale * sizeof(uint32_t));
+		}
+	}
+}
+
+bool HerculesScanout::isAVX2Supported() {
+#if defined(HERCULES_SCANOUT_X86)
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// AVX state has to be enabled by the OS as well
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return false;
+
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+#else
+	return false;
+#endif
+}
+
+void HerculesScanout::expandLineScalar1x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground) {
+	for (size_t index = 0; index < bytes; index++) {
+		auto value = source[index];
+
+		for (unsigned int bit = 0; bit < 8; bit++) {
+			*dest++ = (value & (0x80 >> bit)) ? foreground : background;
+		}
+	}
+}
+
+void HerculesScanout::expandLineScalar2x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground) {
+	for (size_t index = 0; index < bytes; index++) {
+		auto value = source[index];
+
+		for (unsigned int bit = 0; bit < 8; bit++) {
+			auto pixel = (value & (0x80 >> bit)) ? foreground : background;
+			*dest++ = pixel;
+			*dest++ = pixel;
+		}
+	}
+}
+
+#if defined(HERCULES_SCANOUT_X86)
+
+/*
+ * The SIMD kernels broadcast each source byte into every lane, isolate one
+ * bit per lane and turn it into an all-ones or all-zeroes mask, which then
+ * selects between the background and foreground colors.
+ */
+
+void HerculesScanout::expandLineSSE2_1x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground) {
+	auto bg = _mm_set1_epi32(static_cast<int>(background));
+	auto difference = _mm_set1_epi32(static_cast<int>(background ^ foreground));
+	auto bits0 = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+	auto bits1 = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+
+	for (size_t index = 0; index < bytes; index++, dest += 8) {
+		auto value = _mm_set1_epi32(source[index]);
+
+		auto mask0 = _mm_cmpeq_epi32(_mm_and_si128(value, bits0), bits0);
+		auto mask1 = _mm_cmpeq_epi32(_mm_and_si128(value, bits1), bits1);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 0), _mm_xor_si128(bg, _mm_and_si128(mask0, difference)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4), _mm_xor_si128(bg, _mm_and_si128(mask1, difference)));
+	}
+}
+
+void HerculesScanout::expandLineSSE2_2x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground) {
+	auto bg = _mm_set1_epi32(static_cast<int>(background));
+	auto difference = _mm_set1_epi32(static_cast<int>(background ^ foreground));
+	auto bits0 = _mm_set_epi32(0x40, 0x40, 0x80, 0x80);
+	auto bits1 = _mm_set_epi32(0x10, 0x10, 0x20, 0x20);
+	auto bits2 = _mm_set_epi32(0x04, 0x04, 0x08, 0x08);
+	auto bits3 = _mm_set_epi32(0x01, 0x01, 0x02, 0x02);
+
+	for (size_t index = 0; index < bytes; index++, dest += 16) {
+		auto value = _mm_set1_epi32(source[index]);
+
+		auto mask0 = _mm_cmpeq_epi32(_mm_and_si128(value, bits0), bits0);
+		auto mask1 = _mm_cmpeq_epi32(_mm_and_si128(value, bits1), bits1);
+		auto mask2 = _mm_cmpeq_epi32(_mm_and_si128(value, bits2), bits2);
+		auto mask3 = _mm_cmpeq_epi32(_mm_and_si128(value, bits3), bits3);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 0), _mm_xor_si128(bg, _mm_and_si128(mask0, difference)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4), _mm_xor_si128(bg, _mm_and_si128(mask1, difference)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 8), _mm_xor_si128(bg, _mm_and_si128(mask2, difference)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 12), _mm_xor_si128(bg, _mm_and_si128(mask3, difference)));
+	}
+}
+
+HERCULES_SCANOUT_TARGET_AVX2 void HerculesScanout::expandLineAVX2_1x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground) {
+	auto bg = _mm256_set1_epi32(static_cast<int>(background));
+	auto difference = _mm256_set1_epi32(static_cast<int>(background ^ foreground));
+	auto bits = _mm256_set_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+
+	for (size_t index = 0; index < bytes; index++, dest += 8) {
+		auto value = _mm256_set1_epi32(source[index]);
+
+		auto mask = _mm256_cmpeq_epi32(_mm256_and_si256(value, bits), bits);
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_xor_si256(bg, _mm256_and_si256(mask, difference)));
+	}
+}
+
+HERCULES_SCANOUT_TARGET_AVX2 void HerculesScanout::expandLineAVX2_2x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground) {
+	auto bg = _mm256_set1_epi32(static_cast<int>(background));
+	auto difference = _mm256_set1_epi32(static_cast<int>(background ^ foreground));
+	auto bits0 = _mm256_set_epi32(0x10, 0x10, 0x20, 0x20, 0x40, 0x40, 0x80, 0x80);
+	auto bits1 = _mm256_set_epi32(0x01, 0x01, 0x02, 0x02, 0x04, 0x04, 0x08, 0x08);
+
+	for (size_t index = 0; index < bytes; index++, dest += 16) {
+		auto value = _mm256_set1_epi32(source[index]);
+
+		auto mask0 = _mm256_cmpeq_epi32(_mm256_and_si256(value, bits0), bits0);
+		auto mask1 = _mm256_cmpeq_epi32(_mm256_and_si256(value, bits1), bits1);
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 0), _mm256_xor_si256(bg, _mm256_and_si256(mask0, difference)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 8), _mm256_xor_si256(bg, _mm256_and_si256(mask1, difference)));
+	}
+}
+
+#endif
@@ -1,4 +1,49 @@
 #include <UI/Keyboard.h>
 
+#include <string.h>
+
+// Characters produced by the keys of a US keyboard, indexed by scancode
+static const char UnshiftedCharacters[] =
+	"\0\x1B" "1234567890-=\b\t"
+	"qwertyuiop[]\r\0"
+	"asdfghjkl;'`\0\\"
+	"zxcvbnm,./\0*\0 ";
+
+static const char ShiftedCharacters[] =
+	"\0\x1B" "!@#$%^&*()_+\b\t"
+	"QWERTYUIOP{}\r\0"
+	"ASDFGHJKL:\"~\0|"
+	"ZXCVBNM<>?\0*\0 ";
+
+static_assert(sizeof(UnshiftedCharacters) == sizeof(ShiftedCharacters), "keyboard tables differ in length");
+
 Keyboard::Keyboard() = default;
 Keyboard::~Keyboard() = default;
+
+bool Keyboard::translateCharacter(char character, Keystroke& keystroke) {
+	if (character == '\n')
+		character = '\r';
+
+	if (character == '\0')
+		return false;
+
+	// Without the terminating NUL
+	constexpr size_t keyCount = sizeof(UnshiftedCharacters) - 1;
+
+	auto key = static_cast<const char*>(memchr(UnshiftedCharacters, character, keyCount));
+	if (key) {
+		keystroke.scancode = static_cast<uint8_t>(key - UnshiftedCharacters);
+		keystroke.shift = false;
+	}
+	else {
+		key = static_cast<const char*>(memchr(ShiftedCharacters, character, keyCount));
+		if (!key)
+			return false;
+
+		keystroke.scancode = static_cast<uint8_t>(key - ShiftedCharacters);
+		keystroke.shift = true;
+	}
+
+	keystroke.character = static_cast<uint8_t>(character);
+	return true;
+}
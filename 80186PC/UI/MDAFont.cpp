@@ -0,0 +1,70 @@
+#include <UI/MDAFont.h>
+
+#include <Utils/WindowsResources.h>
+
+#include <stdexcept>
+
+static uint32_t readLE(const uint8_t* data, unsigned int bytes) {
+	uint32_t value = 0;
+
+	for (unsigned int index = 0; index < bytes; index++) {
+		value |= static_cast<uint32_t>(data[index]) << (index * 8);
+	}
+
+	return value;
+}
+
+MDAFont::MDAFont() : m_glyphHeight(0) {
+	const void* fontBmpData;
+	size_t fontBmpDataSize;
+
+	getRCDATA(2, &fontBmpData, &fontBmpDataSize);
+
+	auto bmp = static_cast<const uint8_t*>(fontBmpData);
+
+	// BITMAPFILEHEADER followed by any of the BITMAPINFOHEADER versions
+	if (fontBmpDataSize < 14 + 40 || bmp[0] != 'B' || bmp[1] != 'M') {
+		throw std::runtime_error("font bitmap is not a BMP file");
+	}
+
+	auto bitsOffset = readLE(bmp + 10, 4);
+	auto headerSize = readLE(bmp + 14, 4);
+	auto width = static_cast<int32_t>(readLE(bmp + 18, 4));
+	auto height = static_cast<int32_t>(readLE(bmp + 22, 4));
+	auto bitsPerPixel = readLE(bmp + 28, 2);
+	auto compression = readLE(bmp + 30, 4);
+
+	bool bottomUp = height > 0;
+	if (height < 0)
+		height = -height;
+
+	if (bitsPerPixel != 1 || compression != 0 || width < 8 || height < static_cast<int32_t>(GlyphCount)) {
+		throw std::runtime_error("unexpected text mode font format");
+	}
+
+	auto paletteOffset = 14 + headerSize;
+	size_t pitch = ((width + 31) / 32) * 4;
+
+	if (paletteOffset + 2 * 4 > fontBmpDataSize || bitsOffset + pitch * height > fontBmpDataSize) {
+		throw std::runtime_error("font bitmap is truncated");
+	}
+
+	// The brighter palette entry is the foreground
+	auto brightness = [&](unsigned int index) {
+		auto entry = bmp + paletteOffset + index * 4;
+		return static_cast<unsigned int>(entry[0]) + entry[1] + entry[2];
+	};
+
+	uint8_t invert = brightness(0) > brightness(1) ? 0xFF : 0x00;
+
+	m_glyphHeight = height / GlyphCount;
+	m_glyphs.resize(GlyphCount * m_glyphHeight);
+
+	for (unsigned int line = 0; line < m_glyphs.size(); line++) {
+		auto row = bottomUp ? height - 1 - line : line;
+
+		m_glyphs[line] = bmp[bitsOffset + row * pitch] ^ invert;
+	}
+}
+
+MDAFont::~MDAFont() = default;
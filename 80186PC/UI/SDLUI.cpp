@@ -1,5 +1,6 @@
 #include <UI/SDLUI.h>
 #include <UI/VideoAdapter.h>
+#include <UI/HerculesScanout.h>
 #include <UI/Keyboard.h>
 #include <UI/Mouse.h>
 
@@ -7,10 +8,13 @@
 
 #include <SDL.h>
 
+#include <algorithm>
+#include <chrono>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 
+// P3 (602 nm)
 const SDLUI::PaletteSpecification SDLUI::m_paletteSpecifications[PaletteCount]{
 	// PaletteIndexAllBlank
 	{ 0x00, 0x00, 0x00,   0x00, 0x00, 0x00 },
@@ -32,11 +36,12 @@ void SDLUI::SDLSurfaceDeleter::operator()(SDL_Surface *surface) const {
 	SDL_FreeSurface(surface);
 }
 
-void SDLUI::SDLPaletteDeleter::operator()(SDL_Palette* palette) const {
-	SDL_FreePalette(palette);
-}
-
-SDLUI::SDLUI() : m_videoAdapter(nullptr), m_keyboard(nullptr), m_mouse(nullptr), m_mouseCaptured(false) {
+SDLUI::SDLUI() : m_videoAdapter(nullptr), m_keyboard(nullptr), m_mouse(nullptr), m_scale(1), m_glyphAtlasFormat(0), m_glyphHeight(0),
+	m_textModeShadowValid(false), m_textModeShadowConfiguration{}, m_textModeShadowSurface(nullptr),
+	m_framebufferGeneration(0), m_graphicsShadowValid(false), m_graphicsShadowConfiguration{}, m_graphicsShadowSurface(nullptr),
+	m_frameSequence(0), m_presentedSequence(0), m_windowPixelFormat(SDL_PIXELFORMAT_RGB888), m_frameReadyEvent(0), m_renderThreadFailedEvent(0),
+	m_runRenderThread(false),
+	m_mouseCaptured(false) {
 	auto result = SDL_InitSubSystem(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
 	if (result < 0) {
 		throw std::runtime_error("SDL_InitSubSystem failed: " + std::string(SDL_GetError()));
@@ -47,22 +52,13 @@ SDLUI::SDLUI() : m_videoAdapter(nullptr), m_keyboard(nullptr), m_mouse(nullptr),
 		throw std::runtime_error("SDL_CreateWindow failed: " + std::string(SDL_GetError()));;
 	}
 
-	for (size_t index = 0; index < sizeof(m_paletteSpecifications) / sizeof(m_paletteSpecifications[0]); index++) {
-		const auto& spec = m_paletteSpecifications[index];
-		auto& palette = m_screenPalettes[index];
-		palette.reset(SDL_AllocPalette(2));
-		if (!palette) {
-			throw std::runtime_error("SDL_AllocPalette failed: " + std::string(SDL_GetError()));;
-		}
-
-		SDL_Color colors[2]{
-			{ spec.bgR, spec.bgG, spec.bgB, 0xFF }, // P3 (602 nm)
-			{ spec.fgR, spec.fgG, spec.fgB, 0xFF }
-		};
-
-		SDL_SetPaletteColors(palette.get(), colors, 0, 2);
+	m_frameReadyEvent = SDL_RegisterEvents(2);
+	if (m_frameReadyEvent == static_cast<uint32_t>(-1)) {
+		throw std::runtime_error("SDL_RegisterEvents failed");
 	}
 
+	m_renderThreadFailedEvent = m_frameReadyEvent + 1;
+
 	const void* fontBmpData;
 	size_t fontBmpDataSize;
 
@@ -79,243 +75,645 @@ SDLUI::SDLUI() : m_videoAdapter(nullptr), m_keyboard(nullptr), m_mouse(nullptr),
 		throw std::runtime_error("SDL_LoadBMP failed: " + std::string(SDL_GetError()));;
 	}
 	m_textModeFont.reset(font);
+
+	auto fontBitsPerPixel = m_textModeFont->format->BitsPerPixel;
+	if (m_textModeFont->w < 8 || m_textModeFont->h < GlyphCount || (fontBitsPerPixel != 1 && fontBitsPerPixel != 8)) {
+		throw std::runtime_error("unexpected text mode font format");
+	}
+
+	m_glyphHeight = m_textModeFont->h / GlyphCount;
 }
 
 SDLUI::~SDLUI() {
+	stopRenderThread();
+
 	SDL_Quit();
 }
 
+void SDLUI::setScale(unsigned int scale) {
+	m_herculesScanout.setScale(scale);
+	m_scale = scale;
+
+	// atlases are pre-scaled
+	m_glyphAtlasFormat = 0;
+}
+
 void SDLUI::run() {
+	// The render thread draws in the pixel format of the window surface
+	auto surface = SDL_GetWindowSurface(m_window.get());
+	if (surface) {
+		m_windowPixelFormat = surface->format->format;
+	}
+
+	startRenderThread();
+
+	try {
+		pumpEvents();
+	}
+	catch (...) {
+		stopRenderThread();
+		throw;
+	}
+
+	stopRenderThread();
+}
+
+void SDLUI::pumpEvents() {
 	SDL_Event ev;
 
-	auto startOfFrame = std::chrono::steady_clock::now();
+	while (SDL_WaitEvent(&ev)) {
+		if (ev.type == m_frameReadyEvent) {
+			if (m_frames.acquire()) {
+				presentFrame(false);
+			}
+
+			continue;
+		}
+
+		if (ev.type == m_renderThreadFailedEvent) {
+			std::rethrow_exception(m_renderThreadError);
+		}
+
+		switch(ev.type) {
+		case SDL_QUIT:
+			return;
+
+		case SDL_MOUSEMOTION:
+			if (m_mouseCaptured) {
+				auto mouse = m_mouse.load();
+				if (mouse)
+					mouse->addDeltas(ev.motion.xrel, ev.motion.yrel);
+			}
+			break;
+		case SDL_MOUSEBUTTONDOWN:
+			if (!m_mouseCaptured) {
+				if (SDL_SetRelativeMouseMode(SDL_TRUE) >= 0) {
+					m_mouseCaptured = true;
+				}
+			} else { 
+				updateMouseButton(ev.button);
+			}
+			break;
+
+
+		case SDL_MOUSEBUTTONUP:
+			if (m_mouseCaptured) {
+				updateMouseButton(ev.button);
+			}
+				
+			break;
+
+		case SDL_KEYDOWN:
+			if (ev.key.keysym.scancode == SDL_SCANCODE_LALT && m_mouseCaptured) {
+				m_mouseCaptured = false;
+
+				SDL_SetRelativeMouseMode(SDL_FALSE);
+			}
+
+			pushKeyboardEvent(ev.key);
+			break;
+
+		case SDL_KEYUP:
+			pushKeyboardEvent(ev.key);
+			break;
+
+		case SDL_WINDOWEVENT:
+			if (ev.window.event == SDL_WINDOWEVENT_EXPOSED || ev.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+				// window contents have to be presented again in full
+				presentFrame(true);
+			}
+			break;
+		}
+	}
+
+	throw std::runtime_error("SDL_WaitEvent failed: " + std::string(SDL_GetError()));
+}
+
+void SDLUI::startRenderThread() {
+	m_runRenderThread = true;
+	m_renderThread = std::thread(&SDLUI::renderThread, this);
+}
+
+void SDLUI::stopRenderThread() {
+	{
+		std::unique_lock<std::mutex> locker(m_renderThreadMutex);
+		m_runRenderThread = false;
+	}
+
+	m_renderThreadCondvar.notify_all();
+
+	if (m_renderThread.joinable()) {
+		m_renderThread.join();
+	}
+}
+
+void SDLUI::renderThread() {
 	auto frameDuration = std::chrono::nanoseconds(16666666); // 60 Hz
+	auto nextFrame = std::chrono::steady_clock::now();
+
+	try {
+		std::unique_lock<std::mutex> locker(m_renderThreadMutex);
+
+		while (m_runRenderThread) {
+			locker.unlock();
+			renderFrame();
+			locker.lock();
+
+			// Don't try to catch up on missed frames
+			nextFrame = std::max(nextFrame + frameDuration, std::chrono::steady_clock::now());
+
+			m_renderThreadCondvar.wait_until(locker, nextFrame, [this]() { return !m_runRenderThread; });
+		}
+	}
+	catch (...) {
+		// Thrown again on the main thread, by pumpEvents()
+		m_renderThreadError = std::current_exception();
+
+		SDL_Event ev{};
+		ev.type = m_renderThreadFailedEvent;
+		SDL_PushEvent(&ev);
+	}
+}
+
+void SDLUI::renderFrame() {
+	auto video = m_videoAdapter.load();
+	if (!video)
+		return;
+
+	VideoAdapter::AdapterConfiguration config;
+	video->acquireAdapterConfiguration(config, m_framebufferGeneration);
+	m_framebufferGeneration = config.framebufferGeneration;
+
+	if (!config.videoEnabled) {
+		m_textModeShadowValid = false;
+		m_graphicsShadowValid = false;
+		return;
+	}
+
+	int width = config.widthPixels * m_scale;
+	int height = config.heightPixels * m_scale;
+	if (width == 0 || height == 0)
+		return;
+
+	auto format = m_windowPixelFormat.load();
+	if (SDL_BYTESPERPIXEL(format) != sizeof(uint32_t)) {
+		// SDL will convert when presenting
+		format = SDL_PIXELFORMAT_RGB888;
+	}
+
+	if (!m_canvas || m_canvas->w != width || m_canvas->h != height || m_canvas->format->format != format) {
+		m_canvas = createFrameSurface(width, height, format);
+		m_textModeShadowValid = false;
+		m_graphicsShadowValid = false;
+	}
+
+	if (config.textMode) {
+		m_graphicsShadowValid = false;
+
+		renderTextMode(config, m_canvas.get());
+	}
+	else {
+		m_textModeShadowValid = false;
+
+		renderGraphicsMode(config, m_canvas.get());
+	}
+
+	if (!m_dirtyRects.empty()) {
+		publishFrame();
+	}
+}
+
+void SDLUI::publishFrame() {
+	auto sequence = ++m_frameSequence;
+
+	m_damageHistory.emplace_back(sequence, m_dirtyRects);
+	while (m_damageHistory.size() > DamageHistoryLength) {
+		m_damageHistory.pop_front();
+	}
+
+	auto canvas = m_canvas.get();
+	auto& frame = m_frames.back();
 
-	while(true) {
-		while(SDL_PollEvent(&ev)) {
-			switch(ev.type) {
-			case SDL_QUIT:
-				return;
-
-			case SDL_MOUSEMOTION:
-				if (m_mouseCaptured) {
-					auto mouse = m_mouse.load();
-					if (mouse)
-						mouse->addDeltas(ev.motion.xrel, ev.motion.yrel);
+	if (!frame.surface || frame.surface->w != canvas->w || frame.surface->h != canvas->h || frame.surface->format->format != canvas->format->format) {
+		frame.surface = createFrameSurface(canvas->w, canvas->h, canvas->format->format);
+		frame.sequence = 0;
+	}
+
+	// The buffer handed back might be a few frames behind the canvas
+	if (frame.sequence == 0 || frame.sequence + 1 < m_damageHistory.front().first) {
+		if (SDL_BlitSurface(canvas, nullptr, frame.surface.get(), nullptr) < 0) {
+			throw std::runtime_error("SDL_BlitSurface failed: " + std::string(SDL_GetError()));
+		}
+	}
+	else {
+		for (const auto& entry : m_damageHistory) {
+			if (entry.first <= frame.sequence)
+				continue;
+
+			for (auto rect : entry.second) {
+				auto destination = rect;
+
+				if (SDL_BlitSurface(canvas, &rect, frame.surface.get(), &destination) < 0) {
+					throw std::runtime_error("SDL_BlitSurface failed: " + std::string(SDL_GetError()));
 				}
-				break;
-			case SDL_MOUSEBUTTONDOWN:
-				if (!m_mouseCaptured) {
-					if (SDL_SetRelativeMouseMode(SDL_TRUE) >= 0) {
-						m_mouseCaptured = true;
+			}
+		}
+	}
+
+	frame.sequence = sequence;
+	frame.damage = m_dirtyRects;
+
+	m_frames.publish();
+
+	SDL_Event ev{};
+	ev.type = m_frameReadyEvent;
+	SDL_PushEvent(&ev);
+}
+
+void SDLUI::presentFrame(bool full) {
+	auto& frame = m_frames.front();
+	if (!frame.surface)
+		return;
+
+	int currentWidth, currentHeight;
+
+	SDL_GetWindowSize(m_window.get(), &currentWidth, &currentHeight);
+
+	if (currentWidth != frame.surface->w || currentHeight != frame.surface->h) {
+		printf("SDLUI: resizing window from %dx%d to %dx%d\n",
+			currentWidth, currentHeight, frame.surface->w, frame.surface->h);
+
+		SDL_SetWindowSize(m_window.get(), frame.surface->w, frame.surface->h);
+		full = true;
+	}
+
+	auto surface = SDL_GetWindowSurface(m_window.get());
+	if (!surface)
+		return;
+
+	m_windowPixelFormat = surface->format->format;
+
+	// Damage of skipped frames is not known here
+	if (full || frame.sequence != m_presentedSequence + 1) {
+		SDL_BlitSurface(frame.surface.get(), nullptr, surface, nullptr);
+		SDL_UpdateWindowSurface(m_window.get());
+	}
+	else {
+		for (auto rect : frame.damage) {
+			auto destination = rect;
+
+			SDL_BlitSurface(frame.surface.get(), &rect, surface, &destination);
+		}
+
+		SDL_UpdateWindowSurfaceRects(m_window.get(), frame.damage.data(), static_cast<int>(frame.damage.size()));
+	}
+
+	m_presentedSequence = frame.sequence;
+}
+
+std::unique_ptr<SDL_Surface, SDLUI::SDLSurfaceDeleter> SDLUI::createFrameSurface(int width, int height, uint32_t format) {
+	std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> surface(SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, format));
+	if (!surface) {
+		throw std::runtime_error("SDL_CreateRGBSurfaceWithFormat failed: " + std::string(SDL_GetError()));
+	}
+
+	// Frames are copied as they are, even if the format has alpha
+	SDL_SetSurfaceBlendMode(surface.get(), SDL_BLENDMODE_NONE);
+
+	return surface;
+}
+
+unsigned int SDLUI::selectTextModePalette(uint8_t attribute) {
+	if ((attribute & 0x77) == 0x00) {
+		// all black/blank
+
+		return PaletteIndexAllBlank;
+	}
+	else if ((attribute & 0x77) == 0x70) {
+		// inverse video
+
+		if ((attribute & 0x80)) {
+			// bright background
+
+			return PaletteIndexBlankOnBright;
+		}
+		else {
+			return PaletteIndexBlankOnDim;
+		}
+	}
+	else if (attribute & 0x08) {
+		return PaletteIndexBrightOnBlank;
+	}
+	else {
+		return PaletteIndexDimOnBlank;
+	}
+}
+
+void SDLUI::buildGlyphAtlases(const SDL_PixelFormat* format) {
+	auto font = m_textModeFont.get();
+
+	if (SDL_MUSTLOCK(font) && SDL_LockSurface(font) < 0) {
+		throw std::runtime_error("SDL_LockSurface failed: " + std::string(SDL_GetError()));
+	}
+
+	for (size_t index = 0; index < PaletteCount; index++) {
+		const auto& spec = m_paletteSpecifications[index];
+		auto& colors = m_glyphAtlasColors[index];
+		auto& atlas = m_glyphAtlases[index];
+
+		colors[0] = SDL_MapRGB(format, spec.bgR, spec.bgG, spec.bgB);
+		colors[1] = SDL_MapRGB(format, spec.fgR, spec.fgG, spec.fgB);
+
+		auto cellWidth = GlyphWidth * m_scale;
+
+		atlas.resize(GlyphCount * m_glyphHeight * m_scale * cellWidth);
+
+		auto pixel = atlas.data();
+
+		for (unsigned int ch = 0; ch < GlyphCount; ch++) {
+			for (unsigned int line = 0; line < m_glyphHeight; line++) {
+				auto fontLine = static_cast<const uint8_t*>(font->pixels) + (ch * m_glyphHeight + line) * font->pitch;
+				uint8_t bits = 0;
+
+				if (font->format->BitsPerPixel == 1) {
+					bits = fontLine[0];
+				}
+				else {
+					// SDL expands 1-bit images into 8-bit indexed surfaces on load
+					for (unsigned int column = 0; column < 8; column++) {
+						bits = (bits << 1) | (fontLine[column] & 1);
 					}
-				} else { 
-					updateMouseButton(ev.button);
 				}
-				break;
 
+				auto lineStart = pixel;
 
-			case SDL_MOUSEBUTTONUP:
-				if (m_mouseCaptured) {
-					updateMouseButton(ev.button);
+				for (unsigned int column = 0; column < 8; column++) {
+					pixel = std::fill_n(pixel, m_scale, colors[(bits >> (7 - column)) & 1]);
 				}
-					
-				break;
 
-			case SDL_KEYDOWN:
-				if (ev.key.keysym.scancode == SDL_SCANCODE_LALT && m_mouseCaptured) {
-					m_mouseCaptured = false;
+				// Line drawing characters extend their eighth column into the ninth one
+				if (ch >= 0xC0 && ch <= 0xDF) {
+					pixel = std::fill_n(pixel, m_scale, colors[bits & 1]);
+				}
+				else {
+					pixel = std::fill_n(pixel, m_scale, colors[0]);
+				}
 
-					SDL_SetRelativeMouseMode(SDL_FALSE);
+				for (unsigned int copy = 1; copy < m_scale; copy++) {
+					pixel = std::copy(lineStart, lineStart + cellWidth, pixel);
 				}
+			}
+		}
+	}
+
+	if (SDL_MUSTLOCK(font)) {
+		SDL_UnlockSurface(font);
+	}
 
-				pushKeyboardEvent(ev.key);
-				break;
+	m_glyphAtlasFormat = format->format;
+}
+
+void SDLUI::renderTextMode(const VideoAdapter::AdapterConfiguration& config, SDL_Surface* surface) {
+	if (surface->format->BytesPerPixel != sizeof(uint32_t)) {
+		throw std::runtime_error("unsupported window surface format");
+	}
 
-			case SDL_KEYUP:
-				pushKeyboardEvent(ev.key);
-				break;
+	m_dirtyRects.clear();
+
+	if (m_glyphAtlasFormat != surface->format->format) {
+		buildGlyphAtlases(surface->format);
+		m_textModeShadowValid = false;
+	}
+
+	if (!textModeShadowMatches(config, surface)) {
+		m_textModeShadowValid = false;
+	}
+
+	auto cellWidth = GlyphWidth * m_scale;
+	auto cellHeight = config.textModeCharacterHeight * m_scale;
+
+	// Only draw the cells that fit into the surface completely, window might not be resized yet.
+	auto columns = std::min<unsigned int>(config.textModeColumns, surface->w / cellWidth);
+	auto rows = cellHeight == 0 ? 0 : std::min<unsigned int>(config.textModeRows, surface->h / cellHeight);
+
+	auto cellBytes = config.textModeColumns * config.textModeRows * 2;
+
+	bool cursorMoved =
+		m_textModeShadowConfiguration.textModeCursorAddress != config.textModeCursorAddress ||
+		m_textModeShadowConfiguration.textModeFirstCursorLine != config.textModeFirstCursorLine ||
+		m_textModeShadowConfiguration.textModeLastCursorLine != config.textModeLastCursorLine;
+
+	// The framebuffer start might have moved without any writes
+	bool unchanged =
+		config.changedScanLineBands == 0 &&
+		m_textModeShadowConfiguration.textModeFramebuffer == config.textModeFramebuffer;
+
+	if (m_textModeShadowValid && !cursorMoved &&
+		(unchanged || memcmp(m_textModeShadow.data(), config.textModeFramebuffer, cellBytes) == 0)) {
+		return;
+	}
+
+	if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0) {
+		throw std::runtime_error("SDL_LockSurface failed: " + std::string(SDL_GetError()));
+	}
+
+	if (!m_textModeShadowValid) {
+		for (unsigned int row = 0; row < rows; row++) {
+			for (unsigned int column = 0; column < columns; column++) {
+				drawTextModeCell(config, surface, row, column);
 			}
 		}
 
-		auto video = m_videoAdapter.load();
-		if (video) {
-			VideoAdapter::AdapterConfiguration config;
-			video->acquireAdapterConfiguration(config);
-			if (config.videoEnabled) {
-				int currentWidth, currentHeight;
+		addDirtyRect(0, 0, columns * cellWidth, rows * cellHeight);
+	}
+	else {
+		auto oldCursorCell = m_textModeShadowConfiguration.textModeCursorAddress / 2;
+		auto newCursorCell = config.textModeCursorAddress / 2;
 
-				SDL_GetWindowSize(m_window.get(), &currentWidth, &currentHeight);
+		for (unsigned int row = 0; row < rows; row++) {
+			auto rowOffset = row * config.textModeColumns;
+			unsigned int spanStart = 0;
+			unsigned int spanLength = 0;
 
-				if (currentWidth != config.widthPixels || currentHeight != config.heightPixels) {
-					printf("SDLUI: resizing window from %dx%d to %ux%u\n",
-						currentWidth, currentHeight, config.widthPixels, config.heightPixels);
+			for (unsigned int column = 0; column < columns; column++) {
+				auto cellIndex = rowOffset + column;
+				bool dirty =
+					memcmp(&m_textModeShadow[cellIndex * 2], config.textModeFramebuffer + cellIndex * 2, 2) != 0 ||
+					(cursorMoved && (cellIndex == oldCursorCell || cellIndex == newCursorCell));
 
-					SDL_SetWindowSize(m_window.get(), config.widthPixels, config.heightPixels);
-				}
+				if (dirty) {
+					drawTextModeCell(config, surface, row, column);
 
-				auto surface = SDL_GetWindowSurface(m_window.get());
-
-				if (config.textMode) {
-					auto begin = config.textModeFramebuffer;
-					auto ptr = config.textModeFramebuffer;
-					
-					for (unsigned int row = 0; row < config.textModeRows; row++) {
-						for (unsigned int column = 0; column < config.textModeColumns; column++) {
-							auto ch = *ptr++;
-							auto attribute = *ptr++;
-
-							auto x = column * 9;
-							auto y = row * config.textModeCharacterHeight;
-
-							unsigned int palette;
-
-							if ((attribute & 0x77) == 0x00) {
-								// all black/blank
-
-								palette = PaletteIndexAllBlank;
-							}
-							else if ((attribute & 0x77) == 0x70) {
-								// inverse video
-
-								if ((attribute & 0x80)) {
-									// bright background
-
-									palette = PaletteIndexBlankOnBright;
-								}
-								else {
-									palette = PaletteIndexBlankOnDim;
-								}
-							}
-							else if (attribute & 0x08) {
-								palette = PaletteIndexBrightOnBlank;
-							}
-							else {
-								palette = PaletteIndexDimOnBlank;
-							}
-
-							SDL_SetSurfacePalette(m_textModeFont.get(), m_screenPalettes[palette].get());
-
-							SDL_Rect src, dst;
-
-							src.x = 0;
-							src.y = config.textModeCharacterHeight * ch;
-							src.w = 8;
-							src.h = config.textModeCharacterHeight;
-
-							dst.x = x;
-							dst.y = y;
-							dst.w = 8;
-							dst.h = config.textModeCharacterHeight;
-
-							SDL_BlitSurface(
-								m_textModeFont.get(),
-								&src,
-								surface,
-								&dst
-							);
-
-							src.x = 7;
-							src.w = 1;
-							dst.x = x + 8;
-							dst.w = 1;
-
-							if (ch >= 0xC0 && ch <= 0xDF) {
-								SDL_BlitSurface(
-									m_textModeFont.get(),
-									&src,
-									surface,
-									&dst
-								);
-							}
-							else {
-								auto bg = SDL_MapRGB(surface->format,
-									m_screenPalettes[palette]->colors[0].r,
-									m_screenPalettes[palette]->colors[0].g,
-									m_screenPalettes[palette]->colors[0].b);
-
-								SDL_FillRect(
-									surface,
-									&dst,
-									bg
-								);
-							}
-
-							auto fg = SDL_MapRGB(surface->format,
-								m_screenPalettes[palette]->colors[1].r,
-								m_screenPalettes[palette]->colors[1].g,
-								m_screenPalettes[palette]->colors[1].b);
-
-							if ((attribute & 0x07) == 0x01) {
-								// underlined
-
-								dst.x = x;
-								dst.y = y + config.textModeCharacterHeight - 2;
-								dst.w = 9;
-								dst.h = 1;
-
-								SDL_FillRect(
-									surface,
-									&dst,
-									fg
-								);
-							}
-
-							if ((config.textModeCursorAddress + 2) == (ptr - begin) && config.textModeFirstCursorLine <= config.textModeLastCursorLine) {
-								dst.x = x;
-								dst.y = y + config.textModeFirstCursorLine;
-								dst.w = 9;
-								dst.h = config.textModeLastCursorLine - config.textModeFirstCursorLine + 1;
-
-								SDL_FillRect(
-									surface,
-									&dst,
-									fg
-								);
-							}
-						}
+					if (spanLength == 0) {
+						spanStart = column;
 					}
+					spanLength++;
 				}
-				else {
-					if (!m_graphicsSurface || m_graphicsSurface->w != config.widthPixels || m_graphicsSurface->h != config.heightPixels) {
-						// explicitly allocate framebuffer to ensure tightly packed rows
-						m_graphicsSurface.reset();
-						m_graphicsSurfaceData.resize(config.widthPixels / 8 * config.heightPixels);
-						m_graphicsSurface.reset(SDL_CreateRGBSurfaceWithFormatFrom(m_graphicsSurfaceData.data(), config.widthPixels, config.heightPixels, 1, config.widthPixels / 8, SDL_PIXELFORMAT_INDEX1MSB));
-						SDL_SetSurfacePalette(m_graphicsSurface.get(), m_screenPalettes[PaletteIndexDimOnBlank].get());
-					}
+				else if (spanLength != 0) {
+					addDirtyRect(spanStart * cellWidth, row * cellHeight, spanLength * cellWidth, cellHeight);
+					spanLength = 0;
+				}
+			}
 
-					linearizeHerculesVideo(config, m_graphicsSurfaceData.data());
+			if (spanLength != 0) {
+				addDirtyRect(spanStart * cellWidth, row * cellHeight, spanLength * cellWidth, cellHeight);
+			}
+		}
+	}
 
-					SDL_Rect rect;
-					rect.x = 0;
-					rect.y = 0;
-					rect.w = config.widthPixels;
-					rect.h = config.heightPixels;
+	if (SDL_MUSTLOCK(surface)) {
+		SDL_UnlockSurface(surface);
+	}
 
-					SDL_BlitSurface(m_graphicsSurface.get(), &rect, surface, &rect);
-				}
+	m_textModeShadow.assign(config.textModeFramebuffer, config.textModeFramebuffer + cellBytes);
+	m_textModeShadowConfiguration = config;
+	m_textModeShadowSurface = surface;
+	m_textModeShadowValid = true;
+}
 
-				SDL_UpdateWindowSurface(m_window.get());
-			}
+void SDLUI::drawTextModeCell(const VideoAdapter::AdapterConfiguration& config, SDL_Surface* surface, unsigned int row, unsigned int column) {
+	auto characterHeight = config.textModeCharacterHeight;
+	auto cellWidth = GlyphWidth * m_scale;
+	auto cellHeight = characterHeight * m_scale;
+	auto glyphLines = std::min(characterHeight, m_glyphHeight) * m_scale;
+
+	auto cellOffset = (row * config.textModeColumns + column) * 2;
+	auto ch = config.textModeFramebuffer[cellOffset];
+	auto attribute = config.textModeFramebuffer[cellOffset + 1];
+	auto palette = selectTextModePalette(attribute);
+	const auto& colors = m_glyphAtlasColors[palette];
+
+	auto glyph = m_glyphAtlases[palette].data() + ch * m_glyphHeight * m_scale * cellWidth;
+	auto cellPixels = static_cast<uint8_t*>(surface->pixels) + row * cellHeight * surface->pitch + column * cellWidth * sizeof(uint32_t);
+	auto dest = cellPixels;
+
+	for (unsigned int line = 0; line < cellHeight; line++, dest += surface->pitch) {
+		auto destLine = reinterpret_cast<uint32_t*>(dest);
+
+		if (line < glyphLines) {
+			memcpy(destLine, glyph + line * cellWidth, cellWidth * sizeof(uint32_t));
+		}
+		else {
+			std::fill(destLine, destLine + cellWidth, colors[0]);
+		}
+	}
+
+	auto fillLines = [&](unsigned int firstLine, unsigned int lastLine) {
+		for (auto line = firstLine * m_scale; line < (lastLine + 1) * m_scale; line++) {
+			auto destLine = reinterpret_cast<uint32_t*>(cellPixels + line * surface->pitch);
+			std::fill(destLine, destLine + cellWidth, colors[1]);
 		}
+	};
+
+	if ((attribute & 0x07) == 0x01 && characterHeight >= 2) {
+		// underlined
+
+		fillLines(characterHeight - 2, characterHeight - 2);
+	}
+
+	if (config.textModeCursorAddress == cellOffset &&
+		config.textModeFirstCursorLine <= config.textModeLastCursorLine &&
+		config.textModeFirstCursorLine < characterHeight) {
+
+		fillLines(config.textModeFirstCursorLine, std::min(config.textModeLastCursorLine, characterHeight - 1));
+	}
+}
 
-		auto endOfFrame = std::chrono::steady_clock::now();
+bool SDLUI::textModeShadowMatches(const VideoAdapter::AdapterConfiguration& config, const SDL_Surface* surface) const {
+	const auto& shadow = m_textModeShadowConfiguration;
+
+	return
+		m_textModeShadowSurface == surface &&
+		shadow.widthPixels == config.widthPixels &&
+		shadow.heightPixels == config.heightPixels &&
+		shadow.textModeColumns == config.textModeColumns &&
+		shadow.textModeRows == config.textModeRows &&
+		shadow.textModeCharacterHeight == config.textModeCharacterHeight;
+}
 
-		std::this_thread::sleep_until(startOfFrame + frameDuration);
-		startOfFrame = endOfFrame;
+void SDLUI::addDirtyRect(int x, int y, int w, int h) {
+	if (w <= 0 || h <= 0)
+		return;
 
-	} 
+	SDL_Rect rect;
+	rect.x = x;
+	rect.y = y;
+	rect.w = w;
+	rect.h = h;
+	m_dirtyRects.emplace_back(rect);
 }
 
-void SDLUI::linearizeHerculesVideo(const VideoAdapter::AdapterConfiguration& config, unsigned char* data) {
-	unsigned int pitch = config.widthPixels / 8;
+void SDLUI::renderGraphicsMode(const VideoAdapter::AdapterConfiguration& config, SDL_Surface* surface) {
+	if (surface->format->BytesPerPixel != sizeof(uint32_t)) {
+		throw std::runtime_error("unsupported window surface format");
+	}
+
+	m_dirtyRects.clear();
 
-	for (unsigned int dstrow = 0; dstrow < config.heightPixels; dstrow++) {
-		auto srcData = config.graphicsModeFramebuffer + ((dstrow & 3) << 13) + ((dstrow >> 2) * 90);
+	if (m_glyphAtlasFormat != surface->format->format) {
+		buildGlyphAtlases(surface->format);
+		m_graphicsShadowValid = false;
+	}
 
-		memcpy(data + dstrow * pitch, srcData, pitch);
+	if (!graphicsShadowMatches(config, surface)) {
+		m_graphicsShadowValid = false;
 	}
+
+	auto bands = m_graphicsShadowValid ? config.changedScanLineBands : VideoAdapter::AllScanLineBands;
+	if (bands == 0) {
+		return;
+	}
+
+	const auto& colors = m_glyphAtlasColors[PaletteIndexDimOnBlank];
+	m_herculesScanout.setColors(colors[0], colors[1]);
+
+	if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0) {
+		throw std::runtime_error("SDL_LockSurface failed: " + std::string(SDL_GetError()));
+	}
+
+	auto lines = std::min<unsigned int>(config.heightPixels, surface->h / m_scale);
+	auto width = std::min<unsigned int>(config.widthPixels * m_scale, surface->w);
+
+	// Convert runs of adjacent changed bands at once
+	unsigned int band = 0;
+	while (band < VideoAdapter::ScanLineBandCount) {
+		if ((bands & (static_cast<uint64_t>(1) << band)) == 0) {
+			band++;
+			continue;
+		}
+
+		auto firstBand = band;
+		while (band < VideoAdapter::ScanLineBandCount && (bands & (static_cast<uint64_t>(1) << band)) != 0) {
+			band++;
+		}
+
+		auto firstLine = firstBand * VideoAdapter::ScanLineBandHeight;
+		auto endLine = band == VideoAdapter::ScanLineBandCount ? lines : std::min(lines, band * VideoAdapter::ScanLineBandHeight);
+		if (firstLine >= endLine)
+			break;
+
+		m_herculesScanout.scanout(config, surface->pixels, surface->pitch, surface->w, surface->h, firstLine, endLine - firstLine);
+
+		addDirtyRect(0, firstLine * m_scale, width, (endLine - firstLine) * m_scale);
+	}
+
+	if (SDL_MUSTLOCK(surface)) {
+		SDL_UnlockSurface(surface);
+	}
+
+	m_graphicsShadowConfiguration = config;
+	m_graphicsShadowSurface = surface;
+	m_graphicsShadowValid = true;
+}
+
+bool SDLUI::graphicsShadowMatches(const VideoAdapter::AdapterConfiguration& config, const SDL_Surface* surface) const {
+	const auto& shadow = m_graphicsShadowConfiguration;
+
+	return
+		m_graphicsShadowSurface == surface &&
+		shadow.widthPixels == config.widthPixels &&
+		shadow.heightPixels == config.heightPixels &&
+		shadow.graphicsModeFramebuffer == config.graphicsModeFramebuffer;
 }
 
 void SDLUI::pushKeyboardEvent(const SDL_KeyboardEvent& ev) {
@@ -0,0 +1,236 @@
+#include <UI/ScreenRecorder.h>
+#include <UI/ScreenRecording.h>
+
+#include <Utils/FrameDelta.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+static void appendLE(std::vector<uint8_t>& data, uint64_t value, unsigned int size) {
+	for (unsigned int index = 0; index < size; index++)
+		data.push_back(static_cast<uint8_t>(value >> (8 * index)));
+}
+
+ScreenRecorder::ScreenRecorder() : m_videoAdapter(nullptr), m_format(Format::Delta), m_frameRate(DefaultFrameRate), m_run(false),
+	m_frame{}, m_previousWidth(0), m_previousHeight(0), m_framesSinceKeyFrame(0), m_streamWidth(0), m_streamHeight(0),
+	m_framesWritten(0) {
+
+}
+
+ScreenRecorder::~ScreenRecorder() {
+	stop();
+}
+
+void ScreenRecorder::start(const std::filesystem::path& path, Format format, unsigned int frameRate) {
+	if (m_run)
+		throw std::logic_error("the screen is already being recorded");
+
+	if (frameRate == 0)
+		throw std::logic_error("the frame rate must not be zero");
+
+	m_stream.open(path, std::ios::binary | std::ios::trunc);
+	if (!m_stream)
+		throw std::runtime_error("unable to create " + path.string());
+
+	m_format = format;
+	m_frameRate = frameRate;
+	m_previousWidth = 0;
+	m_previousHeight = 0;
+	m_framesSinceKeyFrame = 0;
+	m_streamWidth = 0;
+	m_streamHeight = 0;
+	m_framesWritten = 0;
+
+	if (format == Format::Delta) {
+		std::vector<uint8_t> header(ScreenRecording::Magic, ScreenRecording::Magic + sizeof(ScreenRecording::Magic));
+		appendLE(header, ScreenRecording::Version, 2);
+		appendLE(header, FrameRenderer::ShadeCount, 2);
+
+		for (const auto& color : FrameRenderer::ShadeColors)
+			header.insert(header.end(), color, color + 3);
+
+		write(header.data(), header.size());
+	}
+
+	m_run = true;
+	m_thread = std::thread(&ScreenRecorder::recordingThread, this);
+
+	printf("Recording the screen to %s\n", path.string().c_str());
+}
+
+void ScreenRecorder::stop() {
+	m_run = false;
+
+	if (m_thread.joinable())
+		m_thread.join();
+
+	if (m_stream.is_open())
+		m_stream.close();
+}
+
+void ScreenRecorder::recordingThread() {
+	auto frameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(1)) / m_frameRate;
+	auto recordingStart = std::chrono::steady_clock::now();
+	auto streamStart = recordingStart;
+	auto nextFrame = recordingStart;
+
+	uint64_t generation = 0;
+	VideoAdapter::AdapterConfiguration lastConfig{};
+	bool haveFrame = false;
+
+	try {
+		while (m_run) {
+			std::this_thread::sleep_until(nextFrame);
+
+			auto video = m_videoAdapter.load();
+			if (!video) {
+				nextFrame = std::chrono::steady_clock::now() + frameInterval;
+				continue;
+			}
+
+			// Unchanged frames aren't stored, so there is no point in looking before something is written
+			if (m_format == Format::Delta && haveFrame)
+				video->waitForFramebufferWrites(generation, std::chrono::steady_clock::now() + ConfigurationRecheckInterval);
+
+			VideoAdapter::AdapterConfiguration config;
+			video->acquireAdapterConfiguration(config, generation);
+			generation = config.framebufferGeneration;
+
+			bool changed = !haveFrame || config.changedScanLineBands != 0 || !VideoAdapter::sameDisplayState(lastConfig, config);
+			if (changed) {
+				m_renderer.render(config, m_frame);
+				lastConfig = config;
+				haveFrame = true;
+			}
+
+			auto now = std::chrono::steady_clock::now();
+
+			if (m_frame.width == 0 || m_frame.height == 0) {
+				// Nothing on screen yet
+				nextFrame = now + frameInterval;
+				continue;
+			}
+
+			if (m_format == Format::Delta) {
+				if (changed)
+					writeDeltaFrame(std::chrono::duration_cast<std::chrono::microseconds>(now - recordingStart).count());
+
+				nextFrame = now + frameInterval;
+				continue;
+			}
+
+			if (m_streamWidth == 0) {
+				startConstantRateStream();
+				streamStart = now;
+				nextFrame = now;
+				changed = true;
+			}
+
+			if (changed)
+				updateGrayFrame();
+
+			// Repeat the frame for any intervals missed, so the stream keeps in step with real time
+			uint64_t framesDue = (now - streamStart) / frameInterval + 1;
+			while (m_framesWritten < framesDue && m_run)
+				writeGrayFrame();
+
+			nextFrame += frameInterval;
+		}
+
+		m_stream.flush();
+		if (!m_stream)
+			throw std::runtime_error("unable to write the screen recording");
+	}
+	catch (const std::exception& e) {
+		printf("Screen recording stopped: %s\n", e.what());
+	}
+}
+
+void ScreenRecorder::writeDeltaFrame(uint64_t timestamp) {
+	ScreenRecording::packPlanes(m_frame, m_planes);
+
+	uint8_t flags = 0;
+	if (m_frame.width != m_previousWidth || m_frame.height != m_previousHeight || m_framesSinceKeyFrame + 1 >= KeyFrameInterval) {
+		// Key frames start over from blank planes, which allows seeking
+		m_previousPlanes.assign(m_planes.size(), 0);
+		m_previousWidth = m_frame.width;
+		m_previousHeight = m_frame.height;
+		m_framesSinceKeyFrame = 0;
+		flags |= ScreenRecording::FrameKey;
+	}
+	else {
+		m_framesSinceKeyFrame++;
+	}
+
+	m_payload.clear();
+	encodeFrameDelta(m_previousPlanes.data(), m_planes.data(), m_planes.size(), m_payload);
+
+	std::vector<uint8_t> header;
+	header.reserve(ScreenRecording::FrameHeaderSize);
+	appendLE(header, m_payload.size(), 4);
+	appendLE(header, timestamp, 8);
+	appendLE(header, m_frame.width, 2);
+	appendLE(header, m_frame.height, 2);
+	header.push_back(flags);
+
+	write(header.data(), header.size());
+	write(m_payload.data(), m_payload.size());
+
+	m_previousPlanes.swap(m_planes);
+}
+
+void ScreenRecorder::startConstantRateStream() {
+	m_streamWidth = m_frame.width;
+	m_streamHeight = m_frame.height;
+	m_grayFrame.assign(static_cast<size_t>(m_streamWidth) * m_streamHeight, 0);
+
+	if (m_format == Format::Y4M) {
+		char header[128];
+		auto length = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 Cmono\n", m_streamWidth, m_streamHeight, m_frameRate);
+		write(header, length);
+	}
+	else {
+		printf("Raw screen recording is %ux%u 8 bit grayscale at %u frames per second\n", m_streamWidth, m_streamHeight, m_frameRate);
+	}
+}
+
+void ScreenRecorder::updateGrayFrame() {
+	// Rec. 601 luma of the shade colors
+	uint8_t luma[FrameRenderer::ShadeCount];
+	for (unsigned int shade = 0; shade < FrameRenderer::ShadeCount; shade++) {
+		const auto* color = FrameRenderer::ShadeColors[shade];
+		luma[shade] = static_cast<uint8_t>((299 * color[0] + 587 * color[1] + 114 * color[2] + 500) / 1000);
+	}
+
+	std::fill(m_grayFrame.begin(), m_grayFrame.end(), luma[FrameRenderer::ShadeBlack]);
+
+	auto width = std::min(m_streamWidth, m_frame.width);
+	auto height = std::min(m_streamHeight, m_frame.height);
+
+	for (unsigned int y = 0; y < height; y++) {
+		auto source = m_frame.pixels.data() + static_cast<size_t>(y) * m_frame.width;
+		auto destination = m_grayFrame.data() + static_cast<size_t>(y) * m_streamWidth;
+
+		for (unsigned int x = 0; x < width; x++)
+			destination[x] = luma[source[x]];
+	}
+}
+
+void ScreenRecorder::writeGrayFrame() {
+	if (m_format == Format::Y4M) {
+		static const char frameHeader[] = "FRAME\n";
+		write(frameHeader, sizeof(frameHeader) - 1);
+	}
+
+	write(m_grayFrame.data(), m_grayFrame.size());
+	m_framesWritten++;
+}
+
+void ScreenRecorder::write(const void* data, size_t size) {
+	m_stream.write(static_cast<const char*>(data), size);
+	if (!m_stream)
+		throw std::runtime_error("unable to write the screen recording");
+}
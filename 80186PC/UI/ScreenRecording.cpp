@@ -0,0 +1,132 @@
+#include <UI/ScreenRecording.h>
+
+#include <Utils/FrameDelta.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+const char ScreenRecording::Magic[8]{ '8', '6', 'P', 'C', 'R', 'E', 'C', '\x1A' };
+
+static uint64_t readLE(const uint8_t* data, unsigned int size) {
+	uint64_t value = 0;
+
+	for (unsigned int index = size; index-- > 0;)
+		value = (value << 8) | data[index];
+
+	return value;
+}
+
+ScreenRecording::ScreenRecording() : m_palette{}, m_haveKeyFrame(false), m_width(0), m_height(0) {
+
+}
+
+ScreenRecording::~ScreenRecording() = default;
+
+void ScreenRecording::open(const std::filesystem::path& path) {
+	m_stream.open(path, std::ios::binary);
+	if (!m_stream)
+		throw std::runtime_error("unable to open " + path.string());
+
+	uint8_t header[sizeof(Magic) + 4];
+	if (!m_stream.read(reinterpret_cast<char*>(header), sizeof(header)) || memcmp(header, Magic, sizeof(Magic)) != 0)
+		throw std::runtime_error(path.string() + " is not a screen recording");
+
+	auto version = readLE(header + sizeof(Magic), 2);
+	auto shades = readLE(header + sizeof(Magic) + 2, 2);
+	if (version != Version || shades != FrameRenderer::ShadeCount)
+		throw std::runtime_error(path.string() + " has an unsupported screen recording version");
+
+	if (!m_stream.read(reinterpret_cast<char*>(m_palette), sizeof(m_palette)))
+		throw std::runtime_error(path.string() + " is truncated");
+
+	m_haveKeyFrame = false;
+}
+
+bool ScreenRecording::readFrame(FrameRenderer::Frame& frame, uint64_t& timestamp) {
+	uint8_t header[FrameHeaderSize];
+
+	if (!m_stream.read(reinterpret_cast<char*>(header), sizeof(header)))
+		return false;
+
+	auto payloadSize = static_cast<size_t>(readLE(header, 4));
+	timestamp = readLE(header + 4, 8);
+	auto width = static_cast<unsigned int>(readLE(header + 12, 2));
+	auto height = static_cast<unsigned int>(readLE(header + 14, 2));
+	auto flags = header[16];
+
+	// Even deltas of noise take less than twice the planes
+	if (payloadSize > 2 * planesSize(width, height) + 16)
+		throw std::runtime_error("screen recording frame is damaged");
+
+	m_payload.resize(payloadSize);
+	if (!m_stream.read(reinterpret_cast<char*>(m_payload.data()), payloadSize)) {
+		printf("Screen recording ends with a truncated frame\n");
+		return false;
+	}
+
+	if (flags & FrameKey) {
+		m_width = width;
+		m_height = height;
+		m_planes.assign(planesSize(width, height), 0);
+		m_haveKeyFrame = true;
+	}
+	else if (!m_haveKeyFrame || width != m_width || height != m_height) {
+		throw std::runtime_error("screen recording frame has nothing to be applied to");
+	}
+
+	applyFrameDelta(m_payload.data(), m_payload.size(), m_planes.data(), m_planes.size());
+
+	frame.width = m_width;
+	frame.height = m_height;
+	unpackPlanes(m_planes, frame);
+	return true;
+}
+
+size_t ScreenRecording::planesSize(unsigned int width, unsigned int height) {
+	return 2 * ((static_cast<size_t>(width) * height + 7) / 8);
+}
+
+void ScreenRecording::packPlanes(const FrameRenderer::Frame& frame, std::vector<uint8_t>& planes) {
+	auto pixelCount = static_cast<size_t>(frame.width) * frame.height;
+	auto planeSize = (pixelCount + 7) / 8;
+
+	planes.assign(2 * planeSize, 0);
+	auto lit = planes.data();
+	auto bright = lit + planeSize;
+
+	for (size_t pixel = 0; pixel < pixelCount; pixel++) {
+		auto shade = frame.pixels[pixel];
+		auto bit = static_cast<uint8_t>(0x80 >> (pixel & 7));
+
+		if (shade != FrameRenderer::ShadeBlack)
+			lit[pixel >> 3] |= bit;
+
+		if (shade == FrameRenderer::ShadeBright)
+			bright[pixel >> 3] |= bit;
+	}
+}
+
+void ScreenRecording::unpackPlanes(const std::vector<uint8_t>& planes, FrameRenderer::Frame& frame) {
+	auto pixelCount = static_cast<size_t>(frame.width) * frame.height;
+	auto planeSize = (pixelCount + 7) / 8;
+
+	auto lit = planes.data();
+	auto bright = lit + planeSize;
+
+	frame.pixels.resize(pixelCount);
+
+	for (size_t pixel = 0; pixel < pixelCount; pixel++) {
+		auto bit = static_cast<uint8_t>(0x80 >> (pixel & 7));
+
+		if (bright[pixel >> 3] & bit)
+			frame.pixels[pixel] = FrameRenderer::ShadeBright;
+		else if (lit[pixel >> 3] & bit)
+			frame.pixels[pixel] = FrameRenderer::ShadeNormal;
+		else
+			frame.pixels[pixel] = FrameRenderer::ShadeBlack;
+	}
+}
@@ -0,0 +1,73 @@
+#include <UI/TextScreen.h>
+
+#include <Utils/CodePage437.h>
+
+TextScreen::TextScreen() : m_columns(0), m_rows(0), m_cursorVisible(false), m_cursorRow(0), m_cursorColumn(0), m_hash(0) {
+
+}
+
+TextScreen::~TextScreen() = default;
+
+void TextScreen::capture(const VideoAdapter::AdapterConfiguration& config) {
+	m_columns = config.textModeColumns;
+	m_rows = config.textModeRows;
+	m_cells.assign(config.textModeFramebuffer, config.textModeFramebuffer + m_columns * m_rows * 2);
+
+	auto cursorCell = config.textModeCursorAddress / 2;
+
+	m_cursorVisible =
+		cursorCell < m_columns * m_rows &&
+		config.textModeFirstCursorLine <= config.textModeLastCursorLine &&
+		config.textModeFirstCursorLine < config.textModeCharacterHeight;
+
+	if (m_cursorVisible) {
+		m_cursorRow = cursorCell / m_columns;
+		m_cursorColumn = cursorCell % m_columns;
+	}
+	else {
+		m_cursorRow = 0;
+		m_cursorColumn = 0;
+	}
+
+	// 64-bit FNV-1a
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	auto mix = [&hash](uint8_t byte) {
+		hash = (hash ^ byte) * 0x100000001B3ULL;
+	};
+
+	for (auto byte : m_cells) {
+		mix(byte);
+	}
+
+	mix(m_cursorVisible ? 1 : 0);
+	mix(static_cast<uint8_t>(m_cursorRow));
+	mix(static_cast<uint8_t>(m_cursorColumn));
+
+	m_hash = hash;
+}
+
+std::string TextScreen::row(unsigned int row) const {
+	std::string text;
+
+	auto columns = m_columns;
+	while (columns != 0 && (character(row, columns - 1) == ' ' || character(row, columns - 1) == 0)) {
+		columns--;
+	}
+
+	for (unsigned int column = 0; column < columns; column++) {
+		appendCodePage437AsUTF8(text, character(row, column));
+	}
+
+	return text;
+}
+
+std::string TextScreen::text() const {
+	std::string text;
+
+	for (unsigned int index = 0; index < m_rows; index++) {
+		text += row(index);
+		text.push_back('\n');
+	}
+
+	return text;
+}
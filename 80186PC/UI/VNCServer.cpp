@@ -0,0 +1,1104 @@
+#include <UI/VNCServer.h>
+#include <UI/Keyboard.h>
+#include <UI/Mouse.h>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <comdef.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+static void appendU16(std::vector<uint8_t>& message, uint16_t value) {
+	message.push_back(static_cast<uint8_t>(value >> 8));
+	message.push_back(static_cast<uint8_t>(value));
+}
+
+static void appendU32(std::vector<uint8_t>& message, uint32_t value) {
+	message.push_back(static_cast<uint8_t>(value >> 24));
+	message.push_back(static_cast<uint8_t>(value >> 16));
+	message.push_back(static_cast<uint8_t>(value >> 8));
+	message.push_back(static_cast<uint8_t>(value));
+}
+
+static uint16_t readU16(const uint8_t* data) {
+	return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+static uint32_t readU32(const uint8_t* data) {
+	return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+VNCServer::VNCServer() : m_videoAdapter(nullptr), m_keyboard(nullptr), m_mouse(nullptr), m_listenSocket(INVALID_SOCKET),
+	m_winsockStarted(false), m_run(false) {
+
+}
+
+VNCServer::~VNCServer() {
+	stop();
+}
+
+void VNCServer::start(uint16_t port, bool listenOnAllInterfaces) {
+	if (m_run)
+		throw std::logic_error("the VNC server is already running");
+
+	WSADATA wsaData;
+	auto result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != 0)
+		_com_raise_error(HRESULT_FROM_WIN32(result));
+
+	m_winsockStarted = true;
+
+	auto listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listenSocket == INVALID_SOCKET)
+		_com_raise_error(HRESULT_FROM_WIN32(WSAGetLastError()));
+
+	m_listenSocket = listenSocket;
+
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(listenOnAllInterfaces ? INADDR_ANY : INADDR_LOOPBACK);
+
+	if (bind(listenSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+		listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+
+		_com_raise_error(HRESULT_FROM_WIN32(WSAGetLastError()));
+	}
+
+	m_run = true;
+	m_frameThread = std::thread(&VNCServer::frameThread, this);
+	m_acceptThread = std::thread(&VNCServer::acceptThread, this);
+
+	printf("VNC server listening on port %u\n", port);
+}
+
+void VNCServer::stop() {
+	m_run = false;
+
+	if (m_listenSocket != INVALID_SOCKET) {
+		// Fails the pending accept()
+		closesocket(m_listenSocket);
+		m_listenSocket = INVALID_SOCKET;
+	}
+
+	if (m_acceptThread.joinable())
+		m_acceptThread.join();
+
+	{
+		std::unique_lock<std::mutex> locker(m_frameMutex);
+
+		for (const auto& client : m_clients) {
+			client->closed = true;
+			shutdown(client->socket, SD_BOTH);
+		}
+
+		m_frameCondvar.notify_all();
+		m_frameCondvar.wait(locker, [this]() { return m_clients.empty(); });
+	}
+
+	if (m_frameThread.joinable())
+		m_frameThread.join();
+
+	if (m_winsockStarted) {
+		WSACleanup();
+		m_winsockStarted = false;
+	}
+}
+
+void VNCServer::acceptThread() {
+	while (m_run) {
+		auto socket = accept(m_listenSocket, nullptr, nullptr);
+		if (socket == INVALID_SOCKET) {
+			if (!m_run)
+				break;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			continue;
+		}
+
+		// Updates are written in one go, don't hold them back
+		BOOL noDelay = TRUE;
+		setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+
+		auto client = std::make_shared<Client>();
+		client->socket = socket;
+		client->closed = false;
+		client->updateRequested = false;
+		client->incrementalUpdate = false;
+		client->requestedRect = Rect{};
+		client->pixelFormat = PixelFormat{ 32, 24, false, true, 255, 255, 255, 16, 8, 0 };
+		client->pixelFormatChanged = false;
+		client->supportsCopyRect = false;
+		client->supportsZRLE = false;
+		client->supportsDesktopSize = false;
+		client->width = 0;
+		client->height = 0;
+		client->shadowValid = false;
+		client->sentSerial = 0;
+		client->zlibStreamStarted = false;
+		client->pointerX = -1;
+		client->pointerY = -1;
+		client->buttons = 0;
+
+		{
+			std::unique_lock<std::mutex> locker(m_frameMutex);
+			m_clients.emplace_back(client);
+		}
+
+		m_frameCondvar.notify_all();
+
+		std::thread(&VNCServer::clientThread, this, std::move(client)).detach();
+	}
+}
+
+void VNCServer::frameThread() {
+	uint64_t generation = 0;
+	uint64_t serial = 0;
+	VideoAdapter::AdapterConfiguration lastConfig{};
+	bool lastConfigValid = false;
+
+	while (m_run) {
+		{
+			std::unique_lock<std::mutex> locker(m_frameMutex);
+			if (m_clients.empty()) {
+				m_frameCondvar.wait(locker, [this]() { return !m_run || !m_clients.empty(); });
+
+				// Nothing was tracked while nobody was watching
+				generation = 0;
+				lastConfigValid = false;
+				continue;
+			}
+		}
+
+		auto video = m_videoAdapter.load();
+		if (!video) {
+			std::this_thread::sleep_for(ConfigurationRecheckInterval);
+			continue;
+		}
+
+		VideoAdapter::AdapterConfiguration config;
+		video->acquireAdapterConfiguration(config, generation);
+		generation = config.framebufferGeneration;
+
+		if (!lastConfigValid || config.changedScanLineBands != 0 || !VideoAdapter::sameDisplayState(lastConfig, config)) {
+			auto shared = std::make_shared<SharedFrame>();
+			shared->serial = ++serial;
+			m_renderer.render(config, shared->frame);
+			shared->characterHeight = config.videoEnabled && config.textMode ? config.textModeCharacterHeight : 0;
+
+			{
+				std::unique_lock<std::mutex> locker(m_frameMutex);
+				m_currentFrame = std::move(shared);
+			}
+
+			m_frameCondvar.notify_all();
+
+			lastConfig = config;
+			lastConfigValid = true;
+		}
+
+		std::this_thread::sleep_for(FrameInterval);
+
+		video->waitForFramebufferWrites(generation, std::chrono::steady_clock::now() + ConfigurationRecheckInterval);
+	}
+}
+
+void VNCServer::clientThread(std::shared_ptr<Client> client) {
+	std::thread updateThread;
+
+	if (handshake(*client)) {
+		updateThread = std::thread(&VNCServer::clientUpdateThread, this, client);
+
+		while (m_run && processClientMessage(*client)) {
+
+		}
+	}
+
+	{
+		std::unique_lock<std::mutex> locker(m_frameMutex);
+		client->closed = true;
+	}
+
+	m_frameCondvar.notify_all();
+	shutdown(client->socket, SD_BOTH);
+
+	if (updateThread.joinable())
+		updateThread.join();
+
+	closesocket(client->socket);
+
+	/*
+	 * Notify under the lock: stop() may destroy the server as soon as it can
+	 * see m_clients empty.
+	 */
+	std::unique_lock<std::mutex> locker(m_frameMutex);
+	m_clients.erase(std::find(m_clients.begin(), m_clients.end(), client));
+	m_frameCondvar.notify_all();
+}
+
+void VNCServer::clientUpdateThread(std::shared_ptr<Client> client) {
+	while (true) {
+		std::shared_ptr<const SharedFrame> shared;
+		bool incremental;
+		Rect requestedRect;
+		PixelFormat pixelFormat;
+		bool pixelFormatChanged;
+		bool supportsCopyRect, supportsZRLE, supportsDesktopSize;
+
+		{
+			std::unique_lock<std::mutex> locker(m_frameMutex);
+
+			m_frameCondvar.wait(locker, [&]() {
+				return client->closed || (client->updateRequested && m_currentFrame &&
+					(!client->incrementalUpdate || client->pixelFormatChanged || m_currentFrame->serial != client->sentSerial));
+			});
+
+			if (client->closed)
+				return;
+
+			shared = m_currentFrame;
+			incremental = client->incrementalUpdate;
+			requestedRect = client->requestedRect;
+			pixelFormat = client->pixelFormat;
+			pixelFormatChanged = client->pixelFormatChanged;
+			supportsCopyRect = client->supportsCopyRect;
+			supportsZRLE = client->supportsZRLE;
+			supportsDesktopSize = client->supportsDesktopSize;
+
+			client->updateRequested = false;
+			client->pixelFormatChanged = false;
+		}
+
+		bool sent;
+		if (!sendUpdate(*client, *shared, incremental, requestedRect, pixelFormat, pixelFormatChanged,
+			supportsCopyRect, supportsZRLE, supportsDesktopSize, sent)) {
+
+			// Wakes up the reader thread, which cleans up
+			shutdown(client->socket, SD_BOTH);
+			return;
+		}
+
+		client->sentSerial = shared->serial;
+
+		if (!sent) {
+			// An incremental request stays pending until there is a change to answer it with
+			std::unique_lock<std::mutex> locker(m_frameMutex);
+			if (!client->updateRequested) {
+				client->updateRequested = true;
+				client->incrementalUpdate = true;
+				client->requestedRect = requestedRect;
+			}
+		}
+	}
+}
+
+bool VNCServer::handshake(Client& client) {
+	static const char serverVersion[] = "RFB 003.008\n";
+	if (!sendAll(client.socket, serverVersion, 12))
+		return false;
+
+	char clientVersion[12];
+	if (!receiveAll(client.socket, clientVersion, sizeof(clientVersion)))
+		return false;
+
+	if (memcmp(clientVersion, "RFB 003.", 8) != 0) {
+		printf("VNC: unsupported client version\n");
+		return false;
+	}
+
+	// 3.3 clients are told the security type, later ones get to choose it
+	auto minorVersion = atoi(std::string(clientVersion + 8, 3).c_str());
+	if (minorVersion >= 7) {
+		static const uint8_t securityTypes[] = { 1, 1 }; // one type: None
+		uint8_t chosenType;
+
+		if (!sendAll(client.socket, securityTypes, sizeof(securityTypes)) ||
+			!receiveAll(client.socket, &chosenType, 1) ||
+			chosenType != 1) {
+
+			return false;
+		}
+
+		if (minorVersion >= 8) {
+			std::vector<uint8_t> securityResult;
+			appendU32(securityResult, 0);
+
+			if (!sendAll(client.socket, securityResult.data(), securityResult.size()))
+				return false;
+		}
+	}
+	else {
+		std::vector<uint8_t> securityType;
+		appendU32(securityType, 1);
+
+		if (!sendAll(client.socket, securityType.data(), securityType.size()))
+			return false;
+	}
+
+	// ClientInit, with the shared flag we don't care about
+	uint8_t sharedFlag;
+	if (!receiveAll(client.socket, &sharedFlag, 1))
+		return false;
+
+	// The frame thread has just been told about the client, give it a moment to render
+	std::shared_ptr<const SharedFrame> shared;
+	{
+		std::unique_lock<std::mutex> locker(m_frameMutex);
+		m_frameCondvar.wait_for(locker, std::chrono::seconds(1), [this]() { return !m_run || m_currentFrame; });
+		shared = m_currentFrame;
+	}
+
+	if (shared && shared->frame.width != 0 && shared->frame.height != 0) {
+		client.width = shared->frame.width;
+		client.height = shared->frame.height;
+	}
+	else {
+		client.width = 720;
+		client.height = 350;
+	}
+
+	static const char name[] = "80186PC";
+
+	std::vector<uint8_t> serverInit;
+	appendU16(serverInit, static_cast<uint16_t>(client.width));
+	appendU16(serverInit, static_cast<uint16_t>(client.height));
+	appendPixelFormat(serverInit, client.pixelFormat);
+	appendU32(serverInit, sizeof(name) - 1);
+	serverInit.insert(serverInit.end(), name, name + sizeof(name) - 1);
+
+	return sendAll(client.socket, serverInit.data(), serverInit.size());
+}
+
+bool VNCServer::processClientMessage(Client& client) {
+	uint8_t type;
+	if (!receiveAll(client.socket, &type, 1))
+		return false;
+
+	switch (type) {
+	case 0: { // SetPixelFormat
+		uint8_t data[19];
+		if (!receiveAll(client.socket, data, sizeof(data)))
+			return false;
+
+		PixelFormat format;
+		format.bitsPerPixel = data[3];
+		format.depth = data[4];
+		format.bigEndian = data[5] != 0;
+		format.trueColour = data[6] != 0;
+		format.redMax = readU16(data + 7);
+		format.greenMax = readU16(data + 9);
+		format.blueMax = readU16(data + 11);
+		format.redShift = data[13];
+		format.greenShift = data[14];
+		format.blueShift = data[15];
+
+		if (format.bitsPerPixel != 8 && format.bitsPerPixel != 16 && format.bitsPerPixel != 32) {
+			printf("VNC: unsupported pixel format with %u bits per pixel\n", format.bitsPerPixel);
+			return false;
+		}
+
+		std::unique_lock<std::mutex> locker(m_frameMutex);
+		client.pixelFormat = format;
+		client.pixelFormatChanged = true;
+		break;
+	}
+
+	case 2: { // SetEncodings
+		uint8_t header[3];
+		if (!receiveAll(client.socket, header, sizeof(header)))
+			return false;
+
+		std::vector<uint8_t> encodings(readU16(header + 1) * 4);
+		if (!receiveAll(client.socket, encodings.data(), encodings.size()))
+			return false;
+
+		bool supportsCopyRect = false, supportsZRLE = false, supportsDesktopSize = false;
+		for (size_t offset = 0; offset < encodings.size(); offset += 4) {
+			switch (static_cast<int32_t>(readU32(encodings.data() + offset))) {
+			case EncodingCopyRect:
+				supportsCopyRect = true;
+				break;
+
+			case EncodingZRLE:
+				supportsZRLE = true;
+				break;
+
+			case EncodingDesktopSize:
+				supportsDesktopSize = true;
+				break;
+			}
+		}
+
+		std::unique_lock<std::mutex> locker(m_frameMutex);
+		client.supportsCopyRect = supportsCopyRect;
+		client.supportsZRLE = supportsZRLE;
+		client.supportsDesktopSize = supportsDesktopSize;
+		break;
+	}
+
+	case 3: { // FramebufferUpdateRequest
+		uint8_t data[9];
+		if (!receiveAll(client.socket, data, sizeof(data)))
+			return false;
+
+		{
+			std::unique_lock<std::mutex> locker(m_frameMutex);
+
+			// A pending full update must not be downgraded to an incremental one
+			bool incremental = data[0] != 0;
+			client.incrementalUpdate = incremental && (!client.updateRequested || client.incrementalUpdate);
+			client.updateRequested = true;
+			client.requestedRect = Rect{ readU16(data + 1), readU16(data + 3), readU16(data + 5), readU16(data + 7) };
+		}
+
+		m_frameCondvar.notify_all();
+		break;
+	}
+
+	case 4: { // KeyEvent
+		uint8_t data[7];
+		if (!receiveAll(client.socket, data, sizeof(data)))
+			return false;
+
+		handleKeyEvent(data[0] != 0, readU32(data + 3));
+		break;
+	}
+
+	case 5: { // PointerEvent
+		uint8_t data[5];
+		if (!receiveAll(client.socket, data, sizeof(data)))
+			return false;
+
+		handlePointerEvent(client, data[0], readU16(data + 1), readU16(data + 3));
+		break;
+	}
+
+	case 6: { // ClientCutText, ignored
+		uint8_t header[7];
+		if (!receiveAll(client.socket, header, sizeof(header)))
+			return false;
+
+		auto length = readU32(header + 3);
+		if (length > 1024 * 1024) {
+			printf("VNC: client clipboard text too long\n");
+			return false;
+		}
+
+		std::vector<uint8_t> text(length);
+		if (!receiveAll(client.socket, text.data(), text.size()))
+			return false;
+
+		break;
+	}
+
+	default:
+		printf("VNC: unknown client message type %u\n", type);
+		return false;
+	}
+
+	return true;
+}
+
+void VNCServer::handleKeyEvent(bool down, uint32_t keysym) {
+	// X keysyms to XT scancodes, for a US layout; shifted symbols map to their key
+	static const std::unordered_map<uint32_t, uint8_t> keyMap{
+		{ 0xFF1B,	0x01 }, // Escape
+		{ '1',		0x02 }, { '!',	0x02 },
+		{ '2',		0x03 }, { '@',	0x03 },
+		{ '3',		0x04 }, { '#',	0x04 },
+		{ '4',		0x05 }, { '$',	0x05 },
+		{ '5',		0x06 }, { '%',	0x06 },
+		{ '6',		0x07 }, { '^',	0x07 },
+		{ '7',		0x08 }, { '&',	0x08 },
+		{ '8',		0x09 }, { '*',	0x09 },
+		{ '9',		0x0A }, { '(',	0x0A },
+		{ '0',		0x0B }, { ')',	0x0B },
+		{ '-',		0x0C }, { '_',	0x0C },
+		{ '=',		0x0D }, { '+',	0x0D },
+		{ 0xFF08,	0x0E }, // BackSpace
+		{ 0xFF09,	0x0F }, // Tab
+		{ 'q',		0x10 }, { 'Q',	0x10 },
+		{ 'w',		0x11 }, { 'W',	0x11 },
+		{ 'e',		0x12 }, { 'E',	0x12 },
+		{ 'r',		0x13 }, { 'R',	0x13 },
+		{ 't',		0x14 }, { 'T',	0x14 },
+		{ 'y',		0x15 }, { 'Y',	0x15 },
+		{ 'u',		0x16 }, { 'U',	0x16 },
+		{ 'i',		0x17 }, { 'I',	0x17 },
+		{ 'o',		0x18 }, { 'O',	0x18 },
+		{ 'p',		0x19 }, { 'P',	0x19 },
+		{ '[',		0x1A }, { '{',	0x1A },
+		{ ']',		0x1B }, { '}',	0x1B },
+		{ 0xFF0D,	0x1C }, // Return
+		{ 0xFFE3,	0x1D }, // Control_L
+		{ 'a',		0x1E }, { 'A',	0x1E },
+		{ 's',		0x1F }, { 'S',	0x1F },
+		{ 'd',		0x20 }, { 'D',	0x20 },
+		{ 'f',		0x21 }, { 'F',	0x21 },
+		{ 'g',		0x22 }, { 'G',	0x22 },
+		{ 'h',		0x23 }, { 'H',	0x23 },
+		{ 'j',		0x24 }, { 'J',	0x24 },
+		{ 'k',		0x25 }, { 'K',	0x25 },
+		{ 'l',		0x26 }, { 'L',	0x26 },
+		{ ';',		0x27 }, { ':',	0x27 },
+		{ '\'',		0x28 }, { '"',	0x28 },
+		{ '`',		0x29 }, { '~',	0x29 },
+		{ 0xFFE1,	0x2A }, // Shift_L
+		{ '\\',		0x2B }, { '|',	0x2B },
+		{ 'z',		0x2C }, { 'Z',	0x2C },
+		{ 'x',		0x2D }, { 'X',	0x2D },
+		{ 'c',		0x2E }, { 'C',	0x2E },
+		{ 'v',		0x2F }, { 'V',	0x2F },
+		{ 'b',		0x30 }, { 'B',	0x30 },
+		{ 'n',		0x31 }, { 'N',	0x31 },
+		{ 'm',		0x32 }, { 'M',	0x32 },
+		{ ',',		0x33 }, { '<',	0x33 },
+		{ '.',		0x34 }, { '>',	0x34 },
+		{ '/',		0x35 }, { '?',	0x35 },
+		{ 0xFFE2,	0x36 }, // Shift_R
+		{ 0xFF61,	0x37 }, // Print
+		{ 0xFFAA,	0x37 }, // KP_Multiply
+		{ 0xFFE9,	0x38 }, // Alt_L
+		{ ' ',		0x39 },
+		{ 0xFFE5,	0x3A }, // Caps_Lock
+		{ 0xFFBE,	0x3B }, // F1
+		{ 0xFFBF,	0x3C },
+		{ 0xFFC0,	0x3D },
+		{ 0xFFC1,	0x3E },
+		{ 0xFFC2,	0x3F },
+		{ 0xFFC3,	0x40 },
+		{ 0xFFC4,	0x41 },
+		{ 0xFFC5,	0x42 },
+		{ 0xFFC6,	0x43 },
+		{ 0xFFC7,	0x44 }, // F10
+		{ 0xFF7F,	0x45 }, // Num_Lock
+		{ 0xFF14,	0x46 }, // Scroll_Lock
+		{ 0xFFB7,	0x47 }, { 0xFF95,	0x47 }, // KP_7, KP_Home
+		{ 0xFFB8,	0x48 }, { 0xFF97,	0x48 }, // KP_8, KP_Up
+		{ 0xFFB9,	0x49 }, { 0xFF9A,	0x49 }, // KP_9, KP_Prior
+		{ 0xFFAD,	0x4A }, // KP_Subtract
+		{ 0xFFB4,	0x4B }, { 0xFF96,	0x4B }, // KP_4, KP_Left
+		{ 0xFFB5,	0x4C }, { 0xFF9D,	0x4C }, // KP_5, KP_Begin
+		{ 0xFFB6,	0x4D }, { 0xFF98,	0x4D }, // KP_6, KP_Right
+		{ 0xFFAB,	0x4E }, // KP_Add
+		{ 0xFFB1,	0x4F }, { 0xFF9C,	0x4F }, // KP_1, KP_End
+		{ 0xFFB2,	0x50 }, { 0xFF99,	0x50 }, // KP_2, KP_Down
+		{ 0xFFB3,	0x51 }, { 0xFF9B,	0x51 }, // KP_3, KP_Next
+		{ 0xFFB0,	0x52 }, { 0xFF9E,	0x52 }, // KP_0, KP_Insert
+		{ 0xFFAE,	0x53 }, { 0xFF9F,	0x53 }, // KP_Decimal, KP_Delete
+		{ 0xFF15,	0x54 }, // Sys_Req
+		{ 0xFFC8,	0x57 }, // F11
+		{ 0xFFC9,	0x58 }, // F12
+
+		// extended codes
+		{ 0xFFEA,	0x80 | 0x38 }, // Alt_R
+		{ 0xFE03,	0x80 | 0x38 }, // ISO_Level3_Shift (AltGr)
+		{ 0xFFE4,	0x80 | 0x1D }, // Control_R
+		{ 0xFF63,	0x80 | 0x52 }, // Insert
+		{ 0xFFFF,	0x80 | 0x53 }, // Delete
+		{ 0xFF50,	0x80 | 0x47 }, // Home
+		{ 0xFF57,	0x80 | 0x4F }, // End
+		{ 0xFF55,	0x80 | 0x49 }, // Prior
+		{ 0xFF56,	0x80 | 0x51 }, // Next
+		{ 0xFF51,	0x80 | 0x4B }, // Left
+		{ 0xFF52,	0x80 | 0x48 }, // Up
+		{ 0xFF54,	0x80 | 0x50 }, // Down
+		{ 0xFF53,	0x80 | 0x4D }, // Right
+		{ 0xFFAF,	0x80 | 0x35 }, // KP_Divide
+		{ 0xFF8D,	0x80 | 0x1C }, // KP_Enter
+	};
+
+	auto keyboard = m_keyboard.load();
+
+	if (!keyboard)
+		return;
+
+	auto it = keyMap.find(keysym);
+	if (it == keyMap.end())
+		return;
+
+	uint8_t code = it->second;
+
+	if (code & 0x80) {
+		keyboard->pushScancode(0xE0);
+	}
+
+	if (down) {
+		keyboard->pushScancode(code & 0x7F);
+	}
+	else {
+		keyboard->pushScancode(code | 0x80);
+	}
+}
+
+void VNCServer::handlePointerEvent(Client& client, uint8_t buttons, int x, int y) {
+	auto mouse = m_mouse.load();
+
+	// The machine has a relative mouse, so only motion is passed on
+	if (mouse && client.pointerX >= 0) {
+		int dx = x - client.pointerX;
+		int dy = y - client.pointerY;
+
+		if (dx != 0 || dy != 0)
+			mouse->addDeltas(dx, dy);
+	}
+
+	client.pointerX = x;
+	client.pointerY = y;
+
+	// RFB buttons 1 to 3 (left, middle, right) to the bus mouse buttons
+	static const unsigned int buttonMap[] = { 2, 1, 0 };
+
+	auto changed = static_cast<uint8_t>(client.buttons ^ buttons);
+	for (unsigned int index = 0; index < 3; index++) {
+		if (mouse && (changed & (1 << index)))
+			mouse->updateButtonState(buttonMap[index], (buttons & (1 << index)) != 0);
+	}
+
+	client.buttons = buttons;
+}
+
+bool VNCServer::sendUpdate(Client& client, const SharedFrame& shared, bool incremental, const Rect& requestedRect,
+	const PixelFormat& pixelFormat, bool pixelFormatChanged, bool supportsCopyRect, bool supportsZRLE, bool supportsDesktopSize,
+	bool& sent) {
+
+	sent = false;
+
+	std::vector<uint8_t> message;
+
+	if (pixelFormatChanged) {
+		client.shadowValid = false;
+
+		if (!pixelFormat.trueColour) {
+			// SetColourMapEntries: the pixel values are the shades
+			message.push_back(1);
+			message.push_back(0);
+			appendU16(message, 0);
+			appendU16(message, FrameRenderer::ShadeCount);
+
+			for (unsigned int shade = 0; shade < FrameRenderer::ShadeCount; shade++) {
+				for (unsigned int component = 0; component < 3; component++) {
+					appendU16(message, FrameRenderer::ShadeColors[shade][component] * 257);
+				}
+			}
+		}
+	}
+
+	const auto& frame = shared.frame;
+	if (frame.width == 0 || frame.height == 0) {
+		sent = !message.empty();
+		return message.empty() || sendAll(client.socket, message.data(), message.size());
+	}
+
+	// FramebufferUpdate header, the rectangle count is filled in at the end
+	auto headerOffset = message.size();
+	message.insert(message.end(), { 0, 0, 0, 0 });
+	unsigned int rectCount = 0;
+
+	Rect area;
+	if (supportsDesktopSize && (frame.width != client.width || frame.height != client.height)) {
+		client.width = frame.width;
+		client.height = frame.height;
+		client.shadowValid = false;
+
+		appendRectHeader(message, Rect{ 0, 0, client.width, client.height }, EncodingDesktopSize);
+		rectCount++;
+
+		// The client discards its framebuffer on resize
+		area = Rect{ 0, 0, client.width, client.height };
+	}
+	else if (!intersect(requestedRect, Rect{ 0, 0, client.width, client.height }, area)) {
+		area = Rect{};
+	}
+
+	std::vector<uint8_t> target;
+	fitFrame(frame, client.width, client.height, target);
+
+	if (client.shadow.size() != target.size()) {
+		client.shadow.assign(target.size(), 0);
+		client.shadowValid = false;
+	}
+
+	EncodedPixels encoded;
+	encodePixels(pixelFormat, encoded);
+
+	std::vector<Rect> rects;
+	bool wasShadowValid = client.shadowValid;
+
+	if (area.width != 0 && area.height != 0) {
+		if (incremental && client.shadowValid) {
+			Rect source, destination;
+			if (supportsCopyRect && shared.characterHeight != 0 &&
+				detectScroll(client, target, shared.characterHeight, area, source, destination)) {
+
+				appendRectHeader(message, destination, EncodingCopyRect);
+				appendU16(message, static_cast<uint16_t>(source.x));
+				appendU16(message, static_cast<uint16_t>(source.y));
+				rectCount++;
+			}
+
+			// Narrow every band of lines down to the columns that changed
+			for (unsigned int bandY = area.y; bandY < area.y + area.height; bandY += DiffBandHeight) {
+				auto bandHeight = std::min(DiffBandHeight, area.y + area.height - bandY);
+				auto left = area.x + area.width;
+				auto right = area.x;
+
+				for (unsigned int y = bandY; y < bandY + bandHeight; y++) {
+					const auto* targetRow = target.data() + y * client.width;
+					const auto* shadowRow = client.shadow.data() + y * client.width;
+
+					auto x = area.x;
+					while (x < left && targetRow[x] == shadowRow[x])
+						x++;
+
+					if (x == area.x + area.width)
+						continue;
+
+					left = std::min(left, x);
+
+					x = area.x + area.width;
+					while (x > right && targetRow[x - 1] == shadowRow[x - 1])
+						x--;
+
+					right = std::max(right, x);
+				}
+
+				if (left < right) {
+					rects.push_back(Rect{ left, bandY, right - left, bandHeight });
+				}
+			}
+		}
+		else {
+			rects.push_back(area);
+		}
+	}
+
+	for (const auto& rect : rects) {
+		if (supportsZRLE) {
+			appendZRLE(message, client, target, client.width, rect, encoded);
+		}
+		else {
+			appendRectHeader(message, rect, EncodingRaw);
+			appendRaw(message, target, client.width, rect, encoded);
+		}
+
+		rectCount++;
+
+		for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+			auto offset = y * client.width + rect.x;
+			memcpy(client.shadow.data() + offset, target.data() + offset, rect.width);
+		}
+	}
+
+	// The shadow only covers what the client was sent
+	client.shadowValid = wasShadowValid || (area.x == 0 && area.y == 0 && area.width == client.width && area.height == client.height);
+
+	if (rectCount == 0) {
+		message.resize(headerOffset);
+	}
+	else {
+		message[headerOffset + 2] = static_cast<uint8_t>(rectCount >> 8);
+		message[headerOffset + 3] = static_cast<uint8_t>(rectCount);
+	}
+
+	if (message.empty())
+		return true;
+
+	sent = true;
+	return sendAll(client.socket, message.data(), message.size());
+}
+
+bool VNCServer::detectScroll(Client& client, const std::vector<uint8_t>& target, unsigned int characterHeight, const Rect& area, Rect& source, Rect& destination) {
+	// Only whole-screen updates are worth it, which is what clients ask for anyway
+	if (area.x != 0 || area.y != 0 || area.width != client.width || area.height != client.height)
+		return false;
+
+	auto width = client.width;
+	auto height = client.height;
+
+	auto rowsEqual = [&](const uint8_t* a, unsigned int aRow, const uint8_t* b, unsigned int bRow) {
+		return memcmp(a + aRow * width, b + bRow * width, width) == 0;
+	};
+
+	unsigned int bestRun = 0, bestStart = 0;
+	int bestShift = 0;
+
+	// Try scrolling by up to 3 text rows in either direction
+	for (int rows = -3; rows <= 3; rows++) {
+		if (rows == 0)
+			continue;
+
+		int shift = rows * static_cast<int>(characterHeight);
+		unsigned int distance = std::abs(shift);
+		if (distance >= height)
+			continue;
+
+		// Line y of the target was line y + shift of the shadow
+		unsigned int first = shift < 0 ? distance : 0;
+		unsigned int last = shift < 0 ? height : height - distance;
+
+		unsigned int run = 0, runStart = first, runChanged = 0;
+		for (unsigned int y = first; y <= last; y++) {
+			bool matches = y < last && rowsEqual(target.data(), y, client.shadow.data(), y + shift);
+			if (matches) {
+				if (run == 0)
+					runStart = y;
+
+				run++;
+				if (!rowsEqual(target.data(), y, client.shadow.data(), y))
+					runChanged++;
+
+				continue;
+			}
+
+			// Runs that match without having changed are static content, such as blank lines
+			if (runChanged != 0 && run > bestRun) {
+				bestRun = run;
+				bestStart = runStart;
+				bestShift = shift;
+			}
+
+			run = 0;
+			runChanged = 0;
+		}
+	}
+
+	if (bestRun < height / 2)
+		return false;
+
+	destination = Rect{ 0, bestStart, width, bestRun };
+	source = Rect{ 0, bestStart + bestShift, width, bestRun };
+
+	// The client moves its copy as well
+	memmove(client.shadow.data() + destination.y * width, client.shadow.data() + source.y * width, bestRun * width);
+	return true;
+}
+
+void VNCServer::encodePixels(const PixelFormat& pixelFormat, EncodedPixels& encoded) {
+	encoded.bytesPerPixel = pixelFormat.bitsPerPixel / 8;
+	encoded.bytesPerCPixel = encoded.bytesPerPixel;
+
+	// 32 bit pixels go as 3 bytes in ZRLE if all the colour bits fit in either the upper or lower 3 bytes
+	unsigned int cpixelShift = 0;
+	if (pixelFormat.trueColour && pixelFormat.bitsPerPixel == 32 && pixelFormat.depth <= 24) {
+		uint32_t mask =
+			(static_cast<uint32_t>(pixelFormat.redMax) << pixelFormat.redShift) |
+			(static_cast<uint32_t>(pixelFormat.greenMax) << pixelFormat.greenShift) |
+			(static_cast<uint32_t>(pixelFormat.blueMax) << pixelFormat.blueShift);
+
+		if ((mask & 0xFF000000) == 0) {
+			encoded.bytesPerCPixel = 3;
+		}
+		else if ((mask & 0x000000FF) == 0) {
+			encoded.bytesPerCPixel = 3;
+			cpixelShift = 8;
+		}
+	}
+
+	auto store = [&](uint8_t* bytes, unsigned int count, uint32_t value) {
+		for (unsigned int index = 0; index < count; index++) {
+			auto byteShift = pixelFormat.bigEndian ? 8 * (count - 1 - index) : 8 * index;
+			bytes[index] = static_cast<uint8_t>(value >> byteShift);
+		}
+	};
+
+	for (unsigned int shade = 0; shade < FrameRenderer::ShadeCount; shade++) {
+		uint32_t value = shade;
+
+		if (pixelFormat.trueColour) {
+			const auto* color = FrameRenderer::ShadeColors[shade];
+			value =
+				((color[0] * pixelFormat.redMax / 255u) << pixelFormat.redShift) |
+				((color[1] * pixelFormat.greenMax / 255u) << pixelFormat.greenShift) |
+				((color[2] * pixelFormat.blueMax / 255u) << pixelFormat.blueShift);
+		}
+
+		store(encoded.pixels[shade], encoded.bytesPerPixel, value);
+		store(encoded.cpixels[shade], encoded.bytesPerCPixel, value >> cpixelShift);
+	}
+}
+
+void VNCServer::appendPixelFormat(std::vector<uint8_t>& message, const PixelFormat& pixelFormat) {
+	message.push_back(pixelFormat.bitsPerPixel);
+	message.push_back(pixelFormat.depth);
+	message.push_back(pixelFormat.bigEndian ? 1 : 0);
+	message.push_back(pixelFormat.trueColour ? 1 : 0);
+	appendU16(message, pixelFormat.redMax);
+	appendU16(message, pixelFormat.greenMax);
+	appendU16(message, pixelFormat.blueMax);
+	message.push_back(pixelFormat.redShift);
+	message.push_back(pixelFormat.greenShift);
+	message.push_back(pixelFormat.blueShift);
+	message.insert(message.end(), { 0, 0, 0 });
+}
+
+void VNCServer::appendRectHeader(std::vector<uint8_t>& message, const Rect& rect, int32_t encoding) {
+	appendU16(message, static_cast<uint16_t>(rect.x));
+	appendU16(message, static_cast<uint16_t>(rect.y));
+	appendU16(message, static_cast<uint16_t>(rect.width));
+	appendU16(message, static_cast<uint16_t>(rect.height));
+	appendU32(message, static_cast<uint32_t>(encoding));
+}
+
+void VNCServer::appendRaw(std::vector<uint8_t>& message, const std::vector<uint8_t>& pixels, unsigned int pitch, const Rect& rect, const EncodedPixels& encoded) {
+	message.reserve(message.size() + rect.width * rect.height * encoded.bytesPerPixel);
+
+	for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+		const auto* row = pixels.data() + y * pitch;
+
+		for (unsigned int x = rect.x; x < rect.x + rect.width; x++) {
+			const auto* pixel = encoded.pixels[row[x]];
+			message.insert(message.end(), pixel, pixel + encoded.bytesPerPixel);
+		}
+	}
+}
+
+void VNCServer::appendZRLE(std::vector<uint8_t>& message, Client& client, const std::vector<uint8_t>& pixels, unsigned int pitch, const Rect& rect, const EncodedPixels& encoded) {
+	std::vector<uint8_t> tiles;
+
+	for (unsigned int tileY = rect.y; tileY < rect.y + rect.height; tileY += TileSize) {
+		auto tileHeight = std::min(TileSize, rect.y + rect.height - tileY);
+
+		for (unsigned int tileX = rect.x; tileX < rect.x + rect.width; tileX += TileSize) {
+			auto tileWidth = std::min(TileSize, rect.x + rect.width - tileX);
+
+			bool present[FrameRenderer::ShadeCount]{};
+			for (unsigned int y = tileY; y < tileY + tileHeight; y++) {
+				const auto* row = pixels.data() + y * pitch;
+
+				for (unsigned int x = tileX; x < tileX + tileWidth; x++)
+					present[row[x]] = true;
+			}
+
+			// With three shades at most, every tile is either solid or a packed palette
+			uint8_t paletteIndex[FrameRenderer::ShadeCount]{};
+			unsigned int paletteSize = 0;
+			auto subencodingOffset = tiles.size();
+			tiles.push_back(0);
+
+			for (unsigned int shade = 0; shade < FrameRenderer::ShadeCount; shade++) {
+				if (present[shade]) {
+					paletteIndex[shade] = static_cast<uint8_t>(paletteSize++);
+					tiles.insert(tiles.end(), encoded.cpixels[shade], encoded.cpixels[shade] + encoded.bytesPerCPixel);
+				}
+			}
+
+			tiles[subencodingOffset] = static_cast<uint8_t>(paletteSize);
+			if (paletteSize == 1)
+				continue;
+
+			unsigned int bitsPerIndex = paletteSize == 2 ? 1 : 2;
+
+			for (unsigned int y = tileY; y < tileY + tileHeight; y++) {
+				const auto* row = pixels.data() + y * pitch;
+				unsigned int packed = 0, bits = 0;
+
+				for (unsigned int x = tileX; x < tileX + tileWidth; x++) {
+					packed = (packed << bitsPerIndex) | paletteIndex[row[x]];
+					bits += bitsPerIndex;
+
+					if (bits == 8) {
+						tiles.push_back(static_cast<uint8_t>(packed));
+						packed = 0;
+						bits = 0;
+					}
+				}
+
+				// Rows are padded to a whole byte
+				if (bits != 0)
+					tiles.push_back(static_cast<uint8_t>(packed << (8 - bits)));
+			}
+		}
+	}
+
+	/*
+	 * The zlib stream spans the whole connection. It's made of stored
+	 * deflate blocks, which any inflater accepts; the tiles are already
+	 * compact and this keeps the server free of a zlib dependency.
+	 */
+	std::vector<uint8_t> stream;
+	if (!client.zlibStreamStarted) {
+		stream.insert(stream.end(), { 0x78, 0x01 });
+		client.zlibStreamStarted = true;
+	}
+
+	for (size_t offset = 0; offset < tiles.size(); offset += 0xFFFF) {
+		auto length = static_cast<uint16_t>(std::min<size_t>(tiles.size() - offset, 0xFFFF));
+
+		// Not final, stored
+		stream.push_back(0);
+		stream.push_back(static_cast<uint8_t>(length));
+		stream.push_back(static_cast<uint8_t>(length >> 8));
+		stream.push_back(static_cast<uint8_t>(~length));
+		stream.push_back(static_cast<uint8_t>(~length >> 8));
+		stream.insert(stream.end(), tiles.begin() + offset, tiles.begin() + offset + length);
+	}
+
+	appendRectHeader(message, rect, EncodingZRLE);
+	appendU32(message, static_cast<uint32_t>(stream.size()));
+	message.insert(message.end(), stream.begin(), stream.end());
+}
+
+void VNCServer::fitFrame(const FrameRenderer::Frame& frame, unsigned int width, unsigned int height, std::vector<uint8_t>& pixels) {
+	// Clients that can't be resized see the top left of larger frames, and black around smaller ones
+	pixels.assign(static_cast<size_t>(width) * height, FrameRenderer::ShadeBlack);
+
+	auto copyWidth = std::min(width, frame.width);
+	auto copyHeight = std::min(height, frame.height);
+
+	for (unsigned int y = 0; y < copyHeight; y++) {
+		memcpy(pixels.data() + y * width, frame.pixels.data() + y * frame.width, copyWidth);
+	}
+}
+
+bool VNCServer::intersect(const Rect& a, const Rect& b, Rect& result) {
+	auto left = std::max(a.x, b.x);
+	auto top = std::max(a.y, b.y);
+	auto right = std::min(a.x + a.width, b.x + b.width);
+	auto bottom = std::min(a.y + a.height, b.y + b.height);
+
+	if (left >= right || top >= bottom)
+		return false;
+
+	result = Rect{ left, top, right - left, bottom - top };
+	return true;
+}
+
+bool VNCServer::sendAll(uintptr_t socket, const void* data, size_t size) {
+	const auto* bytes = static_cast<const char*>(data);
+
+	while (size != 0) {
+		auto chunk = static_cast<int>(std::min<size_t>(size, 1 << 20));
+		auto result = send(socket, bytes, chunk, 0);
+		if (result == SOCKET_ERROR || result == 0)
+			return false;
+
+		bytes += result;
+		size -= result;
+	}
+
+	return true;
+}
+
+bool VNCServer::receiveAll(uintptr_t socket, void* data, size_t size) {
+	auto* bytes = static_cast<char*>(data);
+
+	while (size != 0) {
+		auto chunk = static_cast<int>(std::min<size_t>(size, 1 << 20));
+		auto result = recv(socket, bytes, chunk, 0);
+		if (result == SOCKET_ERROR || result == 0)
+			return false;
+
+		bytes += result;
+		size -= result;
+	}
+
+	return true;
+}
@@ -3,3 +3,19 @@
 VideoAdapter::VideoAdapter() = default;
 
 VideoAdapter::~VideoAdapter() = default;
+
+bool VideoAdapter::sameDisplayState(const AdapterConfiguration& a, const AdapterConfiguration& b) {
+	return
+		a.videoEnabled == b.videoEnabled &&
+		a.textMode == b.textMode &&
+		a.widthPixels == b.widthPixels &&
+		a.heightPixels == b.heightPixels &&
+		a.textModeFramebuffer == b.textModeFramebuffer &&
+		a.textModeColumns == b.textModeColumns &&
+		a.textModeRows == b.textModeRows &&
+		a.textModeCharacterHeight == b.textModeCharacterHeight &&
+		a.textModeCursorAddress == b.textModeCursorAddress &&
+		a.textModeFirstCursorLine == b.textModeFirstCursorLine &&
+		a.textModeLastCursorLine == b.textModeLastCursorLine &&
+		a.graphicsModeFramebuffer == b.graphicsModeFramebuffer;
+}
@@ -0,0 +1,58 @@
+#include <Utils/Checksums.h>
+
+#include <array>
+
+static std::array<uint32_t, 256> buildCRC32Table() {
+	std::array<uint32_t, 256> table;
+
+	for (uint32_t index = 0; index < table.size(); index++) {
+		uint32_t value = index;
+
+		for (unsigned int bit = 0; bit < 8; bit++) {
+			value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+		}
+
+		table[index] = value;
+	}
+
+	return table;
+}
+
+uint32_t crc32(const void* data, size_t size, uint32_t crc) {
+	static const auto table = buildCRC32Table();
+
+	auto bytes = static_cast<const uint8_t*>(data);
+
+	crc = ~crc;
+
+	for (size_t index = 0; index < size; index++) {
+		crc = table[(crc ^ bytes[index]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+uint32_t adler32(const void* data, size_t size, uint32_t adler) {
+	static constexpr uint32_t Modulus = 65521;
+	// Largest block that cannot overflow the sums before reduction
+	static constexpr size_t BlockSize = 5552;
+
+	auto bytes = static_cast<const uint8_t*>(data);
+	uint32_t a = adler & 0xFFFF;
+	uint32_t b = adler >> 16;
+
+	while (size != 0) {
+		auto block = size < BlockSize ? size : BlockSize;
+		size -= block;
+
+		while (block-- != 0) {
+			a += *bytes++;
+			b += a;
+		}
+
+		a %= Modulus;
+		b %= Modulus;
+	}
+
+	return (b << 16) | a;
+}
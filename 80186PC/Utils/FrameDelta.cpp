@@ -0,0 +1,89 @@
+#include <Utils/FrameDelta.h>
+
+#include <stdexcept>
+
+// Unchanged runs shorter than this are cheaper to carry along in the literal run
+static constexpr size_t MinimumUnchangedRun = 3;
+
+static void appendLength(std::vector<uint8_t>& delta, size_t length) {
+	while (length >= 0x80) {
+		delta.push_back(static_cast<uint8_t>(length | 0x80));
+		length >>= 7;
+	}
+
+	delta.push_back(static_cast<uint8_t>(length));
+}
+
+static size_t readLength(const uint8_t*& delta, const uint8_t* end) {
+	size_t length = 0;
+
+	for (unsigned int shift = 0; shift < sizeof(size_t) * 8; shift += 7) {
+		if (delta == end)
+			throw std::runtime_error("truncated frame delta");
+
+		auto byte = *delta++;
+		length |= static_cast<size_t>(byte & 0x7F) << shift;
+
+		if ((byte & 0x80) == 0)
+			return length;
+	}
+
+	throw std::runtime_error("malformed frame delta");
+}
+
+void encodeFrameDelta(const uint8_t* previous, const uint8_t* current, size_t size, std::vector<uint8_t>& delta) {
+	size_t position = 0;
+
+	while (position < size) {
+		auto unchangedStart = position;
+		while (position < size && previous[position] == current[position])
+			position++;
+
+		appendLength(delta, position - unchangedStart);
+
+		if (position == size)
+			break;
+
+		// The literal run ends at the first run of unchanged bytes worth skipping
+		auto literalStart = position;
+		size_t unchanged = 0;
+
+		while (position < size && unchanged < MinimumUnchangedRun) {
+			if (previous[position] == current[position])
+				unchanged++;
+			else
+				unchanged = 0;
+
+			position++;
+		}
+
+		if (unchanged == MinimumUnchangedRun || position == size)
+			position -= unchanged;
+
+		appendLength(delta, position - literalStart);
+		for (auto index = literalStart; index < position; index++)
+			delta.push_back(previous[index] ^ current[index]);
+	}
+}
+
+void applyFrameDelta(const uint8_t* delta, size_t deltaSize, uint8_t* frame, size_t size) {
+	auto end = delta + deltaSize;
+	size_t position = 0;
+
+	while (delta != end) {
+		auto unchanged = readLength(delta, end);
+		if (unchanged > size - position)
+			throw std::runtime_error("frame delta exceeds the frame");
+
+		position += unchanged;
+		if (delta == end)
+			break;
+
+		auto literal = readLength(delta, end);
+		if (literal > size - position || literal > static_cast<size_t>(end - delta))
+			throw std::runtime_error("frame delta exceeds the frame");
+
+		for (size_t index = 0; index < literal; index++)
+			frame[position++] ^= *delta++;
+	}
+}
@@ -0,0 +1,123 @@
+#include <Utils/ImageWriter.h>
+#include <Utils/Checksums.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static void appendBE32(std::vector<uint8_t>& data, uint32_t value) {
+	data.push_back(static_cast<uint8_t>(value >> 24));
+	data.push_back(static_cast<uint8_t>(value >> 16));
+	data.push_back(static_cast<uint8_t>(value >> 8));
+	data.push_back(static_cast<uint8_t>(value));
+}
+
+static void appendPNGChunk(std::vector<uint8_t>& png, const char* type, const std::vector<uint8_t>& data) {
+	appendBE32(png, static_cast<uint32_t>(data.size()));
+
+	auto typeOffset = png.size();
+	png.insert(png.end(), type, type + 4);
+	png.insert(png.end(), data.begin(), data.end());
+
+	appendBE32(png, crc32(png.data() + typeOffset, png.size() - typeOffset));
+}
+
+static void writeFile(const std::filesystem::path& path, const void* data, size_t size) {
+	std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+	if (!stream)
+		throw std::runtime_error("unable to create " + path.string());
+
+	stream.write(static_cast<const char*>(data), size);
+	stream.close();
+
+	if (!stream)
+		throw std::runtime_error("unable to write " + path.string());
+}
+
+void writeIndexedPNG(const std::filesystem::path& path, unsigned int width, unsigned int height, const uint8_t* pixels,
+	const uint8_t (*palette)[3], unsigned int paletteSize) {
+
+	if (paletteSize == 0 || paletteSize > 256)
+		throw std::logic_error("unsupported PNG palette size");
+
+	unsigned int bitDepth = 8;
+	if (paletteSize <= 2)
+		bitDepth = 1;
+	else if (paletteSize <= 4)
+		bitDepth = 2;
+	else if (paletteSize <= 16)
+		bitDepth = 4;
+
+	// Filter type byte, then the packed pixels
+	size_t rowBytes = 1 + (static_cast<size_t>(width) * bitDepth + 7) / 8;
+	std::vector<uint8_t> scanlines(rowBytes * height);
+
+	for (unsigned int y = 0; y < height; y++) {
+		auto row = scanlines.data() + y * rowBytes;
+		auto source = pixels + static_cast<size_t>(y) * width;
+
+		for (unsigned int x = 0; x < width; x++) {
+			auto shift = 8 - bitDepth - (x * bitDepth) % 8;
+			row[1 + x * bitDepth / 8] |= static_cast<uint8_t>(source[x] << shift);
+		}
+	}
+
+	// zlib stream made of stored deflate blocks
+	std::vector<uint8_t> compressed{ 0x78, 0x01 };
+	size_t offset = 0;
+	do {
+		auto block = std::min<size_t>(scanlines.size() - offset, 65535);
+		bool final = offset + block == scanlines.size();
+
+		compressed.push_back(final ? 1 : 0);
+		compressed.push_back(static_cast<uint8_t>(block));
+		compressed.push_back(static_cast<uint8_t>(block >> 8));
+		compressed.push_back(static_cast<uint8_t>(~block));
+		compressed.push_back(static_cast<uint8_t>(~block >> 8));
+		compressed.insert(compressed.end(), scanlines.begin() + offset, scanlines.begin() + offset + block);
+
+		offset += block;
+	} while (offset < scanlines.size());
+
+	appendBE32(compressed, adler32(scanlines.data(), scanlines.size()));
+
+	std::vector<uint8_t> header;
+	appendBE32(header, width);
+	appendBE32(header, height);
+	header.push_back(static_cast<uint8_t>(bitDepth));
+	header.push_back(3); // indexed color
+	header.push_back(0); // deflate
+	header.push_back(0); // adaptive filtering
+	header.push_back(0); // no interlace
+
+	std::vector<uint8_t> paletteData;
+	for (unsigned int index = 0; index < paletteSize; index++) {
+		paletteData.insert(paletteData.end(), palette[index], palette[index] + 3);
+	}
+
+	std::vector<uint8_t> png{ 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	appendPNGChunk(png, "IHDR", header);
+	appendPNGChunk(png, "PLTE", paletteData);
+	appendPNGChunk(png, "IDAT", compressed);
+	appendPNGChunk(png, "IEND", {});
+
+	writeFile(path, png.data(), png.size());
+}
+
+void writeIndexedPPM(const std::filesystem::path& path, unsigned int width, unsigned int height, const uint8_t* pixels,
+	const uint8_t (*palette)[3]) {
+
+	auto header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+
+	std::vector<uint8_t> ppm(header.begin(), header.end());
+	ppm.reserve(ppm.size() + static_cast<size_t>(width) * height * 3);
+
+	for (size_t index = 0; index < static_cast<size_t>(width) * height; index++) {
+		const auto& color = palette[pixels[index]];
+		ppm.insert(ppm.end(), color, color + 3);
+	}
+
+	writeFile(path, ppm.data(), ppm.size());
+}
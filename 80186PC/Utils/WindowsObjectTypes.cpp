@@ -2,6 +2,8 @@
 
 #include <comdef.h>
 
+#include <exception>
+
 void WindowsHandleDeleter::operator()(HANDLE handle) const {
 	CloseHandle(handle);
 }
@@ -10,16 +12,45 @@ void WindowsSectionViewDeleter::operator()(void *base) const {
 	UnmapViewOfFile(base);
 }
 
-WindowsMemoryRegion::WindowsMemoryRegion(unsigned int length, DWORD protect) : m_length(length) {
-	m_base = VirtualAlloc(nullptr, m_length, MEM_RESERVE | MEM_COMMIT, protect);
+WindowsMemoryRegion::WindowsMemoryRegion(unsigned int length, DWORD protect) : m_length(length), m_protect(protect) {
+	auto process = GetCurrentProcess();
+
+	m_base = VirtualAlloc2(process, nullptr, m_length, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
 	if (!m_base) {
 		auto error = HRESULT_FROM_WIN32(GetLastError());
 		_com_raise_error(error);
 	}
 
-	memset(m_base, 0, length);
+	// Page file backed sections come zeroed
+	WindowsHandle section(CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, protect, 0, m_length, nullptr));
+	if (!section || !MapViewOfFile3(section.get(), process, m_base, 0, m_length, MEM_REPLACE_PLACEHOLDER, protect, nullptr, 0)) {
+		auto error = HRESULT_FROM_WIN32(GetLastError());
+		VirtualFree(m_base, 0, MEM_RELEASE);
+		_com_raise_error(error);
+	}
 }
 
 WindowsMemoryRegion::~WindowsMemoryRegion() {
-	VirtualFree(m_base, m_length, MEM_RELEASE | MEM_DECOMMIT);
+	// The view took the place of the placeholder, so this releases the address range as well
+	UnmapViewOfFile(m_base);
+}
+
+void WindowsMemoryRegion::mapCopyOnWrite(HANDLE fileMapping, uint64_t offset) {
+	auto process = GetCurrentProcess();
+
+	if (!UnmapViewOfFile2(process, m_base, MEM_PRESERVE_PLACEHOLDER)) {
+		auto error = HRESULT_FROM_WIN32(GetLastError());
+		_com_raise_error(error);
+	}
+
+	if (!MapViewOfFile3(fileMapping, process, m_base, offset, m_length, MEM_REPLACE_PLACEHOLDER, PAGE_WRITECOPY, nullptr, 0)) {
+		auto error = HRESULT_FROM_WIN32(GetLastError());
+
+		// Back to zeroed memory rather than a hole, if at all possible
+		WindowsHandle section(CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, m_protect, 0, m_length, nullptr));
+		if (!section || !MapViewOfFile3(section.get(), process, m_base, 0, m_length, MEM_REPLACE_PLACEHOLDER, m_protect, nullptr, 0))
+			std::terminate();
+
+		_com_raise_error(error);
+	}
 }
@@ -1,11 +1,20 @@
 #include <X86Emu/X86EmuCPUEmulation.h>
+#include <Infrastructure/ExecutionLog.h>
 #include <Infrastructure/IAddressRangeHandler.h>
 #include <Infrastructure/InterruptController.h>
+#include <Infrastructure/StateReader.h>
+#include <Infrastructure/StateWriter.h>
+#include <Infrastructure/VirtualTimer.h>
 
+#include <algorithm>
+#include <functional>
 #include <stdexcept>
 #include <string>
 
-X86EmuCPUEmulation::X86EmuCPUEmulation() : m_interruptPending(false), m_run(true) {
+X86EmuCPUEmulation::X86EmuCPUEmulation() : m_interruptPending(false), m_run(true), m_timerSequence(0), m_nextTimerDeadline(UINT64_MAX),
+	m_stopTime(UINT64_MAX), m_stopInstructions(UINT64_MAX), m_stopped(false), m_slicing(false), m_parked(false),
+	m_lagPolicy(LagPolicy::Slew), m_realTimePacing(true), m_nextPacingCheck(0), m_pacingBaseCycles(0), m_cycleOffset(0), m_lagCycles(0), m_droppedCycles(0) {
+
 	m_emulator.reset(x86emu_new(0, 0));
 	//x86emu_set_log(m_emulator.get(), 16384, flushLog);
 	m_nativeMemioHandler = x86emu_set_memio_handler(m_emulator.get(), memioHandler);
@@ -25,33 +34,306 @@ void X86EmuCPUEmulation::start() {
 }
 
 void X86EmuCPUEmulation::stop() {
-	m_run = false;
+	{
+		std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+		m_run = false;
+		m_stopCondvar.notify_all();
+		wake();
+	}
+
 	if (m_cpu0Thread.joinable())
 		m_cpu0Thread.join();
 }
 
+void X86EmuCPUEmulation::setStop(uint64_t stopTime, uint64_t stopInstructions) {
+	std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+
+	m_stopTime = stopTime;
+	m_stopInstructions = stopInstructions;
+	m_stopCondvar.notify_all();
+	wake();
+}
+
+void X86EmuCPUEmulation::waitForStop() {
+	std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+
+	// Stopped, but maybe at a stop that has been moved since
+	m_stopCondvar.wait(locker, [this]() { return !m_run.load() || (m_stopped && stopReached()); });
+}
+
+uint64_t X86EmuCPUEmulation::instructions() const {
+	return m_emulator->x86.R_TSC;
+}
+
+bool X86EmuCPUEmulation::stopReached() const {
+	return cycles() >= m_stopTime || instructions() >= m_stopInstructions;
+}
+
+void X86EmuCPUEmulation::waitWhileStopped(std::unique_lock<std::recursive_mutex>& locker) {
+	m_stopped = true;
+	m_stopCondvar.notify_all();
+
+	// Woken up by scheduleTimer() for the timers that are to run right away
+	m_stopCondvar.wait(locker, [this]() { return !m_run.load() || !stopReached() || cycles() >= m_nextTimerDeadline; });
+
+	m_stopped = false;
+
+	// Real time spent waiting is none of the pacing's business
+	rebasePacing();
+}
+
+void X86EmuCPUEmulation::wake() {
+	if (!m_parked)
+		return;
+
+	m_parked = false;
+
+	if (wakeHandler())
+		wakeHandler()();
+}
+
 bool X86EmuCPUEmulation::shouldDeliverInterrupt() const {
 	auto interruptPending = m_interruptPending.load();
 	return interruptPending && (m_emulator->x86.R_FLG & FB_IF) && (m_emulator->x86.intr_type == 0);
 }
 
 void X86EmuCPUEmulation::cpu0Thread() {
+	{
+		std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+		rebasePacing();
+	}
+
 	while (m_run.load()) {
 		std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
 
-		if (shouldDeliverInterrupt()) {
-			auto vector = interruptController()->processInterruptAcknowledge();
+		if (cycles() >= m_nextTimerDeadline)
+			runExpiredTimers();
+
+		if (stopReached()) {
+			waitWhileStopped(locker);
+			continue;
+		}
+
+		executeInstruction();
 
-			x86emu_intr_raise(m_emulator.get(), vector, INTR_TYPE_SOFT, 0);
+		std::chrono::steady_clock::time_point resumeTime;
+		if (cycles() >= m_nextPacingCheck && pace(resumeTime)) {
+			locker.unlock();
+			std::this_thread::sleep_until(resumeTime);
 		}
+	}
+}
 
-		m_emulator->max_instr = m_emulator->x86.R_TSC + 1;
-		auto result = x86emu_run(m_emulator.get(), X86EMU_RUN_NO_EXEC);
-		x86emu_clear_log(m_emulator.get(), 1);
-		//if (result != X86EMU_RUN_MAX_INSTR) {
+CPUEmulation::SliceResult X86EmuCPUEmulation::runSlice(uint64_t instructions, std::chrono::steady_clock::time_point& wakeTime) {
+	std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+
+	m_parked = false;
+
+	// As for the CPU thread, real time is measured from the first slice, and not while stopped
+	if (!m_slicing || m_stopped) {
+		m_slicing = true;
+		m_stopped = false;
+		rebasePacing();
+	}
+
+	for (uint64_t executed = 0; executed < instructions; executed++) {
+		if (!m_run.load())
+			return SliceResult::Finished;
+
+		if (cycles() >= m_nextTimerDeadline)
+			runExpiredTimers();
+
+		if (stopReached()) {
+			m_stopped = true;
+			m_parked = true;
+			m_stopCondvar.notify_all();
+
+			wakeTime = std::chrono::steady_clock::time_point::max();
+			return SliceResult::Parked;
+		}
+
+		executeInstruction();
+
+		if (cycles() >= m_nextPacingCheck && pace(wakeTime)) {
+			m_parked = true;
+			return SliceResult::Parked;
+		}
+	}
+
+	return m_run.load() ? SliceResult::Runnable : SliceResult::Finished;
+}
+
+void X86EmuCPUEmulation::executeInstruction() {
+	if (shouldDeliverInterrupt()) {
+		auto vector = interruptController()->processInterruptAcknowledge();
+
+		if (executionLog())
+			executionLog()->interruptDelivered(vector);
+
+		x86emu_intr_raise(m_emulator.get(), vector, INTR_TYPE_SOFT, 0);
+	}
+
+	m_emulator->max_instr = m_emulator->x86.R_TSC + 1;
+	auto result = x86emu_run(m_emulator.get(), X86EMU_RUN_NO_EXEC);
+	x86emu_clear_log(m_emulator.get(), 1);
+	//if (result != X86EMU_RUN_MAX_INSTR) {
 //			throw std::runtime_error("unexpected stop: " + std::to_string(result));
 //		}
+}
+
+bool X86EmuCPUEmulation::pace(std::chrono::steady_clock::time_point& resumeTime) {
+	auto now = cycles();
+
+	auto realNow = std::chrono::steady_clock::now();
+
+	if (!m_realTimePacing.load()) {
+		// Measured from here on once pacing is back on, rather than owing all the time run ahead
+		rebasePacing();
+		return false;
+	}
+
+	auto due = m_pacingBaseTime + std::chrono::microseconds((now - m_pacingBaseCycles) * 1000000 / Frequency);
+
+	if (due > realNow) {
+		m_lagCycles = 0;
+		m_nextPacingCheck = now + PacingInterval;
+
+		resumeTime = due;
+		return true;
+	}
+
+	auto lag = realNow - due;
+	m_lagCycles = std::chrono::duration_cast<std::chrono::microseconds>(lag).count() * Frequency / 1000000;
+
+	std::chrono::milliseconds maximumLag;
+	uint64_t step;
+
+	switch (m_lagPolicy.load()) {
+	case LagPolicy::CatchUp:
+		maximumLag = MaximumCatchUpLag;
+		step = CatchUpStep;
+		break;
+
+	case LagPolicy::Slew:
+		maximumLag = MaximumSlewLag;
+		step = SlewStep;
+		break;
+
+	default:
+		maximumLag = MaximumDropLag;
+		step = 0;
+		break;
+	}
+
+	if (lag > maximumLag) {
+		// Rushing to catch up would only make the machine time jump instead
+		m_droppedCycles += m_lagCycles;
+		m_lagCycles = 0;
+		m_pacingBaseTime = realNow;
+		m_pacingBaseCycles = now;
 	}
+	else if (lag > LagTolerance && step != 0) {
+		/*
+		 * Machine time is moved ahead of the instructions, a little at every
+		 * check, so that the timer interrupts owed are delivered at a bounded
+		 * rate rather than back to back.
+		 */
+		step = std::min(step, m_lagCycles);
+		m_cycleOffset += step;
+		m_lagCycles -= step;
+	}
+
+	m_nextPacingCheck = cycles() + PacingInterval;
+
+	return false;
+}
+
+void X86EmuCPUEmulation::rebasePacing() {
+	m_lagCycles = 0;
+	m_pacingBaseTime = std::chrono::steady_clock::now();
+	m_pacingBaseCycles = cycles();
+	m_nextPacingCheck = m_pacingBaseCycles + PacingInterval;
+}
+
+void X86EmuCPUEmulation::setLagPolicy(LagPolicy policy) {
+	m_lagPolicy = policy;
+}
+
+void X86EmuCPUEmulation::setRealTimePacing(bool pacing) {
+	m_realTimePacing = pacing;
+}
+
+uint64_t X86EmuCPUEmulation::lagCycles() const {
+	return m_lagCycles;
+}
+
+uint64_t X86EmuCPUEmulation::droppedCycles() const {
+	return m_droppedCycles;
+}
+
+void X86EmuCPUEmulation::scheduleTimer(VirtualTimer* timer, uint64_t deadline) {
+	std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+
+	auto it = std::find_if(m_timers.begin(), m_timers.end(), [timer](const ScheduledTimer& scheduled) { return scheduled.timer == timer; });
+	if (it == m_timers.end()) {
+		m_timers.emplace_back(ScheduledTimer{ timer, deadline, m_timerSequence++ });
+	}
+	else {
+		it->deadline = deadline;
+		it->sequence = m_timerSequence++;
+	}
+
+	updateNextTimerDeadline();
+
+	if (m_stopped)
+		m_stopCondvar.notify_all();
+
+	// Such as from Machine::runOnCPUThread(); a parked CPU would otherwise not get to it
+	if (deadline <= cycles())
+		wake();
+}
+
+void X86EmuCPUEmulation::cancelTimer(VirtualTimer* timer) {
+	std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+
+	m_timers.erase(std::remove_if(m_timers.begin(), m_timers.end(), [timer](const ScheduledTimer& scheduled) { return scheduled.timer == timer; }), m_timers.end());
+
+	updateNextTimerDeadline();
+}
+
+void X86EmuCPUEmulation::runExpiredTimers() {
+	/*
+	 * One at a time, as the handlers may schedule timers again, or load a
+	 * state and move the clock. Earliest first, and timers due together in
+	 * the order they were scheduled in. That order comes from the guest and
+	 * the input log alone, unlike the addresses of the timers, so a replay
+	 * runs them in the order the recording did.
+	 */
+	while (true) {
+		auto now = cycles();
+		auto it = std::min_element(m_timers.begin(), m_timers.end(), [](const ScheduledTimer& a, const ScheduledTimer& b) {
+			return a.deadline < b.deadline || (a.deadline == b.deadline && a.sequence < b.sequence);
+		});
+		if (it == m_timers.end() || it->deadline > now)
+			break;
+
+		auto timer = it->timer;
+		m_timers.erase(it);
+		timer->timerExpired();
+	}
+
+	updateNextTimerDeadline();
+}
+
+void X86EmuCPUEmulation::updateNextTimerDeadline() {
+	m_nextTimerDeadline = UINT64_MAX;
+
+	for (const auto& scheduled : m_timers)
+		m_nextTimerDeadline = std::min(m_nextTimerDeadline, scheduled.deadline);
+}
+
+uint64_t X86EmuCPUEmulation::cycles() const {
+	return m_emulator->x86.R_TSC * CyclesPerInstruction + m_cycleOffset;
 }
 
 void X86EmuCPUEmulation::mapMemory(uint64_t base, uint64_t limit, void* hostMemory, unsigned int permissions) {
@@ -96,6 +378,65 @@ void X86EmuCPUEmulation::unmapMemoryInternal(uint64_t base, uint64_t limit) {
 
 }
 
+void X86EmuCPUEmulation::saveState(StateWriter& writer) const {
+	const auto& regs = m_emulator->x86;
+
+	writer.beginChunk("CPU ");
+
+	for (auto value : { regs.R_EAX, regs.R_EBX, regs.R_ECX, regs.R_EDX, regs.R_ESP, regs.R_EBP, regs.R_ESI, regs.R_EDI, regs.R_EIP, regs.R_EFLG })
+		writer.write32(value);
+
+	for (unsigned int index = 0; index < SegmentRegisterCount; index++) {
+		const auto& segment = regs.seg[index];
+		writer.write16(segment.sel);
+		writer.write32(segment.base);
+		writer.write32(segment.limit);
+		writer.write32(segment.acc);
+	}
+
+	writer.write64(regs.R_TSC);
+	writer.write64(m_cycleOffset);
+
+	writer.endChunk();
+}
+
+void X86EmuCPUEmulation::loadState(StateReader& reader) {
+	std::unique_lock<std::recursive_mutex> locker(m_emulatorMutex);
+
+	auto& regs = m_emulator->x86;
+	auto before = cycles();
+
+	reader.beginChunk("CPU ");
+
+	for (auto value : { &regs.R_EAX, &regs.R_EBX, &regs.R_ECX, &regs.R_EDX, &regs.R_ESP, &regs.R_EBP, &regs.R_ESI, &regs.R_EDI, &regs.R_EIP, &regs.R_EFLG })
+		*value = reader.read32();
+
+	for (unsigned int index = 0; index < SegmentRegisterCount; index++) {
+		auto& segment = regs.seg[index];
+		segment.sel = reader.read16();
+		segment.base = reader.read32();
+		segment.limit = reader.read32();
+		segment.acc = static_cast<decltype(segment.acc)>(reader.read32());
+	}
+
+	regs.R_TSC = reader.read64();
+	m_cycleOffset = reader.read64();
+
+	reader.endChunk();
+
+	auto after = cycles();
+
+	for (auto& scheduled : m_timers) {
+		if (scheduled.deadline != 0)
+			scheduled.deadline = after + (scheduled.deadline > before ? scheduled.deadline - before : 0);
+	}
+
+	updateNextTimerDeadline();
+
+	// Real time is measured from here on; whatever lag there was belonged to the old machine time
+	rebasePacing();
+}
+
 void X86EmuCPUEmulation::setInterruptAsserted(bool interrupt) {
 	m_interruptPending = interrupt;
 }
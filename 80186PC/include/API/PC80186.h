@@ -0,0 +1,120 @@
+#ifndef API_PC80186_H
+#define API_PC80186_H
+
+/*
+ * C interface of the emulator library, for embedding any number of
+ * machines in one process. Every machine runs on a CPU thread of its own;
+ * the functions can be called from any thread, and only wait on the machine
+ * they are given.
+ *
+ * Functions returning int return 0 on success and -1 on failure, with
+ * pc80186_last_error() describing it. Paths and text are UTF-8.
+ *
+ * The interface only ever grows: new functions are added, and new fields
+ * are added to the end of pc80186_config, which is versioned by its size.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef PC80186_BUILDING_LIBRARY
+#define PC80186_API __declspec(dllexport)
+#else
+#define PC80186_API __declspec(dllimport)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PC80186_API_VERSION 1
+
+// Machine time runs at this many cycles a second
+#define PC80186_CLOCK_FREQUENCY 4772727
+
+typedef struct pc80186_machine pc80186_machine;
+
+typedef struct pc80186_config {
+	// sizeof(pc80186_config), set by pc80186_config_init()
+	uint32_t size;
+	// VHD image, required
+	const char* hard_disk_image;
+	// Save state to start from, as a copy-on-write clone of the machine that saved it, or NULL
+	const char* save_state;
+	// 48 KiB BIOS ROM image, or NULL for the one built into the library
+	const char* bios_image;
+	// Nonzero to pace machine time to real time, zero to run as fast as possible
+	int real_time;
+	// Nonzero to wait before the first instruction until the machine is run
+	int start_stopped;
+} pc80186_config;
+
+enum {
+	PC80186_BUTTON_LEFT = 0,
+	PC80186_BUTTON_MIDDLE = 1,
+	PC80186_BUTTON_RIGHT = 2
+};
+
+// Pixel values of pc80186_render_screen()
+enum {
+	PC80186_SHADE_BLACK = 0,
+	PC80186_SHADE_NORMAL = 1,
+	PC80186_SHADE_BRIGHT = 2
+};
+
+PC80186_API int pc80186_api_version(void);
+
+// Of the last call that failed on this thread
+PC80186_API const char* pc80186_last_error(void);
+
+// Defaults: real time, running right away
+PC80186_API void pc80186_config_init(pc80186_config* config);
+
+// Returns NULL on failure
+PC80186_API pc80186_machine* pc80186_create(const pc80186_config* config);
+PC80186_API void pc80186_destroy(pc80186_machine* machine);
+
+/*
+ * Runs the machine for a number of instructions or cycles of machine time,
+ * whichever comes first, and returns once it has stopped there. UINT64_MAX
+ * leaves either out, but not both. The machine stays stopped until it is run
+ * again or resumed.
+ */
+PC80186_API int pc80186_run(pc80186_machine* machine, uint64_t instructions, uint64_t cycles);
+PC80186_API int pc80186_pause(pc80186_machine* machine);
+PC80186_API int pc80186_resume(pc80186_machine* machine);
+
+PC80186_API int pc80186_machine_time(pc80186_machine* machine, uint64_t* cycles);
+
+// Input is delivered within a millisecond of machine time
+PC80186_API int pc80186_push_scancodes(pc80186_machine* machine, const uint8_t* scancodes, size_t count);
+PC80186_API int pc80186_type_text(pc80186_machine* machine, const char* text);
+PC80186_API int pc80186_mouse_motion(pc80186_machine* machine, int dx, int dy);
+PC80186_API int pc80186_mouse_button(pc80186_machine* machine, int button, int pressed);
+
+/*
+ * The text mode screen, a newline after every row. Stores as much as fits,
+ * always NUL terminated, and returns the size needed, including the NUL, or
+ * 0 on failure, such as when the screen is not in text mode.
+ */
+PC80186_API size_t pc80186_read_text(pc80186_machine* machine, char* buffer, size_t size);
+
+/*
+ * Renders the screen, a byte per pixel, row by row with no padding, so rows
+ * are width bytes apart, into pixels. Always sets width and height: a call
+ * with NULL pixels only does that, and succeeds, to tell the size to
+ * allocate; otherwise it fails if pixels holds fewer than width * height
+ * bytes.
+ */
+PC80186_API int pc80186_render_screen(pc80186_machine* machine, uint8_t* pixels, size_t size, unsigned int* width,
+	unsigned int* height);
+
+// Save states, as in the executable. Loading needs the disk image the state was saved with.
+PC80186_API int pc80186_save_state(pc80186_machine* machine, const char* path);
+PC80186_API int pc80186_load_state(pc80186_machine* machine, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
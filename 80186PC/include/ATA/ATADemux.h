@@ -15,6 +15,9 @@ public:
 
 	bool isInterruptRequested() const override;
 
+	void saveState(StateWriter& writer) override;
+	void loadState(StateReader& reader) override;
+
 private:
 	void interruptRequestedChanged(IATADevice* device) override;
 
@@ -5,6 +5,7 @@
 #include <mutex>
 #include <atomic>
 #include <array>
+#include <condition_variable>
 
 #include <ATA/IATADevice.h>
 
@@ -21,6 +22,20 @@ public:
 
 	bool isInterruptRequested() const override;
 
+	void saveState(StateWriter& writer) override;
+	void loadState(StateReader& reader) override;
+
+	/*
+	 * Whether resets and commands are carried out on the calling thread, from
+	 * within the register write that starts them, rather than by the drive
+	 * thread. The guest then never sees the drive busy, and everything the
+	 * drive does happens at the same point of its execution every time.
+	 *
+	 * The drive thread is only started by the first access that needs it, so
+	 * a device made synchronous before then never has one.
+	 */
+	void setSynchronous(bool synchronous);
+
 protected:
 	struct ATACommand {
 		uint8_t feature;
@@ -66,11 +81,17 @@ private:
 	};
 
 	void driveThread();
+	void startDriveThreadLocked();
+	// Carries out the reset and command requested, if any
+	void processRequestsLocked(std::unique_lock<std::mutex>& locker);
 	void postReset();
 	void postResetLocked();
 	void postCommand();
 	void postCommandLocked();
 
+	// Until the drive thread has no reset or command left to work on
+	void waitForIdleLocked(std::unique_lock<std::mutex>& locker);
+
 	void setInterruptLocked();
 	void clearInterruptLocked();
 	bool isInterruptRequestedLocked() const;
@@ -80,6 +101,7 @@ private:
 	mutable std::mutex m_driveThreadMutex;
 	std::condition_variable m_driveThreadCondvar;
 	bool m_stopDriveThread;
+	bool m_synchronous;
 	bool m_resetRequest;
 	bool m_commandRequest;
 	bool m_interruptPending;
@@ -7,11 +7,33 @@
 
 #include <filesystem>
 
+class ExecutionLog;
+
 class ATAHardDisk final : public ATADevice {
 public:
 	explicit ATAHardDisk(const std::filesystem::path& diskImage);
 	~ATAHardDisk();
 
+	/*
+	 * Creates a differencing image that reads as the parent and keeps writes
+	 * to itself, so that several machines can run from one image. The parent
+	 * must not be written to while it has overlays.
+	 *
+	 * An earlier overlay of the same parent in its place is replaced, as it
+	 * may no longer match a save state; any other file there, the parent
+	 * included, is left alone, and the overlay is not created.
+	 */
+	static void createOverlay(const std::filesystem::path& parent, const std::filesystem::path& overlay);
+
+	// Is told a checksum of every read, which has to come from the CPU thread, see setSynchronous()
+	inline void setExecutionLog(ExecutionLog* executionLog) {
+		m_executionLog = executionLog;
+	}
+
+	// The image itself is not part of it; it has to be the same, unchanged, when the state is loaded.
+	void saveState(StateWriter& writer) override;
+	void loadState(StateReader& reader) override;
+
 protected:
 	void resetDevice() override;
 	void executeCommand(const ATACommand& command, ATACommandResult& result) override;
@@ -59,6 +81,7 @@ private:
 	void pioNext();
 
 	WindowsHandle m_disk;
+	ExecutionLog* m_executionLog;
 	IdentifyDriveResponse m_identify;
 	static const char m_serialNumber[20];
 	static const char m_firmwareRevision[8];
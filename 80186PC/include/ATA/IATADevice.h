@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 class IATADevice;
+class StateReader;
+class StateWriter;
 
 class IATADeviceHost {
 protected:
@@ -37,6 +39,14 @@ public:
 	virtual void attachToHost(IATADeviceHost* host) = 0;
 
 	virtual bool isInterruptRequested() const = 0;
+
+	/*
+	 * Registers and any transfer in progress, for save states; a command
+	 * being executed is waited for first. The host is not told about the
+	 * interrupt request of a loaded state, it has to ask.
+	 */
+	virtual void saveState(StateWriter& writer) = 0;
+	virtual void loadState(StateReader& reader) = 0;
 };
 
 #endif
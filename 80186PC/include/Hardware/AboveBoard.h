@@ -9,8 +9,11 @@
 #include <stdint.h>
 
 #include <array>
+#include <vector>
 
 class AddressSpaceDispatcher;
+class StateReader;
+class StateWriter;
 
 class AboveBoard final : public IAddressRangeHandler {
 public:
@@ -22,6 +25,24 @@ public:
 	void write(uint64_t address, unsigned int accessSize, uint64_t data) override;
 	uint64_t read(uint64_t address, unsigned int accessSize) override;
 
+	inline WindowsMemoryRegion& expandedMemory() {
+		return m_expandedMemory;
+	}
+
+	// The page mapping only; the expanded memory is saved as a whole by the machine.
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
+
+	/*
+	 * Write tracking, off until enabled as it makes remapping dearer. Once on,
+	 * collectWrites() appends the pages of expanded memory, in
+	 * MappedAddressRange::WriteTrackingPageSize units, written through the
+	 * page frame since the last call; everything counts as written at first.
+	 * CPU thread only.
+	 */
+	void enableWriteTracking();
+	void collectWrites(std::vector<size_t>& pages);
+
 private:
 	uint8_t read8(uint64_t address, uint8_t mask);
 	void write8(uint64_t address, uint8_t mask, uint8_t data);
@@ -30,6 +51,8 @@ private:
 
 	void map(unsigned int logicalPage, bool present, unsigned int physicalPage);
 
+	static constexpr size_t PhysicalPageSize = 16 * 1024;
+
 	struct LogicalPageState {
 		LogicalPageState();
 		~LogicalPageState();
@@ -39,11 +62,17 @@ private:
 
 		MappedAddressRange addressRange;
 		AddressRangeRegistration registration;
+		uint64_t writeGeneration;
 	};
 
+	void collectWrites(LogicalPageState& logicalPageState, std::vector<size_t>& pages);
+
 	WindowsMemoryRegion m_expandedMemory;
 	AddressSpaceDispatcher* m_memoryDispatcher;
 	std::array<LogicalPageState, 32> m_logicalPages;
+	// Collected from logical pages as they are mapped elsewhere
+	std::vector<size_t> m_writtenPages;
+	bool m_writeTracking;
 
 	uint8_t m_reg7Field0;
 };
@@ -2,18 +2,26 @@
 #define HARDWARE_BUS_MOUSE_H
 
 #include <Infrastructure/IAddressRangeHandler.h>
+#include <Infrastructure/VirtualClock.h>
+#include <Infrastructure/VirtualTimer.h>
 #include <Hardware/PPI.h>
 #include <Hardware/PPIConsumer.h>
 #include <UI/Mouse.h>
 
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
-#include <thread>
 
 class InterruptLine;
+class StateReader;
+class StateWriter;
 
-class BusMouse final : public IAddressRangeHandler, private PPIConsumer, public Mouse {
+/*
+ * Logitech bus mouse. The card interrupts at a fixed rate, but only while
+ * there is motion or a button change the guest has not read yet, so that an
+ * idle mouse costs the guest nothing. Motion and buttons are accumulated
+ * from any thread without taking a lock; the interrupts are timed on the
+ * CPU thread against the virtual clock.
+ */
+class BusMouse final : public IAddressRangeHandler, private PPIConsumer, public Mouse, private VirtualTimer {
 public:
 	BusMouse();
 	~BusMouse();	
@@ -26,12 +34,24 @@ public:
 		m_interruptLine = interruptLine;
 	}
 
+	inline VirtualClock* clock() const {
+		return m_clock;
+	}
+
+	inline void setClock(VirtualClock* clock) {
+		m_clock = clock;
+	}
+
 	void write(uint64_t address, unsigned int accessSize, uint64_t data) override;
 	uint64_t read(uint64_t address, unsigned int accessSize) override;
 	
 	void updateButtonState(unsigned int button, bool state) override;
 	void addDeltas(int dx, int dy) override;
 
+	// CPU thread only. Includes motion and button changes not read yet.
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
+
 private:
 	uint8_t readPortA(uint8_t mask) const override;
 	void writePortA(uint8_t value, uint8_t mask) override;
@@ -42,14 +62,22 @@ private:
 	uint8_t readPortC(uint8_t mask) const override;
 	void writePortC(uint8_t value, uint8_t mask) override;
 
-	void busMouseThread();
+	// 30 Hz, the rate the card is usually jumpered to
+	static constexpr uint64_t InterruptPeriod = VirtualClock::Frequency / 30;
+	// Drivers find the IRQ by enabling interrupts and watching port C, so the card keeps pulsing this long after
+	static constexpr uint64_t ProbeWindow = VirtualClock::Frequency / 2;
+
+	void timerExpired() override;
 
-	int8_t transferDeltaClamped(int& delta);
+	bool inputPending() const;
+	void inputChanged();
+	void setInterruptAsserted(bool asserted);
 
-	std::mutex m_uiMutex;
-	unsigned int m_uiButtons;
-	int m_uiDeltaX;
-	int m_uiDeltaY;
+	static int8_t transferDeltaClamped(std::atomic<int>& delta);
+
+	std::atomic<unsigned int> m_uiButtons;
+	std::atomic<int> m_uiDeltaX;
+	std::atomic<int> m_uiDeltaY;
 
 	std::atomic<unsigned int> m_buttons;
 	std::atomic<int8_t> m_deltaX;
@@ -57,14 +85,17 @@ private:
 	
 	PPI m_mousePPI;
 	std::atomic<InterruptLine*> m_interruptLine;
-	std::mutex m_threadMutex;
-	bool m_runThread;
-	std::condition_variable m_threadCondvar;
+	VirtualClock* m_clock;
 	std::atomic<bool> m_interruptEnabled;
 	std::atomic<bool> m_interruptAsserted;
 	std::atomic<bool> m_hold;
 	std::atomic<unsigned int> m_selector;
-	std::thread m_busMouseThread;
+
+	// Set while the timer is scheduled, so that input only schedules it when it is not
+	std::atomic<bool> m_timerActive;
+	// CPU thread only
+	uint64_t m_lastInterrupt;
+	uint64_t m_probeDeadline;
 };
 
 #endif
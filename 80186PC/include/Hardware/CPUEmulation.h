@@ -2,12 +2,20 @@
 #define HARDWARE_CPU_EMULATION_H
 
 #include <stdint.h>
+
+#include <chrono>
+#include <functional>
+
 #include <Infrastructure/InterruptLine.h>
+#include <Infrastructure/VirtualClock.h>
 
+class ExecutionLog;
 class IAddressRangeHandler;
 class InterruptController;
+class StateReader;
+class StateWriter;
 
-class CPUEmulation : public InterruptLine {
+class CPUEmulation : public InterruptLine, public VirtualClock {
 protected:
 	CPUEmulation();
 
@@ -41,16 +49,82 @@ public:
 		m_interruptController = interruptController;
 	}
 
+	// Told about every interrupt delivered, on the CPU thread
+	inline ExecutionLog* executionLog() const {
+		return m_executionLog;
+	}
+
+	inline void setExecutionLog(ExecutionLog* executionLog) {
+		m_executionLog = executionLog;
+	}
+
+	/*
+	 * Called when a CPU run in slices, and parked, has something to do again.
+	 * Comes from whichever thread woke it, with the CPU locked, so it should
+	 * do no more than hand the CPU back to its scheduler.
+	 */
+	inline const std::function<void()>& wakeHandler() const {
+		return m_wakeHandler;
+	}
+
+	inline void setWakeHandler(std::function<void()> handler) {
+		m_wakeHandler = std::move(handler);
+	}
+
 	virtual void start() = 0;
 	virtual void stop() = 0;
 
+	enum class SliceResult {
+		// Has more to do right away
+		Runnable,
+		// Waiting at a stop, or ahead of real time
+		Parked,
+		// Stopped for good
+		Finished
+	};
+
+	/*
+	 * Instead of start(), the CPU can be run in slices, on threads of a
+	 * scheduler's choosing; slices of one CPU must not overlap. Runs up to
+	 * this many instructions, fewer if the CPU reaches a stop or gets ahead
+	 * of real time, and parks then. Parked at a stop, it has nothing to do
+	 * until the wake handler is called; ahead of real time, until wakeTime,
+	 * or the wake handler, whichever comes first.
+	 */
+	virtual SliceResult runSlice(uint64_t instructions, std::chrono::steady_clock::time_point& wakeTime) = 0;
+
+	/*
+	 * Stepping. With a stop set, the CPU waits between two instructions once
+	 * machine time reaches stopTime or it has executed stopInstructions
+	 * instructions in all, whichever comes first, until the stop is moved.
+	 * Timers due by then have run, and timers scheduled to run right away
+	 * still do while it waits. UINT64_MAX for both, the default, runs freely.
+	 */
+	virtual void setStop(uint64_t stopTime, uint64_t stopInstructions) = 0;
+
+	// Until the CPU waits at the stop set, or has been stopped altogether
+	virtual void waitForStop() = 0;
+
+	// Executed since the CPU was created. Only consistent on the CPU thread.
+	virtual uint64_t instructions() const = 0;
+
 	virtual void mapMemory(uint64_t base, uint64_t limit, void* hostMemory, unsigned int permissions) = 0;
 	virtual void unmapMemory(uint64_t base, uint64_t limit) = 0;
 
+	/*
+	 * Registers and machine time, for save states. CPU thread only. Timers
+	 * scheduled when a state is loaded stay as far ahead of the machine time
+	 * as they were, so devices only have to reschedule their own.
+	 */
+	virtual void saveState(StateWriter& writer) const = 0;
+	virtual void loadState(StateReader& reader) = 0;
+
 private:
 	IAddressRangeHandler* m_mmioDispatcher = nullptr;
 	IAddressRangeHandler* m_ioDispatcher = nullptr;
 	InterruptController* m_interruptController = nullptr;
+	ExecutionLog* m_executionLog = nullptr;
+	std::function<void()> m_wakeHandler;
 };
 
 #endif
@@ -2,10 +2,18 @@
 #define HERCULES_VIDEO_H
 
 #include <Infrastructure/IAddressRangeHandler.h>
+#include <Infrastructure/MappedAddressRange.h>
+#include <Infrastructure/VirtualClock.h>
 #include <UI/VideoAdapter.h>
+#include <UI/TextScreen.h>
 
 #include <array>
-#include <shared_mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+class StateReader;
+class StateWriter;
 
 class HerculesVideo final : public IAddressRangeHandler, public VideoAdapter {
 public:
@@ -15,24 +23,77 @@ public:
 	void write(uint64_t address, unsigned int accessSize, uint64_t data) override;
 	uint64_t read(uint64_t address, unsigned int accessSize) override;
 
-	void acquireAdapterConfiguration(AdapterConfiguration& config) override;
+	void acquireAdapterConfiguration(AdapterConfiguration& config, uint64_t sinceGeneration) override;
+	bool waitForFramebufferWrites(uint64_t sinceGeneration, std::chrono::steady_clock::time_point deadline) override;
 
-	inline void setFramebuffer(unsigned char* framebuffer) {
+	/*
+	 * If write tracking is enabled on the framebuffer range, it is used to
+	 * report the changed scan lines.
+	 */
+	inline void setFramebuffer(MappedAddressRange* framebuffer) {
 		m_framebuffer = framebuffer;
 	}
 
+	// Returns false unless text is being displayed.
+	bool captureTextScreen(TextScreen& screen);
+
+	/*
+	 * Blocks until the predicate accepts the text screen, or until the
+	 * timeout expires. The screen is rechecked whenever the framebuffer is
+	 * written, and periodically to catch changes of the CRTC registers. The
+	 * last screen seen is returned through lastScreen, if requested.
+	 */
+	bool waitForTextScreen(const std::function<bool(const TextScreen& screen)>& predicate, std::chrono::milliseconds timeout,
+		TextScreen* lastScreen = nullptr);
+
+	// Status register timing follows the clock.
+	inline void setClock(VirtualClock* clock) {
+		m_clock = clock;
+	}
+
+	// CPU thread only. The framebuffer is not part of it.
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
+
 private:
 	uint8_t read8(uint64_t address, uint8_t mask);
 	void write8(uint64_t address, uint8_t mask, uint8_t data);
 
-	static constexpr float MDACrystal = 16.257e6f;
+	/*
+	 * The 16.257 MHz dot clock is 109/32 of the CPU clock, to within 0.001%.
+	 */
+	static constexpr uint64_t DotsPerCycleNumerator = 109;
+	static constexpr uint64_t DotsPerCycleDenominator = 32;
+
+	static constexpr std::chrono::milliseconds TextScreenRecheckInterval{ 100 };
 
-	bool hblank() const;
+	// The 6845 has a fixed vertical sync width
+	static constexpr unsigned int VerticalSyncLines = 16;
+
+	/*
+	 * Beam timing in dots, precomputed from the registers whenever they change.
+	 */
+	struct CRTCTiming {
+		uint32_t lineDots;
+		uint32_t frameDots;
+		uint32_t horizontalDisplayDots;
+		uint32_t verticalDisplayLines;
+		uint32_t verticalSyncFirstLine;
+		uint32_t verticalSyncEndLine;
+	};
+
+	void updateTiming();
+	uint8_t readStatus() const;
+
+	uint64_t changedScanLineBands(const AdapterConfiguration& config, uint64_t sinceGeneration) const;
 
 	enum {
 		CRTCHTotal			 = 0x00,
 		CRTCHDisplay		 = 0x01,
+		CRTCVTotal			 = 0x04,
+		CRTCVTotalAdjust	 = 0x05,
 		CRTCVDisplay		 = 0x06,
+		CRTCVSyncPosition	 = 0x07,
 		CRTCMaxScanLine		 = 0x09,
 		CRTCCursorStart      = 0x0A,
 		CRTCCursorEnd        = 0x0B,
@@ -42,12 +103,33 @@ private:
 		CRTCCursorAddressLSB = 0x0F,
 	};
 
-	mutable std::shared_mutex m_configurationMutex;
-	uint8_t m_mode;
+	static constexpr size_t CRTCRegisterCount = 18;
+
+	struct RegisterState {
+		uint8_t mode;
+		uint8_t graphicsEnable;
+		std::array<uint8_t, CRTCRegisterCount> crtcRegisters;
+	};
+
+	void publishRegisters();
+	void snapshotRegisters(RegisterState& state) const;
+
+	/*
+	 * Registers are only ever written by the CPU thread, which owns m_registers
+	 * and reads it directly. Other threads read the copy published through a
+	 * seqlock: m_publishedSequence is odd while an update is in progress.
+	 */
+	RegisterState m_registers;
 	uint8_t m_crtcAddress;
-	uint8_t m_graphicsEnable;
-	std::array<uint8_t, 18> m_crtcRegisters;
-	unsigned char* m_framebuffer;
+	CRTCTiming m_timing;
+	VirtualClock* m_clock;
+
+	std::atomic<uint32_t> m_publishedSequence;
+	std::atomic<uint8_t> m_publishedMode;
+	std::atomic<uint8_t> m_publishedGraphicsEnable;
+	std::array<std::atomic<uint8_t>, CRTCRegisterCount> m_publishedCRTCRegisters;
+
+	MappedAddressRange* m_framebuffer;
 };
 
 #endif
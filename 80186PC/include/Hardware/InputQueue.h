@@ -0,0 +1,130 @@
+#ifndef HARDWARE_INPUT_QUEUE_H
+#define HARDWARE_INPUT_QUEUE_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <UI/Keyboard.h>
+#include <UI/Mouse.h>
+#include <Infrastructure/VirtualClock.h>
+#include <Infrastructure/VirtualTimer.h>
+
+class ExecutionLog;
+
+/*
+ * Keyboard and mouse input on its way from the UIs, the automation script
+ * and the VNC server to the devices. Any number of threads queue events
+ * without taking a lock, so that input never waits on the emulation or the
+ * other way around; the CPU thread takes them out between instructions,
+ * every DrainInterval of machine time, and hands them to the devices in
+ * the order they were queued.
+ *
+ * With an execution log, the events are recorded as they are delivered;
+ * while it replays, they are dropped, and the recorded ones are delivered
+ * instead, at the same machine time.
+ */
+class InputQueue final : public Keyboard, public Mouse, private VirtualTimer {
+public:
+	InputQueue();
+	~InputQueue();
+
+	InputQueue(const InputQueue& other) = delete;
+	InputQueue &operator =(const InputQueue& other) = delete;
+
+	inline VirtualClock* clock() const {
+		return m_clock;
+	}
+
+	inline void setClock(VirtualClock* clock) {
+		m_clock = clock;
+	}
+
+	// Where the events are delivered, on the CPU thread
+	inline void setKeyboard(Keyboard* keyboard) {
+		m_keyboard = keyboard;
+	}
+
+	inline void setMouse(Mouse* mouse) {
+		m_mouse = mouse;
+	}
+
+	// CPU thread only
+	inline void setExecutionLog(ExecutionLog* executionLog) {
+		m_executionLog = executionLog;
+	}
+
+	/*
+	 * Starts draining the queue, at multiples of DrainInterval of machine
+	 * time, so that a replay delivers input when the recording did. Called
+	 * again after machine time has moved, as when a state was loaded. The
+	 * clock must be set.
+	 */
+	void start();
+
+	void pushScancode(uint8_t scancode) override;
+	void pushScancodes(const uint8_t* scancodes, size_t count) override;
+	bool typeText(const std::string& text) override;
+	void setTypingFastFill(bool fastFill) override;
+
+	void updateButtonState(unsigned int button, bool state) override;
+	void addDeltas(int dx, int dy) override;
+
+	// Longest an event has been queued before it was delivered, in real time
+	inline std::chrono::steady_clock::duration longestDelay() const {
+		return std::chrono::steady_clock::duration(m_longestDelay.load());
+	}
+
+private:
+	static constexpr uint64_t DrainInterval = VirtualClock::Frequency / 1000;
+
+	enum class EventType {
+		Scancodes,
+		Text,
+		MouseButton,
+		MouseMotion,
+		FastFill
+	};
+
+	struct Event {
+		EventType type;
+		std::chrono::steady_clock::time_point queued;
+		// Scancodes or text
+		std::string data;
+		// Button and state, deltas, or whether to fast fill
+		int values[2];
+		std::atomic<Event*> next;
+	};
+
+	void timerExpired() override;
+
+	/*
+	 * Intrusive multiple producer, single consumer queue: producers swap
+	 * themselves in at m_head, the CPU thread takes events out at m_tail.
+	 * m_stub keeps the list from ever becoming empty.
+	 */
+	void push(Event* event);
+	Event* pop();
+	void deliver(const Event& event);
+
+	// As recorded in execution logs: the type, then the data or both values as 32 bit little endian numbers
+	static void encodeEvent(const Event& event, std::vector<uint8_t>& data);
+	static bool decodeEvent(const std::vector<uint8_t>& data, Event& event);
+
+	VirtualClock* m_clock;
+	Keyboard* m_keyboard;
+	Mouse* m_mouse;
+	ExecutionLog* m_executionLog;
+
+	std::atomic<Event*> m_head;
+	Event m_stub;
+	std::atomic<std::chrono::steady_clock::rep> m_longestDelay;
+
+	// CPU thread only
+	Event* m_tail;
+};
+
+#endif
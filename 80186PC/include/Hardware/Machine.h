@@ -1,14 +1,23 @@
 #ifndef MACHINE_H
 #define MACHINE_H
 
+#include <chrono>
+#include <filesystem>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <regex>
+#include <string>
+#include <vector>
 
 #include <Utils/WindowsObjectTypes.h>
 #include <Infrastructure/AddressSpaceDispatcher.h>
 #include <Infrastructure/MappedAddressRange.h>
 #include <Infrastructure/AddressRangeRegistration.h>
 #include <Infrastructure/DummyAddressRangeHandler.h>
+#include <Infrastructure/CallbackTimer.h>
+#include <Infrastructure/ExecutionLog.h>
+#include <Infrastructure/RewindBuffer.h>
 #include <Hardware/PIC.h>
 #include <Hardware/PIT.h>
 #include <Hardware/HerculesVideo.h>
@@ -21,37 +30,258 @@
 #include <ATA/ATAHardDisk.h>
 #include <Hardware/XTKeyboard.h>
 #include <Hardware/AboveBoard.h>
+#include <Hardware/InputQueue.h>
 
 class CPUEmulation;
+class StateReader;
+class StateWriter;
 
 class Machine final : private PPIConsumer {
 public:
-	explicit Machine(const std::filesystem::path &hardDiskImage);
+	struct Configuration {
+		std::filesystem::path hardDiskImage;
+		// Starts as a clone of the machine that saved it, see below
+		std::filesystem::path saveState;
+		// 48 KiB BIOS ROM image to use instead of the built-in one, if any
+		std::filesystem::path biosImage;
+		// Otherwise machine time runs as fast as the host can go
+		bool realTimePacing = true;
+		// Waits before the first instruction until it is run, see runFor()
+		bool startStopped = false;
+		// Otherwise the machine only runs in the slices it is given, such as by a MachineFleet
+		bool cpuThread = true;
+	};
+
+	/*
+	 * Starting from a save state, the machine is a clone of the one that saved
+	 * it: RAM, video RAM and expanded memory are all mapped copy-on-write from
+	 * the file, and every clone of the same file shares the pages it has not
+	 * written to with the others, through the file cache. So a clone costs
+	 * little more than the memory its guest dirties, and starts right away.
+	 * As with loadState(), each needs the disk image the state was saved
+	 * with, such as an overlay from ATAHardDisk::createOverlay() over it.
+	 */
+	explicit Machine(const Configuration& configuration);
+	explicit Machine(const std::filesystem::path &hardDiskImage, const std::filesystem::path& saveState = std::filesystem::path());
 	~Machine();
 
 	Machine(const Machine& other) = delete;
 	Machine& operator =(const Machine& other) = delete;
 
+	// For the scheduler of a machine without a CPU thread, see CPUEmulation::runSlice()
+	inline CPUEmulation* cpu() {
+		return m_cpu.get();
+	}
+
 	inline VideoAdapter* videoAdapter() {
 		return &m_hercules;
 	}
 
+	// Input is queued, so these can be used from any thread without waiting on the emulation
 	inline Keyboard* keyboard() {
-		return &m_xtKeyboard;
+		return &m_inputQueue;
 	}
 
 	inline Mouse* mouse() {
-		return &m_busMouse;
+		return &m_inputQueue;
+	}
+
+	/*
+	 * Text screen scraping for automation. The waits return false on timeout,
+	 * and pass the last screen seen back through screen, if requested.
+	 */
+	inline bool captureTextScreen(TextScreen& screen) {
+		return m_hercules.captureTextScreen(screen);
+	}
+
+	// Waits until the pattern matches somewhere in TextScreen::text()
+	bool waitForText(const std::regex& pattern, std::chrono::milliseconds timeout, TextScreen* screen = nullptr);
+
+	// Waits until the screen hash differs from the given one
+	bool waitForTextScreenChange(uint64_t hash, std::chrono::milliseconds timeout, TextScreen* screen = nullptr);
+
+	/*
+	 * Whether text typed through keyboard()->typeText() is written into the
+	 * BIOS keyboard buffer directly, rather than typed key by key. Much
+	 * faster, but only seen by programs reading the keyboard through the BIOS.
+	 */
+	void setTypingFastFill(bool fastFill);
+
+	/*
+	 * Calls poll on the CPU thread with the machine time, right away and then
+	 * at whatever machine time it returns, until it returns 0. Returns false
+	 * if that has not happened within the timeout; calling again with the
+	 * same poll carries on.
+	 */
+	bool waitInMachineTime(const std::function<uint64_t(uint64_t now)>& poll, std::chrono::milliseconds timeout);
+
+	// For polls: any framebuffer write after sampleFramebufferWrites() is seen by framebufferWrittenSince().
+	inline uint64_t sampleFramebufferWrites() {
+		return m_vramAddressRange->sampleWrites();
+	}
+
+	inline bool framebufferWrittenSince(uint64_t generation) const {
+		return m_vramAddressRange->writtenSince(generation);
+	}
+
+	// What to do about timer ticks owed when the host falls behind real time
+	void setTimerLagPolicy(VirtualClock::LagPolicy policy);
+
+	/*
+	 * Stepping. Runs the machine until machine time has moved on by cycles or
+	 * it has executed that many instructions, whichever comes first, and
+	 * waits until it is there; UINT64_MAX leaves either out, but not both. The
+	 * machine stays stopped there until it is run again, or until resume().
+	 * Input given while it is stopped waits for it to run again; save states
+	 * are taken and loaded while it is stopped as well.
+	 */
+	void runFor(uint64_t cycles, uint64_t instructions);
+	void pause();
+	void resume();
+
+	uint64_t machineTime();
+
+	inline PIT::TickStatistics timerStatistics() const {
+		return m_pit.tickStatistics();
+	}
+
+	inline std::chrono::steady_clock::duration longestInputDelay() const {
+		return m_inputQueue.longestDelay();
 	}
 
+	/*
+	 * Save states: memory, the CPU and every device, taken between two
+	 * instructions. The hard disk image is not part of a state, so a state
+	 * only makes sense with the image it was saved with, unchanged since.
+	 * Input still queued is not part of it either.
+	 *
+	 * Loading maps RAM and expanded memory from the file copy-on-write
+	 * instead of reading them in, so the file stays in use for as long as
+	 * the machine lives or until another state is loaded. Throws
+	 * std::runtime_error for files that are not save states of this version.
+	 */
+	void saveState(const std::filesystem::path& path);
+	void loadState(const std::filesystem::path& path);
+
+	/*
+	 * Rewind: a checkpoint every interval of machine time, the newest capacity
+	 * of them kept in memory, optionally compressed. A checkpoint costs about
+	 * as much as the memory written since the one before, so this can stay on.
+	 * The hard disk is not part of them: going back past disk writes leaves
+	 * the guest with a disk that is ahead of it. Can be enabled once.
+	 */
+	void enableRewind(size_t capacity, uint64_t interval, bool compress);
+
+	// An extra checkpoint, right away
+	void checkpoint();
+
+	// Back to the checkpoint that many before the newest. Returns false if there are not that many.
+	bool rewind(size_t steps);
+
+	struct RewindStatistics {
+		size_t checkpoints;
+		// Including a copy of all of memory
+		size_t memoryUsed;
+	};
+
+	RewindStatistics rewindStatistics();
+
+	/*
+	 * Deterministic record and replay. Recording saves the state to the path
+	 * with ".state" appended, then logs the input delivered from there on,
+	 * and some of what the guest does, to check replays against (see
+	 * ExecutionLog). Everything else follows from the state, as every device
+	 * is timed by machine time alone. Meanwhile, the timer lag policy is
+	 * Drop, which never moves machine time, and the hard disk works
+	 * synchronously, as it keeps doing afterwards.
+	 *
+	 * A replay loads the state and replays the log from it as fast as the
+	 * host can go, ignoring input from anywhere else, then carries on in
+	 * real time. The end handler is called on the CPU thread when the log
+	 * ends, with what went differently if the execution diverged from the
+	 * recording, or an empty string. It needs the disk image as it was when
+	 * recording started, such as overlays over the same image for both.
+	 *
+	 * Loading states and rewinding are refused while either is going on.
+	 */
+	void startRecording(const std::filesystem::path& path);
+	void stopRecording();
+	void startReplay(const std::filesystem::path& path, std::function<void(const std::string& divergence)> endHandler);
+
 private:
 	static constexpr uint64_t RAMAreaBase  = 0ULL;
 	static constexpr uint64_t RAMAreaEnd   = 0x80000ULL;
+	static constexpr uint64_t BIOSDataAreaBase = 0x400ULL;
 	static constexpr uint64_t VRAMAreaBase = 0xB0000ULL;
 	static constexpr uint64_t VRAMAreaEnd  = 0xC0000ULL;
 	static constexpr uint64_t BIOSAreaBase = 0xF4000ULL;
 	static constexpr uint64_t BIOSAreaEnd  = 0x100000ULL;
 
+	// Resource number of the BIOS ROM image built into the executable
+	static constexpr unsigned int BIOSResource = 1;
+
+	// IRQ 8 to 15 are on the secondary PIC
+	static constexpr unsigned int IRQCount = 16;
+	static constexpr unsigned int CascadeIRQ = 2;
+
+	struct InterruptRoute {
+		unsigned int irq;
+		const char* device;
+		void (*connect)(Machine& machine, InterruptLine* line);
+	};
+
+	// Every IRQ has one device at most, so that guest handlers never have to poll for the source
+	static const InterruptRoute InterruptRoutes[];
+
+	void routeInterrupts();
+	InterruptLine* interruptLine(unsigned int irq);
+
+	static constexpr char SaveStateMagic[8]{ '8', '6', 'P', 'C', 'S', 'A', 'V', '\x1A' };
+	static constexpr uint16_t SaveStateVersion = 1;
+	// Memory images start at multiples of this in the file, so that they can be mapped
+	static constexpr uint64_t SaveStateAlignment = 65536;
+	static constexpr unsigned int MemoryImageCount = 3;
+	// Also the areas of the rewind buffer
+	static constexpr unsigned int RAMImage = 0;
+	static constexpr unsigned int VRAMImage = 1;
+	static constexpr unsigned int EMSImage = 2;
+
+	struct MemoryImage {
+		char tag[4];
+		WindowsMemoryRegion* region;
+		uint64_t offset;
+	};
+
+	// A save state checked against this machine, ready to be applied
+	struct SaveStateFile {
+		WindowsHandle file;
+		WindowsHandle mapping;
+		MemoryImage images[MemoryImageCount];
+		std::vector<uint8_t> deviceState;
+	};
+
+	void memoryImages(MemoryImage (&images)[MemoryImageCount]);
+	SaveStateFile openState(const std::filesystem::path& path);
+	// While constructing, the CPU thread is not running and no one else looks at video RAM either
+	void applyState(SaveStateFile& state, bool constructing);
+	void saveDeviceState(StateWriter& writer);
+	void loadDeviceState(StateReader& reader);
+	// Loads a whole device state, or, should it fail to, puts back the one there was
+	void replaceDeviceState(const std::vector<uint8_t>& deviceState);
+	// CPU thread only
+	void writeState(HANDLE file, const std::vector<uint8_t>& deviceState);
+
+	// CPU thread only
+	bool executionLogged() const;
+	void attachExecutionLog(ExecutionLog* executionLog);
+
+	// Runs the function on the CPU thread between two instructions and waits for it, passing exceptions on
+	void runOnCPUThread(const std::function<void()>& function);
+
+	// Marks the pages written since the last time in the rewind buffer
+	void collectWrites();
+	void takeCheckpoint();
+
 	uint8_t readPortA(uint8_t mask) const override;
 	void writePortA(uint8_t value, uint8_t mask) override;
 
@@ -65,6 +295,7 @@ private:
 	AddressSpaceDispatcher m_mmioDispatcher;
 	AddressSpaceDispatcher m_ioDispatcher;
 	PIC m_primaryPIC;
+	PIC m_secondaryPIC;
 	PIT m_pit;
 	HerculesVideo m_hercules;
 	NMIControl m_nmiControl;
@@ -72,6 +303,8 @@ private:
 	ATAHardDisk m_hdd;
 	ATADemux m_ataDemux;
 	XTIDE m_xtide;
+	// Unless the built-in one is used
+	std::vector<uint8_t> m_biosImage;
 	std::optional<MappedAddressRange> m_biosMainAddressRange;
 	WindowsMemoryRegion m_ram;
 	std::optional<MappedAddressRange> m_ramAddressRange;
@@ -82,6 +315,15 @@ private:
 	XTKeyboard m_xtKeyboard;
 	BusMouse m_busMouse;
 	AboveBoard m_aboveBoard;
+	InputQueue m_inputQueue;
+	ExecutionLog m_executionLog;
+
+	// CPU thread only
+	std::optional<RewindBuffer> m_rewind;
+	uint64_t m_ramWriteGeneration;
+	uint64_t m_vramWriteGeneration;
+	uint64_t m_checkpointInterval;
+	std::optional<CallbackTimer> m_checkpointTimer;
 };
 
 #endif
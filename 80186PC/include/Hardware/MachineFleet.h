@@ -0,0 +1,137 @@
+#ifndef MACHINE_FLEET_H
+#define MACHINE_FLEET_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Hardware/Machine.h>
+
+/*
+ * Runs many machines on a fixed number of worker threads, rather than on a
+ * CPU thread each. Machines are time-sliced: a worker runs one for a quantum
+ * of instructions, then puts it at the back of its queue and goes on with
+ * the next. A worker that runs out of machines steals one from the back of
+ * another worker's queue before it goes to sleep.
+ *
+ * Machines that have nothing to do are parked, off every queue: those at a
+ * stop (see Machine::runFor()) until they are woken, and those ahead of real
+ * time until it catches up. Neither costs a worker anything meanwhile.
+ *
+ * Disk commands are carried out by the workers as well, so with the workers
+ * being the only threads that run, the host scheduler is left with as many
+ * threads to schedule as there are cores.
+ */
+class MachineFleet final {
+public:
+	explicit MachineFleet(unsigned int threads = std::thread::hardware_concurrency());
+	~MachineFleet();
+
+	MachineFleet(const MachineFleet& other) = delete;
+	MachineFleet &operator =(const MachineFleet& other) = delete;
+
+	// Instructions run at a time, short enough for input and pacing to stay responsive
+	static constexpr uint64_t DefaultQuantum = 4096;
+
+	// Before start()
+	inline void setQuantum(uint64_t quantum) {
+		m_quantum = quantum;
+	}
+
+	/*
+	 * Creates a machine, to be run by the fleet, at any time. The machine is
+	 * the fleet's, and lasts as long as it does; cpuThread in the
+	 * configuration is ignored.
+	 */
+	Machine& addMachine(Machine::Configuration configuration);
+
+	void start();
+	void stop();
+
+	struct MachineStatistics {
+		uint64_t instructions;
+		// Machine time
+		uint64_t cycles;
+		uint64_t slices;
+		// Real time spent running the machine
+		std::chrono::nanoseconds busyTime;
+		bool finished;
+	};
+
+	// In the order the machines were added
+	std::vector<MachineStatistics> statistics() const;
+
+private:
+	enum class State {
+		Queued,
+		Running,
+		Parked,
+		Finished
+	};
+
+	struct Entry {
+		std::unique_ptr<Machine> machine;
+		CPUEmulation* cpu;
+		std::atomic<State> state;
+
+		// Protected by m_parkMutex
+		bool wakePending;
+		bool sleeping;
+		std::multimap<std::chrono::steady_clock::time_point, Entry*>::iterator sleepingPosition;
+
+		// Updated by the worker running the machine
+		std::atomic<uint64_t> instructions;
+		std::atomic<uint64_t> cycles;
+		std::atomic<uint64_t> slices;
+		std::atomic<int64_t> busyNanoseconds;
+	};
+
+	struct Worker {
+		std::mutex mutex;
+		std::deque<Entry*> queue;
+		std::thread thread;
+	};
+
+	void workerThread(unsigned int index);
+	void runEntry(unsigned int index, Entry* entry);
+
+	// Returns how many machines the worker has queued now
+	size_t enqueue(unsigned int index, Entry* entry);
+	Entry* takeEntry(unsigned int index);
+	void waitForWork(unsigned int index);
+	void notifyIdleWorker();
+
+	// From the wake handler of the machine's CPU
+	void wake(Entry* entry);
+	void park(unsigned int index, Entry* entry, std::chrono::steady_clock::time_point wakeTime);
+	// Queues the machines whose wake time has come. With m_parkMutex held.
+	void wakeSleepersLocked(unsigned int index);
+	void updateNextWakeTimeLocked();
+
+	uint64_t m_quantum;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	mutable std::mutex m_entriesMutex;
+	std::vector<std::unique_ptr<Entry>> m_entries;
+
+	std::mutex m_parkMutex;
+	std::condition_variable m_workCondvar;
+	std::multimap<std::chrono::steady_clock::time_point, Entry*> m_sleeping;
+	// Of the first sleeping machine, for checking without m_parkMutex
+	std::atomic<int64_t> m_nextWakeTime;
+
+	std::atomic<size_t> m_queued;
+	std::atomic<unsigned int> m_idleWorkers;
+	std::atomic<unsigned int> m_nextWorker;
+	std::atomic<bool> m_run;
+};
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <Infrastructure/IAddressRangeHandler.h>
 
+class StateReader;
+class StateWriter;
+
 class NMIControl final : public IAddressRangeHandler {
 public:
 	NMIControl();
@@ -15,6 +18,9 @@ public:
 		return m_allowNMI;
 	}
 
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
+
 private:
 	uint8_t read8(uint64_t address, uint8_t mask);
 	void write8(uint64_t address, uint8_t mask, uint8_t data);
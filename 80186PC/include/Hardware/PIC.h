@@ -6,8 +6,25 @@
 #include <Infrastructure/InterruptController.h>
 
 #include <array>
-#include <mutex>
-
+#include <atomic>
+
+class StateReader;
+class StateWriter;
+
+/*
+ * 8259A programmable interrupt controller.
+ *
+ * Interrupt lines are asserted from device threads without taking a lock:
+ * IRR, ISR, IMR, the input levels and the highest priority request are kept
+ * in a single atomic word, updated as a whole, so that the CPU thread gets a
+ * consistent view of them with a single load. The programming sequence
+ * state is only touched by the CPU thread.
+ *
+ * A secondary PIC can be cascaded on any line, whatever ICW1 and ICW3 say;
+ * its vector is then taken over on interrupt acknowledge. Cascade lines are
+ * level sensitive, so that a request still pending on the secondary after
+ * another has been acknowledged is seen again.
+ */
 class PIC final : public IAddressRangeHandler, public InterruptController {
 public:
 	class ELCR final : public IAddressRangeHandler {
@@ -18,16 +35,13 @@ public:
 		void write(uint64_t address, unsigned int accessSize, uint64_t data) override;
 		uint64_t read(uint64_t address, unsigned int accessSize) override;
 
-		inline uint8_t value() const {
-			return m_value;
-		}
+		uint8_t value() const;
 
 	private:
 		void write8(uint64_t address, uint8_t mask, uint8_t data);
 		uint8_t read8(uint64_t address, uint8_t mask);
 
 		PIC* m_owner;
-		uint8_t m_value;
 	};
 
 	PIC();
@@ -54,12 +68,15 @@ public:
 		return m_secondaryPICs[line];
 	}
 
-	inline void setSecondaryPIC(unsigned int line, PIC *pic) {
-		m_secondaryPICs[line] = pic;
-	}
+	// Connects the output of the secondary PIC to the line, too
+	void setSecondaryPIC(unsigned int line, PIC *pic);
 
 	uint8_t processInterruptAcknowledge() override;
 
+	// CPU thread only. The input levels are restored too, so devices asserting their lines again don't make for new edges.
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
+
 private:
 	class PICInterruptLine final : public InterruptLine {
 	public:
@@ -76,13 +93,40 @@ private:
 	void write8(uint64_t address, uint8_t mask, uint8_t data);
 	uint8_t read8(uint64_t address, uint8_t mask);
 
+	struct Registers {
+		uint8_t irr;
+		uint8_t isr;
+		uint8_t imr;
+		// Input levels last seen, for edge detection
+		uint8_t inputs;
+		// Level triggered lines, from ICW1 or the ELCR
+		uint8_t levelTriggered;
+		// ICW2
+		uint8_t vectorBase;
+		// Highest priority request demanding service, NoRequest if none
+		uint8_t pendingLine;
+		uint8_t pendingVector;
+	};
+
+	static constexpr uint8_t NoRequest = 0xFF;
+
 	void setInterruptLineAsserted(unsigned int line, bool asserted);
 
-	void irrUpdated();
+	/*
+	 * Applies modify to the registers atomically, running it again if they
+	 * were changed meanwhile, recomputes the pending request and publishes
+	 * the output if it changed.
+	 */
+	template<typename Modify>
+	void updateRegisters(Modify&& modify);
+
+	void publishOutput(bool asserted);
+	uint8_t levelTriggeredLines() const;
 
 	unsigned int internalInterruptAcknowledge(bool& request);
 
-	unsigned int findHighestPriorityRequest(uint8_t mask) const;
+	static void updatePendingRequest(Registers& registers);
+	static unsigned int findHighestPriorityRequest(uint8_t mask);
 
 	enum class State {
 		Idle,
@@ -137,17 +181,18 @@ private:
 	std::array<PICInterruptLine, 8> m_interruptLines;
 	InterruptLine* m_outputInterruptLine;
 	std::array<PIC*, 8> m_secondaryPICs;
+
+	std::atomic<Registers> m_registers;
+	static_assert(std::atomic<Registers>::is_always_lock_free, "PIC registers must fit in a lock-free atomic");
+
+	// CPU thread only
 	State m_state;
-	uint8_t m_edgeSense;
-	uint8_t m_mask;
+	uint8_t m_elcr;
+	uint8_t m_cascadeLines;
 	uint8_t m_icw1;
-	uint8_t m_icw2;
 	uint8_t m_icw3;
 	uint8_t m_icw4;
 	uint8_t m_ocw3;
-	uint8_t m_isr;
-	uint8_t m_irr;
-	std::recursive_mutex m_picMutex;
 };
 
 #endif
@@ -5,16 +5,36 @@
 
 #include <Infrastructure/IAddressRangeHandler.h>
 #include <Infrastructure/InterruptLine.h>
+#include <Infrastructure/VirtualClock.h>
+#include <Infrastructure/VirtualTimer.h>
 
-#include <thread>
-#include <mutex>
-#include <condition_variable>
+class StateReader;
+class StateWriter;
 
-class PIT final : public IAddressRangeHandler {
+/*
+ * 8254 programmable interval timer: three channels, modes 0 to 5, BCD
+ * counting, counter latch and read-back commands, and gate inputs.
+ *
+ * Nothing ticks: every channel remembers when its counting element was last
+ * loaded, and counts and outputs are computed from the virtual clock when
+ * they are needed. Only the output of channel 0, which drives the interrupt
+ * line, has a timer scheduled for its next transition. Transitions the CPU
+ * has run past at once are merged, so that the interrupt line is never
+ * pulsed back to back; how quickly owed ticks are made up after the host
+ * falls behind is left to the lag policy of the clock.
+ *
+ * Used on the CPU thread only, apart from setup before the CPU is started.
+ */
+class PIT final : public IAddressRangeHandler, private VirtualTimer {
 public:
 	PIT();
 	~PIT();
 
+	static constexpr unsigned int ChannelCount = 3;
+
+	// 1.193182 MHz input clock
+	static constexpr uint64_t CyclesPerTick = 4;
+
 	void write(uint64_t address, unsigned int accessSize, uint64_t data) override;
 	uint64_t read(uint64_t address, unsigned int accessSize) override;
 
@@ -26,21 +46,124 @@ public:
 		m_interruptLine = interruptLine;
 	}
 
+	inline VirtualClock* clock() const {
+		return m_clock;
+	}
+
+	void setClock(VirtualClock* clock);
+
+	// Gates are high after reset; on the PC, only the gate of channel 2 is wired to anything.
+	void setGate(unsigned int channel, bool gate);
+
+	bool output(unsigned int channel) const;
+
+	struct TickStatistics {
+		// Rising edges of the channel 0 output delivered to the interrupt line
+		uint64_t ticks;
+		// Delivered more than a period after they were due in real time
+		uint64_t lateTicks;
+		// Merged into other ticks, or lost with machine time the clock gave up on
+		uint64_t lostTicks;
+	};
+
+	// Can be called from any thread
+	TickStatistics tickStatistics() const;
+
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
+
 private:
+	enum : uint8_t {
+		AccessLatch = 0,
+		AccessLow = 1,
+		AccessHigh = 2,
+		AccessLowHigh = 3
+	};
+
+	struct Channel {
+		uint8_t mode;
+		uint8_t access;
+		bool bcd;
+		bool gate;
+
+		uint16_t countRegister;
+		bool countWritten;
+		bool nullCount;
+
+		/*
+		 * While counting, the counting element held start at tick base and
+		 * has counted down since; start is the period in modes 2 and 3.
+		 * Otherwise it holds idleValue, and the output is idleOutput.
+		 */
+		bool counting;
+		uint64_t base;
+		uint32_t start;
+		uint32_t idleValue;
+		bool idleOutput;
+		// modes 0, 1, 4 and 5: the terminal count of the current count has passed
+		bool terminalPassed;
+
+		// modes 2 and 3: a new count written while counting, loaded at the end of the period
+		bool reloadPending;
+		uint64_t pendingBase;
+		uint32_t pendingStart;
+
+		bool writeHighByteNext;
+		uint8_t writtenLowByte;
+		bool readHighByteNext;
+		bool countLatched;
+		uint16_t latchedCount;
+		bool statusLatched;
+		uint8_t latchedStatus;
+	};
+
 	void write8(uint64_t address, uint8_t mask, uint8_t data);
 	uint8_t read8(uint64_t address, uint8_t mask);
 
-	void pitThread();
+	void timerExpired() override;
+
+	uint64_t now() const;
+
+	void writeControlWord(uint64_t now, uint8_t data);
+	void writeCount(Channel& channel, uint64_t now, uint8_t data);
+	void loadCount(Channel& channel, uint64_t now);
+	uint8_t readCount(Channel& channel, uint64_t now);
+	void latchCount(Channel& channel, uint64_t now);
+	void latchStatus(Channel& channel, uint64_t now);
+
+	static void saveChannel(StateWriter& writer, const Channel& channel);
+	static void loadChannel(StateReader& reader, Channel& channel);
+
+	static void freeze(Channel& channel, uint64_t now);
+	static uint32_t modulus(const Channel& channel);
+	static uint32_t countValue(const Channel& channel);
+	static uint16_t displayValue(const Channel& channel, uint32_t value);
+
+	static void settle(Channel& channel, uint64_t now);
+	static uint32_t counterAt(const Channel& channel, uint64_t now);
+	static bool outputAt(const Channel& channel, uint64_t now);
+	static uint64_t nextOutputChange(const Channel& channel, uint64_t now);
+
+	// Brings the interrupt line up to date with every transition of channel 0 until now
+	void advanceOutput0(uint64_t now);
+	// After channel 0 was changed at now
+	void updateOutput0(uint64_t now);
+	void setOutput0(bool output);
+	void scheduleOutput0();
+	void countTick();
 
 	std::atomic<InterruptLine*> m_interruptLine;
-	bool m_byte;
-	uint8_t m_writeLatch;
-	uint16_t m_compareValue;
-	std::mutex m_pitThreadMutex;
-	bool m_runPITThread;
-	bool m_pitThreadAlert;
-	std::condition_variable m_pitThreadCondvar;
-	std::thread m_pitThread;
+	VirtualClock* m_clock;
+	Channel m_channels[ChannelCount];
+	bool m_output0;
+	uint64_t m_output0Tick;
+
+	std::atomic<uint64_t> m_ticks;
+	std::atomic<uint64_t> m_lateTicks;
+	std::atomic<uint64_t> m_lostTicks;
+	uint64_t m_droppedCyclesSeen;
+	// Dropped machine time not yet a whole period, and so not yet counted as a lost tick
+	uint64_t m_droppedCyclesUncounted;
 };
 
 #endif
@@ -4,6 +4,8 @@
 #include <Infrastructure/IAddressRangeHandler.h>
 
 class PPIConsumer;
+class StateReader;
+class StateWriter;
 
 class PPI final : public IAddressRangeHandler {
 public:
@@ -13,6 +15,10 @@ public:
 	void write(uint64_t address, unsigned int accessSize, uint64_t data) override;
 	uint64_t read(uint64_t address, unsigned int accessSize) override;
 
+	// Only the registers of the PPI itself; the consumer is not told about them again.
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
+
 private:
 	uint8_t read8(uint64_t address, uint8_t mask);
 	void write8(uint64_t address, uint8_t mask, uint8_t data);
@@ -7,6 +7,8 @@
 
 class InterruptLine;
 class IATADevice;
+class StateReader;
+class StateWriter;
 
 class XTIDE : public IAddressRangeHandler, private IATADeviceHost {
 public:
@@ -24,6 +26,10 @@ public:
 		m_interruptLine = interruptLine;
 	}
 
+	// Along with the attached devices
+	void saveState(StateWriter& writer);
+	void loadState(StateReader& reader);
+
 private:
 	void write8(uint64_t address, uint8_t mask, uint8_t data);
 	uint8_t read8(uint64_t address, uint8_t mask);
@@ -1,16 +1,32 @@
 #ifndef HARDWARE_XT_KEYBOARD_H
 #define HARDWARE_XT_KEYBOARD_H
 
-#include <atomic>
-#include <mutex>
 #include <deque>
-#include <thread>
 
 #include <UI/Keyboard.h>
+#include <Infrastructure/VirtualClock.h>
+#include <Infrastructure/VirtualTimer.h>
 
 class InterruptLine;
-
-class XTKeyboard final : public Keyboard {
+class StateReader;
+class StateWriter;
+
+/*
+ * XT keyboard interface. Scancodes are delivered one at a time, paced by
+ * the guest: each goes out once the guest has acknowledged the last one by
+ * pulsing the keyboard reset line, after no more than ScancodeInterval of
+ * machine time, what the serial link takes to shift in a byte.
+ *
+ * Typed text is fed in a keystroke at a time, and only while the BIOS
+ * keyboard buffer has room, so that none of it is lost when the guest reads
+ * it slower than it is typed. With fast fill, it is written into the BIOS
+ * keyboard buffer directly instead, whenever no scancode has been in flight
+ * for a while.
+ *
+ * Everything runs on the CPU thread, timed by the virtual clock, so that
+ * the guest sees the same input at the same instruction every time.
+ */
+class XTKeyboard final : public Keyboard, private VirtualTimer {
 public:
 	XTKeyboard();
 	~XTKeyboard();
@@ -26,6 +42,21 @@ public:
 		m_interruptLine = interruptLine;
 	}
 
+	inline VirtualClock* clock() const {
+		return m_clock;
+	}
+
+	inline void setClock(VirtualClock* clock) {
+		m_clock = clock;
+	}
+
+	// Guest memory at 0040:0000, where the BIOS keeps its keyboard buffer
+	inline void setBIOSDataArea(uint8_t* biosDataArea) {
+		m_biosDataArea = biosDataArea;
+	}
+
+	void setTypingFastFill(bool fastFill) override;
+
 	inline bool reset() const {
 		return m_reset;
 	}
@@ -36,30 +67,62 @@ public:
 		return m_hold;
 	}
 
-	inline void setHold(bool hold) {
-		m_hold = hold;
-	}
+	void setHold(bool hold);
 
 	inline uint8_t readDataByte() const {
-		return m_scancode.load();
+		return m_scancode;
 	}
 
 	void pushScancode(uint8_t scancode) override;
+	void pushScancodes(const uint8_t* scancodes, size_t count) override;
+	bool typeText(const std::string& text) override;
 
-private:
-	void xtKeyboardThread();
+	// Includes scancodes and text not delivered yet.
+	void saveState(StateWriter& writer) const;
+	void loadState(StateReader& reader);
 
-	std::atomic<InterruptLine*> m_interruptLine;
+private:
+	/*
+	 * BIOS data area. Head and tail are offsets from segment 40h; the
+	 * buffer holds a scancode and character word per key.
+	 */
+	static constexpr size_t BufferHead = 0x1A;
+	static constexpr size_t BufferTail = 0x1C;
+	static constexpr size_t BufferStart = 0x1E;
+	static constexpr size_t BufferEnd = 0x3E;
+
+	// About 100 us, as a byte on the serial link
+	static constexpr uint64_t ScancodeInterval = VirtualClock::Frequency / 10000;
+	// Typed text waiting for room in the BIOS buffer is retried this often
+	static constexpr uint64_t BufferPollInterval = VirtualClock::Frequency / 1000;
+
+	// Fast fill is retried this often, in machine time
+	static constexpr uint64_t FillInterval = VirtualClock::Frequency / 1000;
+	// and waits this long after the last acknowledge, for the BIOS interrupt handler to be done with the buffer
+	static constexpr uint64_t FillQuietTime = VirtualClock::Frequency / 100;
+
+	void timerExpired() override;
+	// Has the timer run when there is next something to do, if anything
+	void scheduleUpdate();
+	void sendScancode();
+	void fill();
+
+	void queueKeystroke(const Keystroke& keystroke);
+	bool biosBufferPointers(uint16_t& head, uint16_t& tail) const;
+	bool biosBufferHasRoom() const;
+	bool fillBIOSBuffer(const Keystroke& keystroke);
+
+	InterruptLine* m_interruptLine;
+	VirtualClock* m_clock;
+	uint8_t* m_biosDataArea;
 	bool m_reset;
-	std::atomic<bool> m_waitingForAck;
-	std::atomic<bool> m_hold;
+	bool m_waitingForAck;
+	bool m_hold;
+	bool m_fastFill;
+	uint8_t m_scancode;
+	uint64_t m_lastAcknowledge;
 	std::deque<uint8_t> m_queue;
-	std::atomic<uint8_t> m_scancode;
-
-	std::mutex m_threadMutex;
-	std::condition_variable m_threadCondvar;
-	bool m_runThread;
-	std::thread m_thread;
+	std::deque<Keystroke> m_textQueue;
 };
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef CALLBACK_TIMER_H
+#define CALLBACK_TIMER_H
+
+#include <stdint.h>
+
+#include <functional>
+
+#include <Infrastructure/VirtualClock.h>
+#include <Infrastructure/VirtualTimer.h>
+
+/*
+ * Timer calling a function on the CPU thread, for waits on machine time
+ * that do not warrant a class of their own. The function is given the
+ * machine time and returns the next deadline to be called at, or 0 once
+ * it is done.
+ */
+class CallbackTimer final : public VirtualTimer {
+public:
+	CallbackTimer(VirtualClock* clock, std::function<uint64_t(uint64_t now)> callback);
+	~CallbackTimer();
+
+	// Has the function called as soon as possible. May be called from any thread.
+	void start();
+
+	void timerExpired() override;
+
+private:
+	VirtualClock* m_clock;
+	std::function<uint64_t(uint64_t now)> m_callback;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef EXECUTION_LOG_H
+#define EXECUTION_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <Infrastructure/VirtualClock.h>
+#include <Infrastructure/VirtualTimer.h>
+
+/*
+ * Log of what reaches a machine from outside, for replaying its execution
+ * exactly. Everything else the guest sees follows from the state it started
+ * from, as every device is timed by machine time alone.
+ *
+ * Recorded are the input events, as they are delivered, and, only to tell
+ * when a replay has gone astray, the interrupts delivered and a checksum of
+ * every disk read. Replaying hands the input back at the same machine times,
+ * and checks the rest against what happens.
+ *
+ * A log starts with Magic, a 16 bit version and the 64 bit machine time it
+ * starts at, little endian. Events follow as
+ *
+ *   uint8 type, LEB128 machine time since the event before, payload
+ *
+ * with the payload, by type:
+ *
+ *   Input       LEB128 size, the event as InputQueue encodes it
+ *   Interrupt   uint8 vector
+ *   DiskRead    LEB128 sector, uint32 CRC-32 of the data
+ *   End         nothing
+ *
+ * A log cut short, as left by a recording that was killed, ends where the
+ * last complete event does.
+ *
+ * CPU thread only. Disk reads come from there too, as the disk is run
+ * synchronously while the log is in use (see ATADevice::setSynchronous()).
+ */
+class ExecutionLog final : private VirtualTimer {
+public:
+	ExecutionLog();
+	~ExecutionLog();
+
+	ExecutionLog(const ExecutionLog& other) = delete;
+	ExecutionLog &operator =(const ExecutionLog& other) = delete;
+
+	static const char Magic[8];
+	static constexpr uint16_t Version = 1;
+
+	inline VirtualClock* clock() const {
+		return m_clock;
+	}
+
+	inline void setClock(VirtualClock* clock) {
+		m_clock = clock;
+	}
+
+	/*
+	 * Called on the CPU thread when a replay has come to the end of the log,
+	 * with what went differently if it stopped because the execution diverged
+	 * from the recording, or with an empty string.
+	 */
+	inline void setEndHandler(std::function<void(const std::string& divergence)> handler) {
+		m_endHandler = std::move(handler);
+	}
+
+	// From the current machine time. Failing to open the file is reported as std::runtime_error.
+	void startRecording(const std::filesystem::path& path);
+	void startReplay(const std::filesystem::path& path);
+
+	// Ends a recording with an End event, or gives up on a replay without calling the end handler.
+	void finish();
+
+	inline bool recording() const {
+		return m_mode == Mode::Recording;
+	}
+
+	inline bool replaying() const {
+		return m_mode == Mode::Replaying;
+	}
+
+	void recordInput(const std::vector<uint8_t>& input);
+
+	// Takes out the next input of a replay, if it was recorded at the current machine time.
+	bool takeInput(std::vector<uint8_t>& input);
+
+	void interruptDelivered(uint8_t vector);
+	void diskRead(uint64_t sector, uint32_t checksum);
+
+private:
+	enum class Mode {
+		Off,
+		Recording,
+		Replaying
+	};
+
+	enum class EventType : uint8_t {
+		Input = 1,
+		Interrupt,
+		DiskRead,
+		End
+	};
+
+	struct Event {
+		EventType type;
+		uint64_t time;
+		// Input only
+		std::vector<uint8_t> input;
+		// Vector, or sector and checksum
+		uint64_t values[2];
+	};
+
+	// Recordings are flushed this often, in machine time, so that little is lost if the process dies
+	static constexpr uint64_t FlushInterval = VirtualClock::Frequency;
+
+	void timerExpired() override;
+
+	void writeEventHeader(EventType type);
+	void writeNumber(uint64_t value);
+	void writeLE(uint64_t value, unsigned int size);
+
+	// Reads the event after the current one into m_next, and has the timer check on it.
+	void readNextEvent();
+	bool readEvent(Event& event);
+	bool readNumber(uint64_t& value);
+	bool readLE(uint64_t& value, unsigned int size);
+
+	// Checks that the next event is this one, and moves on to the one after
+	void expectEvent(EventType type, uint64_t value0, uint64_t value1);
+	static std::string describeEvent(const Event& event);
+
+	void end(const std::string& divergence);
+
+	VirtualClock* m_clock;
+	std::function<void(const std::string& divergence)> m_endHandler;
+	Mode m_mode;
+	std::ofstream m_output;
+	std::ifstream m_input;
+	// Of the event before, recorded or replayed
+	uint64_t m_lastTime;
+	Event m_next;
+};
+
+#endif
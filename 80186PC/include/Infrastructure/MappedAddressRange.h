@@ -3,6 +3,12 @@
 
 #include <Infrastructure/IAddressRangeHandler.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
 class MappedAddressRange final : public IAddressRangeHandler {
 public:
 	MappedAddressRange(void* base, size_t size, unsigned int permissions);
@@ -15,14 +21,78 @@ public:
 	size_t hostMemorySize() const override;
 	unsigned int hostMemoryPermissions() const override;
 
+	void establishMappings(CPUEmulation* emulation, uint64_t base, uint64_t limit) override;
+	void removeMappings(CPUEmulation* emulation, uint64_t base, uint64_t limit) override;
+
 	inline void changeBase(void* base) {
 		m_base = base;
 	}
 
+	/*
+	 * Write tracking. When enabled, the range is mapped into the CPU without
+	 * write permission, so the first write to each page is routed through
+	 * write(), which records the current write generation for that page and
+	 * then lets further writes through directly. sampleWrites() write-protects
+	 * the pages again and returns a new generation: any page with a
+	 * generation above the sampled one has been written after the sample.
+	 *
+	 * Must be enabled before the range is registered with a dispatcher.
+	 */
+	static constexpr size_t WriteTrackingPageSize = 4096;
+
+	void enableWriteTracking();
+
+	inline bool isWriteTrackingEnabled() const {
+		return !m_pageGenerations.empty();
+	}
+
+	inline size_t trackedPageCount() const {
+		return m_pageGenerations.size();
+	}
+
+	inline uint64_t pageGeneration(size_t page) const {
+		return m_pageGenerations[page].load(std::memory_order_acquire);
+	}
+
+	uint64_t sampleWrites();
+
+	/*
+	 * Blocks until any page is written after the given generation, or until
+	 * the deadline passes, and returns whether it was written. Only the first
+	 * write to a page after a sample wakes waiters up, so sample first.
+	 */
+	bool waitForWrites(uint64_t sinceGeneration, std::chrono::steady_clock::time_point deadline);
+
+	bool writtenSince(uint64_t generation) const;
+
+	/*
+	 * Appends the pages written after the generation, then samples and
+	 * passes the new generation back, for the next call.
+	 */
+	void collectWrites(uint64_t& generation, std::vector<size_t>& pages);
+
+	// For changes made behind the CPU's back: counts every page as written now.
+	void markWritten();
+
 private:
+
+	void recordWrite(uint64_t offset, unsigned int accessSize);
+	void setPageWritable(size_t page, bool writable);
+
 	void* m_base;
 	size_t m_size;
 	unsigned int m_permissions;
+
+	CPUEmulation* m_emulation;
+	uint64_t m_mappingBase;
+	uint64_t m_mappingLimit;
+	std::atomic<uint64_t> m_writeGeneration;
+	std::vector<std::atomic<uint64_t>> m_pageGenerations;
+	std::vector<std::atomic<bool>> m_pageWritable;
+
+	std::atomic<unsigned int> m_writeWaiters;
+	std::mutex m_writeWaitMutex;
+	std::condition_variable m_writeWaitCondvar;
 };
 
 #endif
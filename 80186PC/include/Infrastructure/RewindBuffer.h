@@ -0,0 +1,107 @@
+#ifndef REWIND_BUFFER_H
+#define REWIND_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+/*
+ * Checkpoints of guest memory and device state, the newest few of them kept
+ * in memory, for going back in time.
+ *
+ * The buffer keeps a copy of memory as it was at the newest checkpoint. A
+ * checkpoint only looks at the pages marked written since the one before,
+ * and stores each of them as the XOR of its old and new contents, which
+ * turns it back just as well as forward: rewinding undoes the checkpoints
+ * newest first, on the copy, and copies just the pages that were involved
+ * back into memory. Both are proportional to the pages written, apart from
+ * the first checkpoint, which copies all of memory.
+ *
+ * With compression, the XORs are run length coded as in Utils/FrameDelta.h.
+ *
+ * Not thread safe; whoever owns the memory calls it while nothing else
+ * writes to it.
+ */
+class RewindBuffer final {
+public:
+	static constexpr size_t PageSize = 4096;
+
+	RewindBuffer(size_t capacity, bool compress);
+	~RewindBuffer();
+
+	RewindBuffer(const RewindBuffer& other) = delete;
+	RewindBuffer &operator =(const RewindBuffer& other) = delete;
+
+	// Memory to cover, added before the first checkpoint. Returns the number to mark pages with.
+	unsigned int addArea(void* base, size_t size);
+
+	// Pages written since the newest checkpoint, all of them, before every checkpoint() and rewind().
+	void markWritten(unsigned int area, size_t page);
+
+	void checkpoint(uint64_t time, std::vector<uint8_t> deviceState);
+
+	/*
+	 * Puts memory back as it was at the checkpoint that many before the
+	 * newest, which becomes the newest, and returns its device state for the
+	 * caller to load.
+	 */
+	const std::vector<uint8_t>& rewind(size_t steps);
+
+	// Forgets all checkpoints, as when memory was changed as a whole.
+	void clear();
+
+	inline size_t checkpointCount() const {
+		return m_checkpoints.size();
+	}
+
+	// Oldest first
+	inline uint64_t checkpointTime(size_t index) const {
+		return m_checkpoints[index].time;
+	}
+
+	inline const std::vector<uint8_t>& checkpointDeviceState(size_t index) const {
+		return m_checkpoints[index].deviceState;
+	}
+
+	// Including the copy of memory
+	inline size_t memoryUsed() const {
+		return m_memoryUsed;
+	}
+
+private:
+	struct Area {
+		uint8_t* base;
+		size_t size;
+		std::vector<uint8_t> copy;
+		std::vector<bool> written;
+		std::vector<size_t> writtenPages;
+	};
+
+	struct PageDelta {
+		unsigned int area;
+		size_t page;
+		std::vector<uint8_t> delta;
+	};
+
+	struct Checkpoint {
+		uint64_t time;
+		std::vector<uint8_t> deviceState;
+		std::vector<PageDelta> pages;
+		size_t size;
+	};
+
+	static size_t pageLength(const Area& area, size_t page);
+	void clearWritten();
+	void dropOldest();
+
+	size_t m_capacity;
+	bool m_compress;
+	std::vector<Area> m_areas;
+	std::deque<Checkpoint> m_checkpoints;
+	bool m_haveCopy;
+	size_t m_memoryUsed;
+};
+
+#endif
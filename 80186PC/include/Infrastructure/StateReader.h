@@ -0,0 +1,50 @@
+#ifndef STATE_READER_H
+#define STATE_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reads back what StateWriter wrote. Anything that does not match, such as a
+ * chunk with another tag, or one not read to exactly its end, is reported as
+ * std::runtime_error.
+ */
+class StateReader final {
+public:
+	// The data must outlive the reader.
+	StateReader(const void* data, size_t size);
+	~StateReader();
+
+	StateReader(const StateReader& other) = delete;
+	StateReader &operator =(const StateReader& other) = delete;
+
+	// Checks that the data is made up of whole chunks, without reading any of them.
+	void checkChunks() const;
+
+	void beginChunk(const char* tag);
+	void endChunk();
+
+	uint8_t read8();
+	uint16_t read16();
+	uint32_t read32();
+	uint64_t read64();
+	bool readBool();
+	void readBytes(void* data, size_t size);
+
+	inline bool atEnd() const {
+		return m_position == m_size;
+	}
+
+private:
+	static constexpr size_t ChunkHeaderSize = 8;
+
+	uint64_t readLE(unsigned int size);
+	const uint8_t* take(size_t size);
+
+	const uint8_t* m_data;
+	size_t m_size;
+	size_t m_position;
+	size_t m_chunkEnd;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef STATE_WRITER_H
+#define STATE_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/*
+ * Device state for save states, as little endian numbers grouped into
+ * chunks. Every chunk starts with a four character tag and the size of what
+ * follows, so that StateReader notices a mismatch at the chunk it happens in
+ * rather than reading garbage from there on.
+ */
+class StateWriter final {
+public:
+	StateWriter();
+	~StateWriter();
+
+	StateWriter(const StateWriter& other) = delete;
+	StateWriter &operator =(const StateWriter& other) = delete;
+
+	// Chunks don't nest
+	void beginChunk(const char* tag);
+	void endChunk();
+
+	void write8(uint8_t value);
+	void write16(uint16_t value);
+	void write32(uint32_t value);
+	void write64(uint64_t value);
+	void writeBool(bool value);
+	void writeBytes(const void* data, size_t size);
+
+	inline const std::vector<uint8_t>& data() const {
+		return m_data;
+	}
+
+private:
+	void writeLE(uint64_t value, unsigned int size);
+
+	std::vector<uint8_t> m_data;
+	size_t m_chunkStart;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef VIRTUAL_CLOCK_H
+#define VIRTUAL_CLOCK_H
+
+#include <stdint.h>
+
+class VirtualTimer;
+
+/*
+ * Machine time, counted in CPU clock cycles and advanced by the CPU as it
+ * executes instructions rather than by the host clock, so that devices timed
+ * against it behave the same regardless of the emulation speed. The CPU
+ * paces itself so that machine time keeps up with, but does not run ahead
+ * of, real time; what happens when the host cannot keep up is up to the lag
+ * policy.
+ */
+class VirtualClock {
+protected:
+	VirtualClock();
+	~VirtualClock();
+
+public:
+	VirtualClock(const VirtualClock& other) = delete;
+	VirtualClock &operator =(const VirtualClock& other) = delete;
+
+	// 14.31818 MHz / 3
+	static constexpr uint64_t Frequency = 4772727;
+
+	enum class LagPolicy {
+		// Machine time falls behind for a moment, then the difference is given up on
+		Drop,
+		// Machine time runs up to twice as fast until it has caught up
+		CatchUp,
+		// Machine time runs slightly fast until it has caught up
+		Slew
+	};
+
+	// Only consistent on the CPU thread.
+	virtual uint64_t cycles() const = 0;
+
+	/*
+	 * Has timer->timerExpired() called once cycles() reaches deadline. Every
+	 * timer has at most one deadline; scheduling it again replaces it.
+	 */
+	virtual void scheduleTimer(VirtualTimer* timer, uint64_t deadline) = 0;
+	virtual void cancelTimer(VirtualTimer* timer) = 0;
+
+	// Can be changed at any time
+	virtual void setLagPolicy(LagPolicy policy) = 0;
+
+	/*
+	 * Without pacing, machine time runs as fast as the host can go, such as
+	 * for replays. Can be changed at any time.
+	 */
+	virtual void setRealTimePacing(bool pacing) = 0;
+
+	// How far machine time was behind real time when last compared. Only consistent on the CPU thread.
+	virtual uint64_t lagCycles() const = 0;
+
+	// Machine time given up on in total. Only consistent on the CPU thread.
+	virtual uint64_t droppedCycles() const = 0;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef VIRTUAL_TIMER_H
+#define VIRTUAL_TIMER_H
+
+/*
+ * Receiver of deadlines scheduled on a VirtualClock.
+ */
+class VirtualTimer {
+protected:
+	VirtualTimer();
+	~VirtualTimer();
+
+public:
+	VirtualTimer(const VirtualTimer& other) = delete;
+	VirtualTimer &operator =(const VirtualTimer& other) = delete;
+
+	// Called on the CPU thread, between instructions, once the deadline has passed.
+	virtual void timerExpired() = 0;
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef UI_AUTOMATION_SCRIPT_H
+#define UI_AUTOMATION_SCRIPT_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HeadlessUI.h"
+
+class Machine;
+
+/*
+ * Unattended input and output: runs a script of steps against the machine
+ * on a thread of its own. Waits sleep until the framebuffer is written, or
+ * until a deadline in machine time, rather than polling, so every step goes
+ * ahead as soon as the guest is ready for it.
+ *
+ * One step per line; blank lines and lines starting with # are ignored.
+ *
+ *   type TEXT              types the rest of the line; \n, \t, \e (Escape) and \\ are recognized
+ *   key KEY[+KEY...]       presses and releases keys together, such as enter, f1, ctrl+c or ctrl+alt+del
+ *   fast-fill on|off       whether typed text goes straight into the BIOS keyboard buffer
+ *   mouse-move DX DY
+ *   mouse-button left|middle|right down|up
+ *   wait-text REGEX        until the regular expression matches the text screen
+ *   wait-ticks N           for N timer ticks (18.2 per second) of machine time
+ *   wait-idle N            until the framebuffer has not been written for N timer ticks
+ *   timeout SECONDS        real time limit for the waits that follow, 60 by default
+ *   snapshot PATH          screen capture, as .png, .ppm or .txt
+ *   save-state PATH        saves the whole machine, see Machine::saveState
+ *   load-state PATH        and loads it back
+ *   checkpoint             takes a rewind checkpoint, see Machine::enableRewind
+ *   rewind [N]             back to the checkpoint N before the newest, 0 by default
+ *   quit [CODE]            ends the run with the exit code, 0 by default
+ *
+ * A wait that times out ends the run with exit code 2, and any other
+ * failure with exit code 1.
+ */
+class AutomationScript final {
+public:
+	AutomationScript();
+	~AutomationScript();
+
+	AutomationScript(const AutomationScript& other) = delete;
+	AutomationScript &operator =(const AutomationScript& other) = delete;
+
+	static constexpr int ExitTimedOut = 2;
+	static constexpr int ExitFailed = 1;
+
+	// Throws std::runtime_error naming the line for syntax errors.
+	void load(const std::filesystem::path& path);
+
+	inline void setMachine(Machine* machine) {
+		m_machine = machine;
+	}
+
+	// Called on the script thread when the run ends, with the exit code.
+	inline void setQuitHandler(std::function<void(int exitCode)> handler) {
+		m_quitHandler = std::move(handler);
+	}
+
+	void start();
+	void stop();
+
+	// Once the run has ended.
+	inline int exitCode() const {
+		return m_exitCode;
+	}
+
+private:
+	// One timer tick is 65536 counts of the 1.193182 MHz PIT clock
+	static constexpr uint64_t CyclesPerTimerTick = 65536 * 4;
+	static constexpr std::chrono::seconds DefaultTimeout{ 60 };
+	// Waits check for stop() this often
+	static constexpr std::chrono::milliseconds StopCheckInterval{ 100 };
+
+	enum class StepType {
+		Type,
+		Key,
+		FastFill,
+		MouseMove,
+		MouseButton,
+		WaitText,
+		WaitTicks,
+		WaitIdle,
+		Timeout,
+		Snapshot,
+		SaveState,
+		LoadState,
+		Checkpoint,
+		Rewind,
+		Quit
+	};
+
+	struct Step {
+		StepType type;
+		unsigned int line;
+		std::string text;
+		std::vector<uint8_t> scancodes;
+		std::regex pattern;
+		int64_t values[2];
+	};
+
+	static Step parseStep(const std::string& command, const std::string& arguments);
+	static std::string unescape(const std::string& text);
+	static std::vector<uint8_t> parseKeys(const std::string& keys);
+	static int64_t parseNumber(const std::string& text);
+
+	void scriptThread();
+	bool runStep(const Step& step);
+
+	// Runs wait in slices until it returns true, the timeout passes or stop() is called.
+	bool waitSliced(const std::function<bool(std::chrono::milliseconds slice)>& wait);
+	bool waitInMachineTime(const Step& step, const std::function<uint64_t(uint64_t now)>& poll);
+
+	Machine* m_machine;
+	std::function<void(int exitCode)> m_quitHandler;
+	std::vector<Step> m_steps;
+	std::filesystem::path m_path;
+
+	// Script thread only
+	std::chrono::milliseconds m_timeout;
+	HeadlessUI m_snapshots;
+
+	std::atomic<bool> m_run;
+	std::atomic<int> m_exitCode;
+	std::thread m_thread;
+};
+
+#endif
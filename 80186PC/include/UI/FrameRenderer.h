@@ -0,0 +1,53 @@
+#ifndef UI_FRAME_RENDERER_H
+#define UI_FRAME_RENDERER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "VideoAdapter.h"
+#include "MDAFont.h"
+
+/*
+ * Renders the adapter output into memory, with no dependency on any window
+ * system. Pixels are stored as one of the three shades a monochrome display
+ * can show, one byte per pixel, so that consumers can compare, compress or
+ * colorize frames cheaply.
+ */
+class FrameRenderer final {
+public:
+	FrameRenderer();
+	~FrameRenderer();
+
+	FrameRenderer(const FrameRenderer& other) = delete;
+	FrameRenderer &operator =(const FrameRenderer& other) = delete;
+
+	enum : uint8_t {
+		ShadeBlack = 0,
+		ShadeNormal,
+		ShadeBright,
+
+		ShadeCount
+	};
+
+	// RGB of each shade on a P3 (602 nm) phosphor
+	static const uint8_t ShadeColors[ShadeCount][3];
+
+	struct Frame {
+		unsigned int width;
+		unsigned int height;
+		std::vector<uint8_t> pixels;
+	};
+
+	void render(const VideoAdapter::AdapterConfiguration& config, Frame& frame) const;
+
+private:
+	static constexpr unsigned int GlyphWidth = 9;
+
+	void renderTextMode(const VideoAdapter::AdapterConfiguration& config, Frame& frame) const;
+	void renderGraphicsMode(const VideoAdapter::AdapterConfiguration& config, Frame& frame) const;
+
+	MDAFont m_font;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef UI_HEADLESS_UI_H
+#define UI_HEADLESS_UI_H
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+
+#include "VideoAdapter.h"
+#include "FrameRenderer.h"
+#include "TextScreen.h"
+
+/*
+ * User interface for machines running without a display: nothing is shown,
+ * but the screen can be captured into files on demand or periodically.
+ */
+class HeadlessUI final {
+public:
+	HeadlessUI();
+	~HeadlessUI();
+
+	HeadlessUI(const HeadlessUI& other) = delete;
+	HeadlessUI &operator =(const HeadlessUI& other) = delete;
+
+	enum class SnapshotFormat {
+		PNG,
+		Raw,	// binary PPM
+		Text	// UTF-8, text mode only
+	};
+
+	static const char* snapshotExtension(SnapshotFormat format);
+
+	inline void setVideoAdapter(VideoAdapter* adapter) {
+		m_videoAdapter = adapter;
+	}
+
+	/*
+	 * Periodic snapshots are written as <prefix>-<number>.<extension>, and
+	 * only when the screen has changed since the previous one. A zero
+	 * interval disables them.
+	 */
+	inline void setSnapshotInterval(std::chrono::milliseconds interval) {
+		m_snapshotInterval = interval;
+	}
+
+	inline void setSnapshotPrefix(const std::filesystem::path& prefix) {
+		m_snapshotPrefix = prefix;
+	}
+
+	inline void setSnapshotFormat(SnapshotFormat format) {
+		m_snapshotFormat = format;
+	}
+
+	// Runs until stop() is called.
+	void run();
+
+	// Only sets a flag, so may be called from a signal handler.
+	inline void stop() {
+		m_run = false;
+	}
+
+	// Captures the screen right away. Returns false if there was nothing to capture.
+	bool snapshot(const std::filesystem::path& path, SnapshotFormat format);
+
+private:
+	bool writeSnapshot(const VideoAdapter::AdapterConfiguration& config, const std::filesystem::path& path, SnapshotFormat format);
+	void takePeriodicSnapshot();
+
+	std::atomic<VideoAdapter*> m_videoAdapter;
+	std::atomic<bool> m_run;
+	std::chrono::milliseconds m_snapshotInterval;
+	std::filesystem::path m_snapshotPrefix;
+	SnapshotFormat m_snapshotFormat;
+
+	std::mutex m_renderMutex;
+	FrameRenderer m_renderer;
+	FrameRenderer::Frame m_frame;
+	TextScreen m_textScreen;
+
+	/*
+	 * State as of the last periodic snapshot, to skip unchanged screens.
+	 */
+	uint64_t m_framebufferGeneration;
+	bool m_lastSnapshotValid;
+	VideoAdapter::AdapterConfiguration m_lastSnapshotConfiguration;
+	unsigned long m_snapshotNumber;
+};
+
+#endif
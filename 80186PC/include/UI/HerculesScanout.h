@@ -0,0 +1,62 @@
+#ifndef UI_HERCULES_SCANOUT_H
+#define UI_HERCULES_SCANOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "VideoAdapter.h"
+
+/*
+ * Converts the banked 1 bit per pixel Hercules graphics framebuffer into
+ * 32-bit pixels in a single pass, optionally scaling it up by an integer
+ * factor.
+ */
+class HerculesScanout final {
+public:
+	HerculesScanout();
+	~HerculesScanout();
+
+	HerculesScanout(const HerculesScanout& other) = delete;
+	HerculesScanout &operator =(const HerculesScanout& other) = delete;
+
+	inline void setColors(uint32_t background, uint32_t foreground) {
+		m_background = background;
+		m_foreground = foreground;
+	}
+
+	inline unsigned int scale() const {
+		return m_scale;
+	}
+
+	void setScale(unsigned int scale);
+
+	/*
+	 * Converts lineCount scan lines starting from firstLine. pixels points to
+	 * the top of the whole destination, not to firstLine.
+	 */
+	void scanout(const VideoAdapter::AdapterConfiguration& config, void* pixels, size_t pitch, unsigned int width, unsigned int height,
+		unsigned int firstLine, unsigned int lineCount) const;
+
+private:
+	using ExpandLineFunction = void (*)(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground);
+
+	static constexpr unsigned int BankShift = 13;
+	static constexpr unsigned int BankCount = 4;
+
+	static bool isAVX2Supported();
+
+	static void expandLineScalar1x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground);
+	static void expandLineScalar2x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground);
+	static void expandLineSSE2_1x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground);
+	static void expandLineSSE2_2x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground);
+	static void expandLineAVX2_1x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground);
+	static void expandLineAVX2_2x(const uint8_t* source, size_t bytes, uint32_t* dest, uint32_t background, uint32_t foreground);
+
+	bool m_avx2;
+	unsigned int m_scale;
+	ExpandLineFunction m_expandLine;
+	uint32_t m_background;
+	uint32_t m_foreground;
+};
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef UI_KEYBOARD_H
 #define UI_KEYBOARD_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <string>
+
 class Keyboard {
 protected:
 	Keyboard();
@@ -13,6 +16,30 @@ public:
 	Keyboard &operator =(const Keyboard& other) = delete;
 
 	virtual void pushScancode(uint8_t scancode) = 0;
+
+	// Several scancodes at once, such as a whole key press
+	virtual void pushScancodes(const uint8_t* scancodes, size_t count) = 0;
+
+	/*
+	 * Types the text as if on a US keyboard, pressing shift where needed.
+	 * Characters with no key are skipped; returns false if there were any.
+	 */
+	virtual bool typeText(const std::string& text) = 0;
+
+	// Whether typed text goes straight into the BIOS keyboard buffer rather than being typed out
+	virtual void setTypingFastFill(bool fastFill) = 0;
+
+	struct Keystroke {
+		uint8_t scancode;
+		uint8_t character;
+		bool shift;
+	};
+
+	static constexpr uint8_t LeftShiftScancode = 0x2A;
+	static constexpr uint8_t BreakCode = 0x80;
+
+	// Newlines are typed as Enter
+	static bool translateCharacter(char character, Keystroke& keystroke);
 };
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef UI_MDA_FONT_H
+#define UI_MDA_FONT_H
+
+#include <stdint.h>
+
+#include <vector>
+
+/*
+ * MDA character generator contents, decoded from the font bitmap resource
+ * without any dependency on SDL: GlyphCount glyphs, 8 pixels wide, stacked
+ * top to bottom in a 1 bit per pixel BMP.
+ */
+class MDAFont final {
+public:
+	MDAFont();
+	~MDAFont();
+
+	MDAFont(const MDAFont& other) = delete;
+	MDAFont &operator =(const MDAFont& other) = delete;
+
+	static constexpr unsigned int GlyphCount = 256;
+
+	inline unsigned int glyphHeight() const {
+		return m_glyphHeight;
+	}
+
+	// Bit 7 is the leftmost pixel, set bits are foreground.
+	inline uint8_t glyphLine(uint8_t ch, unsigned int line) const {
+		return m_glyphs[ch * m_glyphHeight + line];
+	}
+
+private:
+	unsigned int m_glyphHeight;
+	std::vector<uint8_t> m_glyphs;
+};
+
+#endif
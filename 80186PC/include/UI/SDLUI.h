@@ -4,13 +4,18 @@
 #include <SDL.h>
 
 #include <memory>
+#include <exception>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <deque>
 #include <array>
 #include <vector>
 
 #include "VideoAdapter.h"
+#include "HerculesScanout.h"
+#include "TripleBuffer.h"
 
 class Keyboard;
 class Mouse;
@@ -37,7 +42,14 @@ public:
 		m_mouse = mouse;
 	}
 
+	inline unsigned int scale() const {
+		return m_scale;
+	}
+
+	void setScale(unsigned int scale);
+
 private:
+	void pumpEvents();
 	void pushKeyboardEvent(const SDL_KeyboardEvent& ev);
 	void updateMouseButton(const SDL_MouseButtonEvent & ev);
 
@@ -49,8 +61,14 @@ private:
 		void operator()(SDL_Surface* surface) const;
 	};
 
-	struct SDLPaletteDeleter {
-		void operator()(SDL_Palette *palette) const;
+	/*
+	 * A completed frame. damage lists the parts that changed since the frame
+	 * with the previous sequence number.
+	 */
+	struct Frame {
+		std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> surface;
+		uint64_t sequence;
+		std::vector<SDL_Rect> damage;
 	};
 
 	enum {
@@ -72,7 +90,24 @@ private:
 		uint8_t fgB;
 	};
 
-	void linearizeHerculesVideo(const VideoAdapter::AdapterConfiguration& config, unsigned char *data);
+	static unsigned int selectTextModePalette(uint8_t attribute);
+
+	void buildGlyphAtlases(const SDL_PixelFormat* format);
+	void renderTextMode(const VideoAdapter::AdapterConfiguration& config, SDL_Surface* surface);
+	void drawTextModeCell(const VideoAdapter::AdapterConfiguration& config, SDL_Surface* surface, unsigned int row, unsigned int column);
+	bool textModeShadowMatches(const VideoAdapter::AdapterConfiguration& config, const SDL_Surface* surface) const;
+	void addDirtyRect(int x, int y, int w, int h);
+
+	void renderGraphicsMode(const VideoAdapter::AdapterConfiguration& config, SDL_Surface* surface);
+	bool graphicsShadowMatches(const VideoAdapter::AdapterConfiguration& config, const SDL_Surface* surface) const;
+
+	void startRenderThread();
+	void stopRenderThread();
+	void renderThread();
+	void renderFrame();
+	void publishFrame();
+	void presentFrame(bool full);
+	static std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> createFrameSurface(int width, int height, uint32_t format);
 
 	std::unique_ptr<SDL_Window, SDLWindowDeleter> m_window;
 	std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> m_screenSurface;
@@ -80,12 +115,70 @@ private:
 	std::atomic<Keyboard*> m_keyboard;
 	std::atomic<Mouse*> m_mouse;
 	std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> m_textModeFont;
-	std::array<std::unique_ptr<SDL_Palette, SDLPaletteDeleter>, PaletteCount> m_screenPalettes;
 	static const PaletteSpecification m_paletteSpecifications[PaletteCount];
-	std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> m_graphicsSurface;
-	std::vector<uint8_t> m_graphicsSurfaceData;
+	unsigned int m_scale;
+
+	static constexpr unsigned int GlyphCount = 256;
+	static constexpr unsigned int GlyphWidth = 9;
+
+	/*
+	 * Font, pre-expanded into 32-bit pixels of the window surface format and
+	 * scaled by m_scale: one atlas per palette, GlyphCount glyphs of
+	 * GlyphWidth x m_glyphHeight pixels each, stored top to bottom with no
+	 * padding.
+	 */
+	std::array<std::vector<uint32_t>, PaletteCount> m_glyphAtlases;
+	std::array<std::array<uint32_t, 2>, PaletteCount> m_glyphAtlasColors;
+	uint32_t m_glyphAtlasFormat;
+	unsigned int m_glyphHeight;
+
+	/*
+	 * Copy of the text mode state as of the last drawn frame, used to only
+	 * redraw cells that have changed since.
+	 */
+	bool m_textModeShadowValid;
+	std::vector<uint8_t> m_textModeShadow;
+	VideoAdapter::AdapterConfiguration m_textModeShadowConfiguration;
+	const SDL_Surface* m_textModeShadowSurface;
+	std::vector<SDL_Rect> m_dirtyRects;
+	HerculesScanout m_herculesScanout;
+
+	/*
+	 * Framebuffer generation of the last acquired configuration, and the
+	 * graphics mode state the window surface currently shows: while they
+	 * match, only the scan line bands reported as changed are converted.
+	 */
+	uint64_t m_framebufferGeneration;
+	bool m_graphicsShadowValid;
+	VideoAdapter::AdapterConfiguration m_graphicsShadowConfiguration;
+	const SDL_Surface* m_graphicsShadowSurface;
+
+	/*
+	 * Frames are drawn by the render thread into m_canvas, which is then
+	 * copied into the back buffer of m_frames. The buffer it gets back might
+	 * be a few frames old, so the damage of the last few frames is kept to
+	 * bring it up to date without copying all of it. The main thread only
+	 * pumps events and presents the latest frame when m_frameReadyEvent
+	 * arrives. Should the render thread fail, it stops, keeps the exception in
+	 * m_renderThreadError and sends m_renderThreadFailedEvent, on which the
+	 * main thread throws it again.
+	 */
+	static constexpr size_t DamageHistoryLength = 4;
+
+	std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> m_canvas;
+	uint64_t m_frameSequence;
+	std::deque<std::pair<uint64_t, std::vector<SDL_Rect>>> m_damageHistory;
+	TripleBuffer<Frame> m_frames;
+	uint64_t m_presentedSequence;
+	std::atomic<uint32_t> m_windowPixelFormat;
+	uint32_t m_frameReadyEvent;
+	uint32_t m_renderThreadFailedEvent;
+	std::exception_ptr m_renderThreadError;
+	std::mutex m_renderThreadMutex;
+	std::condition_variable m_renderThreadCondvar;
+	bool m_runRenderThread;
+	std::thread m_renderThread;
 
-	//uint32_t m_dirtyVRAMEvent;
 	bool m_mouseCaptured;
 	/*std::atomic<int16_t> m_mouseX;
 	std::atomic<int16_t> m_mouseY;
@@ -0,0 +1,87 @@
+#ifndef UI_SCREEN_RECORDER_H
+#define UI_SCREEN_RECORDER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "VideoAdapter.h"
+#include "FrameRenderer.h"
+
+/*
+ * Records the screen into a file on a thread of its own. Frames are taken
+ * from the adapter configuration, which never blocks the CPU thread, and are
+ * only rendered again when the framebuffer or the configuration changed.
+ */
+class ScreenRecorder final {
+public:
+	ScreenRecorder();
+	~ScreenRecorder();
+
+	ScreenRecorder(const ScreenRecorder& other) = delete;
+	ScreenRecorder &operator =(const ScreenRecorder& other) = delete;
+
+	enum class Format {
+		Delta,	// see ScreenRecording, with frames stored only when the screen changes
+		Y4M,	// grayscale YUV4MPEG2 at a constant frame rate, for external encoders
+		Raw		// headerless 8 bit grayscale frames at a constant frame rate
+	};
+
+	static constexpr unsigned int DefaultFrameRate = 30;
+
+	inline void setVideoAdapter(VideoAdapter* adapter) {
+		m_videoAdapter = adapter;
+	}
+
+	/*
+	 * The screen is sampled at most frameRate times a second. Constant rate
+	 * formats repeat unchanged frames and keep the size of the first frame,
+	 * cropping or padding later ones. Failing to create the file is reported
+	 * as std::runtime_error, write errors end the recording.
+	 */
+	void start(const std::filesystem::path& path, Format format, unsigned int frameRate = DefaultFrameRate);
+	void stop();
+
+private:
+	static constexpr unsigned int KeyFrameInterval = 256;
+	// Changes of the adapter configuration alone are only noticed this often
+	static constexpr std::chrono::milliseconds ConfigurationRecheckInterval{ 250 };
+
+	void recordingThread();
+	void writeDeltaFrame(uint64_t timestamp);
+	void startConstantRateStream();
+	void updateGrayFrame();
+	void writeGrayFrame();
+	void write(const void* data, size_t size);
+
+	std::atomic<VideoAdapter*> m_videoAdapter;
+	Format m_format;
+	unsigned int m_frameRate;
+	std::ofstream m_stream;
+	std::atomic<bool> m_run;
+	std::thread m_thread;
+
+	FrameRenderer m_renderer;
+	FrameRenderer::Frame m_frame;
+
+	// Delta format
+	std::vector<uint8_t> m_planes;
+	std::vector<uint8_t> m_previousPlanes;
+	std::vector<uint8_t> m_payload;
+	unsigned int m_previousWidth;
+	unsigned int m_previousHeight;
+	unsigned int m_framesSinceKeyFrame;
+
+	// Constant rate formats
+	unsigned int m_streamWidth;
+	unsigned int m_streamHeight;
+	std::vector<uint8_t> m_grayFrame;
+	uint64_t m_framesWritten;
+};
+
+#endif
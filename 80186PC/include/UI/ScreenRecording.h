@@ -0,0 +1,74 @@
+#ifndef UI_SCREEN_RECORDING_H
+#define UI_SCREEN_RECORDING_H
+
+#include <stdint.h>
+
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "FrameRenderer.h"
+
+/*
+ * Reader of screen recordings written by ScreenRecorder in its own format.
+ *
+ * A recording starts with Magic, a 16 bit version and the number of shades,
+ * followed by their RGB colors. Every recorded frame then follows as
+ *
+ *   uint32 payload size, uint64 microseconds since the start,
+ *   uint16 width, uint16 height, uint8 flags, payload
+ *
+ * with all numbers little endian. The payload holds the frame as two bit
+ * planes, "lit" and "bright", delta coded (see Utils/FrameDelta.h) against
+ * the planes of the previous frame, or against zeroes for key frames. In
+ * graphics mode the bright plane stays empty, so frames are 1bpp in effect.
+ */
+class ScreenRecording final {
+public:
+	ScreenRecording();
+	~ScreenRecording();
+
+	ScreenRecording(const ScreenRecording& other) = delete;
+	ScreenRecording &operator =(const ScreenRecording& other) = delete;
+
+	static const char Magic[8];
+	static constexpr uint16_t Version = 1;
+	static constexpr size_t FrameHeaderSize = 17;
+
+	enum : uint8_t {
+		FrameKey = 1
+	};
+
+	// Failures are reported as std::runtime_error.
+	void open(const std::filesystem::path& path);
+
+	inline unsigned int paletteSize() const {
+		return FrameRenderer::ShadeCount;
+	}
+
+	inline const uint8_t (*palette() const)[3] {
+		return m_palette;
+	}
+
+	/*
+	 * Reads the next frame, with its time in microseconds since the start of
+	 * the recording. Returns false at the end; a frame cut short, as left by
+	 * a recorder that was killed, counts as the end too.
+	 */
+	bool readFrame(FrameRenderer::Frame& frame, uint64_t& timestamp);
+
+	static size_t planesSize(unsigned int width, unsigned int height);
+	static void packPlanes(const FrameRenderer::Frame& frame, std::vector<uint8_t>& planes);
+	static void unpackPlanes(const std::vector<uint8_t>& planes, FrameRenderer::Frame& frame);
+
+private:
+	std::ifstream m_stream;
+	uint8_t m_palette[FrameRenderer::ShadeCount][3];
+	bool m_haveKeyFrame;
+	unsigned int m_width;
+	unsigned int m_height;
+	std::vector<uint8_t> m_planes;
+	std::vector<uint8_t> m_payload;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef UI_TEXT_SCREEN_H
+#define UI_TEXT_SCREEN_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "VideoAdapter.h"
+
+/*
+ * Copy of the text mode screen contents, as characters and attributes
+ * rather than pixels, for automation to inspect.
+ */
+class TextScreen final {
+public:
+	TextScreen();
+	~TextScreen();
+
+	void capture(const VideoAdapter::AdapterConfiguration& config);
+
+	inline unsigned int columns() const {
+		return m_columns;
+	}
+
+	inline unsigned int rows() const {
+		return m_rows;
+	}
+
+	// Code page 437
+	inline uint8_t character(unsigned int row, unsigned int column) const {
+		return m_cells[(row * m_columns + column) * 2];
+	}
+
+	inline uint8_t attribute(unsigned int row, unsigned int column) const {
+		return m_cells[(row * m_columns + column) * 2 + 1];
+	}
+
+	inline bool cursorVisible() const {
+		return m_cursorVisible;
+	}
+
+	inline unsigned int cursorRow() const {
+		return m_cursorRow;
+	}
+
+	inline unsigned int cursorColumn() const {
+		return m_cursorColumn;
+	}
+
+	// Hash of the contents and the cursor, to cheaply detect changes
+	inline uint64_t hash() const {
+		return m_hash;
+	}
+
+	// UTF-8, with trailing blanks dropped
+	std::string row(unsigned int row) const;
+
+	// All rows, each terminated by a newline
+	std::string text() const;
+
+private:
+	unsigned int m_columns;
+	unsigned int m_rows;
+	std::vector<uint8_t> m_cells;
+	bool m_cursorVisible;
+	unsigned int m_cursorRow;
+	unsigned int m_cursorColumn;
+	uint64_t m_hash;
+};
+
+#endif
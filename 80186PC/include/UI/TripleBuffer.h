@@ -0,0 +1,60 @@
+#ifndef UI_TRIPLE_BUFFER_H
+#define UI_TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+
+/*
+ * Lock-free triple buffer for a single producer and a single consumer. The
+ * producer fills back() and publishes it; the consumer picks up the most
+ * recently published buffer as front(), skipping any it did not get to in
+ * time. Neither side ever waits for the other.
+ */
+template<typename T>
+class TripleBuffer final {
+public:
+	TripleBuffer() : m_buffers{}, m_back(0), m_ready(1), m_front(2) {
+
+	}
+
+	~TripleBuffer() = default;
+
+	TripleBuffer(const TripleBuffer& other) = delete;
+	TripleBuffer &operator =(const TripleBuffer& other) = delete;
+
+	// producer side
+
+	inline T& back() {
+		return m_buffers[m_back];
+	}
+
+	inline void publish() {
+		m_back = m_ready.exchange(m_back | FreshFlag, std::memory_order_acq_rel) & IndexMask;
+	}
+
+	// consumer side
+
+	inline T& front() {
+		return m_buffers[m_front];
+	}
+
+	// Returns false if nothing was published since the last call.
+	inline bool acquire() {
+		if ((m_ready.load(std::memory_order_relaxed) & FreshFlag) == 0)
+			return false;
+
+		m_front = m_ready.exchange(m_front, std::memory_order_acq_rel) & IndexMask;
+		return true;
+	}
+
+private:
+	static constexpr unsigned int IndexMask = 3;
+	static constexpr unsigned int FreshFlag = 4;
+
+	std::array<T, 3> m_buffers;
+	unsigned int m_back;
+	std::atomic<unsigned int> m_ready;
+	unsigned int m_front;
+};
+
+#endif
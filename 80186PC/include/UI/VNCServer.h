@@ -0,0 +1,182 @@
+#ifndef UI_VNC_SERVER_H
+#define UI_VNC_SERVER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "VideoAdapter.h"
+#include "FrameRenderer.h"
+
+class Keyboard;
+class Mouse;
+
+/*
+ * RFB (VNC) server, protocol version 3.8 with no authentication, serving the
+ * adapter output and feeding keyboard and pointer events back into the
+ * machine. Can run alongside any of the UIs, or on its own.
+ *
+ * A single frame thread sleeps until the framebuffer is written and renders
+ * at most FrameInterval apart, and only while clients are connected. Every
+ * client gets a reader thread and an update thread; updates carry only the
+ * regions that differ from what the client was last sent, as CopyRect for
+ * scrolled text, then ZRLE or Raw.
+ */
+class VNCServer final {
+public:
+	VNCServer();
+	~VNCServer();
+
+	VNCServer(const VNCServer& other) = delete;
+	VNCServer &operator =(const VNCServer& other) = delete;
+
+	static constexpr uint16_t DefaultPort = 5900;
+
+	inline void setVideoAdapter(VideoAdapter* adapter) {
+		m_videoAdapter = adapter;
+	}
+
+	inline void setKeyboard(Keyboard* keyboard) {
+		m_keyboard = keyboard;
+	}
+
+	inline void setMouse(Mouse* mouse) {
+		m_mouse = mouse;
+	}
+
+	// Listens on the loopback interface only, unless listenOnAllInterfaces is set.
+	void start(uint16_t port, bool listenOnAllInterfaces = false);
+	void stop();
+
+private:
+	static constexpr std::chrono::milliseconds FrameInterval{ 33 };
+	// Changes of the adapter configuration alone are only noticed this often
+	static constexpr std::chrono::milliseconds ConfigurationRecheckInterval{ 250 };
+	static constexpr unsigned int TileSize = 64;
+	static constexpr unsigned int DiffBandHeight = 16;
+
+	enum : int32_t {
+		EncodingRaw = 0,
+		EncodingCopyRect = 1,
+		EncodingZRLE = 16,
+		EncodingDesktopSize = -223
+	};
+
+	struct PixelFormat {
+		uint8_t bitsPerPixel;
+		uint8_t depth;
+		bool bigEndian;
+		bool trueColour;
+		uint16_t redMax;
+		uint16_t greenMax;
+		uint16_t blueMax;
+		uint8_t redShift;
+		uint8_t greenShift;
+		uint8_t blueShift;
+	};
+
+	struct Rect {
+		unsigned int x;
+		unsigned int y;
+		unsigned int width;
+		unsigned int height;
+	};
+
+	struct SharedFrame {
+		uint64_t serial;
+		FrameRenderer::Frame frame;
+		// text mode character height, 0 in graphics mode
+		unsigned int characterHeight;
+	};
+
+	struct Client {
+		uintptr_t socket;
+
+		// Shared between the client threads, protected by m_frameMutex
+		bool closed;
+		bool updateRequested;
+		bool incrementalUpdate;
+		Rect requestedRect;
+		PixelFormat pixelFormat;
+		bool pixelFormatChanged;
+		bool supportsCopyRect;
+		bool supportsZRLE;
+		bool supportsDesktopSize;
+
+		// Update thread only
+		unsigned int width;
+		unsigned int height;
+		std::vector<uint8_t> shadow;
+		bool shadowValid;
+		uint64_t sentSerial;
+		bool zlibStreamStarted;
+
+		// Reader thread only
+		int pointerX;
+		int pointerY;
+		uint8_t buttons;
+	};
+
+	struct EncodedPixels {
+		unsigned int bytesPerPixel;
+		uint8_t pixels[FrameRenderer::ShadeCount][4];
+		unsigned int bytesPerCPixel;
+		uint8_t cpixels[FrameRenderer::ShadeCount][4];
+	};
+
+	void acceptThread();
+	void frameThread();
+	void clientThread(std::shared_ptr<Client> client);
+	void clientUpdateThread(std::shared_ptr<Client> client);
+
+	bool handshake(Client& client);
+	bool processClientMessage(Client& client);
+	void handleKeyEvent(bool down, uint32_t keysym);
+	void handlePointerEvent(Client& client, uint8_t buttons, int x, int y);
+
+	// Returns false if the connection failed; sent tells whether there was anything to send
+	bool sendUpdate(Client& client, const SharedFrame& shared, bool incremental, const Rect& requestedRect,
+		const PixelFormat& pixelFormat, bool pixelFormatChanged, bool supportsCopyRect, bool supportsZRLE, bool supportsDesktopSize,
+		bool& sent);
+	bool detectScroll(Client& client, const std::vector<uint8_t>& target, unsigned int characterHeight, const Rect& area, Rect& source, Rect& destination);
+
+	static void encodePixels(const PixelFormat& pixelFormat, EncodedPixels& encoded);
+	static void appendPixelFormat(std::vector<uint8_t>& message, const PixelFormat& pixelFormat);
+	static void appendRectHeader(std::vector<uint8_t>& message, const Rect& rect, int32_t encoding);
+	static void appendRaw(std::vector<uint8_t>& message, const std::vector<uint8_t>& pixels, unsigned int pitch, const Rect& rect, const EncodedPixels& encoded);
+	void appendZRLE(std::vector<uint8_t>& message, Client& client, const std::vector<uint8_t>& pixels, unsigned int pitch, const Rect& rect, const EncodedPixels& encoded);
+	static void fitFrame(const FrameRenderer::Frame& frame, unsigned int width, unsigned int height, std::vector<uint8_t>& pixels);
+	static bool intersect(const Rect& a, const Rect& b, Rect& result);
+
+	static bool sendAll(uintptr_t socket, const void* data, size_t size);
+	static bool receiveAll(uintptr_t socket, void* data, size_t size);
+
+	std::atomic<VideoAdapter*> m_videoAdapter;
+	std::atomic<Keyboard*> m_keyboard;
+	std::atomic<Mouse*> m_mouse;
+
+	FrameRenderer m_renderer;
+
+	uintptr_t m_listenSocket;
+	bool m_winsockStarted;
+	std::atomic<bool> m_run;
+	std::thread m_acceptThread;
+	std::thread m_frameThread;
+
+	/*
+	 * Latest frame, connected clients and their update requests. Client
+	 * threads are detached, so stop() waits for m_clients to empty.
+	 */
+	std::mutex m_frameMutex;
+	std::condition_variable m_frameCondvar;
+	std::shared_ptr<const SharedFrame> m_currentFrame;
+	std::vector<std::shared_ptr<Client>> m_clients;
+};
+
+#endif
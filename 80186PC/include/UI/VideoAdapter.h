@@ -1,6 +1,10 @@
 #ifndef UI_VIDEO_ADAPTER_H
 #define UI_VIDEO_ADAPTER_H
 
+#include <stdint.h>
+
+#include <chrono>
+
 class VideoAdapter {
 protected:
 	VideoAdapter();
@@ -27,9 +31,38 @@ public:
 
 		// graphics mode only
 		const unsigned char* graphicsModeFramebuffer;
+
+		/*
+		 * Framebuffer change tracking. framebufferGeneration identifies the
+		 * framebuffer contents as of this acquisition, and should be passed
+		 * back on the next one. changedScanLineBands has a bit set for every
+		 * band of ScanLineBandHeight scan lines that might have changed since
+		 * the generation passed in; the last band also covers everything
+		 * below it. Mode changes are not reflected here.
+		 */
+		uint64_t framebufferGeneration;
+		uint64_t changedScanLineBands;
 	};
 
-	virtual void acquireAdapterConfiguration(AdapterConfiguration& config) = 0;
+	/*
+	 * Whether both configurations show the same picture, provided that the
+	 * framebuffer contents are the same; change tracking is not compared.
+	 */
+	static bool sameDisplayState(const AdapterConfiguration& a, const AdapterConfiguration& b);
+
+	static constexpr unsigned int ScanLineBandHeight = 8;
+	static constexpr unsigned int ScanLineBandCount = 64;
+	static constexpr uint64_t AllScanLineBands = ~static_cast<uint64_t>(0);
+
+	// Passing 0 as sinceGeneration reports all scan lines as changed.
+	virtual void acquireAdapterConfiguration(AdapterConfiguration& config, uint64_t sinceGeneration) = 0;
+
+	/*
+	 * Blocks until the framebuffer is written after the given generation, or
+	 * until the deadline passes. Returns false on timeout. Changes of the
+	 * adapter configuration do not wake this up.
+	 */
+	virtual bool waitForFramebufferWrites(uint64_t sinceGeneration, std::chrono::steady_clock::time_point deadline) = 0;
 };
 
 #endif
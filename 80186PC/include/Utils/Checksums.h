@@ -0,0 +1,18 @@
+#ifndef UTILS_CHECKSUMS_H
+#define UTILS_CHECKSUMS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Running checksums as used by PNG and zlib streams. Pass the result of the
+ * previous call to continue a checksum over more data.
+ */
+
+// ISO-HDLC CRC-32, start with 0
+uint32_t crc32(const void* data, size_t size, uint32_t crc = 0);
+
+// Adler-32, start with 1
+uint32_t adler32(const void* data, size_t size, uint32_t adler = 1);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef UTILS_CODE_PAGE_437_H
+#define UTILS_CODE_PAGE_437_H
+
+#include <stdint.h>
+
+#include <string>
+
+uint16_t codePage437ToUnicode(uint8_t ch);
+void appendCodePage437AsUTF8(std::string& string, uint8_t ch);
+
+#endif
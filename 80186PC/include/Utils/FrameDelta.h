@@ -0,0 +1,23 @@
+#ifndef UTILS_FRAME_DELTA_H
+#define UTILS_FRAME_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+/*
+ * Delta coding of equally sized buffers, such as successive video frames.
+ * The delta is the XOR of both buffers, stored as alternating runs of
+ * unchanged (zero) bytes and of literal XOR bytes, each run preceded by its
+ * length as an unsigned LEB128 number. Delta coding against an all zero
+ * buffer gives a self-contained key frame.
+ */
+
+// Appends the delta from previous to current to delta.
+void encodeFrameDelta(const uint8_t* previous, const uint8_t* current, size_t size, std::vector<uint8_t>& delta);
+
+// Applies a delta to frame in place. Malformed deltas are reported as std::runtime_error.
+void applyFrameDelta(const uint8_t* delta, size_t deltaSize, uint8_t* frame, size_t size);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef UTILS_IMAGE_WRITER_H
+#define UTILS_IMAGE_WRITER_H
+
+#include <stdint.h>
+
+#include <filesystem>
+
+/*
+ * Writers for images with one palette index byte per pixel, rows stored top
+ * to bottom with no padding. Failures are reported as std::runtime_error.
+ */
+
+// Palette PNG at the smallest bit depth that fits the palette. The image data
+// is not compressed, so no compression library is needed.
+void writeIndexedPNG(const std::filesystem::path& path, unsigned int width, unsigned int height, const uint8_t* pixels,
+	const uint8_t (*palette)[3], unsigned int paletteSize);
+
+// Binary (P6) PPM
+void writeIndexedPPM(const std::filesystem::path& path, unsigned int width, unsigned int height, const uint8_t* pixels,
+	const uint8_t (*palette)[3]);
+
+#endif
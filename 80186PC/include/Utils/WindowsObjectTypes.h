@@ -2,6 +2,7 @@
 #define WINDOWS_OBJECT_TYPES_H
 
 #include <Windows.h>
+#include <stdint.h>
 #include <type_traits>
 #include <memory>
 
@@ -15,6 +16,13 @@ struct WindowsSectionViewDeleter {
 };
 using WindowsSectionView = std::unique_ptr<std::remove_pointer<void>::type, WindowsSectionViewDeleter>;
 
+/*
+ * Zeroed memory, backed by the page file, that stays at the same address for
+ * its whole life: it is a view of a section mapped over a placeholder, so
+ * that the contents can be replaced by a view of a file later on without
+ * anything that points into it having to change. The length must be a
+ * multiple of the allocation granularity (64 KiB).
+ */
 class WindowsMemoryRegion {
 public:
 	explicit WindowsMemoryRegion(unsigned int length, DWORD protect);
@@ -26,9 +34,18 @@ public:
 	inline void *base() const { return m_base; }
 	inline unsigned int length() const { return m_length; }
 
+	/*
+	 * Replaces the contents with a copy-on-write view of the file mapping at
+	 * offset, a multiple of the allocation granularity: pages are read from
+	 * the file as they are touched, and copied once written. Nothing else
+	 * may access the memory meanwhile.
+	 */
+	void mapCopyOnWrite(HANDLE fileMapping, uint64_t offset);
+
 private:
 	void *m_base;
 	unsigned int m_length;
+	DWORD m_protect;
 };
 
 #endif
@@ -3,7 +3,10 @@
 
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <vector>
 
 #include <Hardware/CPUEmulation.h>
 
@@ -16,13 +19,55 @@ public:
 
 	void start() override;
 	void stop() override;
+	SliceResult runSlice(uint64_t instructions, std::chrono::steady_clock::time_point& wakeTime) override;
+
+	void setStop(uint64_t stopTime, uint64_t stopInstructions) override;
+	void waitForStop() override;
+	uint64_t instructions() const override;
 
 	void mapMemory(uint64_t base, uint64_t limit, void* hostMemory, unsigned int permissions) override;
 	void unmapMemory(uint64_t base, uint64_t limit) override;
 
+	void saveState(StateWriter& writer) const override;
+	void loadState(StateReader& reader) override;
+
 	void setInterruptAsserted(bool interrupt) override;
 
+	uint64_t cycles() const override;
+	void scheduleTimer(VirtualTimer* timer, uint64_t deadline) override;
+	void cancelTimer(VirtualTimer* timer) override;
+	void setLagPolicy(LagPolicy policy) override;
+	void setRealTimePacing(bool pacing) override;
+	uint64_t lagCycles() const override;
+	uint64_t droppedCycles() const override;
+
 private:
+	// libx86emu only counts instructions. This is roughly what an 80186
+	// averages on typical code.
+	static constexpr uint64_t CyclesPerInstruction = 8;
+
+	// Machine time is compared against real time this often (1 ms)
+	static constexpr uint64_t PacingInterval = Frequency / 1000;
+	// Lag up to this much, such as from oversleeping, is made up by running flat out alone
+	static constexpr std::chrono::milliseconds LagTolerance{ 20 };
+	// When the host falls further behind than this, the difference is given up on
+	static constexpr std::chrono::milliseconds MaximumDropLag{ 100 };
+	static constexpr std::chrono::milliseconds MaximumCatchUpLag{ 10000 };
+	static constexpr std::chrono::milliseconds MaximumSlewLag{ 60000 };
+	// Extra machine time per pacing interval while catching up: twice the speed, or 10% faster
+	static constexpr uint64_t CatchUpStep = PacingInterval;
+	static constexpr uint64_t SlewStep = PacingInterval / 10;
+
+	// ES, CS, SS, DS, FS and GS
+	static constexpr unsigned int SegmentRegisterCount = 6;
+
+	struct ScheduledTimer {
+		VirtualTimer* timer;
+		uint64_t deadline;
+		// From m_timerSequence, when last scheduled
+		uint64_t sequence;
+	};
+
 	void cpu0Thread();
 
 	void mapMemoryInternal(uint64_t base, uint64_t limit, void* hostMemory, unsigned int permissions);
@@ -33,6 +78,19 @@ private:
 	static int codeHandler(x86emu_t* emu);
 
 	bool shouldDeliverInterrupt() const;
+	void executeInstruction();
+
+	bool stopReached() const;
+	void waitWhileStopped(std::unique_lock<std::recursive_mutex>& locker);
+	// Calls the wake handler if the CPU is parked
+	void wake();
+
+	void runExpiredTimers();
+	void updateNextTimerDeadline();
+
+	// Returns true if machine time is ahead of real time, with when it is not any more.
+	bool pace(std::chrono::steady_clock::time_point& resumeTime);
+	void rebasePacing();
 
 	static unsigned int translateSize(unsigned int length);
 
@@ -48,6 +106,30 @@ private:
 	std::atomic<bool> m_interruptPending;
 	std::atomic<bool> m_run;
 	std::thread m_cpu0Thread;
+
+	// Protected by m_emulatorMutex
+	std::vector<ScheduledTimer> m_timers;
+	uint64_t m_timerSequence;
+	uint64_t m_nextTimerDeadline;
+	uint64_t m_stopTime;
+	uint64_t m_stopInstructions;
+	bool m_stopped;
+	std::condition_variable_any m_stopCondvar;
+	// Run in slices rather than on a thread of its own
+	bool m_slicing;
+	bool m_parked;
+
+	std::atomic<LagPolicy> m_lagPolicy;
+	std::atomic<bool> m_realTimePacing;
+
+	// CPU thread only
+	uint64_t m_nextPacingCheck;
+	uint64_t m_pacingBaseCycles;
+	std::chrono::steady_clock::time_point m_pacingBaseTime;
+	// Added to the instruction count by the lag policy
+	uint64_t m_cycleOffset;
+	uint64_t m_lagCycles;
+	uint64_t m_droppedCycles;
 };
 
 #endif
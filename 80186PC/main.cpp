@@ -2,23 +2,412 @@
 
 #include <SDL.h>
 
+#include <comdef.h>
+
+#include <UI/AutomationScript.h>
 #include <UI/SDLUI.h>
+#include <UI/HeadlessUI.h>
+#include <UI/ScreenRecorder.h>
+#include <UI/VNCServer.h>
+
+#include <atomic>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static HeadlessUI* headlessUI = nullptr;
+
+static constexpr int ExitReplayDiverged = 3;
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s [--scale 1|2] <HARD DISK IMAGE IN VHD FORMAT>\n"
+		"       %s --headless [--snapshot-interval MS] [--snapshot-format png|raw|text] [--snapshot-prefix PATH]\n"
+		"          <HARD DISK IMAGE IN VHD FORMAT>\n"
+		"Either can also be viewed with a VNC client: [--vnc PORT [--vnc-listen-all]]\n"
+		"and recorded: [--record PATH [--record-format delta|y4m|raw] [--record-rate FPS]]\n"
+		"Timer ticks owed when the host falls behind: [--timer-policy drop|catch-up|slew]\n"
+		"Input can be scripted, and the exit code set by the script: [--script PATH]\n"
+		"Start from a save state, made with the same disk image: [--load-state PATH]\n"
+		"Keep the disk image unchanged, writing to a new differencing image instead: [--disk-overlay PATH]\n"
+		"Keep a checkpoint per second of machine time to rewind to: [--rewind COUNT [--rewind-compress]]\n"
+		"Record the execution, or replay a recording as fast as possible and quit: [--record-execution PATH | --replay PATH]\n",
+		name, name);
+}
+
+static bool startRecorder(ScreenRecorder& recorder, Machine& machine, const char* path, ScreenRecorder::Format format,
+	unsigned int frameRate) {
+
+	recorder.setVideoAdapter(machine.videoAdapter());
+
+	try {
+		recorder.start(path, format, frameRate);
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return false;
+	}
+	catch (const _com_error& e) {
+		fprintf(stderr, "unable to record to %s: %ls\n", path, e.ErrorMessage());
+		return false;
+	}
+
+	return true;
+}
+
+static bool startVNCServer(VNCServer& server, Machine& machine, unsigned long port, bool listenOnAllInterfaces) {
+	server.setVideoAdapter(machine.videoAdapter());
+	server.setKeyboard(machine.keyboard());
+	server.setMouse(machine.mouse());
+
+	try {
+		server.start(static_cast<uint16_t>(port), listenOnAllInterfaces);
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return false;
+	}
+	catch (const _com_error& e) {
+		fprintf(stderr, "VNC server on port %lu: %ls\n", port, e.ErrorMessage());
+		return false;
+	}
+
+	return true;
+}
+
+static void startScript(AutomationScript& script, Machine& machine, std::function<void(int exitCode)> quitHandler) {
+	script.setMachine(&machine);
+	script.setQuitHandler(std::move(quitHandler));
+	script.start();
+}
+
+/*
+ * Starts recording or replaying, if asked to. A replay that diverges from
+ * the recording sets the exit code to ExitReplayDiverged.
+ */
+static bool startExecutionLog(Machine& machine, const char* recordPath, const char* replayPath, std::atomic<int>& exitCode,
+	std::function<void()> quitHandler) {
+
+	try {
+		if (recordPath) {
+			machine.startRecording(recordPath);
+		}
+		else if (replayPath) {
+			machine.startReplay(replayPath, [&exitCode, quitHandler](const std::string& divergence) {
+				if (divergence.empty()) {
+					printf("Replay: end of the log reached\n");
+				}
+				else {
+					fprintf(stderr, "Replay: diverged from the recording: %s\n", divergence.c_str());
+					exitCode = ExitReplayDiverged;
+				}
+
+				quitHandler();
+			});
+		}
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return false;
+	}
+	catch (const _com_error& e) {
+		fprintf(stderr, "%ls\n", e.ErrorMessage());
+		return false;
+	}
+
+	return true;
+}
+
+static void printStatistics(Machine& machine) {
+	auto statistics = machine.timerStatistics();
+	if (statistics.lateTicks != 0 || statistics.lostTicks != 0) {
+		printf("Timer: %llu ticks delivered, %llu late, %llu lost\n",
+			static_cast<unsigned long long>(statistics.ticks),
+			static_cast<unsigned long long>(statistics.lateTicks),
+			static_cast<unsigned long long>(statistics.lostTicks));
+	}
+
+	// Worth mentioning once it is long enough to notice
+	auto inputDelay = std::chrono::duration_cast<std::chrono::milliseconds>(machine.longestInputDelay());
+	if (inputDelay >= std::chrono::milliseconds(100)) {
+		printf("Input: delivered up to %lld ms after it was queued\n", static_cast<long long>(inputDelay.count()));
+	}
+
+	auto rewind = machine.rewindStatistics();
+	if (rewind.checkpoints != 0) {
+		printf("Rewind: %zu checkpoints in %zu KiB\n", rewind.checkpoints, rewind.memoryUsed / 1024);
+	}
+}
+
+static void stopHeadlessUI(int signal) {
+	(void)signal;
+
+	if (headlessUI)
+		headlessUI->stop();
+}
 
 int main(int argc, char* argv[]) {
-	if(argc < 2) {
-		fprintf(stderr, "Usage: %s <HARD DISK IMAGE IN VHD FORMAT>\n", argv[0]);
+	const char* hardDiskImage = nullptr;
+	unsigned int scale = 1;
+	bool headless = false;
+	unsigned long snapshotInterval = 0;
+	const char* snapshotPrefix = "snapshot";
+	auto snapshotFormat = HeadlessUI::SnapshotFormat::PNG;
+	unsigned long vncPort = 0;
+	bool vncListenAll = false;
+	const char* recordingPath = nullptr;
+	auto recordingFormat = ScreenRecorder::Format::Delta;
+	auto recordingFrameRate = ScreenRecorder::DefaultFrameRate;
+	auto timerLagPolicy = VirtualClock::LagPolicy::Slew;
+	const char* scriptPath = nullptr;
+	const char* statePath = nullptr;
+	const char* overlayPath = nullptr;
+	unsigned long rewindCapacity = 0;
+	bool rewindCompress = false;
+	const char* executionRecordPath = nullptr;
+	const char* replayPath = nullptr;
+	std::atomic<int> replayExitCode(0);
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--scale") == 0 && arg + 1 < argc) {
+			scale = static_cast<unsigned int>(strtoul(argv[++arg], nullptr, 10));
+
+			if (scale != 1 && scale != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "--headless") == 0) {
+			headless = true;
+		}
+		else if (strcmp(argv[arg], "--snapshot-interval") == 0 && arg + 1 < argc) {
+			snapshotInterval = strtoul(argv[++arg], nullptr, 10);
+		}
+		else if (strcmp(argv[arg], "--snapshot-prefix") == 0 && arg + 1 < argc) {
+			snapshotPrefix = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--snapshot-format") == 0 && arg + 1 < argc) {
+			auto format = argv[++arg];
+
+			if (strcmp(format, "png") == 0) {
+				snapshotFormat = HeadlessUI::SnapshotFormat::PNG;
+			}
+			else if (strcmp(format, "raw") == 0) {
+				snapshotFormat = HeadlessUI::SnapshotFormat::Raw;
+			}
+			else if (strcmp(format, "text") == 0) {
+				snapshotFormat = HeadlessUI::SnapshotFormat::Text;
+			}
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "--vnc") == 0 && arg + 1 < argc) {
+			vncPort = strtoul(argv[++arg], nullptr, 10);
+
+			if (vncPort == 0 || vncPort > 65535) {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "--vnc-listen-all") == 0) {
+			vncListenAll = true;
+		}
+		else if (strcmp(argv[arg], "--record") == 0 && arg + 1 < argc) {
+			recordingPath = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--record-format") == 0 && arg + 1 < argc) {
+			auto format = argv[++arg];
+
+			if (strcmp(format, "delta") == 0) {
+				recordingFormat = ScreenRecorder::Format::Delta;
+			}
+			else if (strcmp(format, "y4m") == 0) {
+				recordingFormat = ScreenRecorder::Format::Y4M;
+			}
+			else if (strcmp(format, "raw") == 0) {
+				recordingFormat = ScreenRecorder::Format::Raw;
+			}
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "--record-rate") == 0 && arg + 1 < argc) {
+			recordingFrameRate = static_cast<unsigned int>(strtoul(argv[++arg], nullptr, 10));
+
+			if (recordingFrameRate == 0 || recordingFrameRate > 1000) {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "--timer-policy") == 0 && arg + 1 < argc) {
+			auto policy = argv[++arg];
+
+			if (strcmp(policy, "drop") == 0) {
+				timerLagPolicy = VirtualClock::LagPolicy::Drop;
+			}
+			else if (strcmp(policy, "catch-up") == 0) {
+				timerLagPolicy = VirtualClock::LagPolicy::CatchUp;
+			}
+			else if (strcmp(policy, "slew") == 0) {
+				timerLagPolicy = VirtualClock::LagPolicy::Slew;
+			}
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "--script") == 0 && arg + 1 < argc) {
+			scriptPath = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--load-state") == 0 && arg + 1 < argc) {
+			statePath = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--disk-overlay") == 0 && arg + 1 < argc) {
+			overlayPath = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--rewind") == 0 && arg + 1 < argc) {
+			rewindCapacity = strtoul(argv[++arg], nullptr, 10);
+			if (rewindCapacity == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "--rewind-compress") == 0) {
+			rewindCompress = true;
+		}
+		else if (strcmp(argv[arg], "--record-execution") == 0 && arg + 1 < argc) {
+			executionRecordPath = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--replay") == 0 && arg + 1 < argc) {
+			replayPath = argv[++arg];
+		}
+		else if (!hardDiskImage) {
+			hardDiskImage = argv[arg];
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!hardDiskImage || (executionRecordPath && replayPath)) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	SDLUI ui;
+	if (overlayPath) {
+		try {
+			ATAHardDisk::createOverlay(hardDiskImage, overlayPath);
+			hardDiskImage = overlayPath;
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "%s\n", e.what());
+			return 1;
+		}
+		catch (const _com_error& e) {
+			fprintf(stderr, "unable to create %s: %ls\n", overlayPath, e.ErrorMessage());
+			return 1;
+		}
+	}
+
+	// Loaded up front, so that mistakes in it show before the machine is started
+	AutomationScript script;
+	if (scriptPath) {
+		try {
+			script.load(scriptPath);
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "%s\n", e.what());
+			return 1;
+		}
+	}
+
+	if (headless) {
+		HeadlessUI ui;
+		ui.setSnapshotInterval(std::chrono::milliseconds(snapshotInterval));
+		ui.setSnapshotPrefix(snapshotPrefix);
+		ui.setSnapshotFormat(snapshotFormat);
+
+		Machine machine(hardDiskImage, statePath ? statePath : std::filesystem::path());
+		machine.setTimerLagPolicy(timerLagPolicy);
+
+		if (rewindCapacity != 0)
+			machine.enableRewind(rewindCapacity, VirtualClock::Frequency, rewindCompress);
+
+		if (!startExecutionLog(machine, executionRecordPath, replayPath, replayExitCode, [&ui]() { ui.stop(); }))
+			return 1;
+
+		ui.setVideoAdapter(machine.videoAdapter());
+
+		// Declared after the machine so that they stop before the machine goes away
+		VNCServer vnc;
+		if (vncPort != 0 && !startVNCServer(vnc, machine, vncPort, vncListenAll))
+			return 1;
+
+		ScreenRecorder recorder;
+		if (recordingPath && !startRecorder(recorder, machine, recordingPath, recordingFormat, recordingFrameRate))
+			return 1;
+
+		headlessUI = &ui;
+		signal(SIGINT, stopHeadlessUI);
+		signal(SIGTERM, stopHeadlessUI);
+
+		if (scriptPath)
+			startScript(script, machine, [&ui](int) { ui.stop(); });
+
+		ui.run();
+
+		script.stop();
+		headlessUI = nullptr;
+
+		printStatistics(machine);
+	}
+	else {
+		SDLUI ui;
+		ui.setScale(scale);
+
+		Machine machine(hardDiskImage, statePath ? statePath : std::filesystem::path());
+		machine.setTimerLagPolicy(timerLagPolicy);
+
+		if (rewindCapacity != 0)
+			machine.enableRewind(rewindCapacity, VirtualClock::Frequency, rewindCompress);
+
+		auto quitHandler = []() {
+			SDL_Event event{};
+			event.type = SDL_QUIT;
+			SDL_PushEvent(&event);
+		};
+
+		if (!startExecutionLog(machine, executionRecordPath, replayPath, replayExitCode, quitHandler))
+			return 1;
+
+		ui.setVideoAdapter(machine.videoAdapter());
+		ui.setKeyboard(machine.keyboard());
+		ui.setMouse(machine.mouse());
 
-	Machine machine(argv[1]);
+		VNCServer vnc;
+		if (vncPort != 0 && !startVNCServer(vnc, machine, vncPort, vncListenAll))
+			return 1;
 
-	ui.setVideoAdapter(machine.videoAdapter());
-	ui.setKeyboard(machine.keyboard());
-	ui.setMouse(machine.mouse());
+		ScreenRecorder recorder;
+		if (recordingPath && !startRecorder(recorder, machine, recordingPath, recordingFormat, recordingFrameRate))
+			return 1;
+
+		if (scriptPath)
+			startScript(script, machine, [quitHandler](int) { quitHandler(); });
+
+		ui.run();
+
+		script.stop();
+		printStatistics(machine);
+	}
 
-	ui.run();
+	if (replayExitCode != 0)
+		return replayExitCode;
 
-	return 0;
+	return script.exitCode();
 }